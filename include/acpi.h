@@ -0,0 +1,41 @@
+/**
+ * MiniOS - ACPI Table Interface
+ *
+ * Just enough ACPI to find the firmware's description tables and read
+ * the processor list out of the MADT.
+ */
+
+#ifndef _MINIOS_ACPI_H
+#define _MINIOS_ACPI_H
+
+#include "types.h"
+
+/* Processors remembered from the MADT */
+#define ACPI_MAX_CPUS   64
+
+/**
+ * Locate the RSDP and the root table, and parse the MADT
+ * Uses the RSDP the bootloader passed, falling back to the BIOS areas.
+ * @return 0 on success, negative if there are no usable ACPI tables
+ */
+int acpi_init(void);
+
+/**
+ * Find a description table by signature (e.g. "APIC")
+ * @return Table (starting with its header), or NULL if absent or corrupt
+ */
+const void* acpi_find_table(const char* signature);
+
+/**
+ * Get the number of enabled processors listed in the MADT
+ * @return Count, or 0 if there is no MADT
+ */
+int acpi_cpu_count(void);
+
+/**
+ * Get the local APIC ID of an enabled processor
+ * @param index  0 to acpi_cpu_count() - 1, in MADT order
+ */
+uint32_t acpi_cpu_apic_id(int index);
+
+#endif /* _MINIOS_ACPI_H */
@@ -0,0 +1,36 @@
+/**
+ * MiniOS - AHCI SATA Driver Interface
+ */
+
+#ifndef _MINIOS_AHCI_H
+#define _MINIOS_AHCI_H
+
+#include "types.h"
+#include "ata.h"
+
+/**
+ * Initialize the AHCI driver
+ * Finds an AHCI controller on the PCI bus, sets up the first port with a
+ * SATA disk and attaches it to the block request queue (see blk.h)
+ */
+void ahci_init(void);
+
+/**
+ * Check if a SATA disk is attached
+ * @return non-zero if a disk was found and attached
+ */
+int ahci_is_present(void);
+
+/**
+ * Check if commands are queued with NCQ (otherwise one at a time)
+ * @return non-zero if native command queuing is in use
+ */
+int ahci_ncq_enabled(void);
+
+/**
+ * Get the disk's IDENTIFY parameters
+ * @return Drive information, or NULL if no disk is attached
+ */
+const ata_info_t* ahci_get_info(void);
+
+#endif /* _MINIOS_AHCI_H */
@@ -10,37 +10,52 @@
 /* Sector size in bytes */
 #define ATA_SECTOR_SIZE 512
 
+/* Drive parameters from IDENTIFY DEVICE */
+typedef struct {
+    char     model[41];         /* Model string, trailing spaces stripped */
+    uint64_t sectors;           /* Capacity in sectors */
+    int      lba48;             /* 48-bit addressing supported */
+    uint16_t multiple_max;      /* Largest READ/WRITE MULTIPLE block (0: none) */
+    uint16_t multiple;          /* Block size in use (0: one sector per DRQ) */
+    int      dma;               /* DMA supported */
+    uint8_t  mwdma_modes;       /* Multiword DMA modes supported (bit n = mode n) */
+    uint8_t  udma_modes;        /* Ultra DMA modes supported */
+    uint8_t  udma_active;       /* Ultra DMA mode selected */
+    int      ncq;               /* Native command queuing supported (SATA) */
+    uint8_t  queue_depth;       /* NCQ tags the drive accepts (1-32) */
+} ata_info_t;
+
 /**
  * Initialize the ATA driver
- * Detects and initializes primary IDE controller
+ * Detects and initializes primary IDE controller, and attaches the drive
+ * to the block request queue (see blk.h for reads and writes)
  */
 void ata_init(void);
 
 /**
- * Read sectors from disk
- * 
- * @param lba     Starting logical block address
- * @param count   Number of sectors to read (1-256, 0 means 256)
- * @param buffer  Buffer to store read data (must be at least count * 512 bytes)
- * @return        0 on success, negative on error
+ * Check if ATA drive is present
+ * @return non-zero if drive is detected
  */
-int ata_read_sectors(uint32_t lba, uint8_t count, void* buffer);
+int ata_is_present(void);
 
 /**
- * Write sectors to disk
- * 
- * @param lba     Starting logical block address
- * @param count   Number of sectors to write (1-256, 0 means 256)
- * @param buffer  Buffer containing data to write
- * @return        0 on success, negative on error
+ * Check if transfers use bus-master DMA (otherwise PIO)
+ * @return non-zero if DMA is in use
  */
-int ata_write_sectors(uint32_t lba, uint8_t count, const void* buffer);
+int ata_dma_enabled(void);
 
 /**
- * Check if ATA drive is present
- * @return non-zero if drive is detected
+ * Get the drive's IDENTIFY parameters
+ * @return Drive information, or NULL if no drive is present
  */
-int ata_is_present(void);
+const ata_info_t* ata_get_info(void);
+
+/**
+ * Decode 256 words of IDENTIFY DEVICE data (shared with the AHCI driver)
+ * @param id    IDENTIFY data as returned by the drive
+ * @param info  Filled with the drive parameters
+ */
+void ata_parse_identify(const uint16_t* id, ata_info_t* info);
 
 #endif /* _MINIOS_ATA_H */
 
@@ -0,0 +1,62 @@
+/**
+ * MiniOS - Block Cache Interface
+ *
+ * Sector cache between disk users (shell, a future filesystem) and the
+ * block request queue. Sectors are hashed by LBA and reclaimed in LRU order.
+ * Sequential reads grow an adaptive read-ahead window, and writes are
+ * held dirty and written back as contiguous multi-sector runs.
+ */
+
+#ifndef _MINIOS_BCACHE_H
+#define _MINIOS_BCACHE_H
+
+#include "types.h"
+
+/* Default cache size */
+#define BCACHE_DEFAULT_SIZE     (1024 * 1024)
+
+/* Block cache counters */
+typedef struct {
+    uint32_t blocks;            /* Capacity in sectors */
+    uint32_t cached;            /* Sectors holding data */
+    uint32_t dirty;             /* Sectors waiting for write-back */
+    uint64_t hits;              /* Sector reads served from the cache */
+    uint64_t misses;            /* Sector reads that went to the disk */
+    uint64_t readahead;         /* Sectors read ahead of the request */
+    uint64_t readahead_hits;    /* Read-ahead sectors later requested */
+    uint64_t disk_reads;        /* Read commands issued */
+    uint64_t disk_writes;       /* Write commands issued (after coalescing) */
+    uint64_t written;           /* Sectors written back */
+} bcache_stats_t;
+
+/**
+ * Set up the cache with a memory budget
+ * @param bytes  Data memory to use (rounded down to whole pages)
+ * @return       0 on success, negative if the memory isn't available
+ */
+int bcache_init(size_t bytes);
+
+/**
+ * Read sectors through the cache
+ * @return 0 on success, negative on error
+ */
+int bcache_read(uint64_t lba, uint32_t count, void* buffer);
+
+/**
+ * Write sectors into the cache (written to disk later, or by bcache_flush)
+ * @return 0 on success, negative on error
+ */
+int bcache_write(uint64_t lba, uint32_t count, const void* buffer);
+
+/**
+ * Write all dirty sectors back to the disk
+ * @return 0 on success, negative if any write failed (those stay dirty)
+ */
+int bcache_flush(void);
+
+/**
+ * Get cache counters
+ */
+void bcache_get_stats(bcache_stats_t* stats);
+
+#endif /* _MINIOS_BCACHE_H */
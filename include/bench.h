@@ -0,0 +1,28 @@
+/**
+ * MiniOS - Benchmark Harness Interface
+ *
+ * Booting with "bench" on the kernel command line runs the benchmarks
+ * instead of the shell. Every result is one line on the screen and the
+ * serial port:
+ *
+ *     BENCH <name> <value> <unit>
+ *
+ * between a "BENCH-BEGIN ..." line describing the machine and a
+ * "BENCH-END" line, so runs of two builds can be compared by script.
+ */
+
+#ifndef _MINIOS_BENCH_H
+#define _MINIOS_BENCH_H
+
+#include "types.h"
+
+/* Runs of each microbenchmark; the fastest is reported */
+#define BENCH_RUNS      3
+
+/**
+ * Run every benchmark, then exit QEMU (isa-debug-exit) or halt
+ * Call from a thread holding the kernel lock.
+ */
+void bench_run(void) __attribute__((noreturn));
+
+#endif /* _MINIOS_BENCH_H */
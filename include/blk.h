@@ -0,0 +1,147 @@
+/**
+ * MiniOS - Block Request Queue Interface
+ *
+ * Asynchronous disk I/O. Callers submit requests with a completion
+ * callback; the queue merges requests for adjacent sectors, keeps them in
+ * LBA order and hands them to the disk driver from the block softirq, as
+ * many at a time as the device queues (one for ATA, up to 32 for NCQ). Completions run in softirq context, like network
+ * receive, so the shell and the network stack keep running while a
+ * transfer is in flight.
+ * 
+ * Requests for overlapping sectors are not ordered against each other;
+ * a submitter that needs ordering waits for the first to complete.
+ */
+
+#ifndef _MINIOS_BLK_H
+#define _MINIOS_BLK_H
+
+#include "types.h"
+
+/* Sector size in bytes */
+#define BLK_SECTOR_SIZE 512
+
+struct blk_request;
+struct blk_device;
+
+/* Completion callback: status is 0 on success, negative on error */
+typedef void (*blk_done_t)(struct blk_request* req, int status);
+
+/* I/O request (owned by the submitter until its callback runs) */
+typedef struct blk_request {
+    uint64_t lba;
+    uint32_t count;             /* Sectors */
+    void* buffer;               /* count * 512 bytes */
+    int write;
+    blk_done_t done;
+    void* priv;                 /* Submitter data */
+
+    /* Queue internals */
+    struct blk_request* next;           /* Sorted queue link */
+    struct blk_request* merge_next;     /* Further requests merged behind this one */
+    struct blk_request* merge_tail;
+    uint32_t total;                     /* Sectors in the merged chain */
+    uint32_t segments;                  /* Requests in the merged chain */
+    uint64_t queued;                    /* Tick when first queued */
+    uint64_t submit_tsc;                /* rdtsc() at submit, for perf */
+    uint64_t deadline;                  /* Tick by which the driver must progress */
+} blk_request_t;
+
+/* Driver return codes for start */
+#define BLK_DONE        1       /* Command finished successfully */
+#define BLK_PENDING     0       /* Command in flight, ended with blk_end_request() */
+
+/* Disk driver backend */
+typedef struct blk_device {
+    const char* name;
+    uint64_t sectors;           /* Capacity */
+    uint32_t max_sectors;       /* Largest single command */
+    uint32_t max_segments;      /* Most buffers one command can scatter to */
+    uint32_t queue_depth;       /* Commands the device accepts at once (0 means 1) */
+
+    /* Issue a command for a merged chain (sectors req->lba .. + req->total,
+     * buffers of each request on merge_next in turn) */
+    int (*start)(struct blk_device* dev, blk_request_t* req);
+
+    /* Handle the interrupt reported by blk_interrupt(), ending finished commands */
+    void (*service)(struct blk_device* dev);
+
+    /* No progress on req in time: recover and restart it, or end it with an
+     * error (other commands in flight may be restarted or ended too) */
+    void (*timeout)(struct blk_device* dev, blk_request_t* req);
+
+    void* priv;
+} blk_device_t;
+
+/* Queue counters */
+typedef struct {
+    uint64_t submitted;         /* Requests submitted */
+    uint64_t merged;            /* Requests merged into a neighbour */
+    uint64_t dispatched;        /* Commands issued to the driver */
+    uint64_t expired;           /* Commands issued out of order for their deadline */
+    uint64_t errors;            /* Commands that failed */
+    uint32_t queued;            /* Requests waiting now */
+    uint32_t inflight;          /* Commands issued and not yet ended */
+} blk_stats_t;
+
+/**
+ * Attach the disk driver that serves the queue
+ * @return 0 on success, negative if a disk is already attached
+ */
+int blk_register(blk_device_t* dev);
+
+/**
+ * Driver interrupt hook: schedule dev->service()
+ * Safe to call from interrupt context.
+ */
+void blk_interrupt(void);
+
+/**
+ * Driver completion: a command started by dev->start() has finished
+ * @param status  0 (or BLK_DONE) on success, negative on error
+ */
+void blk_end_request(blk_request_t* req, int status);
+
+/**
+ * Driver progress report: restart the timeout of a long command
+ */
+void blk_request_progress(blk_request_t* req);
+
+/**
+ * Check if a disk is attached
+ */
+int blk_is_present(void);
+
+/**
+ * Get the attached disk's capacity in sectors (0 if none)
+ */
+uint64_t blk_get_capacity(void);
+
+/**
+ * Get the attached disk backend (NULL if none)
+ */
+const blk_device_t* blk_get_device(void);
+
+/**
+ * Queue a request; 'done' runs once it completes (possibly before return)
+ * @return 0 if queued, negative if the request is invalid
+ */
+int blk_submit(blk_request_t* req);
+
+/**
+ * Read sectors and wait for them (not for use from softirq context)
+ * @return 0 on success, negative on error
+ */
+int blk_read(uint64_t lba, uint32_t count, void* buffer);
+
+/**
+ * Write sectors and wait for them (not for use from softirq context)
+ * @return 0 on success, negative on error
+ */
+int blk_write(uint64_t lba, uint32_t count, const void* buffer);
+
+/**
+ * Get queue counters
+ */
+void blk_get_stats(blk_stats_t* stats);
+
+#endif /* _MINIOS_BLK_H */
@@ -0,0 +1,108 @@
+/**
+ * MiniOS - Internet Checksum Interface
+ *
+ * One's complement sums (RFC 1071) for IP, ICMP, UDP and TCP.
+ * A partial sum is a 32-bit one's complement value that can be extended
+ * and combined cheaply; it is only folded to the final 16-bit checksum
+ * at the end. Sums are over memory-order 16-bit words, so a 16-bit field
+ * can be added to or compared with a sum without byte swapping.
+ */
+
+#ifndef _MINIOS_CHECKSUM_H
+#define _MINIOS_CHECKSUM_H
+
+#include "types.h"
+
+/**
+ * Add a buffer to a partial sum
+ * Works a 64-bit word at a time; 'data' may have any alignment.
+ */
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum);
+
+/**
+ * Copy a buffer and add it to a partial sum in the same pass
+ */
+uint32_t csum_partial_copy(void* dest, const void* src, size_t len, uint32_t sum);
+
+/**
+ * Sum of the TCP/UDP pseudo-header added to a partial sum
+ * @param src_ip, dest_ip  Addresses in network byte order
+ * @param len              Transport segment length in host byte order
+ */
+uint32_t csum_tcpudp_nofold(uint32_t src_ip, uint32_t dest_ip, uint16_t len,
+                            uint8_t protocol, uint32_t sum);
+
+/**
+ * Combine two partial sums
+ */
+static inline uint32_t csum_add(uint32_t sum, uint32_t addend) {
+    sum += addend;
+    return sum + (sum < addend);
+}
+
+/**
+ * Combine the partial sum of a block that starts 'offset' bytes into
+ * the summed region (odd offsets swap the bytes of the block's sum)
+ */
+static inline uint32_t csum_block_add(uint32_t sum, uint32_t block, size_t offset) {
+    if (offset & 1) {
+        block = (block << 8) | (block >> 24);
+    }
+    return csum_add(sum, block);
+}
+
+/**
+ * Fold a partial sum to 16 bits and complement it: the checksum field value
+ * Over data that includes a correct checksum field the result is 0.
+ */
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/**
+ * Internet checksum of a buffer (IP and ICMP headers)
+ */
+static inline uint16_t csum_buffer(const void* data, size_t len) {
+    return csum_fold(csum_partial(data, len, 0));
+}
+
+/**
+ * Final TCP/UDP checksum from a partial sum of the segment
+ */
+static inline uint16_t csum_tcpudp_magic(uint32_t src_ip, uint32_t dest_ip, uint16_t len,
+                                         uint8_t protocol, uint32_t sum) {
+    return csum_fold(csum_tcpudp_nofold(src_ip, dest_ip, len, protocol, sum));
+}
+
+/**
+ * Pseudo-header seed for a checksum left to the device (CSUM_PARTIAL)
+ * The field holds the folded pseudo-header sum, not complemented.
+ */
+static inline uint16_t csum_pseudo_seed(uint32_t src_ip, uint32_t dest_ip, uint16_t len,
+                                        uint8_t protocol) {
+    return (uint16_t)~csum_tcpudp_magic(src_ip, dest_ip, len, protocol, 0);
+}
+
+/**
+ * Update a checksum for a 16-bit field changing from 'from' to 'to' (RFC 1624)
+ */
+static inline void csum_replace2(uint16_t* check, uint16_t from, uint16_t to) {
+    uint32_t sum = (uint16_t)~*check;
+    sum += (uint16_t)~from;
+    sum += to;
+    *check = csum_fold(sum);
+}
+
+/**
+ * Update a checksum for a 32-bit field changing from 'from' to 'to' (RFC 1624)
+ */
+static inline void csum_replace4(uint16_t* check, uint32_t from, uint32_t to) {
+    uint32_t sum = (uint16_t)~*check;
+    sum = csum_add(sum, ~from);
+    sum = csum_add(sum, to);
+    *check = csum_fold(sum);
+}
+
+#endif /* _MINIOS_CHECKSUM_H */
@@ -0,0 +1,39 @@
+/**
+ * MiniOS - Console Interface
+ *
+ * Kernel output (printf) goes to every registered console: the screen,
+ * and the serial port when there is one. Each console takes whole
+ * buffers, so a sink pays its per-call costs once per printf rather
+ * than once per character.
+ */
+
+#ifndef _MINIOS_CONSOLE_H
+#define _MINIOS_CONSOLE_H
+
+#include "types.h"
+
+#define CONSOLE_MAX     4
+
+typedef struct {
+    const char* name;
+    void (*write)(const char* buf, size_t len);
+    void (*flush)(void);            /* Wait for queued output (optional) */
+} console_t;
+
+/**
+ * Add a console; output written from now on reaches it too
+ * @return 0 on success, -1 if CONSOLE_MAX are already registered
+ */
+int console_register(const console_t* con);
+
+/**
+ * Write 'len' bytes to every console
+ */
+void console_write(const char* buf, size_t len);
+
+/**
+ * Wait until every console has sent what it was given
+ */
+void console_flush(void);
+
+#endif /* _MINIOS_CONSOLE_H */
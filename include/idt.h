@@ -15,6 +15,12 @@ typedef void (*interrupt_handler_t)(void);
  */
 void idt_init(void);
 
+/**
+ * Load the IDT built by idt_init() on the calling CPU
+ * Application processors share the boot CPU's table.
+ */
+void idt_load(void);
+
 /**
  * Register an interrupt handler
  * @param vector   Interrupt vector number (0-255)
@@ -22,17 +28,51 @@ void idt_init(void);
  */
 void idt_set_handler(uint8_t vector, interrupt_handler_t handler);
 
+/**
+ * Add a handler to a hardware IRQ shared with other (PCI) devices
+ * Every handler on the line runs on each interrupt and must check
+ * whether its own device raised it.
+ * @param vector   Interrupt vector number (IRQ_BASE + irq)
+ * @param handler  Handler function
+ * @return 0 on success, negative if the line has no room for another handler
+ */
+int idt_share_handler(uint8_t vector, interrupt_handler_t handler);
+
 /**
  * Send End-Of-Interrupt signal to PIC
  * @param irq  IRQ number (0-15)
  */
 void pic_send_eoi(uint8_t irq);
 
+/**
+ * Unmask an IRQ line at the PIC
+ * @param irq  IRQ number (0-15)
+ */
+void pic_unmask_irq(uint8_t irq);
+
+/**
+ * Mask an IRQ line at the PIC
+ * @param irq  IRQ number (0-15)
+ */
+void pic_mask_irq(uint8_t irq);
+
+/* Vector of the first hardware IRQ after PIC remapping */
+#define IRQ_BASE        32
+
 /* Common interrupt vectors */
 #define IRQ0_TIMER      32
 #define IRQ1_KEYBOARD   33
 #define IRQ14_ATA_PRI   46
 #define IRQ15_ATA_SEC   47
 
+/* Vectors raised by the local APIC itself */
+#define LAPIC_TIMER_VECTOR      48
+#define LAPIC_SPURIOUS_VECTOR   255
+
+/* Inter-processor interrupts (sent through the local APIC) */
+#define IPI_CALL_VECTOR         49
+#define IPI_RESCHED_VECTOR      50
+#define IPI_PROFILE_VECTOR      51
+
 #endif /* _MINIOS_IDT_H */
 
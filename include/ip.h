@@ -0,0 +1,54 @@
+/**
+ * MiniOS - IPv4 Interface
+ *
+ * The IP layer between Ethernet/ARP and the transport protocols.
+ * Transport code hands ip_send a packet buffer holding its segment and
+ * the IP header is pushed in front of it.
+ */
+
+#ifndef _MINIOS_IP_H
+#define _MINIOS_IP_H
+
+#include "types.h"
+#include "net.h"
+#include "pktbuf.h"
+
+/* IP header */
+typedef struct {
+    uint8_t  version_ihl;   /* Version (4) and IHL (5) */
+    uint8_t  tos;           /* Type of service */
+    uint16_t total_len;     /* Total length */
+    uint16_t id;            /* Identification */
+    uint16_t flags_frag;    /* Flags and fragment offset */
+    uint8_t  ttl;           /* Time to live */
+    uint8_t  protocol;      /* Protocol (1 = ICMP) */
+    uint16_t checksum;      /* Header checksum */
+    uint32_t src_ip;        /* Source IP */
+    uint32_t dest_ip;       /* Destination IP */
+} PACKED ip_header_t;
+
+/* IP protocol numbers */
+#define IP_PROTO_ICMP       1
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+
+/* Default time to live for outgoing packets */
+#define IP_DEFAULT_TTL      64
+
+/* Largest transport segment that fits in one frame */
+#define IP_MAX_PAYLOAD      (ETH_MTU - sizeof(ip_header_t))
+
+/**
+ * Process an incoming IP packet ('pb' starts at the IP header)
+ */
+void ip_process(pktbuf_t* pb);
+
+/**
+ * Send an IP packet (takes ownership of the packet buffer)
+ * @param dest_ip   Destination address (network byte order)
+ * @param protocol  IP_PROTO_* of the payload already in 'pb'
+ * @return          0 if sent or queued for address resolution, negative on error
+ */
+int ip_send(uint32_t dest_ip, uint8_t protocol, pktbuf_t* pb);
+
+#endif /* _MINIOS_IP_H */
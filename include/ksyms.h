@@ -0,0 +1,38 @@
+/**
+ * MiniOS - Kernel Symbol Table Interface
+ *
+ * The table is generated by the Makefile from the linked kernel's own
+ * symbols (nm -n, functions only) and linked into a second image: one
+ * entry per function, sorted by address. It sits in .rodata, after all
+ * code, so linking it in moves no function.
+ */
+
+#ifndef _MINIOS_KSYMS_H
+#define _MINIOS_KSYMS_H
+
+#include "types.h"
+
+/* Function start */
+typedef struct {
+    uint64_t addr;
+    const char* name;
+} ksym_t;
+
+/* Generated table (build/ksymtab.c) */
+extern const ksym_t ksyms[];
+extern const uint32_t ksym_count;
+
+/**
+ * Find the function containing an address
+ * @return Index into ksyms[], or -1 if the address is before every function
+ */
+int ksym_find(uint64_t addr);
+
+/**
+ * Name the function containing an address
+ * @param offset  Set to the address's distance from the function start (may be NULL)
+ * @return Function name, or NULL if unknown
+ */
+const char* ksym_lookup(uint64_t addr, uint64_t* offset);
+
+#endif /* _MINIOS_KSYMS_H */
@@ -0,0 +1,65 @@
+/**
+ * MiniOS - Local APIC Interface
+ */
+
+#ifndef _MINIOS_LAPIC_H
+#define _MINIOS_LAPIC_H
+
+#include "types.h"
+
+/* Interrupt command register: delivery modes and level */
+#define LAPIC_ICR_FIXED         0x00000     /* Vector in bits 0-7 */
+#define LAPIC_ICR_INIT          0x00500
+#define LAPIC_ICR_STARTUP       0x00600     /* Start page number in bits 0-7 */
+#define LAPIC_ICR_ASSERT        0x04000
+
+/**
+ * Enable the calling CPU's local APIC
+ * External interrupts keep coming from the 8259 PIC through the boot
+ * CPU's LINT0, so this only adds the APIC's own sources (its timer and
+ * inter-processor interrupts).
+ * @return 0 on success, negative if there is no usable local APIC
+ */
+int lapic_init(void);
+
+/**
+ * Check if the local APIC is enabled
+ * @return non-zero after a successful lapic_init()
+ */
+int lapic_is_enabled(void);
+
+/**
+ * Get this CPU's local APIC ID
+ */
+uint32_t lapic_id(void);
+
+/**
+ * Signal End-Of-Interrupt for a vector the local APIC delivered
+ */
+void lapic_eoi(void);
+
+/**
+ * Start the timer counting down from 'count' (one-shot)
+ * It raises LAPIC_TIMER_VECTOR when it reaches zero. The count rate is
+ * found by calibration (see timer.c).
+ */
+void lapic_timer_start(uint32_t count);
+
+/**
+ * Stop the timer
+ */
+void lapic_timer_stop(void);
+
+/**
+ * Read the timer's current count
+ */
+uint32_t lapic_timer_current(void);
+
+/**
+ * Send an inter-processor interrupt and wait until the APIC has sent it
+ * @param apic_id  Destination local APIC ID
+ * @param icr      Delivery mode and flags (LAPIC_ICR_*) ORed with the vector
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+
+#endif /* _MINIOS_LAPIC_H */
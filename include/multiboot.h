@@ -0,0 +1,69 @@
+/**
+ * MiniOS - Multiboot2 Boot Information Interface
+ */
+
+#ifndef _MINIOS_MULTIBOOT_H
+#define _MINIOS_MULTIBOOT_H
+
+#include "types.h"
+
+/* Magic value the bootloader leaves in EAX */
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289
+
+/* Memory map entry types */
+#define MB_MEMORY_AVAILABLE         1
+#define MB_MEMORY_RESERVED          2
+#define MB_MEMORY_ACPI_RECLAIMABLE  3
+#define MB_MEMORY_NVS               4
+#define MB_MEMORY_BADRAM            5
+
+/* Memory region reported by the bootloader */
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} mb_mem_region_t;
+
+/**
+ * Parse the Multiboot2 information structure
+ * Must be called before the PMM is initialized.
+ * @param magic  Value passed in EAX by the bootloader
+ * @param info   Physical address of the boot information
+ * @return       0 on success, negative if the boot info is missing or invalid
+ */
+int multiboot_init(uint32_t magic, void* info);
+
+/**
+ * Get the number of memory map regions
+ */
+int multiboot_region_count(void);
+
+/**
+ * Get a memory map region
+ * @return Region, or NULL if index is out of range
+ */
+const mb_mem_region_t* multiboot_get_region(int index);
+
+/**
+ * Get the kernel command line (empty string if none)
+ */
+const char* multiboot_get_cmdline(void);
+
+/**
+ * Check if the kernel command line contains a word (e.g. "bench")
+ */
+int multiboot_cmdline_has(const char* word);
+
+/**
+ * Get the physical range occupied by the boot information structure
+ */
+void multiboot_get_info_range(uint64_t* start_out, uint64_t* end_out);
+
+/**
+ * Get the bootloader's copy of the ACPI RSDP
+ * The ACPI 2.0+ form is preferred when the bootloader passes both.
+ * @return RSDP structure, or NULL if the boot information had none
+ */
+const void* multiboot_get_acpi_rsdp(void);
+
+#endif /* _MINIOS_MULTIBOOT_H */
@@ -18,6 +18,11 @@ typedef struct {
     uint16_t ethertype;
 } PACKED eth_header_t;
 
+/* Offloads the network device accepted */
+#define NET_OFFLOAD_TX_CSUM     0x01    /* Device fills in L4 checksums */
+#define NET_OFFLOAD_RX_CSUM     0x02    /* Device validates L4 checksums */
+#define NET_OFFLOAD_TSO4        0x04    /* Device segments large TCPv4 sends */
+
 /* Common ethertypes */
 #define ETHERTYPE_IPV4  0x0800
 #define ETHERTYPE_ARP   0x0806
@@ -60,22 +65,39 @@ uint32_t net_get_ip(void);
  */
 void net_set_ip(uint32_t ip);
 
+/**
+ * Get the offloads the network device accepted
+ * @return NET_OFFLOAD_* bits
+ */
+int net_get_offloads(void);
+
 /**
  * Check if network is initialized
  */
 int net_is_initialized(void);
 
 /**
- * Process incoming network packets (call periodically)
+ * Process incoming network packets
+ * Normally driven by the device interrupt; callable directly to poll.
+ * @param budget  Maximum number of packets to process
+ * @return        Number of packets processed
  */
-void net_poll(void);
+int net_poll(int budget);
 
 /**
  * Send an ICMP echo request (ping)
  * @param dest_ip  Destination IP address
- * @return         0 on success, negative on error
+ * @return         The request's sequence number, negative on error
  */
 int net_ping(uint32_t dest_ip);
 
+/**
+ * Check whether the reply to an echo request has arrived
+ * @param seq      Sequence number returned by net_ping()
+ * @param rtt_ns   Set to the round-trip time in nanoseconds
+ * @return         Non-zero if the reply arrived
+ */
+int net_ping_reply(uint16_t seq, uint64_t* rtt_ns);
+
 #endif /* _MINIOS_NET_H */
 
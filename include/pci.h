@@ -37,6 +37,16 @@ uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t func, uint8_t offs
  */
 void pci_config_write(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset, uint32_t value);
 
+/**
+ * Read a 16-bit value from PCI configuration space
+ */
+uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset);
+
+/**
+ * Read an 8-bit value from PCI configuration space
+ */
+uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset);
+
 /**
  * Find a PCI device by vendor and device ID
  * @return non-zero if found, device info stored in *dev
@@ -54,6 +64,26 @@ int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* dev);
  */
 void pci_enable_bus_master(pci_device_t* dev);
 
+/**
+ * Enable memory-mapped register access for a PCI device
+ */
+void pci_enable_mmio(pci_device_t* dev);
+
+/**
+ * Get the base address decoded by a BAR
+ * Combines both halves of a 64-bit memory BAR.
+ */
+uint64_t pci_bar_address(const pci_device_t* dev, int bar);
+
+/**
+ * Find a capability in a device's capability list
+ * @param cap_id  Capability ID to look for
+ * @param start   0 to search from the beginning, or the offset of a
+ *                previous match to find the next one
+ * @return        Config space offset of the capability, or 0 if not found
+ */
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id, uint8_t start);
+
 /**
  * Get the number of detected PCI devices
  */
@@ -0,0 +1,124 @@
+/**
+ * MiniOS - Performance Counters Interface
+ *
+ * Event counters, per-vector interrupt counts and log2 latency histograms
+ * (in TSC cycles), kept per CPU inside the percpu_t. An update is one
+ * GS-relative add: no lock, no atomic, and a thread preempted around it
+ * still counts on exactly one CPU.
+ *
+ * Readers sum every CPU's copy. perf_reset() only moves the baseline the
+ * sums are taken against, so nothing a CPU is updating is ever cleared.
+ */
+
+#ifndef _MINIOS_PERF_H
+#define _MINIOS_PERF_H
+
+#include "types.h"
+#include "ports.h"
+
+/* Event counters */
+#define PERF_NET_TX         0   /* Frames queued to the NIC */
+#define PERF_NET_RX         1   /* Frames taken from the NIC */
+#define PERF_ARP_HIT        2   /* Neighbour lookups answered from the cache */
+#define PERF_ARP_MISS       3
+#define PERF_BLK_READ       4   /* Sectors read */
+#define PERF_BLK_WRITE      5   /* Sectors written */
+#define PERF_NR_COUNTERS    6
+
+/* Latency histograms */
+#define PERF_LAT_NET_TX     0   /* virtio_net_send_batch() */
+#define PERF_LAT_NET_POLL   1   /* net_poll() */
+#define PERF_LAT_BLK_READ   2   /* Submit to completion */
+#define PERF_LAT_BLK_WRITE  3
+#define PERF_LAT_KMALLOC    4
+#define PERF_LAT_KFREE      5
+#define PERF_NR_HISTS       6
+
+/* Bucket i counts latencies of [2^i, 2^(i+1)) cycles; the last one, anything longer */
+#define PERF_HIST_BUCKETS   32
+
+#define PERF_NR_VECTORS     256
+
+/* Latency histogram */
+typedef struct {
+    uint64_t buckets[PERF_HIST_BUCKETS];
+    uint64_t cycles;                /* Sum of every latency recorded */
+} perf_hist_t;
+
+/* One CPU's counters (percpu_t.perf) */
+typedef struct {
+    uint64_t counts[PERF_NR_COUNTERS];
+    uint64_t irqs[PERF_NR_VECTORS];
+    perf_hist_t hists[PERF_NR_HISTS];
+} perf_cpu_t;
+
+/* Sum over every CPU since the last perf_reset() */
+typedef struct {
+    perf_cpu_t total;
+    uint64_t elapsed_ns;
+} perf_snapshot_t;
+
+/* smp.h embeds perf_cpu_t, and the macros below need its percpu_t */
+#include "smp.h"
+
+/**
+ * Add to the calling CPU's copy of a counter, 'offset' bytes into its percpu_t
+ */
+static inline void perf_gs_add(uint64_t offset, uint64_t n) {
+    __asm__ volatile("addq %1, %%gs:(%0)" : : "r"(offset), "r"(n) : "cc");
+}
+
+/**
+ * Record one latency in a histogram 'offset' bytes into the percpu_t
+ */
+static inline void perf_hist_add(uint64_t offset, uint64_t cycles) {
+    uint32_t bucket = 63 - __builtin_clzll(cycles | 1);
+
+    if (bucket >= PERF_HIST_BUCKETS) {
+        bucket = PERF_HIST_BUCKETS - 1;
+    }
+    perf_gs_add(offset + offsetof(perf_hist_t, buckets) + bucket * sizeof(uint64_t), 1);
+    perf_gs_add(offset + offsetof(perf_hist_t, cycles), cycles);
+}
+
+/* Count 'n' events of counter 'c' */
+#define perf_add(c, n) \
+    perf_gs_add(offsetof(percpu_t, perf.counts) + (c) * sizeof(uint64_t), (n))
+
+#define perf_count(c)   perf_add(c, 1)
+
+/* Count an interrupt on vector 'v' */
+#define perf_irq(v) \
+    perf_gs_add(offsetof(percpu_t, perf.irqs) + (v) * sizeof(uint64_t), 1)
+
+/* Record the cycles since 'start' (an earlier rdtsc()) in histogram 'h' */
+#define perf_lat(h, start) \
+    perf_hist_add(offsetof(percpu_t, perf.hists) + (h) * sizeof(perf_hist_t), \
+                  rdtsc() - (start))
+
+/**
+ * Sum every CPU's counters since the last reset
+ */
+void perf_read(perf_snapshot_t* snap);
+
+/**
+ * Start counting from zero again
+ */
+void perf_reset(void);
+
+/**
+ * Convert TSC cycles to nanoseconds (0 if the TSC is uncalibrated)
+ */
+uint64_t perf_cycles_to_ns(uint64_t cycles);
+
+/**
+ * Get a counter's name
+ */
+const char* perf_counter_name(int counter);
+
+/**
+ * Get a histogram's name
+ */
+const char* perf_hist_name(int hist);
+
+#endif /* _MINIOS_PERF_H */
@@ -0,0 +1,178 @@
+/**
+ * MiniOS - Packet Buffer Interface
+ *
+ * Reference-counted packet buffers shared by the network driver and the
+ * protocol layers. Headers are pushed into headroom and pulled off the
+ * front in place, so a frame is never copied between layers.
+ */
+
+#ifndef _MINIOS_PKTBUF_H
+#define _MINIOS_PKTBUF_H
+
+#include "types.h"
+
+/* Size of a packet data buffer (one virtqueue DMA buffer) */
+#define PKTBUF_SIZE         2048
+
+/* Headroom reserved in freshly allocated buffers for lower-layer headers */
+#define PKTBUF_HEADROOM     128
+
+/* Packet flags */
+#define PKTBUF_F_CSUM_PARTIAL   0x01    /* L4 checksum left for the device */
+#define PKTBUF_F_CSUM_VALID     0x02    /* Device verified the L4 checksum */
+
+/* Segmentation offload types */
+#define PKTBUF_GSO_NONE         0
+#define PKTBUF_GSO_TCPV4        1
+
+struct pktbuf;
+
+/* Called when the last reference is dropped */
+typedef void (*pktbuf_release_t)(struct pktbuf* pb);
+
+/* Packet buffer */
+typedef struct pktbuf {
+    uint8_t* head;              /* Start of the underlying buffer */
+    uint8_t* data;              /* Start of valid data */
+    uint16_t len;               /* Bytes of valid data */
+    uint16_t size;              /* Size of the underlying buffer */
+    uint16_t refcnt;
+    uint16_t flags;             /* PKTBUF_F_* */
+    uint16_t csum_start;        /* CSUM_PARTIAL: checksummed region, from head */
+    uint16_t csum_offset;       /* CSUM_PARTIAL: checksum field, from csum_start */
+    uint16_t gso_size;          /* TSO: payload bytes per segment */
+    uint8_t  gso_type;          /* TSO: PKTBUF_GSO_* */
+    pktbuf_release_t release;   /* Returns the buffer to its owner */
+    void* priv;                 /* Owner data (e.g. descriptor index) */
+    struct pktbuf* next;        /* Queue link */
+} pktbuf_t;
+
+/**
+ * Initialize the packet buffer caches
+ */
+void pktbuf_init(void);
+
+/**
+ * Allocate a packet buffer with PKTBUF_HEADROOM bytes of headroom
+ * @return New buffer with one reference, or NULL if out of memory
+ */
+pktbuf_t* pktbuf_alloc(void);
+
+/**
+ * Allocate a packet buffer able to hold 'len' bytes after the headroom
+ * Lengths beyond a standard buffer (TSO sends) get a heap buffer.
+ * @return New buffer with one reference, or NULL if out of memory
+ */
+pktbuf_t* pktbuf_alloc_len(uint32_t len);
+
+/**
+ * Allocate a raw PKTBUF_SIZE data buffer (for driver receive rings)
+ */
+void* pktbuf_data_alloc(void);
+
+/**
+ * Free a raw data buffer from pktbuf_data_alloc
+ */
+void pktbuf_data_free(void* data);
+
+/**
+ * Set up a packet buffer around memory owned by someone else
+ * The buffer starts with one reference and no valid data.
+ */
+void pktbuf_wrap(pktbuf_t* pb, uint8_t* buffer, uint16_t size,
+                 pktbuf_release_t release, void* priv);
+
+/**
+ * Take an additional reference
+ */
+static inline pktbuf_t* pktbuf_ref(pktbuf_t* pb) {
+    pb->refcnt++;
+    return pb;
+}
+
+/**
+ * Drop a reference, releasing the buffer when it was the last one
+ */
+void pktbuf_free(pktbuf_t* pb);
+
+/**
+ * Fill in a CSUM_PARTIAL checksum in software
+ * Sums from csum_start to the end of the data and stores the result at
+ * csum_offset (the field should hold the pseudo-header sum, or zero).
+ */
+void pktbuf_csum_finish(pktbuf_t* pb);
+
+/**
+ * Bytes available in front of the data
+ */
+static inline uint16_t pktbuf_headroom(const pktbuf_t* pb) {
+    return (uint16_t)(pb->data - pb->head);
+}
+
+/**
+ * Bytes available after the data
+ */
+static inline uint16_t pktbuf_tailroom(const pktbuf_t* pb) {
+    return (uint16_t)(pb->size - pktbuf_headroom(pb) - pb->len);
+}
+
+/**
+ * Prepend 'len' bytes of header space
+ * @return Pointer to the new header, or NULL if headroom is too small
+ */
+static inline void* pktbuf_push(pktbuf_t* pb, uint16_t len) {
+    if (pktbuf_headroom(pb) < len) {
+        return NULL;
+    }
+    pb->data -= len;
+    pb->len += len;
+    return pb->data;
+}
+
+/**
+ * Strip 'len' bytes from the front
+ * @return Pointer to the stripped header, or NULL if the packet is too short
+ */
+static inline void* pktbuf_pull(pktbuf_t* pb, uint16_t len) {
+    if (pb->len < len) {
+        return NULL;
+    }
+    uint8_t* hdr = pb->data;
+    pb->data += len;
+    pb->len -= len;
+    return hdr;
+}
+
+/**
+ * Append 'len' bytes at the tail
+ * @return Pointer to the appended space, or NULL if tailroom is too small
+ */
+static inline void* pktbuf_append(pktbuf_t* pb, uint16_t len) {
+    if (pktbuf_tailroom(pb) < len) {
+        return NULL;
+    }
+    uint8_t* tail = pb->data + pb->len;
+    pb->len += len;
+    return tail;
+}
+
+/**
+ * Leave the checksum of the header at 'data' to the device
+ * @param field_offset  Offset of the checksum field within the header
+ */
+static inline void pktbuf_set_csum_partial(pktbuf_t* pb, uint16_t field_offset) {
+    pb->flags |= PKTBUF_F_CSUM_PARTIAL;
+    pb->csum_start = pktbuf_headroom(pb);
+    pb->csum_offset = field_offset;
+}
+
+/**
+ * Cut the packet down to 'len' bytes (no-op if already shorter)
+ */
+static inline void pktbuf_trim(pktbuf_t* pb, uint16_t len) {
+    if (pb->len > len) {
+        pb->len = len;
+    }
+}
+
+#endif /* _MINIOS_PKTBUF_H */
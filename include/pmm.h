@@ -0,0 +1,73 @@
+/**
+ * MiniOS - Physical Memory Manager Interface
+ */
+
+#ifndef _MINIOS_PMM_H
+#define _MINIOS_PMM_H
+
+#include "types.h"
+
+/* Largest buddy block order (2^PMM_MAX_ORDER pages = 4MB) */
+#define PMM_MAX_ORDER   10
+
+/**
+ * Initialize the physical memory manager
+ * Usable memory is taken from the Multiboot2 memory map, so
+ * multiboot_init() must have been called first.
+ */
+void pmm_init(void);
+
+/**
+ * Allocate a single physical page
+ * @return Physical address of page, or NULL on failure
+ */
+void* pmm_alloc_page(void);
+
+/**
+ * Allocate physically contiguous pages
+ * @param count  Number of pages (1 to 2^PMM_MAX_ORDER)
+ * @return       Physical address of first page, or NULL on failure
+ */
+void* pmm_alloc_pages(size_t count);
+
+/**
+ * Free a single physical page
+ */
+void pmm_free_page(void* addr);
+
+/**
+ * Free contiguous pages (any sub-range of an earlier allocation is allowed)
+ */
+void pmm_free_pages(void* addr, size_t count);
+
+/**
+ * Get free page count
+ */
+size_t pmm_get_free_pages(void);
+
+/**
+ * Get total page count
+ */
+size_t pmm_get_total_pages(void);
+
+/**
+ * Get free memory in bytes
+ */
+size_t pmm_get_free_memory(void);
+
+/**
+ * Get total memory in bytes
+ */
+size_t pmm_get_total_memory(void);
+
+/**
+ * Get number of free blocks of a given order
+ */
+size_t pmm_get_free_blocks(int order);
+
+/**
+ * Get number of memory zones (usable physical ranges) being managed
+ */
+int pmm_get_zone_count(void);
+
+#endif /* _MINIOS_PMM_H */
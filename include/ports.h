@@ -78,6 +78,24 @@ static inline void sti(void) {
     __asm__ volatile("sti");
 }
 
+/**
+ * Disable interrupts, returning the previous RFLAGS
+ */
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/**
+ * Re-enable interrupts if they were enabled when irq_save() was called
+ */
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) {     /* RFLAGS.IF */
+        sti();
+    }
+}
+
 /**
  * Halt the CPU until next interrupt
  */
@@ -85,5 +103,41 @@ static inline void hlt(void) {
     __asm__ volatile("hlt");
 }
 
+/**
+ * Read the CPU timestamp counter
+ */
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Execute CPUID for a leaf (subleaf 0)
+ */
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx,
+                         uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+/**
+ * Read a model-specific register
+ */
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Write a model-specific register
+ */
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value),
+                     "d"((uint32_t)(value >> 32)));
+}
+
 #endif /* _MINIOS_PORTS_H */
 
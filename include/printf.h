@@ -9,7 +9,7 @@
 #include <stdarg.h>
 
 /**
- * Formatted print to VGA console
+ * Formatted print to the consoles (screen and serial port)
  * Supports: %d, %u, %x, %X, %s, %c, %p, %%
  * Width and zero-padding supported (e.g., %08x)
  * 
@@ -38,5 +38,40 @@ int vprintf(const char* format, va_list args);
  */
 int vsprintf(char* buffer, const char* format, va_list args);
 
+/**
+ * Print text as is, without looking for conversions
+ * @return len
+ */
+int printf_literal(const char* str, size_t len);
+
+/* Bytes per hexdump() line */
+#define HEXDUMP_WIDTH   16
+
+/**
+ * Print bytes as hex and ASCII, HEXDUMP_WIDTH per line:
+ *     0010: 48 65 6c 6c 6f 00 ...  Hello.
+ * Lines are labelled with their offset, counting from 'offset'.
+ */
+void hexdump(const void* data, size_t len, uint32_t offset);
+
+/*
+ * printf() sorts out its format at compile time where it can: a literal
+ * with no arguments and no '%' is known to need no formatting and goes
+ * straight to the consoles. Everything else calls the formatter.
+ */
+#define PRINTF_KIND_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, \
+                     kind, ...) kind
+#define PRINTF_KIND(...) \
+    PRINTF_KIND_(__VA_ARGS__, ARGS, ARGS, ARGS, ARGS, ARGS, ARGS, ARGS, ARGS, ARGS, \
+                 ARGS, ARGS, ARGS, ARGS, ARGS, ARGS, PLAIN, )
+#define PRINTF_CAT_(a, b)   a##b
+#define PRINTF_CAT(a, b)    PRINTF_CAT_(a, b)
+
+#define printf(...)         PRINTF_CAT(PRINTF_, PRINTF_KIND(__VA_ARGS__))(__VA_ARGS__)
+#define PRINTF_ARGS         (printf)
+#define PRINTF_PLAIN(fmt) \
+    ((__builtin_constant_p(__builtin_strchr(fmt, '%')) && !__builtin_strchr(fmt, '%')) \
+     ? printf_literal(fmt, __builtin_strlen(fmt)) : (printf)(fmt))
+
 #endif /* _MINIOS_PRINTF_H */
 
@@ -0,0 +1,54 @@
+/**
+ * MiniOS - Sampling Profiler Interface
+ *
+ * While running, the profiler keeps the clock ticking every 1/TIMER_HZ
+ * (even tickless), and each timer interrupt records the interrupted RIP
+ * and sends every other CPU a sample IPI to record its own. Samples go
+ * into a per-CPU buffer, so recording one takes no lock; they are only
+ * resolved against the kernel symbol table when a report is asked for.
+ */
+
+#ifndef _MINIOS_PROFILE_H
+#define _MINIOS_PROFILE_H
+
+#include "types.h"
+
+/* Samples kept per CPU (about 20 s at TIMER_HZ) */
+#define PROFILE_SAMPLES     2048
+
+/* One line of a report */
+typedef struct {
+    const char* name;               /* Function, or NULL for unknown addresses */
+    uint32_t samples;
+} profile_entry_t;
+
+/**
+ * Clear the samples and start sampling (kernel lock held)
+ * @return 0 on success, -1 if already running
+ */
+int profile_start(void);
+
+/**
+ * Stop sampling; the samples are kept for profile_top()
+ */
+void profile_stop(void);
+
+/**
+ * Check if the profiler is sampling
+ */
+int profile_is_running(void);
+
+/**
+ * Record a sample if 'vector' is a profiling tick (called by isr_handler())
+ */
+void profile_interrupt(uint64_t vector, uint64_t rip);
+
+/**
+ * Get the functions with the most samples, most first
+ * @param total    Set to the number of samples taken on all CPUs
+ * @param dropped  Set to the samples lost to full buffers
+ * @return Entries filled in, or -1 if out of memory
+ */
+int profile_top(profile_entry_t* out, int max, uint32_t* total, uint32_t* dropped);
+
+#endif /* _MINIOS_PROFILE_H */
@@ -0,0 +1,118 @@
+/**
+ * MiniOS - Lock-free Rings
+ *
+ * Fixed-size queues of fixed-size elements, with one consumer and either
+ * one producer (SPSC) or several (MPSC). Nobody takes a lock, so an
+ * interrupt handler can feed a thread without spinning on anything the
+ * thread holds.
+ *
+ * Indices run freely and are masked on use, so the size must be a power
+ * of two and every slot can be filled. The producer and consumer indices
+ * sit on cache lines of their own (as long as the ring itself is aligned,
+ * which kmalloc only promises to 16 bytes); each side only writes its own
+ * line. A side publishes its index with a release store after touching
+ * the slots, and the other side reads it with an acquire load before
+ * touching them.
+ */
+
+#ifndef _MINIOS_RING_H
+#define _MINIOS_RING_H
+
+#include "types.h"
+
+typedef struct {
+    /* Read-only after ring_init() */
+    uint8_t* slots;
+    uint32_t mask;                  /* Size - 1 */
+    uint32_t esize;                 /* Bytes per element */
+
+    struct {
+        volatile uint32_t head;     /* Next slot to reserve */
+        volatile uint32_t tail;     /* Slots before this are filled */
+    } ALIGNED(64) prod;
+
+    struct {
+        volatile uint32_t tail;     /* Slots before this are free again */
+    } ALIGNED(64) cons;
+} ring_t;
+
+/**
+ * Set up a ring over 'size' slots of 'esize' bytes each
+ * @return 0 on success, -1 if size is not a power of two
+ */
+int ring_init(ring_t* ring, void* slots, uint32_t size, uint32_t esize);
+
+/**
+ * Append up to 'n' elements (single producer)
+ * @return Number appended
+ */
+uint32_t ring_sp_enqueue_bulk(ring_t* ring, const void* objs, uint32_t n);
+
+/**
+ * Append up to 'n' elements (any number of producers, interrupt handlers included)
+ * @return Number appended
+ */
+uint32_t ring_mp_enqueue_bulk(ring_t* ring, const void* objs, uint32_t n);
+
+/**
+ * Remove up to 'n' elements from the front (single consumer)
+ * @return Number removed
+ */
+uint32_t ring_sc_dequeue_bulk(ring_t* ring, void* objs, uint32_t n);
+
+/**
+ * Append one element (single producer)
+ * @return 0 on success, -1 if the ring is full
+ */
+static inline int ring_sp_enqueue(ring_t* ring, const void* obj) {
+    return ring_sp_enqueue_bulk(ring, obj, 1) ? 0 : -1;
+}
+
+/**
+ * Append one element (any number of producers)
+ * @return 0 on success, -1 if the ring is full
+ */
+static inline int ring_mp_enqueue(ring_t* ring, const void* obj) {
+    return ring_mp_enqueue_bulk(ring, obj, 1) ? 0 : -1;
+}
+
+/**
+ * Remove the front element (single consumer)
+ * @return 0 on success, -1 if the ring is empty
+ */
+static inline int ring_sc_dequeue(ring_t* ring, void* obj) {
+    return ring_sc_dequeue_bulk(ring, obj, 1) ? 0 : -1;
+}
+
+/**
+ * Number of slots
+ */
+static inline uint32_t ring_size(const ring_t* ring) {
+    return ring->mask + 1;
+}
+
+/**
+ * Number of queued elements (a snapshot when the other side is active)
+ */
+static inline uint32_t ring_count(const ring_t* ring) {
+    /* Consumer first: it can never pass a producer index read after it */
+    uint32_t cons = __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+    uint32_t prod = __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE);
+    return MIN(prod - cons, ring->mask + 1);
+}
+
+/**
+ * Check if nothing is queued
+ */
+static inline int ring_empty(const ring_t* ring) {
+    return ring_count(ring) == 0;
+}
+
+/**
+ * Check if every slot is taken
+ */
+static inline int ring_full(const ring_t* ring) {
+    return ring_count(ring) > ring->mask;
+}
+
+#endif /* _MINIOS_RING_H */
@@ -0,0 +1,46 @@
+/**
+ * MiniOS - Serial Port Interface
+ *
+ * COM1 (a 16550 UART) at 115200 baud, 8N1, registered as a console.
+ * Output is queued in a transmit ring and sent by the UART's "transmitter
+ * empty" interrupt, so writers never wait for the line unless the ring
+ * is full.
+ */
+
+#ifndef _MINIOS_SERIAL_H
+#define _MINIOS_SERIAL_H
+
+#include "types.h"
+
+#define SERIAL_BAUD     115200
+
+/* Transmit ring size in bytes (a power of two) */
+#define SERIAL_TX_SIZE  4096
+
+/**
+ * Set up COM1, its interrupt and its console
+ * @return 0 on success, -1 if no UART answers
+ */
+int serial_init(void);
+
+/**
+ * Check if a UART was found
+ */
+int serial_is_present(void);
+
+/**
+ * Queue 'len' bytes for sending ('\n' goes out as "\r\n")
+ */
+void serial_write(const char* buf, size_t len);
+
+/**
+ * Send a character
+ */
+void serial_putchar(char c);
+
+/**
+ * Wait until everything queued has left the UART
+ */
+void serial_flush(void);
+
+#endif /* _MINIOS_SERIAL_H */
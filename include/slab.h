@@ -0,0 +1,87 @@
+/**
+ * MiniOS - Slab Allocator Interface
+ *
+ * Object caches for fixed-size kernel objects. Backing memory comes
+ * straight from the PMM; kmalloc() uses the size-class caches for
+ * small requests.
+ */
+
+#ifndef _MINIOS_SLAB_H
+#define _MINIOS_SLAB_H
+
+#include "types.h"
+
+/* Largest object size a cache can hold */
+#define SLAB_MAX_OBJ_SIZE   2048
+
+/* Opaque object cache */
+typedef struct kmem_cache kmem_cache_t;
+
+/* Cache statistics */
+typedef struct {
+    const char* name;
+    size_t obj_size;        /* Object size including alignment padding */
+    size_t active_objs;     /* Objects currently allocated */
+    size_t total_objs;      /* Object slots in all slabs */
+    size_t slabs;           /* Slabs owned by the cache */
+} kmem_cache_info_t;
+
+/**
+ * Initialize the slab allocator and the kmalloc size-class caches
+ * Requires the PMM to be initialized.
+ */
+void slab_init(void);
+
+/**
+ * Check if the slab allocator is ready
+ */
+int slab_is_initialized(void);
+
+/**
+ * Create an object cache
+ * @param name   Name shown in statistics (not copied)
+ * @param size   Object size in bytes (1 to SLAB_MAX_OBJ_SIZE)
+ * @param align  Object alignment, power of two (0 for default of 16)
+ * @return       New cache, or NULL on failure
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+/**
+ * Allocate an object from a cache
+ * @return Object pointer, or NULL if out of memory
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/**
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+/**
+ * Allocate from the smallest size class that fits (used by kmalloc)
+ * @return Object pointer, or NULL if size is too large or out of memory
+ */
+void* slab_alloc_size(size_t size);
+
+/**
+ * Check if a pointer belongs to a slab
+ */
+int slab_owns(const void* ptr);
+
+/**
+ * Free an object allocated by slab_alloc_size or kmem_cache_alloc
+ */
+void slab_free(void* ptr);
+
+/**
+ * Get number of caches
+ */
+int kmem_cache_count(void);
+
+/**
+ * Get statistics for the cache at the given index
+ * @return 0 on success, negative if index is out of range
+ */
+int kmem_cache_get_info(int index, kmem_cache_info_t* info);
+
+#endif /* _MINIOS_SLAB_H */
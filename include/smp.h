@@ -0,0 +1,117 @@
+/**
+ * MiniOS - Multiprocessor Support Interface
+ *
+ * Every CPU has a percpu_t, found through its GS base: gs:0 holds the
+ * area's own address, so this_cpu() and smp_cpu_id() are single loads
+ * with no table lookup. CPU 0 is the boot CPU; application processors
+ * are numbered in the order they came up.
+ */
+
+#ifndef _MINIOS_SMP_H
+#define _MINIOS_SMP_H
+
+#include "types.h"
+#include "spinlock.h"
+#include "perf.h"
+
+/* CPUs the kernel drives at most */
+#define SMP_MAX_CPUS    8
+
+struct thread;
+
+/* Function run on another CPU by smp_call_function() */
+typedef void (*smp_call_fn_t)(void* arg);
+
+/* Per-CPU area */
+typedef struct percpu {
+    struct percpu* self;            /* gs:0 */
+    uint32_t id;                    /* Logical CPU number */
+    uint32_t apic_id;               /* Local APIC ID */
+    volatile int online;            /* Set by the CPU once it is running */
+
+    /* Cross-CPU call mailbox, one caller at a time */
+    spinlock_t call_lock;
+    smp_call_fn_t volatile call_fn;
+    void* volatile call_arg;
+    volatile int call_done;
+    uint64_t calls;                 /* Calls this CPU has run for others */
+
+    /* Scheduler (thread.c) */
+    struct thread* curr;            /* Running thread */
+    struct thread* idle;
+    spinlock_t rq_lock;
+    struct thread* rq_head;         /* Runnable threads, FIFO */
+    struct thread* rq_tail;
+    volatile uint32_t rq_len;
+    volatile int need_resched;
+    uint64_t slice_start;           /* ktime_ns() of the last switch */
+    uint64_t switches;
+    uint64_t steals;                /* Threads taken from other CPUs */
+
+    perf_cpu_t perf;                /* Counters (perf.h) */
+} ALIGNED(64) percpu_t;
+
+/**
+ * Get the calling CPU's per-CPU area
+ */
+static inline percpu_t* this_cpu(void) {
+    percpu_t* cpu;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * Get the calling CPU's logical number
+ */
+static inline uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, id)));
+    return id;
+}
+
+/**
+ * Point the boot CPU's GS base at its per-CPU area
+ * Must run before anything uses this_cpu() (the allocators do).
+ */
+void smp_early_init(void);
+
+/**
+ * Start the application processors the MADT lists
+ * Needs the local APIC, the ACPI tables, a running clock and sched_init().
+ * Each AP enters the scheduler and runs (or steals) threads from then on.
+ * @return Number of CPUs online, including the boot CPU
+ */
+int smp_init(void);
+
+/**
+ * Get the number of CPUs online
+ */
+int smp_cpu_count(void);
+
+/**
+ * Get a CPU's per-CPU area
+ * @return Area, or NULL if no such CPU is online
+ */
+percpu_t* smp_get_cpu(int id);
+
+/**
+ * Send an interrupt to another CPU
+ */
+void smp_send_ipi(int id, uint8_t vector);
+
+/**
+ * Run a function on a CPU and wait for it to return
+ * The function runs in interrupt context on the target. Call with
+ * interrupts enabled: two CPUs calling each other with interrupts off
+ * would wait on each other forever.
+ * @return 0 on success, negative if the CPU is not online
+ */
+int smp_call_function(int id, smp_call_fn_t fn, void* arg);
+
+/**
+ * Run a function on every online CPU, the caller last
+ * @return Number of CPUs it ran on
+ */
+int smp_call_all(smp_call_fn_t fn, void* arg);
+
+#endif /* _MINIOS_SMP_H */
@@ -0,0 +1,65 @@
+/**
+ * MiniOS - Deferred Interrupt Work
+ *
+ * Interrupt handlers do the minimum and raise a softirq; the handler for
+ * it runs later with interrupts enabled. During boot that is the idle
+ * loop's job; from softirq_start() on, each softirq has a thread of its
+ * own, woken when the softirq is raised. Handlers always run under the
+ * kernel lock, so they never race with each other or with shell code.
+ */
+
+#ifndef _MINIOS_SOFTIRQ_H
+#define _MINIOS_SOFTIRQ_H
+
+#include "types.h"
+
+/* Softirq numbers */
+#define SOFTIRQ_NET_RX      0
+#define SOFTIRQ_TIMER       1
+#define SOFTIRQ_BLOCK       2
+#define SOFTIRQ_SCHED       3
+#define SOFTIRQ_MAX         8
+
+/* Softirq handler function type */
+typedef void (*softirq_handler_t)(void);
+
+/**
+ * Register the handler for a softirq
+ */
+void softirq_register(int nr, softirq_handler_t handler);
+
+/**
+ * Mark a softirq as pending (safe to call from interrupt context)
+ */
+void softirq_raise(int nr);
+
+/**
+ * Check if any softirq is pending
+ */
+int softirq_pending(void);
+
+/**
+ * Run all pending softirq handlers (boot only: then the threads do)
+ */
+void softirq_run(void);
+
+/**
+ * Give every registered softirq its thread
+ * @return Number of threads started
+ */
+int softirq_start(void);
+
+/**
+ * Idle the CPU until something happens
+ * Before softirq_start() this runs pending softirqs, or halts until the
+ * next interrupt. A thread instead sleeps until a softirq has run or
+ * cpu_idle_wake() is called, so polling loops see every change.
+ */
+void cpu_idle(void);
+
+/**
+ * Wake the threads waiting in cpu_idle() (safe from interrupt handlers)
+ */
+void cpu_idle_wake(void);
+
+#endif /* _MINIOS_SOFTIRQ_H */
@@ -0,0 +1,97 @@
+/**
+ * MiniOS - Ticket Spinlocks
+ *
+ * A lock is two counters: 'next' hands out tickets and 'owner' is the
+ * ticket being served. CPUs get the lock in the order they asked for it,
+ * so a busy lock can't starve one of them.
+ *
+ * Anything an interrupt handler also takes must be locked with the
+ * _irqsave variants, or the handler can spin forever on a lock its own
+ * CPU holds.
+ */
+
+#ifndef _MINIOS_SPINLOCK_H
+#define _MINIOS_SPINLOCK_H
+
+#include "types.h"
+#include "ports.h"
+
+typedef struct {
+    volatile uint16_t next;     /* Next ticket to hand out */
+    volatile uint16_t owner;    /* Ticket holding the lock */
+} spinlock_t;
+
+#define SPINLOCK_INIT   { 0, 0 }
+
+/**
+ * Tell the CPU this is a spin-wait loop
+ */
+static inline void cpu_relax(void) {
+    __asm__ volatile("pause" ::: "memory");
+}
+
+/**
+ * Initialize a lock (same as SPINLOCK_INIT)
+ */
+static inline void spin_init(spinlock_t* lock) {
+    lock->next = 0;
+    lock->owner = 0;
+}
+
+/**
+ * Take a lock, spinning until it is free
+ */
+static inline void spin_lock(spinlock_t* lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_relax();
+    }
+}
+
+/**
+ * Take a lock only if nobody holds it or waits for it
+ * @return non-zero if the lock was taken
+ */
+static inline int spin_trylock(spinlock_t* lock) {
+    uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint16_t ticket = owner;
+
+    return __atomic_compare_exchange_n(&lock->next, &ticket, (uint16_t)(owner + 1), 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release a lock (only the holder writes 'owner')
+ */
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Check if a lock is held
+ */
+static inline int spin_is_locked(spinlock_t* lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+/**
+ * Disable interrupts, then take a lock
+ * @return Flags for spin_unlock_irqrestore()
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * Release a lock, then restore the interrupt state
+ */
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* _MINIOS_SPINLOCK_H */
@@ -45,6 +45,16 @@ char* strcat(char* dest, const char* src);
  */
 char* strchr(const char* str, int c);
 
+/**
+ * Detect CPU features used by the memory primitives (call once at boot)
+ */
+void string_init(void);
+
+/**
+ * Check if memcpy/memset use Enhanced REP MOVSB/STOSB
+ */
+int string_has_erms(void);
+
 /**
  * Copy n bytes from src to dest
  */
@@ -0,0 +1,131 @@
+/**
+ * MiniOS - TCP Interface
+ *
+ * Stream sockets over the IP layer. Sends are copied into a per-socket
+ * send buffer and go out as the peer's window and the congestion window
+ * allow; received data is queued in a receive buffer until read. All
+ * calls are non-blocking and must be made from shell or softirq
+ * context; callers wait for progress with cpu_idle().
+ */
+
+#ifndef _MINIOS_TCP_H
+#define _MINIOS_TCP_H
+
+#include "types.h"
+
+/* Connection states (RFC 793) */
+#define TCP_CLOSED          0
+#define TCP_LISTEN          1
+#define TCP_SYN_SENT        2
+#define TCP_SYN_RECEIVED    3
+#define TCP_ESTABLISHED     4
+#define TCP_FIN_WAIT_1      5
+#define TCP_FIN_WAIT_2      6
+#define TCP_CLOSE_WAIT      7
+#define TCP_CLOSING         8
+#define TCP_LAST_ACK        9
+#define TCP_TIME_WAIT       10
+
+/* Connection errors */
+#define TCP_ERR_REFUSED     1   /* Peer answered the SYN with RST */
+#define TCP_ERR_RESET       2   /* Connection reset by peer */
+#define TCP_ERR_TIMEOUT     3   /* Retransmissions gave up */
+
+/* Per-socket buffer sizes */
+#define TCP_SNDBUF_SIZE     65536
+#define TCP_RCVBUF_SIZE     65536
+
+/* Pending connections a listener holds for tcp_accept */
+#define TCP_BACKLOG         8
+
+/* Socket handle */
+typedef struct tcp_socket tcp_socket_t;
+
+/* Protocol counters */
+typedef struct {
+    uint64_t active_opens;      /* tcp_connect calls */
+    uint64_t passive_opens;     /* Connections accepted by a listener */
+    uint64_t segs_in;
+    uint64_t segs_out;
+    uint64_t retransmits;       /* Segments sent again (timeout or fast retransmit) */
+    uint64_t resets_out;
+    uint64_t rx_errors;         /* Bad header or checksum */
+} tcp_stats_t;
+
+/**
+ * Listen for connections on a local port (host byte order)
+ * @return Listening socket, or NULL if the port is taken or out of memory
+ */
+tcp_socket_t* tcp_listen(uint16_t port);
+
+/**
+ * Take the next established connection from a listener (non-blocking)
+ * @return Connected socket, or NULL if none is waiting
+ */
+tcp_socket_t* tcp_accept(tcp_socket_t* listener);
+
+/**
+ * Start connecting to a remote address (network byte order) and port
+ * Poll tcp_get_state until it leaves TCP_SYN_SENT.
+ * @return Socket, or NULL if out of memory
+ */
+tcp_socket_t* tcp_connect(uint32_t dest_ip, uint16_t dest_port);
+
+/**
+ * Queue data for sending
+ * @return Bytes accepted (possibly fewer than 'len'), or -1 if the
+ *         connection can no longer send
+ */
+int tcp_send(tcp_socket_t* sock, const void* data, uint32_t len);
+
+/**
+ * Read received data (non-blocking)
+ * @return Bytes read, 0 if nothing is available yet, or -1 once the peer
+ *         has closed and everything has been read (or on error)
+ */
+int tcp_recv(tcp_socket_t* sock, void* buffer, uint32_t len);
+
+/**
+ * Bytes of send buffer space free
+ */
+uint32_t tcp_send_space(const tcp_socket_t* sock);
+
+/**
+ * Check if everything sent has been acknowledged
+ */
+int tcp_send_done(const tcp_socket_t* sock);
+
+/**
+ * Get the connection state (TCP_*)
+ */
+int tcp_get_state(const tcp_socket_t* sock);
+
+/**
+ * Get the connection error (TCP_ERR_*), or 0
+ */
+int tcp_get_error(const tcp_socket_t* sock);
+
+/**
+ * Get a printable name for a state
+ */
+const char* tcp_state_name(int state);
+
+/**
+ * Close a socket
+ * Queued data is still delivered and the connection is shut down with
+ * FIN; the socket is freed once the peer is done. The handle must not
+ * be used afterwards.
+ */
+void tcp_close(tcp_socket_t* sock);
+
+/**
+ * Reset the connection and free the socket immediately
+ */
+void tcp_abort(tcp_socket_t* sock);
+
+/**
+ * Get the protocol counters
+ */
+void tcp_get_stats(tcp_stats_t* stats);
+
+#endif /* _MINIOS_TCP_H */
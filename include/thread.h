@@ -0,0 +1,206 @@
+/**
+ * MiniOS - Kernel Threads Interface
+ *
+ * Threads are scheduled preemptively from per-CPU run queues; a CPU with
+ * nothing queued steals from the busiest other queue before it halts.
+ * A thread blocks on a wait queue until an interrupt handler (or another
+ * thread) wakes it.
+ *
+ * The network, block and timer code was written for a single context, so
+ * it still runs under the kernel lock: a sleeping lock that a thread
+ * gives up whenever it blocks or yields and takes back when it runs
+ * again. Preemption leaves it held, so the code between two waits stays
+ * atomic with respect to every other holder.
+ */
+
+#ifndef _MINIOS_THREAD_H
+#define _MINIOS_THREAD_H
+
+#include "types.h"
+#include "spinlock.h"
+#include "timer.h"
+
+/* Stack of each thread, from the PMM */
+#define THREAD_STACK_PAGES  4
+
+#define THREAD_NAME_LEN     16
+
+/* How long a thread runs before a waiting one gets the CPU */
+#define SCHED_SLICE_MS      10
+
+/* Thread states */
+#define THREAD_RUNNING      0   /* On a CPU */
+#define THREAD_READY        1   /* On a run queue */
+#define THREAD_BLOCKED      2   /* On a wait queue, or sleeping */
+#define THREAD_DEAD         3   /* Exited, stack freed once switched away */
+
+/* Thread entry point */
+typedef void (*thread_fn_t)(void* arg);
+
+struct wait_queue;
+
+/* Kernel thread */
+typedef struct thread {
+    uint64_t rsp;                   /* Saved stack pointer (switch.asm) */
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    volatile int state;
+    volatile int on_cpu;            /* Still switching out: not yet runnable elsewhere */
+    uint32_t cpu;                   /* CPU it last ran on */
+    uint32_t klock_depth;           /* Kernel lock nesting */
+
+    thread_fn_t fn;
+    void* arg;
+    void* stack;                    /* Bottom of its PMM stack */
+
+    struct thread* rq_next;         /* Run queue link */
+    struct wait_queue* wq;          /* Wait queue it is on, if any */
+    struct thread* wq_next;
+    struct thread* all_next;        /* Every thread, for thread_get_info() */
+    ktimer_t sleep_timer;
+
+    uint64_t switches;              /* Times it was switched in */
+    uint64_t runtime_ns;
+    uint64_t run_start;             /* ktime_ns() when switched in */
+} thread_t;
+
+/* Wait queue */
+typedef struct wait_queue {
+    spinlock_t lock;
+    thread_t* head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT     { SPINLOCK_INIT, NULL }
+
+/* Snapshot of a thread for the shell */
+typedef struct {
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    int state;
+    uint32_t cpu;
+    uint64_t switches;
+    uint64_t runtime_ns;
+} thread_info_t;
+
+/**
+ * Set up the scheduler and the boot CPU's idle thread (before smp_init)
+ * @return 0 on success, -1 if out of memory
+ */
+int sched_init(void);
+
+/**
+ * Leave the boot stack for the boot CPU's idle thread and start scheduling
+ * Never returns: whatever kernel_main still had to do must be a thread.
+ */
+void sched_start(void) __attribute__((noreturn));
+
+/**
+ * Enter the scheduler on an application processor (from smp.c)
+ */
+void sched_ap_start(void) __attribute__((noreturn));
+
+/**
+ * Check if sched_start() has run
+ */
+int sched_is_running(void);
+
+/**
+ * Preempt the current thread if its CPU has been asked to reschedule
+ * Called by isr_handler() on the way out of every interrupt.
+ */
+void sched_irq_exit(void);
+
+/**
+ * Create a thread; it is runnable at once
+ * @return Thread, or NULL if out of memory
+ */
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg);
+
+/**
+ * Get the running thread (NULL before sched_start())
+ */
+thread_t* thread_current(void);
+
+/**
+ * Give the CPU to another runnable thread, if there is one
+ */
+void thread_yield(void);
+
+/**
+ * Block for at least 'ms' milliseconds
+ */
+void thread_sleep(uint32_t ms);
+
+/**
+ * Make a blocked thread runnable (safe from interrupt handlers)
+ * @return non-zero if it was blocked
+ */
+int thread_wake(thread_t* thread);
+
+/**
+ * End the current thread
+ */
+void thread_exit(void) __attribute__((noreturn));
+
+/**
+ * Snapshot up to 'max' threads
+ * @return Number of entries filled in
+ */
+int thread_get_info(thread_info_t* info, int max);
+
+/**
+ * Get a thread state's name
+ */
+const char* thread_state_name(int state);
+
+/**
+ * Initialize a wait queue (same as WAIT_QUEUE_INIT)
+ */
+void wait_queue_init(wait_queue_t* wq);
+
+/**
+ * Put the current thread on a wait queue, marked blocked
+ * Check the condition again afterwards: a wake-up from then on is not lost.
+ */
+void wait_prepare(wait_queue_t* wq);
+
+/**
+ * Switch away until woken (before sched_start(): cpu_idle())
+ */
+void wait_block(void);
+
+/**
+ * Take the current thread off a wait queue and mark it running
+ */
+void wait_finish(wait_queue_t* wq);
+
+/**
+ * Wake every thread on a wait queue (safe from interrupt handlers)
+ */
+void wake_up(wait_queue_t* wq);
+
+/**
+ * Block until a condition holds; whoever makes it true calls wake_up()
+ */
+#define wait_event(wq, cond)                \
+    do {                                    \
+        while (!(cond)) {                   \
+            wait_prepare(wq);               \
+            if (!(cond)) {                  \
+                wait_block();               \
+            }                               \
+            wait_finish(wq);                \
+        }                                   \
+    } while (0)
+
+/**
+ * Take the kernel lock (nests; no-op before sched_start())
+ */
+void kernel_lock(void);
+
+/**
+ * Release one level of the kernel lock
+ */
+void kernel_unlock(void);
+
+#endif /* _MINIOS_THREAD_H */
@@ -0,0 +1,109 @@
+/**
+ * MiniOS - System Timer Interface
+ *
+ * Monotonic time (ktime_ns, from the calibrated TSC), a tick count
+ * derived from it, and one-shot kernel timers on a hierarchical timer
+ * wheel. Timer callbacks run from the timer softirq, in the same context
+ * as the network softirq and the shell.
+ */
+
+#ifndef _MINIOS_TIMER_H
+#define _MINIOS_TIMER_H
+
+#include "types.h"
+
+/* Timer resolution: kernel timers expire on whole ticks */
+#define TIMER_HZ    100
+
+/* Time units */
+#define NS_PER_US   1000ULL
+#define NS_PER_MS   1000000ULL
+#define NS_PER_SEC  1000000000ULL
+#define TICK_NS     (NS_PER_SEC / TIMER_HZ)
+
+/* Convert milliseconds to ticks, rounding up */
+#define MS_TO_TICKS(ms)     (((ms) * TIMER_HZ + 999) / 1000)
+
+/* Timer callback */
+typedef void (*ktimer_fn_t)(void* arg);
+
+/* Kernel timer (one-shot) */
+typedef struct ktimer {
+    struct ktimer* next;        /* Wheel slot links */
+    struct ktimer* prev;
+    struct ktimer** slot;       /* Wheel slot the timer is on */
+    uint64_t expires;           /* Tick at which the timer fires */
+    ktimer_fn_t fn;
+    void* arg;
+    int pending;                /* Armed and not yet fired */
+} ktimer_t;
+
+/**
+ * Calibrate the clocks and start the timer interrupt
+ * Uses the local APIC timer one-shot (tickless) if there is one, else
+ * the PIT at TIMER_HZ.
+ */
+void timer_init(void);
+
+/**
+ * Get the nanoseconds since timer_init (monotonic)
+ */
+uint64_t ktime_ns(void);
+
+/**
+ * Get the number of timer ticks since timer_init
+ */
+uint64_t timer_ticks(void);
+
+/**
+ * Busy-wait for a number of microseconds
+ */
+void udelay(uint32_t us);
+
+/**
+ * Get the calibrated TSC frequency
+ * @return Hz, or 0 if the TSC could not be calibrated
+ */
+uint64_t timer_tsc_hz(void);
+
+/**
+ * Check if the clock is tickless (one-shot local APIC timer)
+ * @return non-zero if the CPU is only interrupted when a timer is due
+ */
+int timer_is_tickless(void);
+
+/**
+ * Keep the calling CPU's clock interrupting every tick (on), or go back to
+ * waking only for due timers (off). A no-op with the PIT, which always does.
+ */
+void timer_set_every_tick(int on);
+
+/**
+ * Get the CPU timer_set_every_tick() keeps ticking
+ * @return CPU index, or -1 if none
+ */
+int timer_every_tick_cpu(void);
+
+/**
+ * Set up a timer (not armed)
+ */
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg);
+
+/**
+ * Arm a timer to fire 'delay' ticks from now (re-arms if already pending)
+ */
+void ktimer_arm(ktimer_t* timer, uint32_t delay);
+
+/**
+ * Disarm a timer (no-op if it is not pending)
+ */
+void ktimer_cancel(ktimer_t* timer);
+
+/**
+ * Check if a timer is armed
+ */
+static inline int ktimer_pending(const ktimer_t* timer) {
+    return timer->pending;
+}
+
+#endif /* _MINIOS_TIMER_H */
@@ -39,6 +39,7 @@ typedef _Bool bool;
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define MIN(a, b)       ((a) < (b) ? (a) : (b))
 #define MAX(a, b)       ((a) > (b) ? (a) : (b))
+#define offsetof(type, member) __builtin_offsetof(type, member)
 
 /* Alignment macros */
 #define ALIGN_UP(x, align)   (((x) + ((align) - 1)) & ~((align) - 1))
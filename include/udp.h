@@ -0,0 +1,110 @@
+/**
+ * MiniOS - UDP Interface
+ *
+ * Datagram sockets bound to local ports. Received datagrams are queued
+ * on the socket as packet buffers, with the data pointer at the payload,
+ * so nothing is copied between the driver and the reader. Everything
+ * runs in softirq/shell context; an optional notify callback lets a
+ * socket handle datagrams as soon as they arrive.
+ */
+
+#ifndef _MINIOS_UDP_H
+#define _MINIOS_UDP_H
+
+#include "types.h"
+#include "pktbuf.h"
+#include "ip.h"
+
+/* Datagrams queued per socket before new ones are dropped (power of two) */
+#define UDP_RX_QUEUE_LEN    32
+
+/* Ephemeral port range for udp_bind(0, ...) */
+#define UDP_EPHEMERAL_FIRST 49152
+#define UDP_EPHEMERAL_LAST  65535
+
+/* UDP header */
+typedef struct {
+    uint16_t src_port;
+    uint16_t dest_port;
+    uint16_t length;        /* Header plus payload */
+    uint16_t checksum;
+} PACKED udp_header_t;
+
+/* Largest payload that fits in one unfragmented frame */
+#define UDP_MAX_PAYLOAD     (IP_MAX_PAYLOAD - sizeof(udp_header_t))
+
+/* Socket handle */
+typedef struct udp_socket udp_socket_t;
+
+/* Called after a datagram has been queued on the socket */
+typedef void (*udp_notify_t)(udp_socket_t* sock);
+
+/* Protocol counters */
+typedef struct {
+    uint64_t rx_datagrams;      /* Delivered to a socket */
+    uint64_t tx_datagrams;
+    uint64_t rx_no_port;        /* Nobody bound to the port */
+    uint64_t rx_queue_full;     /* Socket queue overflowed */
+    uint64_t rx_errors;         /* Bad length or checksum */
+} udp_stats_t;
+
+/**
+ * Bind a socket to a local port
+ * @param port    Port in host byte order, or 0 for an ephemeral port
+ * @param notify  Optional callback run when a datagram arrives
+ * @return        Socket, or NULL if the port is taken or out of memory
+ */
+udp_socket_t* udp_bind(uint16_t port, udp_notify_t notify);
+
+/**
+ * Close a socket, dropping any queued datagrams
+ */
+void udp_close(udp_socket_t* sock);
+
+/**
+ * Get the local port of a socket (host byte order)
+ */
+uint16_t udp_local_port(const udp_socket_t* sock);
+
+/**
+ * Take the next queued datagram (non-blocking)
+ * The buffer's data is the payload; the caller owns the returned reference.
+ * @param src_ip    Sender address (network byte order), may be NULL
+ * @param src_port  Sender port (host byte order), may be NULL
+ * @return          Datagram, or NULL if none is queued
+ */
+pktbuf_t* udp_recv(udp_socket_t* sock, uint32_t* src_ip, uint16_t* src_port);
+
+/**
+ * Send the payload held in a packet buffer (takes ownership)
+ * The UDP header is pushed into the buffer's headroom, so a received
+ * datagram can be sent straight back.
+ * @return  0 if sent or queued for address resolution, negative on error
+ */
+int udp_sendto(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, pktbuf_t* pb);
+
+/**
+ * Copy 'len' bytes into a new packet buffer and send them
+ */
+int udp_send(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+             const void* data, uint16_t len);
+
+/**
+ * Get the protocol counters
+ */
+void udp_get_stats(udp_stats_t* stats);
+
+/**
+ * Start the echo/stats responder on a port
+ * Datagrams are echoed back unchanged, except "stats", which is answered
+ * with the UDP counters.
+ * @return  0 on success, negative if the port could not be bound
+ */
+int udp_echo_start(uint16_t port);
+
+/**
+ * Stop the echo/stats responder
+ */
+void udp_echo_stop(void);
+
+#endif /* _MINIOS_UDP_H */
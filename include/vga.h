@@ -54,11 +54,22 @@ void vga_set_color(uint8_t fg, uint8_t bg);
  */
 void vga_putchar(char c);
 
+/**
+ * Write 'len' characters (the screen's console)
+ */
+void vga_write(const char* buf, size_t len);
+
 /**
  * Print a null-terminated string
  */
 void vga_puts(const char* str);
 
+/**
+ * Scroll the view 'lines' rows back into the history (negative: forward)
+ * Any output returns the view to the live screen.
+ */
+void vga_scroll_view(int lines);
+
 /**
  * Move cursor to specific position
  */
@@ -0,0 +1,274 @@
+/**
+ * MiniOS - Virtio Transport and Virtqueue Interface
+ *
+ * Shared by the virtio device drivers (network, block). The transport
+ * part drives a virtio-pci device through either the modern interface
+ * (vendor capabilities pointing at MMIO regions) or the legacy I/O-port
+ * one. The virtqueue part implements both ring layouts behind one
+ * interface: split rings (separate descriptor table, available and used
+ * rings) and, when the device offers VIRTIO_F_RING_PACKED, packed rings (a
+ * single descriptor ring the device writes completions back into). A
+ * buffer may be a chain of several descriptors, and each chain carries a
+ * driver cookie that is handed back when the device has used it.
+ *
+ * The virtqueue functions don't lock. A queue used from more than one
+ * CPU is serialized by its driver with the queue's 'lock'.
+ */
+
+#ifndef _MINIOS_VIRTIO_H
+#define _MINIOS_VIRTIO_H
+
+#include "types.h"
+#include "pci.h"
+#include "spinlock.h"
+
+/* Virtio PCI vendor ID */
+#define VIRTIO_VENDOR_ID            0x1AF4
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FEATURES_OK   0x08
+#define VIRTIO_STATUS_FAILED        0x80
+
+/* ISR status bits */
+#define VIRTIO_ISR_QUEUE            0x01
+#define VIRTIO_ISR_CONFIG           0x02
+
+/* Device-independent feature bits */
+#define VIRTIO_RING_F_EVENT_IDX     (1ULL << 29)
+#define VIRTIO_F_VERSION_1          (1ULL << 32)    /* Modern device */
+#define VIRTIO_F_RING_PACKED        (1ULL << 34)    /* Packed virtqueues */
+
+/* Descriptor flags */
+#define VIRTQ_DESC_F_NEXT           0x01
+#define VIRTQ_DESC_F_WRITE          0x02
+#define VIRTQ_DESC_F_AVAIL          0x0080      /* Packed: driver's wrap counter */
+#define VIRTQ_DESC_F_USED           0x8000      /* Packed: device's wrap counter */
+
+/* Ring flags */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  0x01
+#define VIRTQ_USED_F_NO_NOTIFY      0x01
+
+/* Packed ring event suppression flags */
+#define VIRTQ_EVENT_F_ENABLE        0
+#define VIRTQ_EVENT_F_DISABLE       1
+#define VIRTQ_EVENT_F_DESC          2           /* At off_wrap (EVENT_IDX only) */
+
+/* Largest ring we ask a modern device for */
+#define VIRTQ_MAX_SIZE              256
+
+/* Split ring descriptor */
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} PACKED virtq_desc_t;
+
+/* Available ring */
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];            /* Followed by used_event */
+} PACKED virtq_avail_t;
+
+/* Used ring element */
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} PACKED virtq_used_elem_t;
+
+/* Used ring */
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];   /* Followed by avail_event */
+} PACKED virtq_used_t;
+
+/* Packed ring descriptor (also the used entry the device writes back) */
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;                /* Buffer ID, the same on every link of a chain */
+    uint16_t flags;
+} PACKED virtq_packed_desc_t;
+
+/* Packed ring event suppression area */
+typedef struct {
+    uint16_t off_wrap;          /* Ring offset, wrap counter in bit 15 */
+    uint16_t flags;
+} PACKED virtq_event_t;
+
+/* A virtio-pci device */
+typedef struct virtio_dev {
+    int modern;                 /* Modern MMIO transport (else legacy I/O) */
+    uint16_t io_base;
+    volatile uint8_t* common_cfg;
+    volatile uint8_t* notify_base;
+    volatile uint8_t* isr_cfg;
+    volatile uint8_t* device_cfg;
+    uint32_t notify_multiplier;
+    uint64_t features;          /* Negotiated feature bits */
+} virtio_dev_t;
+
+/* A virtqueue (split or packed) */
+typedef struct virtq {
+    virtq_desc_t* desc;         /* Split rings */
+    virtq_avail_t* avail;
+    virtq_used_t* used;
+    virtq_packed_desc_t* ring;  /* Packed ring */
+    virtq_event_t* driver_event;    /* Packed: our interrupt suppression */
+    virtq_event_t* device_event;    /* Packed: the device's notify suppression */
+    uint16_t size;              /* Entries (split: a power of two) */
+    uint16_t queue_idx;         /* Index used for notifications */
+    volatile uint16_t* notify;  /* Modern: this queue's doorbell */
+    virtio_dev_t* dev;
+    int event_idx;              /* VIRTIO_RING_F_EVENT_IDX negotiated */
+    int packed;                 /* VIRTIO_F_RING_PACKED negotiated */
+    uint16_t avail_idx;         /* Split: next avail entry (published by virtq_kick)
+                                   Packed: next ring slot to fill */
+    uint16_t kicked_idx;        /* Split: avail->idx when the device was last notified
+                                   Packed: slots filled since then */
+    uint16_t last_used_idx;     /* Packed: next ring slot the device completes */
+    uint8_t avail_wrap;         /* Packed: wrap counters, start at 1 */
+    uint8_t used_wrap;
+    uint16_t free_head;         /* Split: first free descriptor
+                                   Packed: first free buffer ID */
+    uint16_t num_free;          /* Free descriptors */
+    uint16_t* id_next;          /* Packed: buffer ID free list */
+    uint16_t* id_count;         /* Packed: descriptors in each ID's chain */
+    void** cookies;             /* Driver cookie per chain head (packed: per ID) */
+    spinlock_t lock;            /* Taken by drivers that share the queue */
+} virtq_t;
+
+/* One buffer of a chain */
+typedef struct {
+    void* addr;
+    uint32_t len;
+} virtq_buf_t;
+
+/*
+ * Memory ordering against the device. x86 keeps stores in order and loads
+ * in order, so only a store followed by a load of another location needs
+ * a fence; the other two only stop the compiler from reordering.
+ */
+static inline void virtio_wmb(void) {
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void virtio_rmb(void) {
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void virtio_mb(void) {
+    __asm__ volatile("mfence" ::: "memory");
+}
+
+/**
+ * Bring up a virtio-pci device's transport
+ * Prefers the modern interface, resets the device and sets ACKNOWLEDGE
+ * and DRIVER.
+ * @return 0 on success, negative if neither transport is usable
+ */
+int virtio_pci_init(virtio_dev_t* vdev, pci_device_t* pci);
+
+/**
+ * Get the feature bits the device offers
+ */
+uint64_t virtio_get_features(virtio_dev_t* vdev);
+
+/**
+ * Accept a subset of the offered features
+ * @return 0 on success, negative if a modern device rejects the set
+ */
+int virtio_set_features(virtio_dev_t* vdev, uint64_t features);
+
+/**
+ * Tell the device the driver is ready (after its queues are set up)
+ */
+void virtio_driver_ok(virtio_dev_t* vdev);
+
+/**
+ * Give up on the device
+ */
+void virtio_fail(virtio_dev_t* vdev);
+
+/**
+ * Read (and so acknowledge) the interrupt status
+ */
+uint8_t virtio_read_isr(virtio_dev_t* vdev);
+
+/**
+ * Read device-specific configuration space
+ */
+uint8_t virtio_config_read8(virtio_dev_t* vdev, int off);
+uint16_t virtio_config_read16(virtio_dev_t* vdev, int off);
+uint32_t virtio_config_read32(virtio_dev_t* vdev, int off);
+uint64_t virtio_config_read64(virtio_dev_t* vdev, int off);
+
+/**
+ * Set up virtqueue 'queue_idx' (after feature negotiation)
+ * @param max_size  Largest ring to use if the device lets us choose
+ * @return 0 on success, negative if the queue doesn't exist or no memory
+ */
+int virtq_setup(virtio_dev_t* vdev, virtq_t* vq, int queue_idx, uint16_t max_size);
+
+/**
+ * Queue a descriptor chain: 'out' device-readable buffers followed by
+ * 'in' device-writable ones. The device need not look at it until
+ * virtq_kick() (a split ring doesn't publish it before then).
+ * @param cookie  Returned by virtq_get() once the device is done (non-NULL)
+ * @return 0 on success, negative if the ring hasn't enough free descriptors
+ */
+int virtq_add(virtq_t* vq, const virtq_buf_t* bufs, int out, int in, void* cookie);
+
+/**
+ * Queue one buffer (a chain of one)
+ */
+static inline int virtq_add_buf(virtq_t* vq, void* addr, uint32_t len, int writable,
+                                void* cookie) {
+    virtq_buf_t buf = { addr, len };
+    return virtq_add(vq, &buf, writable ? 0 : 1, writable ? 1 : 0, cookie);
+}
+
+/**
+ * Publish queued chains and notify the device, unless it has said it
+ * doesn't need to hear about them
+ */
+void virtq_kick(virtq_t* vq);
+
+/**
+ * Take the next chain the device has used and free its descriptors
+ * @param len  Set to the bytes the device wrote (may be NULL)
+ * @return The chain's cookie, or NULL if none is pending
+ */
+void* virtq_get(virtq_t* vq, uint32_t* len);
+
+/**
+ * Check if the device has used chains waiting for virtq_get()
+ */
+static inline int virtq_has_used(const virtq_t* vq) {
+    if (vq->packed) {
+        /* A used slot has both AVAIL and USED equal to the used wrap counter */
+        uint16_t flags = ((volatile virtq_packed_desc_t*)vq->ring)[vq->last_used_idx].flags;
+        uint16_t both = VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED;
+        return (flags & both) == (vq->used_wrap ? both : 0);
+    }
+    return vq->last_used_idx != *(volatile uint16_t*)&vq->used->idx;
+}
+
+/**
+ * Stop used-buffer interrupts for a queue
+ */
+void virtq_disable_irq(virtq_t* vq);
+
+/**
+ * Restart used-buffer interrupts for a queue
+ * @return Non-zero if chains were used meanwhile (poll again instead of
+ *         waiting for an interrupt)
+ */
+int virtq_enable_irq(virtq_t* vq);
+
+#endif /* _MINIOS_VIRTIO_H */
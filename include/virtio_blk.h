@@ -0,0 +1,41 @@
+/**
+ * MiniOS - Virtio Block Driver Interface
+ */
+
+#ifndef _MINIOS_VIRTIO_BLK_H
+#define _MINIOS_VIRTIO_BLK_H
+
+#include "types.h"
+
+/**
+ * Initialize the virtio-blk driver
+ * Finds a virtio block device on the PCI bus and attaches it to the block
+ * request queue (see blk.h)
+ */
+void virtio_blk_init(void);
+
+/**
+ * Check if a virtio disk is attached
+ * @return non-zero if a disk was found and attached
+ */
+int virtio_blk_is_present(void);
+
+/**
+ * Check if the disk refuses writes
+ * @return non-zero if the device is read-only
+ */
+int virtio_blk_is_readonly(void);
+
+/**
+ * Check if the driver uses the modern virtio-pci transport
+ * @return non-zero for modern, zero for legacy (or no disk)
+ */
+int virtio_blk_is_modern(void);
+
+/**
+ * Check if the request queue uses the packed ring layout
+ * @return non-zero for packed, zero for split (or no disk)
+ */
+int virtio_blk_is_packed(void);
+
+#endif /* _MINIOS_VIRTIO_BLK_H */
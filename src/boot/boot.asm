@@ -29,16 +29,23 @@ pml4_table:
     resb 4096
 pdpt_table:
     resb 4096
-pd_table:
-    resb 4096
-pt_table:
-    resb 4096
+pd_tables:
+    resb 4096 * 4       ; Four page directories map 4GB with 2MB pages
 
-; Stack
+; Boot stack: kernel_main's initialization only. sched_start() then moves
+; to the idle thread, and every thread has a stack from the PMM.
 stack_bottom:
     resb 16384  ; 16 KB stack
 stack_top:
 
+section .data
+align 8
+
+; Top of physical memory reachable through the identity map (read by pmm.c)
+global phys_mapped_top
+phys_mapped_top:
+    dq 0
+
 section .rodata
 
 ; GDT for 64-bit mode
@@ -121,30 +128,66 @@ check_long_mode:
     mov al, 'L'
     jmp error
 
-; Set up identity-mapped page tables using 2MB huge pages
+; Set up identity-mapped page tables covering all of RAM
+; Uses 1GB pages (512GB) when the CPU supports them, otherwise 2MB pages (4GB)
 setup_page_tables:
     ; Map PML4[0] -> PDPT
     mov eax, pdpt_table
     or eax, 0b11            ; Present + Writable
     mov [pml4_table], eax
 
-    ; Map PDPT[0] -> PD
-    mov eax, pd_table
+    ; Check for 1GB page support
+    mov eax, 0x80000001
+    cpuid
+    test edx, 1 << 26       ; Page1GB bit
+    jz .map_2mb
+
+    ; Map 512GB using 1GB huge pages (512 entries in PDPT)
+    ; Physical address i << 30 spans both dwords of each entry
+    mov ecx, 0
+.map_pdpt_1gb:
+    mov eax, ecx
+    shl eax, 30             ; Low dword: (i & 3) << 30
+    or eax, 0b10000011      ; Present + Writable + Huge (PS bit)
+    mov [pdpt_table + ecx * 8], eax
+    mov edx, ecx
+    shr edx, 2              ; High dword: i >> 2
+    mov [pdpt_table + ecx * 8 + 4], edx
+    inc ecx
+    cmp ecx, 512
+    jne .map_pdpt_1gb
+
+    mov dword [phys_mapped_top], 0
+    mov dword [phys_mapped_top + 4], 0x80   ; 512GB
+    ret
+
+.map_2mb:
+    ; Map PDPT[0..3] -> four page directories
+    mov ecx, 0
+.map_pdpt:
+    mov eax, ecx
+    shl eax, 12
+    add eax, pd_tables
     or eax, 0b11
-    mov [pdpt_table], eax
+    mov [pdpt_table + ecx * 8], eax
+    inc ecx
+    cmp ecx, 4
+    jne .map_pdpt
 
-    ; Map first 64MB using 2MB huge pages (32 entries in PD)
+    ; Map first 4GB using 2MB huge pages (4 * 512 entries)
     ; Each PD entry with PS bit maps 2MB directly
     mov ecx, 0              ; Counter
 .map_pd:
-    mov eax, 0x200000       ; 2MB
-    mul ecx
+    mov eax, ecx
+    shl eax, 21             ; i * 2MB
     or eax, 0b10000011      ; Present + Writable + Huge (PS bit)
-    mov [pd_table + ecx * 8], eax
+    mov [pd_tables + ecx * 8], eax
     inc ecx
-    cmp ecx, 32             ; Map 32 * 2MB = 64MB
+    cmp ecx, 2048           ; Map 2048 * 2MB = 4GB
     jne .map_pd
 
+    mov dword [phys_mapped_top], 0
+    mov dword [phys_mapped_top + 4], 1      ; 4GB
     ret
 
 ; Enable paging and enter long mode
@@ -199,6 +242,9 @@ long_mode_start:
 
     ; Call kernel main
     ; RDI = multiboot magic, RSI = multiboot info (passed from 32-bit code)
+    ; Upper halves are undefined after the mode switch, so zero-extend them
+    mov edi, edi
+    mov esi, esi
     call kernel_main
 
     ; If kernel returns, halt
@@ -1,61 +1,188 @@
 /**
  * MiniOS - Kernel Heap Allocator
- * 
- * Simple first-fit heap allocator for kernel memory.
+ *
+ * Boundary-tag heap allocator for kernel memory.
+ * Blocks are laid out in address order; every header records its own
+ * size and the size of the block before it, so a freed block merges with
+ * both physical neighbours in O(1). Free blocks live on segregated
+ * power-of-two size lists with a summary bitmap of non-empty lists.
+ * Small requests are served by the slab allocator instead.
+ * One lock covers the free lists and the block headers.
  */
 
 #include "types.h"
 #include "heap.h"
+#include "slab.h"
 #include "string.h"
+#include "spinlock.h"
+#include "perf.h"
 
-/* Heap block header */
+/* Heap block header (boundary tag) */
 typedef struct heap_block {
-    size_t size;                /* Size of block (not including header) */
-    int free;                   /* Is this block free? */
-    struct heap_block* next;    /* Next block in list */
+    size_t prev_size;           /* Payload size of previous block (0 if first) */
+    size_t size;                /* Payload size, low bit set if free */
 } heap_block_t;
 
+/* Free list links, stored in the payload of a free block */
+typedef struct heap_free {
+    struct heap_free* next;
+    struct heap_free* prev;
+} heap_free_t;
+
 /* Heap state */
 static heap_block_t* heap_start = NULL;
+static uint8_t* heap_end = NULL;
 static size_t heap_size = 0;
 static size_t heap_used = 0;
+static spinlock_t heap_lock = SPINLOCK_INIT;
 
 /* Minimum block size (to avoid fragmentation) */
 #define MIN_BLOCK_SIZE  16
 #define HEADER_SIZE     sizeof(heap_block_t)
+#define BLOCK_FREE      1UL
+
+/* Segregated free lists: bin i holds payloads in [2^(i+4), 2^(i+5)) */
+#define HEAP_NUM_BINS   28
+static heap_free_t* heap_bins[HEAP_NUM_BINS];
+static uint32_t heap_bin_mask = 0;
 
 /* Align size to 16 bytes */
 static size_t align_size(size_t size) {
     return (size + 15) & ~15;
 }
 
+static inline size_t block_size(const heap_block_t* block) {
+    return block->size & ~BLOCK_FREE;
+}
+
+static inline int block_is_free(const heap_block_t* block) {
+    return block->size & BLOCK_FREE;
+}
+
+static inline heap_free_t* block_links(heap_block_t* block) {
+    return (heap_free_t*)((uint8_t*)block + HEADER_SIZE);
+}
+
+static inline heap_block_t* links_block(heap_free_t* links) {
+    return (heap_block_t*)((uint8_t*)links - HEADER_SIZE);
+}
+
+/**
+ * Next block in address order, or NULL at the end of the heap
+ */
+static inline heap_block_t* block_next(heap_block_t* block) {
+    uint8_t* next = (uint8_t*)block + HEADER_SIZE + block_size(block);
+    return next < heap_end ? (heap_block_t*)next : NULL;
+}
+
+/**
+ * Previous block in address order, or NULL at the start of the heap
+ */
+static inline heap_block_t* block_prev(heap_block_t* block) {
+    if (block == heap_start) {
+        return NULL;
+    }
+    return (heap_block_t*)((uint8_t*)block - block->prev_size - HEADER_SIZE);
+}
+
+/**
+ * Bin index for a payload size
+ */
+static int bin_index(size_t size) {
+    int bin = (63 - __builtin_clzll(size)) - 4;
+    if (bin < 0) bin = 0;
+    if (bin >= HEAP_NUM_BINS) bin = HEAP_NUM_BINS - 1;
+    return bin;
+}
+
+/**
+ * Put a free block on its size bin
+ */
+static void bin_insert(heap_block_t* block) {
+    int bin = bin_index(block_size(block));
+    heap_free_t* links = block_links(block);
+
+    links->prev = NULL;
+    links->next = heap_bins[bin];
+    if (links->next) {
+        links->next->prev = links;
+    }
+    heap_bins[bin] = links;
+    heap_bin_mask |= 1U << bin;
+}
+
+/**
+ * Take a free block off its size bin
+ */
+static void bin_remove(heap_block_t* block) {
+    int bin = bin_index(block_size(block));
+    heap_free_t* links = block_links(block);
+
+    if (links->prev) {
+        links->prev->next = links->next;
+    } else {
+        heap_bins[bin] = links->next;
+    }
+    if (links->next) {
+        links->next->prev = links->prev;
+    }
+    if (!heap_bins[bin]) {
+        heap_bin_mask &= ~(1U << bin);
+    }
+}
+
+/**
+ * Set a block's payload size and keep the neighbour's back-pointer in sync
+ */
+static void block_set_size(heap_block_t* block, size_t size, int free) {
+    block->size = size | (free ? BLOCK_FREE : 0);
+    heap_block_t* next = block_next(block);
+    if (next) {
+        next->prev_size = size;
+    }
+}
+
 /**
  * Initialize the kernel heap
  */
 void heap_init(void* start, size_t size) {
     heap_start = (heap_block_t*)start;
+    heap_end = (uint8_t*)start + size;
     heap_size = size;
     heap_used = HEADER_SIZE;
-    
+
+    memset(heap_bins, 0, sizeof(heap_bins));
+    heap_bin_mask = 0;
+
     /* Create initial free block spanning entire heap */
-    heap_start->size = size - HEADER_SIZE;
-    heap_start->free = 1;
-    heap_start->next = NULL;
+    heap_start->prev_size = 0;
+    heap_start->size = (size - HEADER_SIZE) | BLOCK_FREE;
+    bin_insert(heap_start);
 }
 
 /**
  * Find a free block of at least 'size' bytes
  */
 static heap_block_t* find_free_block(size_t size) {
-    heap_block_t* block = heap_start;
-    
-    while (block) {
-        if (block->free && block->size >= size) {
-            return block;
+    int bin = bin_index(size);
+
+    /* The request's own bin may hold smaller blocks: first fit within it */
+    if (heap_bin_mask & (1U << bin)) {
+        for (heap_free_t* links = heap_bins[bin]; links; links = links->next) {
+            heap_block_t* block = links_block(links);
+            if (block_size(block) >= size) {
+                return block;
+            }
         }
-        block = block->next;
     }
-    
+
+    /* Any block in a larger bin fits */
+    uint32_t larger = (bin + 1 < HEAP_NUM_BINS) ? heap_bin_mask >> (bin + 1) : 0;
+    if (larger) {
+        int found = bin + 1 + __builtin_ctz(larger);
+        return links_block(heap_bins[found]);
+    }
+
     return NULL;
 }
 
@@ -63,106 +190,142 @@ static heap_block_t* find_free_block(size_t size) {
  * Split a block if it's significantly larger than needed
  */
 static void split_block(heap_block_t* block, size_t size) {
-    size_t remaining = block->size - size - HEADER_SIZE;
-    
+    size_t remaining = block_size(block) - size;
+
     /* Only split if remaining space is useful */
-    if (remaining >= MIN_BLOCK_SIZE) {
-        heap_block_t* new_block = (heap_block_t*)((uint8_t*)block + HEADER_SIZE + size);
-        new_block->size = remaining;
-        new_block->free = 1;
-        new_block->next = block->next;
-        
+    if (remaining >= HEADER_SIZE + MIN_BLOCK_SIZE) {
         block->size = size;
-        block->next = new_block;
+        heap_block_t* new_block = (heap_block_t*)((uint8_t*)block + HEADER_SIZE + size);
+        new_block->prev_size = size;
+        block_set_size(new_block, remaining - HEADER_SIZE, 1);
+        bin_insert(new_block);
     }
 }
 
 /**
- * Merge adjacent free blocks
+ * Allocate memory: small sizes from the slab caches, the rest from the heap
  */
-static void merge_free_blocks(void) {
-    heap_block_t* block = heap_start;
-    
-    while (block && block->next) {
-        if (block->free && block->next->free) {
-            /* Merge with next block */
-            block->size += HEADER_SIZE + block->next->size;
-            block->next = block->next->next;
-            /* Don't advance - check if we can merge more */
-        } else {
-            block = block->next;
-        }
-    }
-}
-
-/**
- * Allocate memory from the heap
- */
-void* kmalloc(size_t size) {
+static void* heap_alloc(size_t size) {
     if (size == 0) {
         return NULL;
     }
-    
+
+    /* Small objects come from the slab size classes */
+    if (size <= SLAB_MAX_OBJ_SIZE && slab_is_initialized()) {
+        void* obj = slab_alloc_size(size);
+        if (obj) {
+            return obj;
+        }
+    }
+
     /* Align size */
     size = align_size(size);
-    
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
+
     /* Find a free block */
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
     heap_block_t* block = find_free_block(size);
-    
+
     if (!block) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         return NULL;  /* Out of memory */
     }
-    
+
+    bin_remove(block);
+
     /* Split if block is too large */
     split_block(block, size);
-    
+
     /* Mark as used */
-    block->free = 0;
-    heap_used += block->size + HEADER_SIZE;
-    
+    block->size &= ~BLOCK_FREE;
+    heap_used += block_size(block) + HEADER_SIZE;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
     /* Return pointer to data area (after header) */
     return (void*)((uint8_t*)block + HEADER_SIZE);
 }
 
+/**
+ * Allocate memory from the heap
+ */
+void* kmalloc(size_t size) {
+    uint64_t start = rdtsc();
+    void* ptr = heap_alloc(size);
+
+    perf_lat(PERF_LAT_KMALLOC, start);
+    return ptr;
+}
+
 /**
  * Allocate zeroed memory
  */
 void* kcalloc(size_t count, size_t size) {
     size_t total = count * size;
     void* ptr = kmalloc(total);
-    
+
     if (ptr) {
         memset(ptr, 0, total);
     }
-    
+
     return ptr;
 }
 
 /**
- * Free previously allocated memory
+ * Free memory from heap_alloc
  */
-void kfree(void* ptr) {
+static void heap_free(void* ptr) {
     if (!ptr) {
         return;
     }
-    
+
+    /* Validate pointer is within heap, otherwise it may be a slab object */
+    if ((uint8_t*)ptr < (uint8_t*)heap_start + HEADER_SIZE || (uint8_t*)ptr >= heap_end) {
+        slab_free(ptr);
+        return;
+    }
+
     /* Get block header */
     heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - HEADER_SIZE);
-    
-    /* Validate pointer is within heap */
-    if ((uint8_t*)block < (uint8_t*)heap_start ||
-        (uint8_t*)block >= (uint8_t*)heap_start + heap_size) {
-        return;  /* Invalid pointer */
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    if (block_is_free(block)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return;  /* Double free */
     }
-    
-    /* Mark as free */
-    if (!block->free) {
-        block->free = 1;
-        heap_used -= block->size + HEADER_SIZE;
-        
-        /* Merge adjacent free blocks */
-        merge_free_blocks();
+
+    size_t size = block_size(block);
+    heap_used -= size + HEADER_SIZE;
+
+    /* Merge with the following block */
+    heap_block_t* next = block_next(block);
+    if (next && block_is_free(next)) {
+        bin_remove(next);
+        size += HEADER_SIZE + block_size(next);
+    }
+
+    /* Merge with the preceding block */
+    heap_block_t* prev = block_prev(block);
+    if (prev && block_is_free(prev)) {
+        bin_remove(prev);
+        size += HEADER_SIZE + block_size(prev);
+        block = prev;
     }
+
+    block_set_size(block, size, 1);
+    bin_insert(block);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/**
+ * Free previously allocated memory
+ */
+void kfree(void* ptr) {
+    uint64_t start = rdtsc();
+    heap_free(ptr);
+
+    perf_lat(PERF_LAT_KFREE, start);
 }
 
 /**
@@ -173,4 +336,3 @@ void heap_stats(size_t* total_out, size_t* used_out, size_t* free_out) {
     if (used_out)  *used_out = heap_used;
     if (free_out)  *free_out = heap_size - heap_used;
 }
-
@@ -7,6 +7,11 @@
 #include "types.h"
 #include "ports.h"
 #include "idt.h"
+#include "string.h"
+#include "lapic.h"
+#include "thread.h"
+#include "perf.h"
+#include "profile.h"
 
 /* PIC ports */
 #define PIC1_COMMAND    0x20
@@ -43,6 +48,10 @@ static idt_pointer_t idt_ptr;
 /* User-defined interrupt handlers */
 static interrupt_handler_t handlers[256];
 
+/* Further handlers on shared (PCI) IRQ lines, called after handlers[] */
+#define IRQ_MAX_SHARED  4
+static interrupt_handler_t shared_handlers[16][IRQ_MAX_SHARED];
+
 /* External ISR stubs from isr.asm */
 extern void isr0(void);
 extern void isr1(void);
@@ -95,6 +104,13 @@ extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
 
+/* Local APIC vectors */
+extern void isr48(void);
+extern void isr49(void);
+extern void isr50(void);
+extern void isr51(void);
+extern void isr255(void);
+
 /**
  * Set an IDT entry
  */
@@ -152,6 +168,31 @@ void pic_send_eoi(uint8_t irq) {
     outb(PIC1_COMMAND, PIC_EOI);
 }
 
+/**
+ * Unmask an IRQ line at the PIC
+ */
+void pic_unmask_irq(uint8_t irq) {
+    if (irq >= 16) {
+        return;
+    }
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = 2;  /* Slave PIC cascades through IRQ2 */
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+/**
+ * Mask an IRQ line at the PIC
+ */
+void pic_mask_irq(uint8_t irq) {
+    if (irq >= 8 && irq < 16) {
+        outb(PIC2_DATA, inb(PIC2_DATA) | (1 << (irq - 8)));
+    } else if (irq < 8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) | (1 << irq));
+    }
+}
+
 /**
  * Initialize the IDT
  */
@@ -160,6 +201,7 @@ void idt_init(void) {
     for (int i = 0; i < 256; i++) {
         handlers[i] = NULL;
     }
+    memset(shared_handlers, 0, sizeof(shared_handlers));
     
     /* Set up IDT pointer */
     idt_ptr.limit = sizeof(idt) - 1;
@@ -226,16 +268,30 @@ void idt_init(void) {
     idt_set_entry(46, (uint64_t)irq14, KERNEL_CS, INT_GATE);
     idt_set_entry(47, (uint64_t)irq15, KERNEL_CS, INT_GATE);
     
+    /* Local APIC */
+    idt_set_entry(LAPIC_TIMER_VECTOR, (uint64_t)isr48, KERNEL_CS, INT_GATE);
+    idt_set_entry(IPI_CALL_VECTOR, (uint64_t)isr49, KERNEL_CS, INT_GATE);
+    idt_set_entry(IPI_RESCHED_VECTOR, (uint64_t)isr50, KERNEL_CS, INT_GATE);
+    idt_set_entry(IPI_PROFILE_VECTOR, (uint64_t)isr51, KERNEL_CS, INT_GATE);
+    idt_set_entry(LAPIC_SPURIOUS_VECTOR, (uint64_t)isr255, KERNEL_CS, INT_GATE);
+    
     /* Initialize PIC */
     pic_init();
     
     /* Load IDT */
-    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+    idt_load();
     
     /* Enable interrupts */
     sti();
 }
 
+/**
+ * Load the IDT on the calling CPU
+ */
+void idt_load(void) {
+    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+}
+
 /**
  * Register an interrupt handler
  */
@@ -243,12 +299,46 @@ void idt_set_handler(uint8_t vector, interrupt_handler_t handler) {
     handlers[vector] = handler;
 }
 
+/**
+ * Add a handler to a hardware IRQ that other devices may also use
+ */
+int idt_share_handler(uint8_t vector, interrupt_handler_t handler) {
+    if (!handlers[vector]) {
+        handlers[vector] = handler;
+        return 0;
+    }
+    if (vector < IRQ_BASE || vector >= IRQ_BASE + 16) {
+        return -1;
+    }
+    
+    interrupt_handler_t* chain = shared_handlers[vector - IRQ_BASE];
+    for (int i = 0; i < IRQ_MAX_SHARED; i++) {
+        if (!chain[i]) {
+            chain[i] = handler;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 /**
  * Common interrupt handler (called from assembly)
+ * @param rip  Where the interrupted code was
  */
-void isr_handler(uint64_t vector, uint64_t error_code) {
+void isr_handler(uint64_t vector, uint64_t error_code, uint64_t rip) {
+    perf_irq(vector);
+    profile_interrupt(vector, rip);
+    
     if (handlers[vector]) {
         handlers[vector]();
+        
+        /* Level-triggered PCI lines: every device on the line checks itself */
+        if (vector >= IRQ_BASE && vector < IRQ_BASE + 16) {
+            interrupt_handler_t* chain = shared_handlers[vector - IRQ_BASE];
+            for (int i = 0; i < IRQ_MAX_SHARED && chain[i]; i++) {
+                chain[i]();
+            }
+        }
     } else {
         /* Unhandled exception - halt */
         if (vector < 32) {
@@ -266,11 +356,16 @@ void isr_handler(uint64_t vector, uint64_t error_code) {
         }
     }
     
-    /* Send EOI for hardware interrupts */
+    /* Send EOI for hardware interrupts (never for a spurious APIC one) */
     if (vector >= 32 && vector < 48) {
         pic_send_eoi(vector - 32);
+    } else if (vector >= LAPIC_TIMER_VECTOR && vector != LAPIC_SPURIOUS_VECTOR) {
+        lapic_eoi();
     }
     
+    /* A wake-up or an expired slice may want another thread on this CPU */
+    sched_irq_exit();
+    
     UNUSED(error_code);
 }
 
@@ -84,6 +84,13 @@ IRQ 13, 45      ; FPU
 IRQ 14, 46      ; Primary ATA
 IRQ 15, 47      ; Secondary ATA
 
+; Local APIC interrupts
+ISR_NOERR 48    ; APIC timer
+ISR_NOERR 49    ; Cross-CPU function call IPI
+ISR_NOERR 50    ; Reschedule IPI
+ISR_NOERR 51    ; Profiler sample IPI
+ISR_NOERR 255   ; Spurious
+
 ; Common ISR handler
 isr_common:
     ; Save all registers
@@ -106,6 +113,7 @@ isr_common:
     ; Get interrupt number and error code
     mov rdi, [rsp + 120]    ; Interrupt number
     mov rsi, [rsp + 128]    ; Error code
+    mov rdx, [rsp + 136]    ; Interrupted RIP (start of the CPU's frame)
     
     ; Call C handler
     call isr_handler
@@ -0,0 +1,203 @@
+/**
+ * MiniOS - Multiboot2 Boot Information
+ * 
+ * Parses the tag list handed over by the bootloader and keeps a copy of
+ * the parts the kernel needs (memory map, command line, ACPI RSDP).
+ */
+
+#include "types.h"
+#include "string.h"
+#include "multiboot.h"
+
+/* Tag types */
+#define MB_TAG_END      0
+#define MB_TAG_CMDLINE  1
+#define MB_TAG_MMAP     6
+#define MB_TAG_ACPI_OLD 14      /* ACPI 1.0 RSDP */
+#define MB_TAG_ACPI_NEW 15      /* ACPI 2.0+ RSDP */
+
+/* Fixed part of the boot information */
+typedef struct {
+    uint32_t total_size;
+    uint32_t reserved;
+} PACKED mb_info_header_t;
+
+/* Generic tag header */
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+} PACKED mb_tag_t;
+
+/* Memory map tag */
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+} PACKED mb_tag_mmap_t;
+
+/* Memory map entry */
+typedef struct {
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+} PACKED mb_mmap_entry_t;
+
+/* Parsed state */
+#define MB_MAX_REGIONS  32
+#define MB_CMDLINE_MAX  256
+#define MB_RSDP_MAX     36      /* Size of the ACPI 2.0 RSDP */
+
+static mb_mem_region_t mb_regions[MB_MAX_REGIONS];
+static int mb_region_count = 0;
+static char mb_cmdline[MB_CMDLINE_MAX];
+static uint64_t mb_info_start = 0;
+static uint64_t mb_info_end = 0;
+static uint8_t mb_rsdp[MB_RSDP_MAX];
+static int mb_rsdp_type = 0;        /* Tag the copy came from, 0 if none */
+
+/**
+ * Copy the memory map tag into mb_regions
+ */
+static void multiboot_parse_mmap(const mb_tag_mmap_t* tag) {
+    const uint8_t* entry = (const uint8_t*)tag + sizeof(mb_tag_mmap_t);
+    const uint8_t* end = (const uint8_t*)tag + tag->size;
+
+    if (tag->entry_size < sizeof(mb_mmap_entry_t)) {
+        return;
+    }
+
+    while (entry + sizeof(mb_mmap_entry_t) <= end && mb_region_count < MB_MAX_REGIONS) {
+        const mb_mmap_entry_t* e = (const mb_mmap_entry_t*)entry;
+        if (e->length > 0) {
+            mb_regions[mb_region_count].base = e->base_addr;
+            mb_regions[mb_region_count].length = e->length;
+            mb_regions[mb_region_count].type = e->type;
+            mb_region_count++;
+        }
+        entry += tag->entry_size;
+    }
+}
+
+/**
+ * Keep a copy of an RSDP tag, preferring the ACPI 2.0+ one
+ */
+static void multiboot_parse_rsdp(const mb_tag_t* tag) {
+    uint32_t len = tag->size - sizeof(mb_tag_t);
+
+    if (mb_rsdp_type == MB_TAG_ACPI_NEW) {
+        return;
+    }
+    if (len > MB_RSDP_MAX) {
+        len = MB_RSDP_MAX;
+    }
+    memset(mb_rsdp, 0, sizeof(mb_rsdp));
+    memcpy(mb_rsdp, (const uint8_t*)tag + sizeof(mb_tag_t), len);
+    mb_rsdp_type = tag->type;
+}
+
+/**
+ * Parse the Multiboot2 information structure
+ */
+int multiboot_init(uint32_t magic, void* info) {
+    mb_region_count = 0;
+    mb_cmdline[0] = '\0';
+    mb_rsdp_type = 0;
+
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC || !info) {
+        return -1;
+    }
+
+    const mb_info_header_t* hdr = (const mb_info_header_t*)info;
+    mb_info_start = (uint64_t)(uintptr_t)info;
+    mb_info_end = mb_info_start + hdr->total_size;
+
+    /* Tags start after the header and are 8-byte aligned */
+    const uint8_t* p = (const uint8_t*)info + sizeof(mb_info_header_t);
+    const uint8_t* end = (const uint8_t*)info + hdr->total_size;
+
+    while (p + sizeof(mb_tag_t) <= end) {
+        const mb_tag_t* tag = (const mb_tag_t*)p;
+        if (tag->type == MB_TAG_END || tag->size < sizeof(mb_tag_t)) {
+            break;
+        }
+
+        switch (tag->type) {
+            case MB_TAG_CMDLINE:
+                strncpy(mb_cmdline, (const char*)(p + sizeof(mb_tag_t)), MB_CMDLINE_MAX - 1);
+                mb_cmdline[MB_CMDLINE_MAX - 1] = '\0';
+                break;
+            case MB_TAG_MMAP:
+                multiboot_parse_mmap((const mb_tag_mmap_t*)tag);
+                break;
+            case MB_TAG_ACPI_OLD:
+            case MB_TAG_ACPI_NEW:
+                multiboot_parse_rsdp(tag);
+                break;
+            default:
+                break;
+        }
+
+        p += ALIGN_UP(tag->size, 8);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the number of memory map regions
+ */
+int multiboot_region_count(void) {
+    return mb_region_count;
+}
+
+/**
+ * Get a memory map region
+ */
+const mb_mem_region_t* multiboot_get_region(int index) {
+    if (index < 0 || index >= mb_region_count) {
+        return NULL;
+    }
+    return &mb_regions[index];
+}
+
+/**
+ * Get the kernel command line
+ */
+const char* multiboot_get_cmdline(void) {
+    return mb_cmdline;
+}
+
+/**
+ * Check if the command line contains a word (words are separated by spaces)
+ */
+int multiboot_cmdline_has(const char* word) {
+    size_t len = strlen(word);
+    const char* p = mb_cmdline;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        const char* start = p;
+        while (*p && *p != ' ') p++;
+        if ((size_t)(p - start) == len && strncmp(start, word, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the physical range of the boot information structure
+ */
+void multiboot_get_info_range(uint64_t* start_out, uint64_t* end_out) {
+    if (start_out) *start_out = mb_info_start;
+    if (end_out)   *end_out = mb_info_end;
+}
+
+/**
+ * Get the bootloader's copy of the ACPI RSDP
+ */
+const void* multiboot_get_acpi_rsdp(void) {
+    return mb_rsdp_type ? mb_rsdp : NULL;
+}
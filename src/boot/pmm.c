@@ -1,115 +1,584 @@
 /**
  * MiniOS - Physical Memory Manager
- * 
- * Simple bitmap-based physical memory allocator.
- * Manages physical page frames (4KB each).
+ *
+ * Buddy-system physical page allocator.
+ * Manages physical page frames (4KB each) in power-of-two blocks of
+ * 2^order pages, order 0 to PMM_MAX_ORDER.
+ *
+ * Free blocks sit on per-order doubly linked lists threaded through the
+ * free pages themselves. A per-order bitmap marks which blocks are on a
+ * list so the buddy of a freed block can be tested in O(1), and a summary
+ * word holds one bit per non-empty list so allocation jumps straight to
+ * the smallest order that can satisfy a request.
+ *
+ * Usable RAM comes from the Multiboot2 memory map. Each usable range becomes
+ * a zone whose bitmaps are carved from the zone's own first pages, so the
+ * metadata cost scales with installed memory rather than a fixed window.
+ *
+ * The zones are shared by all CPUs behind one lock. In front of them each
+ * CPU keeps a small cache of single pages, refilled and drained in
+ * batches, so allocating or freeing one page usually only disables
+ * interrupts on the calling CPU. Cached pages are marked in a bitmap of
+ * their own, so freeing a page twice can't put it in a cache twice.
  */
 
 #include "types.h"
 #include "string.h"
+#include "pmm.h"
+#include "multiboot.h"
+#include "smp.h"
+#include "spinlock.h"
 
 /* Memory constants */
 #define PMM_PAGE_SIZE       4096
-#define PMM_PAGES_PER_BYTE  8
+#define PMM_NUM_ORDERS      (PMM_MAX_ORDER + 1)
+#define PMM_MAX_BLOCK_PAGES (1UL << PMM_MAX_ORDER)
 
-/* Memory region to manage (simplified: assume 16MB starting at 1MB) */
-#define PMM_START_ADDR      0x200000    /* Start at 2MB to avoid kernel */
-#define PMM_MEMORY_SIZE     (14 * 1024 * 1024)  /* 14MB available */
-#define PMM_TOTAL_PAGES     (PMM_MEMORY_SIZE / PMM_PAGE_SIZE)
-#define PMM_BITMAP_SIZE     (PMM_TOTAL_PAGES / PMM_PAGES_PER_BYTE)
+/* Fallback window when the bootloader gives no memory map (old fixed layout) */
+#define PMM_FALLBACK_START  0x100000
+#define PMM_FALLBACK_END    (16 * 1024 * 1024)
 
-/* Bitmap to track free/used pages */
-static uint8_t pmm_bitmap[PMM_BITMAP_SIZE];
+/* Zone and reservation limits */
+#define PMM_MAX_ZONES       32
+#define PMM_MAX_RESERVED    8
+
+/* Per-CPU single-page cache */
+#define PMM_PCP_SIZE        32
+#define PMM_PCP_BATCH       16      /* Pages moved to or from the zones at once */
+
+/* Free block header, stored in the first bytes of the free block */
+typedef struct pmm_free_block {
+    struct pmm_free_block* next;
+    struct pmm_free_block* prev;
+} pmm_free_block_t;
+
+/* A contiguous range of physical page frames */
+typedef struct {
+    uint64_t base_pfn;      /* First managed page frame */
+    uint64_t end_pfn;       /* One past the last managed page frame */
+    uint64_t align_pfn;     /* base_pfn rounded down to a max-order boundary */
+    uint64_t* used_map;     /* 1 bit per page, set = allocated */
+    uint64_t* cached_map;   /* 1 bit per page, set = in a per-CPU cache */
+    uint64_t* free_map[PMM_NUM_ORDERS];     /* 1 bit per block, set = on free list */
+    pmm_free_block_t* free_list[PMM_NUM_ORDERS];
+    size_t free_blocks[PMM_NUM_ORDERS];
+    uint32_t order_mask;    /* Bit k set if free_list[k] is non-empty */
+} pmm_zone_t;
+
+/* Pages cached by one CPU (on their own cache line) */
+typedef struct {
+    uint32_t count;
+    void* pages[PMM_PCP_SIZE];
+} ALIGNED(64) pmm_pcp_t;
+
+/* Physical range that must never be handed out */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} pmm_range_t;
+
+static pmm_zone_t pmm_zones[PMM_MAX_ZONES];
+static int pmm_zone_count;
+static pmm_range_t pmm_reserved[PMM_MAX_RESERVED];
+static int pmm_reserved_count;
 static size_t pmm_free_count;
 static size_t pmm_total_pages;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+static pmm_pcp_t pmm_pcp[SMP_MAX_CPUS];
+
+/* Linker symbols bounding the kernel image */
+extern char __kernel_start[];
+extern char __kernel_end[];
+
+/* Top of the identity map built by boot.asm */
+extern uint64_t phys_mapped_top;
+
+/**
+ * Bitmap helpers
+ */
+static inline int bit_test(const uint64_t* map, uint64_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t* map, uint64_t bit) {
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void bit_clear(uint64_t* map, uint64_t bit) {
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/**
+ * Set a bit that other CPUs may be changing in the same word
+ * @return Previous value of the bit
+ */
+static inline int bit_test_and_set_atomic(uint64_t* map, uint64_t bit) {
+    uint64_t mask = 1ULL << (bit % 64);
+    return (__atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static inline void bit_clear_atomic(uint64_t* map, uint64_t bit) {
+    __atomic_fetch_and(&map[bit / 64], ~(1ULL << (bit % 64)), __ATOMIC_RELAXED);
+}
+
+/**
+ * Mask of bits [lo, hi) within a single 64-bit word (0 <= lo < hi <= 64)
+ */
+static inline uint64_t word_mask(unsigned lo, unsigned hi) {
+    uint64_t upper = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+    return upper & ~((1ULL << lo) - 1);
+}
+
+/**
+ * Set or clear a run of bits, one word at a time
+ */
+static void bitmap_fill(uint64_t* map, uint64_t start, uint64_t count, int value) {
+    while (count > 0) {
+        uint64_t word = start / 64;
+        unsigned lo = start % 64;
+        unsigned hi = (count >= 64 - lo) ? 64 : lo + (unsigned)count;
+        uint64_t mask = word_mask(lo, hi);
+
+        if (value) {
+            map[word] |= mask;
+        } else {
+            map[word] &= ~mask;
+        }
+
+        start += hi - lo;
+        count -= hi - lo;
+    }
+}
+
+/**
+ * Check whether every bit in a run is set, one word at a time
+ */
+static int bitmap_all_set(const uint64_t* map, uint64_t start, uint64_t count) {
+    while (count > 0) {
+        uint64_t word = start / 64;
+        unsigned lo = start % 64;
+        unsigned hi = (count >= 64 - lo) ? 64 : lo + (unsigned)count;
+        uint64_t mask = word_mask(lo, hi);
+
+        if ((map[word] & mask) != mask) {
+            return 0;
+        }
+
+        start += hi - lo;
+        count -= hi - lo;
+    }
+    return 1;
+}
+
+/**
+ * Check whether any bit in a run is set, one word at a time
+ */
+static int bitmap_any_set(const uint64_t* map, uint64_t start, uint64_t count) {
+    while (count > 0) {
+        uint64_t word = start / 64;
+        unsigned lo = start % 64;
+        unsigned hi = (count >= 64 - lo) ? 64 : lo + (unsigned)count;
+
+        if (map[word] & word_mask(lo, hi)) {
+            return 1;
+        }
+
+        start += hi - lo;
+        count -= hi - lo;
+    }
+    return 0;
+}
 
 /**
- * Set a bit in the bitmap (mark page as used)
+ * Smallest order whose block holds at least 'count' pages
  */
-static void pmm_set_bit(size_t page) {
-    pmm_bitmap[page / 8] |= (1 << (page % 8));
+static int pmm_order_for(size_t count) {
+    int order = 0;
+    while ((1UL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+static inline pmm_free_block_t* pfn_to_block(uint64_t pfn) {
+    return (pmm_free_block_t*)(uintptr_t)(pfn * PMM_PAGE_SIZE);
+}
+
+static inline uint64_t block_to_pfn(pmm_free_block_t* block) {
+    return (uint64_t)(uintptr_t)block / PMM_PAGE_SIZE;
 }
 
 /**
- * Clear a bit in the bitmap (mark page as free)
+ * Put a block on its order's free list
  */
-static void pmm_clear_bit(size_t page) {
-    pmm_bitmap[page / 8] &= ~(1 << (page % 8));
+static void zone_push(pmm_zone_t* z, uint64_t pfn, int order) {
+    pmm_free_block_t* block = pfn_to_block(pfn);
+
+    block->prev = NULL;
+    block->next = z->free_list[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    z->free_list[order] = block;
+    z->free_blocks[order]++;
+    z->order_mask |= 1U << order;
+
+    bit_set(z->free_map[order], (pfn - z->align_pfn) >> order);
+}
+
+/**
+ * Take a specific block off its order's free list
+ */
+static void zone_remove(pmm_zone_t* z, uint64_t pfn, int order) {
+    pmm_free_block_t* block = pfn_to_block(pfn);
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        z->free_list[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+
+    z->free_blocks[order]--;
+    if (!z->free_list[order]) {
+        z->order_mask &= ~(1U << order);
+    }
+
+    bit_clear(z->free_map[order], (pfn - z->align_pfn) >> order);
 }
 
 /**
- * Test if a bit is set (page is used)
+ * Free one aligned block, merging with its buddy as far as possible
  */
-static int pmm_test_bit(size_t page) {
-    return pmm_bitmap[page / 8] & (1 << (page % 8));
+static void zone_free_block(pmm_zone_t* z, uint64_t pfn, int order) {
+    uint64_t span = z->end_pfn - z->align_pfn;
+    uint64_t idx = pfn - z->align_pfn;
+
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = idx ^ (1UL << order);
+        if (buddy >= span || !bit_test(z->free_map[order], buddy >> order)) {
+            break;
+        }
+        zone_remove(z, z->align_pfn + buddy, order);
+        idx &= ~(1UL << order);
+        order++;
+    }
+
+    zone_push(z, z->align_pfn + idx, order);
 }
 
 /**
- * Initialize the physical memory manager
+ * Return an arbitrary page range to the free lists as maximal aligned blocks
+ */
+static void zone_release(pmm_zone_t* z, uint64_t pfn, uint64_t count) {
+    bitmap_fill(z->used_map, pfn - z->align_pfn, count, 0);
+    pmm_free_count += count;
+
+    while (count > 0) {
+        uint64_t idx = pfn - z->align_pfn;
+        int order = PMM_MAX_ORDER;
+
+        /* Largest block that is both aligned here and fits the range */
+        while (order > 0 &&
+               ((idx & ((1UL << order) - 1)) != 0 || (1UL << order) > count)) {
+            order--;
+        }
+
+        zone_free_block(z, pfn, order);
+        pfn += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/**
+ * Allocate exactly 'count' contiguous pages from a zone
+ * @return First page frame number, or 0 on failure
+ */
+static uint64_t zone_alloc(pmm_zone_t* z, size_t count) {
+    int order = pmm_order_for(count);
+    uint32_t candidates = z->order_mask >> order;
+
+    if (!candidates) {
+        return 0;
+    }
+
+    /* Smallest non-empty order that is large enough */
+    int k = order + __builtin_ctz(candidates);
+    uint64_t pfn = block_to_pfn(z->free_list[k]);
+    zone_remove(z, pfn, k);
+
+    /* Split down, handing the upper halves back to the free lists */
+    while (k > order) {
+        k--;
+        zone_push(z, pfn + (1UL << k), k);
+    }
+
+    bitmap_fill(z->used_map, pfn - z->align_pfn, 1UL << order, 1);
+    pmm_free_count -= 1UL << order;
+
+    /* Give back the unused tail of a rounded-up block */
+    if ((1UL << order) > count) {
+        zone_release(z, pfn + count, (1UL << order) - count);
+    }
+
+    return pfn;
+}
+
+/**
+ * Find the zone that owns a physical address
+ */
+static pmm_zone_t* pmm_addr_zone(uint64_t addr) {
+    uint64_t pfn = addr / PMM_PAGE_SIZE;
+
+    for (int i = 0; i < pmm_zone_count; i++) {
+        if (pfn >= pmm_zones[i].base_pfn && pfn < pmm_zones[i].end_pfn) {
+            return &pmm_zones[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add a zone covering [start, end), carving its bitmaps from its first pages
+ */
+static void pmm_add_zone(uint64_t start, uint64_t end) {
+    uint64_t base_pfn = ALIGN_UP(start, PMM_PAGE_SIZE) / PMM_PAGE_SIZE;
+    uint64_t end_pfn = ALIGN_DOWN(end, PMM_PAGE_SIZE) / PMM_PAGE_SIZE;
+
+    if (end_pfn <= base_pfn || pmm_zone_count >= PMM_MAX_ZONES) {
+        return;
+    }
+
+    uint64_t align_pfn = ALIGN_DOWN(base_pfn, PMM_MAX_BLOCK_PAGES);
+    uint64_t span = end_pfn - align_pfn;
+
+    /* Used and cached bits per page, plus one free bit per block at every order */
+    uint64_t used_words = (span + 63) / 64;
+    uint64_t meta_words = 2 * used_words;
+    for (int order = 0; order < PMM_NUM_ORDERS; order++) {
+        meta_words += ((span >> order) + 2 + 63) / 64;
+    }
+    uint64_t meta_pages = ALIGN_UP(meta_words * sizeof(uint64_t), PMM_PAGE_SIZE) / PMM_PAGE_SIZE;
+
+    if (end_pfn - base_pfn <= meta_pages) {
+        return;  /* Too small to be worth managing */
+    }
+
+    pmm_zone_t* z = &pmm_zones[pmm_zone_count++];
+    memset(z, 0, sizeof(*z));
+
+    uint64_t* meta = (uint64_t*)(uintptr_t)(base_pfn * PMM_PAGE_SIZE);
+    memset(meta, 0, meta_words * sizeof(uint64_t));
+
+    /* Everything starts out allocated; the usable pages are then released */
+    z->used_map = meta;
+    memset(z->used_map, 0xFF, used_words * sizeof(uint64_t));
+    meta += used_words;
+    z->cached_map = meta;
+    meta += used_words;
+    for (int order = 0; order < PMM_NUM_ORDERS; order++) {
+        z->free_map[order] = meta;
+        meta += ((span >> order) + 2 + 63) / 64;
+    }
+
+    z->base_pfn = base_pfn + meta_pages;
+    z->end_pfn = end_pfn;
+    z->align_pfn = align_pfn;
+
+    pmm_total_pages += z->end_pfn - z->base_pfn;
+    zone_release(z, z->base_pfn, z->end_pfn - z->base_pfn);
+}
+
+/**
+ * Add usable memory [start, end), skipping reserved ranges from index 'first'
+ */
+static void pmm_add_range(uint64_t start, uint64_t end, int first) {
+    for (int i = first; i < pmm_reserved_count; i++) {
+        const pmm_range_t* r = &pmm_reserved[i];
+        if (r->start < end && r->end > start) {
+            if (start < r->start) {
+                pmm_add_range(start, r->start, i + 1);
+            }
+            if (r->end < end) {
+                pmm_add_range(r->end, end, i + 1);
+            }
+            return;
+        }
+    }
+    pmm_add_zone(start, end);
+}
+
+/**
+ * Mark a physical range as never allocatable
+ */
+static void pmm_reserve(uint64_t start, uint64_t end) {
+    if (end > start && pmm_reserved_count < PMM_MAX_RESERVED) {
+        pmm_reserved[pmm_reserved_count].start = ALIGN_DOWN(start, PMM_PAGE_SIZE);
+        pmm_reserved[pmm_reserved_count].end = ALIGN_UP(end, PMM_PAGE_SIZE);
+        pmm_reserved_count++;
+    }
+}
+
+/**
+ * Initialize the physical memory manager from the Multiboot2 memory map
  */
 void pmm_init(void) {
-    pmm_total_pages = PMM_TOTAL_PAGES;
-    pmm_free_count = PMM_TOTAL_PAGES;
-    
-    /* Clear bitmap (all pages free) */
-    memset(pmm_bitmap, 0, PMM_BITMAP_SIZE);
+    pmm_zone_count = 0;
+    pmm_reserved_count = 0;
+    pmm_total_pages = 0;
+    pmm_free_count = 0;
+    memset(pmm_pcp, 0, sizeof(pmm_pcp));
+
+    /* Low memory (BIOS, VGA), the kernel image and the boot information */
+    uint64_t mbi_start, mbi_end;
+    multiboot_get_info_range(&mbi_start, &mbi_end);
+    pmm_reserve(0, 0x100000);
+    pmm_reserve((uint64_t)(uintptr_t)__kernel_start, (uint64_t)(uintptr_t)__kernel_end);
+    pmm_reserve(mbi_start, mbi_end);
+
+    /* Only RAM covered by the boot identity map is usable */
+    uint64_t limit = phys_mapped_top;
+
+    for (int i = 0; i < multiboot_region_count(); i++) {
+        const mb_mem_region_t* r = multiboot_get_region(i);
+        if (r->type != MB_MEMORY_AVAILABLE || r->base >= limit) {
+            continue;
+        }
+        uint64_t end = r->base + r->length;
+        pmm_add_range(r->base, end > limit ? limit : end, 0);
+    }
+
+    /* No usable memory map: fall back to the old fixed window */
+    if (pmm_zone_count == 0) {
+        pmm_add_range(PMM_FALLBACK_START, PMM_FALLBACK_END, 0);
+    }
 }
 
 /**
- * Allocate a physical page
- * @return Physical address of allocated page, or 0 on failure
+ * Get number of memory zones being managed
  */
-void* pmm_alloc_page(void) {
-    if (pmm_free_count == 0) {
+int pmm_get_zone_count(void) {
+    return pmm_zone_count;
+}
+
+/**
+ * Allocate contiguous pages from the zones (pmm_lock held)
+ */
+static void* pmm_alloc_locked(size_t count) {
+    if (pmm_free_count < count) {
         return NULL;
     }
-    
-    /* Find first free page */
-    for (size_t i = 0; i < PMM_TOTAL_PAGES; i++) {
-        if (!pmm_test_bit(i)) {
-            pmm_set_bit(i);
-            pmm_free_count--;
-            return (void*)(PMM_START_ADDR + (i * PMM_PAGE_SIZE));
+
+    /* Prefer high zones so low memory stays available for legacy DMA */
+    for (int i = pmm_zone_count - 1; i >= 0; i--) {
+        uint64_t pfn = zone_alloc(&pmm_zones[i], count);
+        if (pfn) {
+            return (void*)(uintptr_t)(pfn * PMM_PAGE_SIZE);
         }
     }
-    
+
     return NULL;
 }
 
+/**
+ * Free contiguous pages to the zones (pmm_lock held)
+ */
+static void pmm_free_locked(pmm_zone_t* z, uint64_t pfn, size_t count) {
+    if (pfn + count > z->end_pfn) {
+        count = z->end_pfn - pfn;
+    }
+
+    /* Fast path: whole range allocated, none of it sitting in a cache */
+    if (bitmap_all_set(z->used_map, pfn - z->align_pfn, count) &&
+        !bitmap_any_set(z->cached_map, pfn - z->align_pfn, count)) {
+        zone_release(z, pfn, count);
+        return;
+    }
+
+    /* Otherwise release only runs of pages that are actually allocated */
+    while (count > 0) {
+        uint64_t run = 0;
+        while (run < count && bit_test(z->used_map, pfn + run - z->align_pfn) &&
+               !bit_test(z->cached_map, pfn + run - z->align_pfn)) {
+            run++;
+        }
+        if (run > 0) {
+            zone_release(z, pfn, run);
+        } else {
+            run = 1;  /* Already free (or cached), skip */
+        }
+        pfn += run;
+        count -= run;
+    }
+}
+
+/**
+ * Note that a page is in a per-CPU cache, or has left it
+ */
+static void pmm_cache_mark(void* page) {
+    uint64_t addr = (uint64_t)(uintptr_t)page;
+    pmm_zone_t* z = pmm_addr_zone(addr);
+    uint64_t pfn = addr / PMM_PAGE_SIZE;
+    bit_test_and_set_atomic(z->cached_map, pfn - z->align_pfn);
+}
+
+static void pmm_cache_unmark(void* page) {
+    uint64_t addr = (uint64_t)(uintptr_t)page;
+    pmm_zone_t* z = pmm_addr_zone(addr);
+    uint64_t pfn = addr / PMM_PAGE_SIZE;
+    bit_clear_atomic(z->cached_map, pfn - z->align_pfn);
+}
+
+/**
+ * Allocate a physical page
+ * @return Physical address of allocated page, or 0 on failure
+ */
+void* pmm_alloc_page(void) {
+    return pmm_alloc_pages(1);
+}
+
 /**
  * Allocate multiple contiguous physical pages
  * @param count Number of pages to allocate
  * @return Physical address of first page, or 0 on failure
  */
 void* pmm_alloc_pages(size_t count) {
-    if (count == 0 || pmm_free_count < count) {
+    if (count == 0 || count > PMM_MAX_BLOCK_PAGES) {
         return NULL;
     }
-    
-    /* Find contiguous free pages */
-    size_t consecutive = 0;
-    size_t start = 0;
-    
-    for (size_t i = 0; i < PMM_TOTAL_PAGES; i++) {
-        if (!pmm_test_bit(i)) {
-            if (consecutive == 0) {
-                start = i;
-            }
-            consecutive++;
-            if (consecutive == count) {
-                /* Found enough pages, mark them as used */
-                for (size_t j = start; j < start + count; j++) {
-                    pmm_set_bit(j);
+
+    uint64_t flags = irq_save();
+    void* page = NULL;
+
+    if (count == 1) {
+        /* This CPU's cache, refilled with a batch when it runs dry */
+        pmm_pcp_t* pcp = &pmm_pcp[smp_cpu_id()];
+        if (pcp->count == 0) {
+            spin_lock(&pmm_lock);
+            while (pcp->count < PMM_PCP_BATCH) {
+                void* p = pmm_alloc_locked(1);
+                if (!p) {
+                    break;
                 }
-                pmm_free_count -= count;
-                return (void*)(PMM_START_ADDR + (start * PMM_PAGE_SIZE));
+                pmm_cache_mark(p);
+                pcp->pages[pcp->count++] = p;
             }
-        } else {
-            consecutive = 0;
+            spin_unlock(&pmm_lock);
         }
+        if (pcp->count > 0) {
+            page = pcp->pages[--pcp->count];
+            pmm_cache_unmark(page);
+        }
+    } else {
+        spin_lock(&pmm_lock);
+        page = pmm_alloc_locked(count);
+        spin_unlock(&pmm_lock);
     }
-    
-    return NULL;
+
+    irq_restore(flags);
+    return page;
 }
 
 /**
@@ -117,36 +586,71 @@ void* pmm_alloc_pages(size_t count) {
  * @param addr Physical address of page to free
  */
 void pmm_free_page(void* addr) {
-    uint64_t page_addr = (uint64_t)addr;
-    
-    if (page_addr < PMM_START_ADDR || 
-        page_addr >= PMM_START_ADDR + PMM_MEMORY_SIZE) {
+    pmm_free_pages(addr, 1);
+}
+
+/**
+ * Free multiple contiguous pages
+ */
+void pmm_free_pages(void* addr, size_t count) {
+    uint64_t page_addr = (uint64_t)(uintptr_t)addr;
+    pmm_zone_t* z = pmm_addr_zone(page_addr);
+
+    if (!z || count == 0) {
         return;  /* Invalid address */
     }
-    
-    size_t page = (page_addr - PMM_START_ADDR) / PMM_PAGE_SIZE;
-    
-    if (pmm_test_bit(page)) {
-        pmm_clear_bit(page);
-        pmm_free_count++;
+
+    uint64_t pfn = page_addr / PMM_PAGE_SIZE;
+    uint64_t flags = irq_save();
+
+    /* An allocated single page goes to this CPU's cache; when the cache is
+     * full, its older half goes back to the zones first. One that is
+     * already in a cache (a double free) is left alone. */
+    if (count == 1 && bit_test(z->used_map, pfn - z->align_pfn)) {
+        if (bit_test_and_set_atomic(z->cached_map, pfn - z->align_pfn)) {
+            irq_restore(flags);
+            return;
+        }
+
+        pmm_pcp_t* pcp = &pmm_pcp[smp_cpu_id()];
+        if (pcp->count == PMM_PCP_SIZE) {
+            spin_lock(&pmm_lock);
+            for (uint32_t i = 0; i < PMM_PCP_BATCH; i++) {
+                uint64_t old = (uint64_t)(uintptr_t)pcp->pages[i];
+                pmm_cache_unmark(pcp->pages[i]);
+                pmm_free_locked(pmm_addr_zone(old), old / PMM_PAGE_SIZE, 1);
+            }
+            spin_unlock(&pmm_lock);
+            memmove(pcp->pages, pcp->pages + PMM_PCP_BATCH,
+                    (PMM_PCP_SIZE - PMM_PCP_BATCH) * sizeof(void*));
+            pcp->count -= PMM_PCP_BATCH;
+        }
+        pcp->pages[pcp->count++] = addr;
+    } else {
+        spin_lock(&pmm_lock);
+        pmm_free_locked(z, pfn, count);
+        spin_unlock(&pmm_lock);
     }
+
+    irq_restore(flags);
 }
 
 /**
- * Free multiple contiguous pages
+ * Pages sitting in the per-CPU caches (allocated as far as the zones know)
  */
-void pmm_free_pages(void* addr, size_t count) {
-    uint8_t* page_addr = (uint8_t*)addr;
-    for (size_t i = 0; i < count; i++) {
-        pmm_free_page(page_addr + (i * PMM_PAGE_SIZE));
+static size_t pmm_pcp_pages(void) {
+    size_t pages = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        pages += pmm_pcp[i].count;
     }
+    return pages;
 }
 
 /**
  * Get free page count
  */
 size_t pmm_get_free_pages(void) {
-    return pmm_free_count;
+    return pmm_free_count + pmm_pcp_pages();
 }
 
 /**
@@ -160,7 +664,7 @@ size_t pmm_get_total_pages(void) {
  * Get free memory in bytes
  */
 size_t pmm_get_free_memory(void) {
-    return pmm_free_count * PMM_PAGE_SIZE;
+    return pmm_get_free_pages() * PMM_PAGE_SIZE;
 }
 
 /**
@@ -170,3 +674,17 @@ size_t pmm_get_total_memory(void) {
     return pmm_total_pages * PMM_PAGE_SIZE;
 }
 
+/**
+ * Get number of free blocks of a given order
+ */
+size_t pmm_get_free_blocks(int order) {
+    if (order < 0 || order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    size_t blocks = 0;
+    for (int i = 0; i < pmm_zone_count; i++) {
+        blocks += pmm_zones[i].free_blocks[order];
+    }
+    return blocks;
+}
@@ -0,0 +1,448 @@
+/**
+ * MiniOS - Slab Allocator
+ *
+ * Object caches for fixed-size kernel objects.
+ * Each slab is one naturally aligned 16KB block from the PMM with a small
+ * header at the start, so the owning slab of any object is found by
+ * rounding its address down. Free objects in a slab form a singly linked
+ * list, and each cache keeps its slabs on partial/full/empty lists so
+ * allocation and free are both O(1).
+ *
+ * The slab lists are shared by all CPUs behind a per-cache lock. Each CPU
+ * also keeps a small array of free objects per cache, taken from and
+ * returned to the slabs in batches, so most kmem_cache_alloc/free calls
+ * only disable interrupts on the calling CPU.
+ *
+ * A bitmap in each slab header marks the objects handed out to callers.
+ * Freeing an object whose bit is already clear (a double free) is ignored
+ * instead of putting the object on a free list twice.
+ */
+
+#include "types.h"
+#include "string.h"
+#include "slab.h"
+#include "pmm.h"
+#include "smp.h"
+#include "spinlock.h"
+
+/* Slab geometry (a power-of-two page count keeps buddy blocks aligned) */
+#define SLAB_PAGES      4
+#define SLAB_SIZE       (SLAB_PAGES * PAGE_SIZE)
+#define SLAB_MAGIC      0x51AB51ABU
+#define SLAB_MIN_ALIGN  16
+
+/* Empty slabs kept per cache before pages go back to the PMM */
+#define SLAB_MAX_EMPTY  1
+
+/* kmalloc size classes: 16, 32, ..., 2048 */
+#define SLAB_MIN_CLASS_SHIFT    4
+#define SLAB_NUM_CLASSES        8
+
+/* Most objects a slab can hold (the smallest object is one pointer) */
+#define SLAB_MAX_OBJS   (SLAB_SIZE / sizeof(void*))
+#define SLAB_MAP_WORDS  (SLAB_MAX_OBJS / 64)
+
+/* Per-CPU object cache */
+#define SLAB_CPU_CACHE  16
+#define SLAB_CPU_BATCH  8       /* Objects moved to or from the slabs at once */
+
+/* Slab header, at the start of every slab */
+typedef struct slab {
+    uint32_t magic;
+    uint32_t in_use;            /* Allocated objects in this slab */
+    struct kmem_cache* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* free_list;            /* First free object */
+    uint64_t user_map[SLAB_MAP_WORDS];  /* Bit per object, set = owned by a caller */
+} slab_t;
+
+/* Slab list */
+typedef struct {
+    slab_t* head;
+    size_t count;
+} slab_list_t;
+
+/* Free objects cached by one CPU */
+typedef struct {
+    uint32_t count;
+    void* objs[SLAB_CPU_CACHE];
+} slab_cpu_cache_t;
+
+/* Object cache */
+struct kmem_cache {
+    const char* name;
+    size_t obj_size;            /* Rounded up to alignment */
+    size_t first_offset;        /* Offset of first object in a slab */
+    size_t objs_per_slab;
+    slab_list_t partial;        /* Some objects free */
+    slab_list_t full;           /* No objects free */
+    slab_list_t empty;          /* All objects free */
+    size_t active_objs;         /* Taken from the slabs, including CPU caches */
+    spinlock_t lock;            /* Slab lists and active_objs */
+    struct kmem_cache* next;    /* Next cache in global list */
+    slab_cpu_cache_t cpu[SMP_MAX_CPUS];
+};
+
+/* Cache of kmem_cache_t structures, and the list of all caches */
+static struct kmem_cache cache_cache;
+static struct kmem_cache* cache_list = NULL;
+static int cache_count = 0;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+/* kmalloc size classes */
+static kmem_cache_t* size_caches[SLAB_NUM_CLASSES];
+static const char* size_cache_names[SLAB_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static int slab_ready = 0;
+
+/**
+ * Slab list helpers
+ */
+static void slab_list_add(slab_list_t* list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = list->head;
+    if (list->head) {
+        list->head->prev = slab;
+    }
+    list->head = slab;
+    list->count++;
+}
+
+static void slab_list_remove(slab_list_t* list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        list->head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    list->count--;
+}
+
+/**
+ * Get the slab that contains an object
+ */
+static inline slab_t* slab_of(const void* obj) {
+    return (slab_t*)ALIGN_DOWN((uintptr_t)obj, SLAB_SIZE);
+}
+
+/**
+ * Mark an object as handed out, or as returned
+ * Objects of one slab are freed from several CPUs at once, so the bitmap
+ * is only changed atomically.
+ * @return 0, or -1 if the object is not an object start or was already in that state
+ */
+static int slab_mark(struct kmem_cache* cache, void* obj, int owned) {
+    slab_t* slab = slab_of(obj);
+    uintptr_t offset = (uintptr_t)obj - (uintptr_t)slab - cache->first_offset;
+
+    if ((uintptr_t)obj < (uintptr_t)slab + cache->first_offset || offset % cache->obj_size) {
+        return -1;
+    }
+    size_t index = offset / cache->obj_size;
+    if (index >= cache->objs_per_slab) {
+        return -1;
+    }
+
+    uint64_t mask = 1ULL << (index % 64);
+    uint64_t* word = &slab->user_map[index / 64];
+    uint64_t old = owned ? __atomic_fetch_or(word, mask, __ATOMIC_RELAXED)
+                         : __atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+    return ((old & mask) != 0) == owned ? -1 : 0;
+}
+
+/**
+ * Fill in cache geometry
+ */
+static void cache_setup(struct kmem_cache* cache, const char* name, size_t size, size_t align) {
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->obj_size = ALIGN_UP(size, align);
+    cache->first_offset = ALIGN_UP(sizeof(slab_t), align);
+    cache->objs_per_slab = (SLAB_SIZE - cache->first_offset) / cache->obj_size;
+
+    spin_init(&cache->lock);
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    cache_count++;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+/**
+ * Allocate a new slab from the PMM and thread its free list
+ */
+static slab_t* slab_grow(struct kmem_cache* cache) {
+    slab_t* slab = (slab_t*)pmm_alloc_pages(SLAB_PAGES);
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->free_list = NULL;
+    memset(slab->user_map, 0, sizeof(slab->user_map));
+
+    /* Link objects so the lowest address is handed out first */
+    uint8_t* base = (uint8_t*)slab + cache->first_offset;
+    for (size_t i = cache->objs_per_slab; i > 0; i--) {
+        void** obj = (void**)(base + (i - 1) * cache->obj_size);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    slab_list_add(&cache->empty, slab);
+    return slab;
+}
+
+/**
+ * Initialize the slab allocator
+ */
+void slab_init(void) {
+    cache_list = NULL;
+    cache_count = 0;
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), SLAB_MIN_ALIGN);
+
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        size_caches[i] = kmem_cache_create(size_cache_names[i],
+                                           1UL << (SLAB_MIN_CLASS_SHIFT + i), 0);
+    }
+
+    slab_ready = 1;
+}
+
+/**
+ * Check if the slab allocator is ready
+ */
+int slab_is_initialized(void) {
+    return slab_ready;
+}
+
+/**
+ * Create an object cache
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    if (align == 0) {
+        align = SLAB_MIN_ALIGN;
+    }
+    if (size == 0 || size > SLAB_MAX_OBJ_SIZE || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+
+    /* Objects must be able to hold the free-list link */
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    struct kmem_cache* cache = (struct kmem_cache*)kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        return NULL;
+    }
+
+    cache_setup(cache, name, size, align);
+    return cache;
+}
+
+/**
+ * Take an object off the slab lists (cache lock held)
+ */
+static void* slab_take(struct kmem_cache* cache) {
+    slab_t* slab = cache->partial.head;
+
+    if (!slab) {
+        slab = cache->empty.head;
+        if (!slab) {
+            slab = slab_grow(cache);
+            if (!slab) {
+                return NULL;
+            }
+        }
+        slab_list_remove(&cache->empty, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void** obj = (void**)slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+    cache->active_objs++;
+
+    if (slab->in_use == cache->objs_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+/**
+ * Put an object back on its slab (cache lock held)
+ */
+static void slab_put(struct kmem_cache* cache, void* obj) {
+    slab_t* slab = slab_of(obj);
+
+    if (slab->in_use == cache->objs_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->active_objs--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty.count >= SLAB_MAX_EMPTY) {
+            slab->magic = 0;
+            pmm_free_pages(slab, SLAB_PAGES);
+        } else {
+            slab_list_add(&cache->empty, slab);
+        }
+    }
+}
+
+/**
+ * Allocate an object from a cache
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    uint64_t flags = irq_save();
+    slab_cpu_cache_t* cc = &cache->cpu[smp_cpu_id()];
+    void* obj = NULL;
+
+    /* Refill this CPU's array with a batch when it runs dry */
+    if (cc->count == 0) {
+        spin_lock(&cache->lock);
+        while (cc->count < SLAB_CPU_BATCH) {
+            void* fresh = slab_take(cache);
+            if (!fresh) {
+                break;
+            }
+            cc->objs[cc->count++] = fresh;
+        }
+        spin_unlock(&cache->lock);
+    }
+    if (cc->count > 0) {
+        obj = cc->objs[--cc->count];
+        slab_mark(cache, obj, 1);
+    }
+
+    irq_restore(flags);
+    return obj;
+}
+
+/**
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) {
+        return;
+    }
+
+    slab_t* slab = slab_of(obj);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        return;  /* Not ours */
+    }
+    if (slab_mark(cache, obj, 0) < 0) {
+        return;  /* Double free (or not an object) */
+    }
+
+    uint64_t flags = irq_save();
+    slab_cpu_cache_t* cc = &cache->cpu[smp_cpu_id()];
+
+    /* Full: the oldest batch goes back to the slabs, the hot end stays */
+    if (cc->count == SLAB_CPU_CACHE) {
+        spin_lock(&cache->lock);
+        for (uint32_t i = 0; i < SLAB_CPU_BATCH; i++) {
+            slab_put(cache, cc->objs[i]);
+        }
+        spin_unlock(&cache->lock);
+        memmove(cc->objs, cc->objs + SLAB_CPU_BATCH,
+                (SLAB_CPU_CACHE - SLAB_CPU_BATCH) * sizeof(void*));
+        cc->count -= SLAB_CPU_BATCH;
+    }
+    cc->objs[cc->count++] = obj;
+
+    irq_restore(flags);
+}
+
+/**
+ * Allocate from the smallest size class that fits
+ */
+void* slab_alloc_size(size_t size) {
+    if (!slab_ready || size == 0 || size > SLAB_MAX_OBJ_SIZE) {
+        return NULL;
+    }
+
+    int index = 0;
+    while ((1UL << (SLAB_MIN_CLASS_SHIFT + index)) < size) {
+        index++;
+    }
+
+    return kmem_cache_alloc(size_caches[index]);
+}
+
+/**
+ * Check if a pointer belongs to a slab
+ */
+int slab_owns(const void* ptr) {
+    if (!slab_ready || !ptr) {
+        return 0;
+    }
+    return slab_of(ptr)->magic == SLAB_MAGIC;
+}
+
+/**
+ * Free an object without knowing its cache
+ */
+void slab_free(void* ptr) {
+    if (!slab_owns(ptr)) {
+        return;
+    }
+    kmem_cache_free(slab_of(ptr)->cache, ptr);
+}
+
+/**
+ * Get number of caches
+ */
+int kmem_cache_count(void) {
+    return cache_count;
+}
+
+/**
+ * Get statistics for a cache
+ */
+int kmem_cache_get_info(int index, kmem_cache_info_t* info) {
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    struct kmem_cache* cache = cache_list;
+
+    for (int i = 0; cache && i < index; i++) {
+        cache = cache->next;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    if (index < 0 || !cache) {
+        return -1;
+    }
+
+    /* Objects parked in CPU arrays are free as far as users are concerned */
+    size_t cached = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        cached += cache->cpu[i].count;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+    info->name = cache->name;
+    info->obj_size = cache->obj_size;
+    info->active_objs = cache->active_objs - cached;
+    info->slabs = cache->partial.count + cache->full.count + cache->empty.count;
+    info->total_objs = info->slabs * cache->objs_per_slab;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return 0;
+}
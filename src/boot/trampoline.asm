@@ -0,0 +1,112 @@
+; MiniOS - Application Processor Trampoline
+; A STARTUP IPI starts an AP in real mode at page (vector << 12), so smp.c
+; copies this code to SMP_TRAMPOLINE_BASE below 1MB. It climbs to long
+; mode with a throwaway GDT, then switches to the boot CPU's page tables,
+; GDT and a stack of its own, and calls the C entry with its per-CPU area.
+;
+; The code runs from the copy, not from where it was linked, so every
+; address it uses goes through TRAMP().
+
+TRAMPOLINE_BASE equ 0x8000      ; Must match SMP_TRAMPOLINE_BASE in smp.c
+
+%define TRAMP(label) (TRAMPOLINE_BASE + ((label) - smp_trampoline_start))
+
+; Selectors of the trampoline GDT
+TRAMP_CODE32    equ 0x08
+TRAMP_DATA      equ 0x10
+TRAMP_CODE64    equ 0x18
+
+; Selectors of the kernel GDT (boot.asm)
+KERNEL_CODE     equ 0x08
+KERNEL_DATA     equ 0x10
+
+section .text
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_args
+
+bits 16
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+
+    ; Protected mode
+    o32 lgdt [TRAMP(tramp_gdt.pointer)]
+    mov eax, cr0
+    or eax, 1               ; PE
+    mov cr0, eax
+    jmp dword TRAMP_CODE32:TRAMP(tramp_protected)
+
+bits 32
+tramp_protected:
+    mov ax, TRAMP_DATA
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Same paging setup as the boot CPU (see enable_paging in boot.asm)
+    mov eax, cr4
+    or eax, 1 << 5          ; PAE
+    mov cr4, eax
+
+    mov eax, [TRAMP(smp_trampoline_args.cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080     ; EFER MSR
+    rdmsr
+    or eax, 1 << 8          ; Long mode enable
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31         ; PG
+    mov cr0, eax
+
+    jmp TRAMP_CODE64:TRAMP(tramp_long)
+
+bits 64
+tramp_long:
+    ; Kernel GDT, then reload every segment register from it
+    lgdt [TRAMP(smp_trampoline_args.gdt_limit)]
+    mov ax, KERNEL_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov rsp, [TRAMP(smp_trampoline_args.stack)]
+    mov rdi, [TRAMP(smp_trampoline_args.cpu)]
+    mov rax, [TRAMP(smp_trampoline_args.entry)]
+
+    ; Far return into the kernel code segment; the zero is a return
+    ; address for the entry, which never returns
+    push 0
+    push KERNEL_CODE
+    push rax
+    o64 retf
+
+; Trampoline GDT: flat 32-bit code and data, and 64-bit code
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; 32-bit code
+    dq 0x00CF92000000FFFF   ; Data
+    dq 0x00AF9A000000FFFF   ; 64-bit code
+.pointer:
+    dw $ - tramp_gdt - 1
+    dd TRAMP(tramp_gdt)
+
+; Filled in by smp.c in the copy (layout matches smp_boot_args_t)
+align 8
+smp_trampoline_args:
+.cr3:       dd 0            ; Boot CPU's PML4 (below 4GB)
+.gdt_limit: dw 0            ; Boot CPU's GDTR
+.gdt_base:  dq 0
+.stack:     dq 0            ; Top of this AP's stack
+.entry:     dq 0            ; C entry point
+.cpu:       dq 0            ; Its per-CPU area (first argument)
+
+smp_trampoline_end:
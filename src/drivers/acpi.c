@@ -0,0 +1,250 @@
+/**
+ * MiniOS - ACPI Tables
+ * 
+ * The RSDP points at the root table (RSDT with 32-bit entries, or XSDT
+ * with 64-bit ones from ACPI 2.0 on), which lists every other description
+ * table. The only one the kernel reads is the MADT: its local APIC entries
+ * name the processors that SMP bring-up sends INIT/STARTUP to.
+ * 
+ * Tables are read in place through the identity map; any that lie above
+ * it, or whose checksum is wrong, are treated as missing.
+ */
+
+#include "types.h"
+#include "string.h"
+#include "acpi.h"
+#include "multiboot.h"
+
+/* Root System Description Pointer */
+typedef struct {
+    char signature[8];          /* "RSD PTR " */
+    uint8_t checksum;           /* Covers the first 20 bytes */
+    char oem_id[6];
+    uint8_t revision;           /* 0 = ACPI 1.0, 2 = ACPI 2.0+ */
+    uint32_t rsdt_addr;
+    uint32_t length;            /* ACPI 2.0+ from here on */
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;       /* Covers 'length' bytes */
+    uint8_t reserved[3];
+} PACKED acpi_rsdp_t;
+
+/* Header shared by all description tables */
+typedef struct {
+    char signature[4];
+    uint32_t length;            /* Including this header */
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} PACKED acpi_header_t;
+
+/* Multiple APIC Description Table */
+typedef struct {
+    acpi_header_t hdr;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} PACKED acpi_madt_t;
+
+/* MADT entry: processor local APIC */
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} PACKED acpi_madt_lapic_t;
+
+#define ACPI_RSDP_V1_SIZE       20
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+
+/* BIOS areas searched for the RSDP (16-byte aligned) */
+#define ACPI_EBDA_PTR           0x40E
+#define ACPI_EBDA_SEARCH_SIZE   1024
+#define ACPI_BIOS_START         0xE0000
+#define ACPI_BIOS_END           0x100000
+
+/* Highest physical address covered by the boot identity map */
+extern uint64_t phys_mapped_top;
+
+static const acpi_rsdp_t* acpi_rsdp = NULL;
+static const acpi_header_t* acpi_root = NULL;
+static int acpi_root_wide = 0;          /* XSDT: 64-bit entries */
+static uint32_t acpi_cpus[ACPI_MAX_CPUS];
+static int acpi_ncpus = 0;
+
+/**
+ * Bytes of a table sum to zero
+ */
+static int acpi_checksum_ok(const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint8_t sum = 0;
+    
+    for (uint32_t i = 0; i < len; i++) {
+        sum += p[i];
+    }
+    return sum == 0;
+}
+
+/**
+ * Map a table's physical address, checking it lies inside the identity map
+ * @return Header, or NULL if the table is out of reach or corrupt
+ */
+static const acpi_header_t* acpi_table_at(uint64_t addr) {
+    if (addr == 0 || addr + sizeof(acpi_header_t) > phys_mapped_top) {
+        return NULL;
+    }
+    
+    const acpi_header_t* hdr = (const acpi_header_t*)(uintptr_t)addr;
+    if (hdr->length < sizeof(acpi_header_t) || addr + hdr->length > phys_mapped_top ||
+        !acpi_checksum_ok(hdr, hdr->length)) {
+        return NULL;
+    }
+    return hdr;
+}
+
+/**
+ * Check an RSDP candidate
+ */
+static int acpi_rsdp_valid(const acpi_rsdp_t* rsdp) {
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 ||
+        !acpi_checksum_ok(rsdp, ACPI_RSDP_V1_SIZE)) {
+        return 0;
+    }
+    if (rsdp->revision >= 2 &&
+        (rsdp->length < sizeof(acpi_rsdp_t) || !acpi_checksum_ok(rsdp, sizeof(acpi_rsdp_t)))) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Scan a BIOS memory range for the RSDP
+ */
+static const acpi_rsdp_t* acpi_scan_rsdp(uint64_t start, uint64_t end) {
+    for (uint64_t addr = ALIGN_UP(start, 16); addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)(uintptr_t)addr;
+        if (acpi_rsdp_valid(rsdp)) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the RSDP: the bootloader's copy, then the EBDA, then the BIOS ROM
+ */
+static const acpi_rsdp_t* acpi_find_rsdp(void) {
+    const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)multiboot_get_acpi_rsdp();
+    if (rsdp && acpi_rsdp_valid(rsdp)) {
+        return rsdp;
+    }
+    
+    /* The BIOS data area sits in page 0, which GCC assumes is never read */
+    const volatile uint16_t* ebda_seg = (const volatile uint16_t*)(uintptr_t)ACPI_EBDA_PTR;
+    __asm__("" : "+r"(ebda_seg));
+    uint64_t ebda = (uint64_t)*ebda_seg << 4;
+    if (ebda >= 0x80000 && ebda < ACPI_BIOS_START) {
+        rsdp = acpi_scan_rsdp(ebda, ebda + ACPI_EBDA_SEARCH_SIZE);
+        if (rsdp) {
+            return rsdp;
+        }
+    }
+    
+    return acpi_scan_rsdp(ACPI_BIOS_START, ACPI_BIOS_END);
+}
+
+/**
+ * Collect the enabled processors from the MADT
+ */
+static void acpi_parse_madt(const acpi_madt_t* madt) {
+    const uint8_t* p = (const uint8_t*)madt + sizeof(acpi_madt_t);
+    const uint8_t* end = (const uint8_t*)madt + madt->hdr.length;
+    
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        if (p[0] == ACPI_MADT_LAPIC && p[1] >= sizeof(acpi_madt_lapic_t)) {
+            const acpi_madt_lapic_t* lapic = (const acpi_madt_lapic_t*)p;
+            if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) && acpi_ncpus < ACPI_MAX_CPUS) {
+                acpi_cpus[acpi_ncpus++] = lapic->apic_id;
+            }
+        }
+        p += p[1];
+    }
+}
+
+/**
+ * Locate the ACPI tables
+ */
+int acpi_init(void) {
+    acpi_ncpus = 0;
+    acpi_root = NULL;
+    
+    acpi_rsdp = acpi_find_rsdp();
+    if (!acpi_rsdp) {
+        return -1;
+    }
+    
+    /* The XSDT supersedes the RSDT when both exist */
+    if (acpi_rsdp->revision >= 2 && acpi_rsdp->xsdt_addr) {
+        acpi_root = acpi_table_at(acpi_rsdp->xsdt_addr);
+        acpi_root_wide = 1;
+    }
+    if (!acpi_root) {
+        acpi_root = acpi_table_at(acpi_rsdp->rsdt_addr);
+        acpi_root_wide = 0;
+    }
+    if (!acpi_root) {
+        return -1;
+    }
+    
+    const acpi_madt_t* madt = (const acpi_madt_t*)acpi_find_table("APIC");
+    if (madt && madt->hdr.length >= sizeof(acpi_madt_t)) {
+        acpi_parse_madt(madt);
+    }
+    return 0;
+}
+
+/**
+ * Find a description table by signature
+ */
+const void* acpi_find_table(const char* signature) {
+    if (!acpi_root) {
+        return NULL;
+    }
+    
+    const uint8_t* entries = (const uint8_t*)acpi_root + sizeof(acpi_header_t);
+    uint32_t entry_size = acpi_root_wide ? 8 : 4;
+    uint32_t count = (acpi_root->length - sizeof(acpi_header_t)) / entry_size;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        /* Entries are only 4-byte aligned in the XSDT */
+        uint64_t addr = 0;
+        memcpy(&addr, entries + i * entry_size, entry_size);
+        
+        const acpi_header_t* hdr = acpi_table_at(addr);
+        if (hdr && memcmp(hdr->signature, signature, 4) == 0) {
+            return hdr;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the number of enabled processors
+ */
+int acpi_cpu_count(void) {
+    return acpi_ncpus;
+}
+
+/**
+ * Get the local APIC ID of an enabled processor
+ */
+uint32_t acpi_cpu_apic_id(int index) {
+    if (index < 0 || index >= acpi_ncpus) {
+        return 0;
+    }
+    return acpi_cpus[index];
+}
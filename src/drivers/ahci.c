@@ -0,0 +1,665 @@
+/**
+ * MiniOS - AHCI SATA Driver
+ * 
+ * Second backend for the block request queue, for SATA disks behind an
+ * AHCI host controller. The HBA fetches commands from a per-port command
+ * list of 32 slots, each pointing at a command table that holds the
+ * command FIS and a scatter/gather PRD table, and posts the drive's
+ * responses into a FIS receive area. All of these come from the PMM.
+ * 
+ * Drives with native command queuing get READ/WRITE FPDMA QUEUED on every
+ * slot the drive and HBA support (usually 32), so the block queue keeps up
+ * to that many commands in flight and the drive picks its own order;
+ * completions arrive as Set Device Bits FISes clearing PxSACT. Other
+ * drives use READ/WRITE DMA (EXT) one command at a time.
+ */
+
+#include "types.h"
+#include "ahci.h"
+#include "ata.h"
+#include "ports.h"
+#include "pci.h"
+#include "pmm.h"
+#include "idt.h"
+#include "string.h"
+#include "timer.h"
+#include "blk.h"
+
+/* HBA (generic host control) registers */
+#define HBA_CAP             0x00
+#define HBA_GHC             0x04
+#define HBA_IS              0x08
+#define HBA_PI              0x0C
+#define HBA_VS              0x10
+
+#define HBA_CAP_S64A        (1U << 31)      /* 64-bit addressing */
+#define HBA_CAP_SNCQ        (1U << 30)      /* Native command queuing */
+#define HBA_CAP_NCS(cap)    ((((cap) >> 8) & 0x1F) + 1)   /* Command slots */
+
+#define HBA_GHC_AE          (1U << 31)      /* AHCI enable */
+#define HBA_GHC_IE          (1U << 1)       /* Interrupt enable */
+
+/* Port registers (at 0x100 + port * 0x80) */
+#define PORT_BASE(port)     (0x100 + (port) * 0x80)
+#define PORT_CLB            0x00            /* Command list base */
+#define PORT_CLBU           0x04
+#define PORT_FB             0x08            /* FIS receive base */
+#define PORT_FBU            0x0C
+#define PORT_IS             0x10
+#define PORT_IE             0x14
+#define PORT_CMD            0x18
+#define PORT_TFD            0x20            /* Task file: status, error */
+#define PORT_SIG            0x24
+#define PORT_SSTS           0x28            /* SATA status */
+#define PORT_SCTL           0x2C            /* SATA control */
+#define PORT_SERR           0x30            /* SATA error */
+#define PORT_SACT           0x34            /* NCQ tags outstanding */
+#define PORT_CI             0x38            /* Command slots issued */
+
+#define PORT_CMD_ST         (1U << 0)       /* Start processing the list */
+#define PORT_CMD_SUD        (1U << 1)       /* Spin up device */
+#define PORT_CMD_POD        (1U << 2)       /* Power on device */
+#define PORT_CMD_FRE        (1U << 4)       /* FIS receive enable */
+#define PORT_CMD_FR         (1U << 14)      /* FIS receive running */
+#define PORT_CMD_CR         (1U << 15)      /* Command list running */
+
+#define PORT_IS_DHRS        (1U << 0)       /* D2H register FIS */
+#define PORT_IS_PSS         (1U << 1)       /* PIO setup FIS */
+#define PORT_IS_DSS         (1U << 2)       /* DMA setup FIS */
+#define PORT_IS_SDBS        (1U << 3)       /* Set device bits FIS (NCQ done) */
+#define PORT_IS_IFS         (1U << 27)      /* Interface fatal error */
+#define PORT_IS_HBDS        (1U << 28)      /* Host bus data error */
+#define PORT_IS_HBFS        (1U << 29)      /* Host bus fatal error */
+#define PORT_IS_TFES        (1U << 30)      /* Task file error */
+#define PORT_IS_ERROR       (PORT_IS_IFS | PORT_IS_HBDS | PORT_IS_HBFS | PORT_IS_TFES)
+
+#define PORT_TFD_ERR        0x01
+#define PORT_TFD_DRQ        0x08
+#define PORT_TFD_BSY        0x80
+
+#define PORT_SSTS_DET(s)    ((s) & 0x0F)
+#define PORT_SSTS_PRESENT   3               /* Device present, link up */
+#define PORT_SIG_ATA        0x00000101      /* Plain SATA disk (not ATAPI) */
+
+/* Host to device register FIS */
+#define FIS_TYPE_REG_H2D    0x27
+#define FIS_H2D_COMMAND     0x80            /* Command (not control) update */
+#define FIS_H2D_DWORDS      5
+#define FIS_DEVICE_LBA      0x40
+
+/* Commands */
+#define ATA_CMD_READ_DMA        0xC8
+#define ATA_CMD_WRITE_DMA       0xCA
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_IDENTIFY        0xEC
+
+/* Command header flags */
+#define AHCI_CMD_WRITE      (1U << 6)
+
+/* Scatter/gather limits: one PRD moves up to 4MB (an even byte count) */
+#define AHCI_PRDS           56
+#define AHCI_PRD_MAX        (4 * 1024 * 1024)
+#define AHCI_SLOTS          32
+#define AHCI_MAX_SEGMENTS   32
+#define AHCI_MAX_SECTORS    16384           /* 8MB: <= 34 PRDs for 32 segments */
+#define AHCI_LBA28_SECTORS  256
+
+/* Polled register waits (each iteration is an uncached MMIO read) */
+#define AHCI_SPIN           1000000
+
+/* Command header: one per slot in the command list */
+typedef struct {
+    uint16_t flags;             /* FIS length in dwords, write, ... */
+    uint16_t prdtl;             /* PRD entries */
+    volatile uint32_t prdbc;    /* Bytes transferred (written by the HBA) */
+    uint32_t ctba;              /* Command table (128-byte aligned) */
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} PACKED ahci_cmd_header_t;
+
+/* PRD entry */
+typedef struct {
+    uint32_t dba;               /* Data address (word aligned) */
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;               /* Byte count - 1 (bit 31: interrupt) */
+} PACKED ahci_prd_t;
+
+/* Command table: 1KB, so the 32 tables fill eight pages */
+typedef struct {
+    uint8_t cfis[64];           /* Command FIS */
+    uint8_t acmd[16];           /* ATAPI command */
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDS];
+} PACKED ahci_cmd_table_t;
+
+#define AHCI_TABLE_PAGES    ((AHCI_SLOTS * sizeof(ahci_cmd_table_t)) / PAGE_SIZE)
+
+/* Layout of the port page: command list, FIS receive area, IDENTIFY buffer */
+#define AHCI_FIS_OFFSET     1024
+#define AHCI_IDENT_OFFSET   2048
+
+/* Driver state */
+static volatile uint8_t* abar = NULL;
+static int ahci_port = -1;
+static int ahci_present = 0;
+static int hba_64bit = 0;
+static int ahci_ncq = 0;
+static uint8_t irq_line = 0;                /* 0 = no interrupt, poll */
+static ata_info_t ahci_info;
+
+static uint8_t* port_page = NULL;
+static ahci_cmd_header_t* cmd_list = NULL;
+static ahci_cmd_table_t* cmd_tables = NULL;
+
+static uint32_t slot_mask = 0;              /* Slots usable by commands */
+static uint32_t slots_busy = 0;             /* Slots issued and not reaped */
+static blk_request_t* slot_req[AHCI_SLOTS];
+static volatile uint32_t irq_port_status = 0;
+
+static ktimer_t poll_timer;
+static blk_device_t ahci_blk;
+
+/* Highest physical address covered by the boot identity map */
+extern uint64_t phys_mapped_top;
+
+static inline uint32_t hba_read(int reg) {
+    return *(volatile uint32_t*)(abar + reg);
+}
+
+static inline void hba_write(int reg, uint32_t value) {
+    *(volatile uint32_t*)(abar + reg) = value;
+}
+
+static inline uint32_t port_read(int reg) {
+    return hba_read(PORT_BASE(ahci_port) + reg);
+}
+
+static inline void port_write(int reg, uint32_t value) {
+    hba_write(PORT_BASE(ahci_port) + reg, value);
+}
+
+/**
+ * Spin until (reg & mask) == value
+ * @return 0 on success, -1 on timeout
+ */
+static int ahci_wait(int reg, uint32_t mask, uint32_t value) {
+    for (int i = 0; i < AHCI_SPIN; i++) {
+        if ((port_read(reg) & mask) == value) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check that the HBA can reach a buffer
+ */
+static int ahci_dma_ok(uint64_t addr, uint64_t bytes) {
+    return hba_64bit || addr + bytes <= 0x100000000ULL;
+}
+
+/**
+ * Stop command processing and FIS receive on the port
+ */
+static int ahci_port_stop(void) {
+    port_write(PORT_CMD, port_read(PORT_CMD) & ~PORT_CMD_ST);
+    if (ahci_wait(PORT_CMD, PORT_CMD_CR, 0) < 0) {
+        return -1;
+    }
+    
+    port_write(PORT_CMD, port_read(PORT_CMD) & ~PORT_CMD_FRE);
+    return ahci_wait(PORT_CMD, PORT_CMD_FR, 0);
+}
+
+/**
+ * Point the port at our memory and start it
+ */
+static int ahci_port_start(void) {
+    uint64_t clb = (uintptr_t)cmd_list;
+    uint64_t fb = (uintptr_t)(port_page + AHCI_FIS_OFFSET);
+    
+    port_write(PORT_CLB, (uint32_t)clb);
+    port_write(PORT_CLBU, (uint32_t)(clb >> 32));
+    port_write(PORT_FB, (uint32_t)fb);
+    port_write(PORT_FBU, (uint32_t)(fb >> 32));
+    
+    /* Clear stale errors and interrupts (write 1 to clear) */
+    port_write(PORT_SERR, 0xFFFFFFFF);
+    port_write(PORT_IS, 0xFFFFFFFF);
+    
+    port_write(PORT_CMD, port_read(PORT_CMD) | PORT_CMD_FRE | PORT_CMD_SUD | PORT_CMD_POD);
+    
+    /* The HBA may only start once the drive is idle */
+    if (ahci_wait(PORT_TFD, PORT_TFD_BSY | PORT_TFD_DRQ, 0) < 0) {
+        return -1;
+    }
+    port_write(PORT_CMD, port_read(PORT_CMD) | PORT_CMD_ST);
+    return 0;
+}
+
+/**
+ * Reset the link (COMRESET) when the drive is stuck busy
+ */
+static void ahci_port_reset(void) {
+    uint32_t sctl = port_read(PORT_SCTL) & ~0x0FU;
+    
+    /* DET = 1 for at least 1ms sends COMRESET */
+    port_write(PORT_SCTL, sctl | 1);
+    for (int i = 0; i < 2000; i++) {
+        io_wait();
+    }
+    port_write(PORT_SCTL, sctl);
+    
+    ahci_wait(PORT_SSTS, 0x0F, PORT_SSTS_PRESENT);
+    port_write(PORT_SERR, 0xFFFFFFFF);
+}
+
+/**
+ * Fill in a host to device register FIS
+ */
+static void ahci_build_fis(uint8_t* fis, uint8_t command, uint64_t lba,
+                           uint32_t count, int tag) {
+    memset(fis, 0, FIS_H2D_DWORDS * 4);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = FIS_H2D_COMMAND;
+    fis[2] = command;
+    
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = FIS_DEVICE_LBA;
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    
+    if (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+        /* Queued commands carry the count in FEATURES and the tag in COUNT */
+        fis[3] = (uint8_t)count;
+        fis[11] = (uint8_t)(count >> 8);
+        fis[12] = (uint8_t)(tag << 3);
+    } else {
+        if (command == ATA_CMD_READ_DMA || command == ATA_CMD_WRITE_DMA) {
+            fis[7] |= (lba >> 24) & 0x0F;   /* LBA28: bits 27:24 in DEVICE */
+        }
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+    }
+}
+
+/**
+ * Describe the buffers of a merged chain in a command table
+ * @return PRD entries used, or -1 if the buffers can't be described
+ */
+static int ahci_build_prdt(ahci_cmd_table_t* table, blk_request_t* req) {
+    int n = 0;
+    
+    for (blk_request_t* seg = req; seg; seg = seg->merge_next) {
+        uint64_t addr = (uintptr_t)seg->buffer;
+        uint32_t bytes = seg->count * BLK_SECTOR_SIZE;
+        
+        if ((addr & 1) || !ahci_dma_ok(addr, bytes)) {
+            return -1;
+        }
+        
+        while (bytes) {
+            uint32_t len = bytes < AHCI_PRD_MAX ? bytes : AHCI_PRD_MAX;
+            if (n == AHCI_PRDS) {
+                return -1;
+            }
+            table->prdt[n].dba = (uint32_t)addr;
+            table->prdt[n].dbau = (uint32_t)(addr >> 32);
+            table->prdt[n].reserved = 0;
+            table->prdt[n].dbc = len - 1;
+            n++;
+            addr += len;
+            bytes -= len;
+        }
+    }
+    return n;
+}
+
+/**
+ * Issue IDENTIFY DEVICE in slot 0 and wait for it (interrupts still off)
+ */
+static int ahci_identify(void) {
+    uint16_t* id = (uint16_t*)(port_page + AHCI_IDENT_OFFSET);
+    ahci_cmd_table_t* table = &cmd_tables[0];
+    
+    ahci_build_fis(table->cfis, ATA_CMD_IDENTIFY, 0, 0, 0);
+    table->cfis[7] = 0;
+    table->prdt[0].dba = (uint32_t)(uintptr_t)id;
+    table->prdt[0].dbau = (uint32_t)((uintptr_t)id >> 32);
+    table->prdt[0].reserved = 0;
+    table->prdt[0].dbc = ATA_SECTOR_SIZE - 1;
+    
+    cmd_list[0].flags = FIS_H2D_DWORDS;
+    cmd_list[0].prdtl = 1;
+    cmd_list[0].prdbc = 0;
+    
+    port_write(PORT_CI, 1);
+    for (int i = 0; i < AHCI_SPIN; i++) {
+        if (port_read(PORT_IS) & PORT_IS_TFES) {
+            return -1;
+        }
+        if (!(port_read(PORT_CI) & 1)) {
+            if (port_read(PORT_TFD) & PORT_TFD_ERR) {
+                return -1;
+            }
+            ata_parse_identify(id, &ahci_info);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * End every reaped slot's command
+ */
+static void ahci_complete(void) {
+    uint32_t done = slots_busy & ~(port_read(PORT_SACT) | port_read(PORT_CI));
+    
+    while (done) {
+        int tag = __builtin_ctz(done);
+        blk_request_t* req = slot_req[tag];
+        done &= done - 1;
+        
+        slots_busy &= ~(1U << tag);
+        slot_req[tag] = NULL;
+        blk_end_request(req, 0);
+    }
+}
+
+/**
+ * Restart the port after an error and fail everything in flight
+ * (a queued command error aborts all outstanding NCQ commands)
+ */
+static void ahci_recover(void) {
+    if (ahci_port_stop() < 0 ||
+        (port_read(PORT_TFD) & (PORT_TFD_BSY | PORT_TFD_DRQ))) {
+        ahci_port_reset();
+    }
+    ahci_port_start();
+    
+    uint32_t busy = slots_busy;
+    slots_busy = 0;
+    while (busy) {
+        int tag = __builtin_ctz(busy);
+        blk_request_t* req = slot_req[tag];
+        busy &= busy - 1;
+        
+        slot_req[tag] = NULL;
+        blk_end_request(req, -1);
+    }
+}
+
+/**
+ * Port interrupt (the PCI line may be shared)
+ */
+static void ahci_interrupt_handler(void) {
+    if (!(hba_read(HBA_IS) & (1U << ahci_port))) {
+        return;     /* Another device on the line */
+    }
+    
+    /* Clear the port's status before its bit in the HBA summary */
+    uint32_t status = port_read(PORT_IS);
+    port_write(PORT_IS, status);
+    hba_write(HBA_IS, 1U << ahci_port);
+    
+    __atomic_or_fetch(&irq_port_status, status, __ATOMIC_RELAXED);
+    blk_interrupt();
+}
+
+/**
+ * No interrupt line: look at the slots every tick while commands are out
+ */
+static void ahci_poll(void* arg) {
+    (void)arg;
+    blk_interrupt();
+}
+
+/**
+ * Block queue: issue a command for a merged chain in a free slot
+ */
+static int ahci_blk_start(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    
+    /* The queue depth keeps the block layer within the slots */
+    uint32_t free = slot_mask & ~slots_busy;
+    if (!free) {
+        return -1;
+    }
+    int tag = __builtin_ctz(free);
+    ahci_cmd_table_t* table = &cmd_tables[tag];
+    
+    int n = ahci_build_prdt(table, req);
+    if (n < 0) {
+        return -1;
+    }
+    
+    uint8_t command;
+    if (ahci_ncq) {
+        command = req->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    } else if (ahci_info.lba48) {
+        command = req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    } else {
+        command = req->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+    ahci_build_fis(table->cfis, command, req->lba, req->total, tag);
+    
+    cmd_list[tag].flags = FIS_H2D_DWORDS | (req->write ? AHCI_CMD_WRITE : 0);
+    cmd_list[tag].prdtl = (uint16_t)n;
+    cmd_list[tag].prdbc = 0;
+    
+    slot_req[tag] = req;
+    slots_busy |= 1U << tag;
+    
+    /* Tables must be in memory before the HBA sees the slot */
+    __asm__ volatile("" ::: "memory");
+    if (ahci_ncq) {
+        port_write(PORT_SACT, 1U << tag);
+    }
+    port_write(PORT_CI, 1U << tag);
+    
+    if (!irq_line && !ktimer_pending(&poll_timer)) {
+        ktimer_arm(&poll_timer, 1);
+    }
+    return BLK_PENDING;
+}
+
+/**
+ * Block queue: reap the slots the drive has finished
+ */
+static void ahci_blk_service(blk_device_t* dev) {
+    (void)dev;
+    
+    /* Without an IRQ nothing latched the status: collect it here */
+    uint32_t status = __atomic_exchange_n(&irq_port_status, 0, __ATOMIC_RELAXED);
+    if (!irq_line) {
+        status |= port_read(PORT_IS);
+        port_write(PORT_IS, status);
+    }
+    
+    if (status & PORT_IS_ERROR) {
+        ahci_recover();
+        return;
+    }
+    
+    ahci_complete();
+    if (slots_busy && !irq_line) {
+        ktimer_arm(&poll_timer, 1);
+    }
+}
+
+/**
+ * Block queue: a command got no answer in time
+ */
+static void ahci_blk_timeout(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    
+    /* A lost interrupt leaves the command finished but unreaped */
+    ahci_complete();
+    for (int tag = 0; tag < AHCI_SLOTS; tag++) {
+        if (slot_req[tag] == req) {
+            ahci_recover();
+            return;
+        }
+    }
+}
+
+/**
+ * Find the first port with a SATA disk attached
+ */
+static int ahci_find_port(void) {
+    uint32_t implemented = hba_read(HBA_PI);
+    
+    for (int port = 0; port < 32; port++) {
+        if (!(implemented & (1U << port))) {
+            continue;
+        }
+        uint32_t ssts = hba_read(PORT_BASE(port) + PORT_SSTS);
+        uint32_t sig = hba_read(PORT_BASE(port) + PORT_SIG);
+        if (PORT_SSTS_DET(ssts) == PORT_SSTS_PRESENT && sig == PORT_SIG_ATA) {
+            return port;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocate the command list, FIS receive area and command tables
+ */
+static int ahci_alloc(void) {
+    port_page = (uint8_t*)pmm_alloc_page();
+    cmd_tables = (ahci_cmd_table_t*)pmm_alloc_pages(AHCI_TABLE_PAGES);
+    
+    if (!port_page || !cmd_tables ||
+        !ahci_dma_ok((uintptr_t)port_page, PAGE_SIZE) ||
+        !ahci_dma_ok((uintptr_t)cmd_tables, AHCI_TABLE_PAGES * PAGE_SIZE)) {
+        if (port_page) pmm_free_page(port_page);
+        if (cmd_tables) pmm_free_pages(cmd_tables, AHCI_TABLE_PAGES);
+        port_page = NULL;
+        cmd_tables = NULL;
+        return -1;
+    }
+    
+    memset(port_page, 0, PAGE_SIZE);
+    memset(cmd_tables, 0, AHCI_TABLE_PAGES * PAGE_SIZE);
+    cmd_list = (ahci_cmd_header_t*)port_page;
+    
+    for (int tag = 0; tag < AHCI_SLOTS; tag++) {
+        uint64_t ctba = (uintptr_t)&cmd_tables[tag];
+        cmd_list[tag].ctba = (uint32_t)ctba;
+        cmd_list[tag].ctbau = (uint32_t)(ctba >> 32);
+    }
+    return 0;
+}
+
+/**
+ * Release the port memory after a failed probe
+ */
+static void ahci_free(void) {
+    pmm_free_page(port_page);
+    pmm_free_pages(cmd_tables, AHCI_TABLE_PAGES);
+    port_page = NULL;
+    cmd_tables = NULL;
+    cmd_list = NULL;
+}
+
+/**
+ * Initialize the AHCI driver
+ */
+void ahci_init(void) {
+    pci_device_t dev;
+    ahci_present = 0;
+    
+    /* Mass storage controller, SATA subclass (prog_if 1 is AHCI) */
+    if (!pci_find_class(0x01, 0x06, &dev) || dev.prog_if != 0x01) {
+        return;
+    }
+    
+    /* BAR5 (ABAR) holds the HBA registers */
+    uint64_t base = pci_bar_address(&dev, 5);
+    if (base == 0 || base + PORT_BASE(32) > phys_mapped_top) {
+        return;
+    }
+    pci_enable_mmio(&dev);
+    pci_enable_bus_master(&dev);
+    abar = (volatile uint8_t*)(uintptr_t)base;
+    
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | HBA_GHC_AE);
+    uint32_t cap = hba_read(HBA_CAP);
+    hba_64bit = (cap & HBA_CAP_S64A) != 0;
+    
+    ahci_port = ahci_find_port();
+    if (ahci_port < 0 || ahci_alloc() < 0) {
+        return;
+    }
+    
+    /* Identify with the port's interrupts off */
+    port_write(PORT_IE, 0);
+    if (ahci_port_stop() < 0 || ahci_port_start() < 0 || ahci_identify() < 0) {
+        ahci_port_stop();
+        ahci_free();
+        return;
+    }
+    
+    /* Queue on as many tags as both the drive and the HBA have */
+    uint32_t slots = HBA_CAP_NCS(cap);
+    ahci_ncq = (cap & HBA_CAP_SNCQ) && ahci_info.ncq;
+    if (ahci_ncq && ahci_info.queue_depth < slots) {
+        slots = ahci_info.queue_depth;
+    }
+    slot_mask = slots >= 32 ? 0xFFFFFFFF : (1U << slots) - 1;
+    
+    ktimer_init(&poll_timer, ahci_poll, NULL);
+    port_write(PORT_IS, 0xFFFFFFFF);
+    hba_write(HBA_IS, 1U << ahci_port);
+    
+    /* Route the controller's PCI interrupt line through the PIC */
+    if (dev.irq_line > 0 && dev.irq_line < 16 && dev.irq_line != 2 &&
+        idt_share_handler(IRQ_BASE + dev.irq_line, ahci_interrupt_handler) == 0) {
+        irq_line = dev.irq_line;
+        port_write(PORT_IE, PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS |
+                            PORT_IS_SDBS | PORT_IS_ERROR);
+        hba_write(HBA_GHC, hba_read(HBA_GHC) | HBA_GHC_IE);
+        pic_unmask_irq(irq_line);
+    }
+    
+    ahci_blk.name = "ahci";
+    ahci_blk.sectors = ahci_info.sectors;
+    ahci_blk.max_sectors = ahci_info.lba48 ? AHCI_MAX_SECTORS : AHCI_LBA28_SECTORS;
+    ahci_blk.max_segments = AHCI_MAX_SEGMENTS;
+    ahci_blk.queue_depth = ahci_ncq ? slots : 1;
+    ahci_blk.start = ahci_blk_start;
+    ahci_blk.service = ahci_blk_service;
+    ahci_blk.timeout = ahci_blk_timeout;
+    ahci_blk.priv = NULL;
+    if (blk_register(&ahci_blk) == 0) {
+        ahci_present = 1;
+    }
+}
+
+/**
+ * Check if a SATA disk is attached
+ */
+int ahci_is_present(void) {
+    return ahci_present;
+}
+
+/**
+ * Check if commands are queued with NCQ
+ */
+int ahci_ncq_enabled(void) {
+    return ahci_present && ahci_ncq;
+}
+
+/**
+ * Get the disk's IDENTIFY parameters
+ */
+const ata_info_t* ahci_get_info(void) {
+    return ahci_present ? &ahci_info : NULL;
+}
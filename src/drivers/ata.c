@@ -1,12 +1,23 @@
 /**
  * MiniOS - ATA/IDE Disk Driver
  * 
- * PIO mode driver for ATA hard drives.
+ * Driver for ATA hard drives, serving the block request queue. Transfers
+ * use bus-master DMA when the IDE controller supports it: the sectors move
+ * straight between the disk and memory described by a PRD table, and the
+ * channel interrupt reports completion. PIO (one port access per word)
+ * remains the fallback; it is interrupt driven too, one DRQ block per
+ * interrupt, and only polls if the channel's IRQ turns out not to work.
  */
 
 #include "types.h"
 #include "ata.h"
 #include "ports.h"
+#include "pci.h"
+#include "pmm.h"
+#include "idt.h"
+#include "string.h"
+#include "blk.h"
+#include "timer.h"
 
 /* ATA I/O port base addresses */
 #define ATA_PRIMARY_IO      0x1F0
@@ -28,7 +39,18 @@
 
 /* ATA commands */
 #define ATA_CMD_READ_PIO    0x20
+#define ATA_CMD_READ_PIO_EXT    0x24
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_READ_MULTIPLE_EXT   0x29
 #define ATA_CMD_WRITE_PIO   0x30
+#define ATA_CMD_WRITE_PIO_EXT   0x34
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT  0x39
+#define ATA_CMD_READ_MULTIPLE   0xC4
+#define ATA_CMD_WRITE_MULTIPLE  0xC5
+#define ATA_CMD_SET_MULTIPLE    0xC6
+#define ATA_CMD_READ_DMA    0xC8
+#define ATA_CMD_WRITE_DMA   0xCA
 #define ATA_CMD_IDENTIFY    0xEC
 
 /* ATA status bits */
@@ -41,26 +63,94 @@
 #define ATA_SR_IDX          0x02    /* Index */
 #define ATA_SR_ERR          0x01    /* Error */
 
+/* Largest sector count per command */
+#define ATA_LBA28_SECTORS   256
+#define ATA_LBA48_SECTORS   65536
+#define ATA_LBA28_LIMIT     0x10000000ULL   /* First LBA that needs LBA48 */
+
+/* How long polled status waits give the drive */
+#define ATA_WAIT_NS         (100 * NS_PER_MS)
+
 /* Drive selection */
 #define ATA_DRIVE_MASTER    0xE0
 #define ATA_DRIVE_SLAVE     0xF0
 
+/* Bus-master IDE registers (offsets from the channel's BAR4 block) */
+#define BM_REG_COMMAND      0x00
+#define BM_REG_STATUS       0x02
+#define BM_REG_PRDT         0x04
+#define BM_SECONDARY        0x08    /* Secondary channel block offset */
+
+#define BM_CMD_START        0x01
+#define BM_CMD_READ         0x08    /* Device to memory */
+
+#define BM_SR_ACTIVE        0x01
+#define BM_SR_ERR           0x02
+#define BM_SR_IRQ           0x04
+
+/* Physical Region Descriptor: one contiguous piece of a DMA transfer */
+typedef struct {
+    uint32_t addr;              /* Physical address (word aligned) */
+    uint16_t bytes;             /* Byte count, 0 means 64KB */
+    uint16_t flags;             /* PRD_EOT on the last entry */
+} PACKED ata_prd_t;
+
+#define PRD_EOT             0x8000
+#define PRD_BOUNDARY        0x10000     /* A region may not cross 64KB */
+#define PRD_MAX             (PAGE_SIZE / sizeof(ata_prd_t))
+
+/* Bounce buffer for callers whose memory the controller can't reach */
+#define ATA_BOUNCE_SECTORS  256
+#define ATA_BOUNCE_PAGES    (ATA_BOUNCE_SECTORS * ATA_SECTOR_SIZE / PAGE_SIZE)
+
+/* Buffers per merged command, and the largest command the PRD table can
+ * then always describe (each buffer may need one entry beyond its size) */
+#define ATA_MAX_SEGMENTS    32
+#define ATA_DMA_MAX_SECTORS ((PRD_MAX - ATA_MAX_SEGMENTS) * PRD_BOUNDARY / ATA_SECTOR_SIZE)
+
+/* How a command in flight moves its data */
+#define ATA_XFER_DMA        0
+#define ATA_XFER_PIO        1
+
 /* Current I/O base and control base */
 static uint16_t ata_io_base = ATA_PRIMARY_IO;
 static uint16_t ata_ctrl_base = ATA_PRIMARY_CTRL;
 static int ata_drive_present = 0;
+static ata_info_t ata_info;
+
+/* Bus-master DMA state (bm_base == 0: PIO only) */
+static uint16_t bm_base = 0;
+static ata_prd_t* prd_table = NULL;
+static uint8_t* bounce_buffer = NULL;
+
+/* No working channel interrupt: PIO commands complete by polling */
+static int ata_polled = 0;
+
+/* Status latched by the interrupt handler */
+static volatile uint8_t irq_status = 0;
+static volatile uint8_t irq_bm_status = 0;
+
+/* Command in flight */
+static int xfer_mode = ATA_XFER_PIO;
+static int xfer_bounce = 0;             /* DMA through the bounce buffer */
+static blk_request_t* xfer_req = NULL;  /* Command in flight */
+static blk_request_t* xfer_seg = NULL;  /* PIO: current buffer of the chain */
+static uint32_t xfer_offset = 0;        /* PIO: bytes done in xfer_seg */
+static uint32_t xfer_left = 0;          /* PIO: sectors still to move */
+
+static blk_device_t ata_blk;
 
 /**
  * Wait for drive to be ready (not busy)
  */
 static int ata_wait_ready(void) {
-    int timeout = 100000;
-    while (timeout--) {
+    uint64_t deadline = ktime_ns() + ATA_WAIT_NS;
+    do {
         uint8_t status = inb(ata_io_base + ATA_REG_STATUS);
         if (!(status & ATA_SR_BSY)) {
             return 0;
         }
-    }
+    } while (ktime_ns() < deadline);
     return -1;  /* Timeout */
 }
 
@@ -68,8 +158,8 @@ static int ata_wait_ready(void) {
  * Wait for data request
  */
 static int ata_wait_drq(void) {
-    int timeout = 100000;
-    while (timeout--) {
+    uint64_t deadline = ktime_ns() + ATA_WAIT_NS;
+    do {
         uint8_t status = inb(ata_io_base + ATA_REG_STATUS);
         if (status & ATA_SR_ERR) {
             return -1;  /* Error */
@@ -77,7 +167,7 @@ static int ata_wait_drq(void) {
         if (status & ATA_SR_DRQ) {
             return 0;   /* Data ready */
         }
-    }
+    } while (ktime_ns() < deadline);
     return -1;  /* Timeout */
 }
 
@@ -85,13 +175,66 @@ static int ata_wait_drq(void) {
  * Software reset the ATA bus
  */
 static void ata_soft_reset(void) {
-    outb(ata_ctrl_base, 0x04);  /* Set SRST bit */
-    io_wait();
-    io_wait();
-    io_wait();
-    io_wait();
+    outb(ata_ctrl_base, 0x04);  /* Set SRST bit (held at least 5us) */
+    udelay(5);
     outb(ata_ctrl_base, 0x00);  /* Clear SRST bit */
-    io_wait();
+    udelay(2000);               /* Drives may not show BSY for 2ms */
+}
+
+/**
+ * Copy an IDENTIFY string (two characters per word, high byte first)
+ */
+static void ata_copy_string(char* dest, const uint16_t* words, int count) {
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        dest[len++] = (char)(words[i] >> 8);
+        dest[len++] = (char)(words[i] & 0xFF);
+    }
+    
+    /* Strings are padded with spaces */
+    while (len > 0 && dest[len - 1] == ' ') {
+        len--;
+    }
+    dest[len] = '\0';
+}
+
+/**
+ * Pull capacity, command set and transfer modes out of IDENTIFY data
+ */
+void ata_parse_identify(const uint16_t* id, ata_info_t* info) {
+    memset(info, 0, sizeof(*info));
+    ata_copy_string(info->model, &id[27], 20);
+    
+    /* Word 83 bit 10: 48-bit address feature set; words 100-103 hold the
+     * LBA48 capacity, words 60-61 the 28-bit one */
+    info->lba48 = (id[83] & (1 << 10)) != 0;
+    if (info->lba48) {
+        info->sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                        ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    }
+    if (info->sectors == 0) {
+        info->sectors = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+        info->lba48 = 0;
+    }
+    
+    /* Word 47 bits 7:0: most sectors per DRQ block with READ/WRITE MULTIPLE */
+    info->multiple_max = id[47] & 0xFF;
+    
+    /* Word 49 bit 8: DMA; word 63: multiword DMA modes; word 88 (valid if
+     * word 53 bit 2): Ultra DMA modes supported (low byte) and selected (high) */
+    info->dma = (id[49] & (1 << 8)) != 0;
+    info->mwdma_modes = id[63] & 0x07;
+    if (id[53] & (1 << 2)) {
+        info->udma_modes = id[88] & 0x7F;
+        info->udma_active = (id[88] >> 8) & 0x7F;
+    }
+    
+    /* Word 76 bit 8 (SATA capabilities): native command queuing; word 75
+     * bits 4:0: queue depth minus one. 0x0000/0xFFFF mean not reported */
+    if (id[76] != 0 && id[76] != 0xFFFF && (id[76] & (1 << 8))) {
+        info->ncq = 1;
+        info->queue_depth = (id[75] & 0x1F) + 1;
+    }
 }
 
 /**
@@ -130,19 +273,8 @@ static int ata_identify(void) {
     }
     
     /* Wait for DRQ or ERR */
-    int timeout = 100000;
-    while (timeout--) {
-        status = inb(ata_io_base + ATA_REG_STATUS);
-        if (status & ATA_SR_ERR) {
-            return 0;  /* Error */
-        }
-        if (status & ATA_SR_DRQ) {
-            break;
-        }
-    }
-    
-    if (timeout <= 0) {
-        return 0;  /* Timeout */
+    if (ata_wait_drq() < 0) {
+        return 0;  /* Error or timeout */
     }
     
     /* Read identify data (256 words) */
@@ -151,146 +283,475 @@ static int ata_identify(void) {
         identify_data[i] = inw(ata_io_base + ATA_REG_DATA);
     }
     
-    /* Identify data received - drive exists */
-    (void)identify_data;  /* Not used for now */
+    ata_parse_identify(identify_data, &ata_info);
     return 1;
 }
 
 /**
- * Initialize ATA driver
+ * Turn on READ/WRITE MULTIPLE with the drive's largest block size
  */
-void ata_init(void) {
-    ata_drive_present = 0;
-    
-    /* Try primary master */
-    ata_io_base = ATA_PRIMARY_IO;
-    ata_ctrl_base = ATA_PRIMARY_CTRL;
-    
-    /* Check if controller exists */
-    uint8_t status = inb(ata_io_base + ATA_REG_STATUS);
-    if (status == 0xFF) {
-        /* No controller on primary bus, try secondary */
-        ata_io_base = ATA_SECONDARY_IO;
-        ata_ctrl_base = ATA_SECONDARY_CTRL;
-        status = inb(ata_io_base + ATA_REG_STATUS);
-        if (status == 0xFF) {
-            return;  /* No ATA controller found */
-        }
+static void ata_set_multiple(void) {
+    if (ata_info.multiple_max == 0 || ata_wait_ready() < 0) {
+        return;
     }
     
-    /* Soft reset */
-    ata_soft_reset();
+    outb(ata_io_base + ATA_REG_DRIVE, ATA_DRIVE_MASTER);
+    io_wait();
+    outb(ata_io_base + ATA_REG_SECCOUNT, (uint8_t)ata_info.multiple_max);
+    outb(ata_io_base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
     
-    /* Try to identify drive */
-    if (ata_identify()) {
-        ata_drive_present = 1;
+    if (ata_wait_ready() < 0 || (inb(ata_io_base + ATA_REG_STATUS) & ATA_SR_ERR)) {
+        return;     /* Aborted: stay with one sector per DRQ */
     }
+    ata_info.multiple = ata_info.multiple_max;
 }
 
 /**
- * Check if drive is present
+ * Channel interrupt: latch the status, acknowledge, and leave the rest to
+ * the block softirq
  */
-int ata_is_present(void) {
-    return ata_drive_present;
+static void ata_interrupt_handler(void) {
+    if (bm_base) {
+        uint8_t status = inb(bm_base + BM_REG_STATUS);
+        if (status & BM_SR_IRQ) {
+            irq_bm_status = status;
+            outb(bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+        }
+    }
+    
+    /* Reading the status register clears the drive's interrupt */
+    irq_status = inb(ata_io_base + ATA_REG_STATUS);
+    blk_interrupt();
 }
 
 /**
- * Read sectors from disk (PIO mode)
+ * Set up bus-master DMA on the IDE controller, if there is one
  */
-int ata_read_sectors(uint32_t lba, uint8_t count, void* buffer) {
-    if (!ata_drive_present) {
-        return -1;
+static void ata_dma_init(void) {
+    pci_device_t dev;
+    
+    /* Mass storage controller, IDE subclass */
+    if (!pci_find_class(0x01, 0x01, &dev)) {
+        return;
     }
     
-    if (count == 0) {
-        count = 1;  /* Treat 0 as 256 would be confusing, use 1 */
+    /* prog_if bit 7: bus mastering; bits 0/2: channel in native PCI mode,
+     * which would move its ports and IRQ away from the legacy ones used here */
+    int secondary = (ata_io_base == ATA_SECONDARY_IO);
+    if (!(dev.prog_if & 0x80) || (dev.prog_if & (secondary ? 0x04 : 0x01))) {
+        return;
     }
     
-    /* Wait for drive to be ready */
-    if (ata_wait_ready() < 0) {
+    /* BAR4 is an I/O BAR holding both channels' registers */
+    if (!(dev.bar[4] & 1)) {
+        return;
+    }
+    uint16_t base = (uint16_t)(dev.bar[4] & ~3U) + (secondary ? BM_SECONDARY : 0);
+    
+    /* The controller takes 32-bit addresses */
+    prd_table = (ata_prd_t*)pmm_alloc_page();
+    bounce_buffer = (uint8_t*)pmm_alloc_pages(ATA_BOUNCE_PAGES);
+    if (!prd_table || !bounce_buffer ||
+        (uintptr_t)prd_table + PAGE_SIZE > 0x100000000ULL ||
+        (uintptr_t)bounce_buffer + ATA_BOUNCE_PAGES * PAGE_SIZE > 0x100000000ULL) {
+        if (prd_table) pmm_free_page(prd_table);
+        if (bounce_buffer) pmm_free_pages(bounce_buffer, ATA_BOUNCE_PAGES);
+        prd_table = NULL;
+        bounce_buffer = NULL;
+        return;
+    }
+    
+    pci_enable_bus_master(&dev);
+    
+    /* Stop the engine and clear stale status */
+    outb(base + BM_REG_COMMAND, 0);
+    outb(base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+    
+    bm_base = base;
+}
+
+/**
+ * Append PRD entries for one buffer, split at 64KB boundaries
+ * @return New entry count, or -1 if the controller can't reach the buffer
+ */
+static int ata_prd_add(int n, void* buffer, uint32_t bytes) {
+    uintptr_t addr = (uintptr_t)buffer;
+    
+    if ((addr & 1) || addr + bytes > 0x100000000ULL) {
         return -1;
     }
     
-    /* Select drive with LBA mode */
-    outb(ata_io_base + ATA_REG_DRIVE, ATA_DRIVE_MASTER | 0x40 | ((lba >> 24) & 0x0F));
-    io_wait();
+    while (bytes) {
+        uint32_t chunk = PRD_BOUNDARY - (addr & (PRD_BOUNDARY - 1));
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        if (n == (int)PRD_MAX) {
+            return -1;
+        }
+        prd_table[n].addr = (uint32_t)addr;
+        prd_table[n].bytes = (uint16_t)chunk;   /* 64KB wraps to 0 */
+        prd_table[n].flags = 0;
+        addr += chunk;
+        bytes -= chunk;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Describe every buffer of a merged chain in the PRD table
+ * @return 0 on success, -1 if some buffer can't be reached
+ */
+static int ata_build_prdt(blk_request_t* req) {
+    int n = 0;
+    for (; req && n >= 0; req = req->merge_next) {
+        n = ata_prd_add(n, req->buffer, req->count * ATA_SECTOR_SIZE);
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    prd_table[n - 1].flags = PRD_EOT;
+    return 0;
+}
+
+/**
+ * Copy between a chain's buffers and the bounce buffer
+ */
+static void ata_bounce_copy(blk_request_t* req, int to_bounce) {
+    uint8_t* bounce = bounce_buffer;
+    for (; req; req = req->merge_next) {
+        uint32_t bytes = req->count * ATA_SECTOR_SIZE;
+        if (to_bounce) {
+            memcpy(bounce, req->buffer, bytes);
+        } else {
+            memcpy(req->buffer, bounce, bytes);
+        }
+        bounce += bytes;
+    }
+}
+
+/**
+ * Load the task file for a command starting at 'lba'
+ * 'count' is at most 256 (LBA28) or 65536 (LBA48); the largest is encoded as 0.
+ */
+static void ata_setup_command(uint64_t lba, uint32_t count, int ext) {
+    if (ext) {
+        outb(ata_io_base + ATA_REG_DRIVE, ATA_DRIVE_MASTER);
+        io_wait();
+        
+        /* Each register is a two-deep FIFO: high-order bytes go first */
+        outb(ata_io_base + ATA_REG_SECCOUNT, (count >> 8) & 0xFF);
+        outb(ata_io_base + ATA_REG_LBA_LO, (lba >> 24) & 0xFF);
+        outb(ata_io_base + ATA_REG_LBA_MID, (lba >> 32) & 0xFF);
+        outb(ata_io_base + ATA_REG_LBA_HI, (lba >> 40) & 0xFF);
+    } else {
+        /* Select drive with LBA mode */
+        outb(ata_io_base + ATA_REG_DRIVE, ATA_DRIVE_MASTER | 0x40 | ((lba >> 24) & 0x0F));
+        io_wait();
+    }
     
     /* Set sector count and LBA */
-    outb(ata_io_base + ATA_REG_SECCOUNT, count);
+    outb(ata_io_base + ATA_REG_SECCOUNT, count & 0xFF);
     outb(ata_io_base + ATA_REG_LBA_LO, lba & 0xFF);
     outb(ata_io_base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
     outb(ata_io_base + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
+}
+
+/**
+ * Start a READ DMA / WRITE DMA command for a chain
+ * @return 0 if started, -1 if the chain has to go by PIO instead
+ */
+static int ata_dma_start(blk_request_t* req, int ext) {
+    xfer_bounce = 0;
+    if (ata_build_prdt(req) < 0) {
+        /* Memory the controller can't reach goes through the bounce buffer */
+        if (req->total > ATA_BOUNCE_SECTORS) {
+            return -1;
+        }
+        xfer_bounce = 1;
+        if (req->write) {
+            ata_bounce_copy(req, 1);
+        }
+        int n = ata_prd_add(0, bounce_buffer, req->total * ATA_SECTOR_SIZE);
+        prd_table[n - 1].flags = PRD_EOT;
+    }
     
-    /* Send READ command */
-    outb(ata_io_base + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
+    /* Program the bus master: table, direction, clear status */
+    uint8_t dir = req->write ? 0 : BM_CMD_READ;
+    outl(bm_base + BM_REG_PRDT, (uint32_t)(uintptr_t)prd_table);
+    outb(bm_base + BM_REG_COMMAND, dir);
+    outb(bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+    irq_bm_status = 0;
     
-    /* Read sectors */
-    uint16_t* buf = (uint16_t*)buffer;
-    for (int sector = 0; sector < count; sector++) {
-        /* Wait for data */
-        if (ata_wait_drq() < 0) {
-            return -1;
+    ata_setup_command(req->lba, req->total, ext);
+    
+    uint8_t command = req->write ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                                 : (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    outb(ata_io_base + ATA_REG_COMMAND, command);
+    outb(bm_base + BM_REG_COMMAND, dir | BM_CMD_START);
+    
+    xfer_mode = ATA_XFER_DMA;
+    return 0;
+}
+
+/**
+ * Move one DRQ block ('multiple' sectors, or one) of a PIO command
+ */
+static void ata_pio_block(int write) {
+    uint32_t block = ata_info.multiple ? ata_info.multiple : 1;
+    uint32_t n = xfer_left < block ? xfer_left : block;
+    
+    for (uint32_t s = 0; s < n; s++) {
+        /* Sectors never straddle two buffers of a chain */
+        if (xfer_offset == xfer_seg->count * ATA_SECTOR_SIZE) {
+            xfer_seg = xfer_seg->merge_next;
+            xfer_offset = 0;
         }
         
-        /* Read 256 words (512 bytes) */
-        for (int i = 0; i < 256; i++) {
-            buf[sector * 256 + i] = inw(ata_io_base + ATA_REG_DATA);
+        uint16_t* buf = (uint16_t*)((uint8_t*)xfer_seg->buffer + xfer_offset);
+        if (write) {
+            for (int i = 0; i < 256; i++) {
+                outw(ata_io_base + ATA_REG_DATA, buf[i]);
+            }
+        } else {
+            for (int i = 0; i < 256; i++) {
+                buf[i] = inw(ata_io_base + ATA_REG_DATA);
+            }
         }
+        xfer_offset += ATA_SECTOR_SIZE;
+    }
+    xfer_left -= n;
+}
+
+/**
+ * Issue a PIO command: READ/WRITE MULTIPLE when enabled, else one sector per DRQ
+ */
+static void ata_pio_command(blk_request_t* req, int ext) {
+    ata_setup_command(req->lba, req->total, ext);
+    
+    uint8_t command;
+    if (ata_info.multiple) {
+        command = req->write ? (ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE)
+                             : (ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE);
+    } else {
+        command = req->write ? (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                             : (ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
     }
+    outb(ata_io_base + ATA_REG_COMMAND, command);
     
-    return 0;
+    xfer_mode = ATA_XFER_PIO;
+    xfer_seg = req;
+    xfer_offset = 0;
+    xfer_left = req->total;
 }
 
 /**
- * Write sectors to disk (PIO mode)
+ * Run a whole PIO command by polling (no usable interrupt)
  */
-int ata_write_sectors(uint32_t lba, uint8_t count, const void* buffer) {
-    if (!ata_drive_present) {
-        return -1;
+static int ata_pio_polled(blk_request_t* req, int ext) {
+    ata_pio_command(req, ext);
+    
+    while (xfer_left) {
+        /* Wait for data */
+        if (ata_wait_drq() < 0) {
+            return -1;
+        }
+        ata_pio_block(req->write);
     }
     
-    if (count == 0) {
-        count = 1;
+    /* Wait for the last block to be taken */
+    if (ata_wait_ready() < 0 || (inb(ata_io_base + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
+        return -1;
     }
+    return BLK_DONE;
+}
+
+/**
+ * Block queue: issue a command for a merged chain
+ */
+static int ata_blk_start(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    xfer_req = req;
     
-    /* Wait for drive to be ready */
+    /* LBA48 commands carry a 16-bit count and reach past 128GB */
+    int ext = ata_info.lba48 &&
+              (req->total > ATA_LBA28_SECTORS || req->lba + req->total > ATA_LBA28_LIMIT);
+    
+    /* The previous command has completed, so this normally doesn't wait */
     if (ata_wait_ready() < 0) {
         return -1;
     }
     
-    /* Select drive with LBA mode */
-    outb(ata_io_base + ATA_REG_DRIVE, ATA_DRIVE_MASTER | 0x40 | ((lba >> 24) & 0x0F));
-    io_wait();
+    if (bm_base && ata_dma_start(req, ext) == 0) {
+        return BLK_PENDING;
+    }
     
-    /* Set sector count and LBA */
-    outb(ata_io_base + ATA_REG_SECCOUNT, count);
-    outb(ata_io_base + ATA_REG_LBA_LO, lba & 0xFF);
-    outb(ata_io_base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
-    outb(ata_io_base + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
+    if (ata_polled) {
+        return ata_pio_polled(req, ext);
+    }
     
-    /* Send WRITE command */
-    outb(ata_io_base + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
+    ata_pio_command(req, ext);
     
-    /* Write sectors */
-    const uint16_t* buf = (const uint16_t*)buffer;
-    for (int sector = 0; sector < count; sector++) {
-        /* Wait for ready */
+    /* A write's first block goes out without waiting for an interrupt */
+    if (req->write) {
         if (ata_wait_drq() < 0) {
             return -1;
         }
-        
-        /* Write 256 words (512 bytes) */
-        for (int i = 0; i < 256; i++) {
-            outw(ata_io_base + ATA_REG_DATA, buf[sector * 256 + i]);
+        ata_pio_block(1);
+    }
+    return BLK_PENDING;
+}
+
+/**
+ * Advance the command in flight after an interrupt
+ */
+static int ata_service_command(blk_request_t* req) {
+    uint8_t status = irq_status;
+    
+    if (xfer_mode == ATA_XFER_DMA) {
+        uint8_t bm_status = irq_bm_status;
+        if (!(bm_status & BM_SR_IRQ)) {
+            return BLK_PENDING;     /* Not the DMA completion */
         }
-        
-        /* Flush cache */
-        io_wait();
+        outb(bm_base + BM_REG_COMMAND, 0);
+        if ((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+            return -1;
+        }
+        if (xfer_bounce && !req->write) {
+            ata_bounce_copy(req, 0);
+        }
+        return BLK_DONE;
     }
     
-    /* Wait for write to complete */
-    ata_wait_ready();
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        return -1;
+    }
     
-    return 0;
+    /* Writes interrupt once each block is taken, and once more at the end */
+    if (req->write) {
+        if (xfer_left == 0) {
+            return BLK_DONE;
+        }
+        if (!(status & ATA_SR_DRQ)) {
+            return -1;
+        }
+        ata_pio_block(1);
+        return BLK_PENDING;
+    }
+    
+    /* Reads interrupt when each block is ready */
+    if (!(status & ATA_SR_DRQ)) {
+        return BLK_PENDING;
+    }
+    ata_pio_block(0);
+    return xfer_left ? BLK_PENDING : BLK_DONE;
 }
 
+/**
+ * Block queue: the channel interrupted during a command
+ */
+static void ata_blk_service(blk_device_t* dev) {
+    (void)dev;
+    
+    int result = ata_service_command(xfer_req);
+    if (result == BLK_PENDING) {
+        blk_request_progress(xfer_req);
+    } else {
+        blk_end_request(xfer_req, result);
+    }
+}
+
+/**
+ * Block queue: no interrupt in time; fall back a level and start over
+ */
+static void ata_blk_timeout(blk_device_t* dev, blk_request_t* req) {
+    if (xfer_mode == ATA_XFER_DMA) {
+        outb(bm_base + BM_REG_COMMAND, 0);
+        bm_base = 0;        /* DMA never completed: use PIO from now on */
+    } else {
+        ata_polled = 1;     /* Not even PIO interrupts: poll */
+    }
+    
+    ata_soft_reset();
+    ata_set_multiple();     /* A reset may drop the multiple block size */
+    
+    int result = ata_blk_start(dev, req);
+    if (result != BLK_PENDING) {
+        blk_end_request(req, result);
+    }
+}
+
+/**
+ * Initialize ATA driver
+ */
+void ata_init(void) {
+    ata_drive_present = 0;
+    
+    /* Try primary master */
+    ata_io_base = ATA_PRIMARY_IO;
+    ata_ctrl_base = ATA_PRIMARY_CTRL;
+    
+    /* Check if controller exists */
+    uint8_t status = inb(ata_io_base + ATA_REG_STATUS);
+    if (status == 0xFF) {
+        /* No controller on primary bus, try secondary */
+        ata_io_base = ATA_SECONDARY_IO;
+        ata_ctrl_base = ATA_SECONDARY_CTRL;
+        status = inb(ata_io_base + ATA_REG_STATUS);
+        if (status == 0xFF) {
+            return;  /* No ATA controller found */
+        }
+    }
+    
+    /* Soft reset */
+    ata_soft_reset();
+    
+    /* Try to identify drive */
+    if (ata_identify()) {
+        ata_drive_present = 1;
+        ata_set_multiple();
+        if (ata_info.dma) {
+            ata_dma_init();
+        }
+        
+        /* Legacy-mode channels interrupt on IRQ 14 (primary) or 15 */
+        uint8_t irq = (ata_io_base == ATA_SECONDARY_IO) ? 15 : 14;
+        idt_set_handler(IRQ_BASE + irq, ata_interrupt_handler);
+        pic_unmask_irq(irq);
+        
+        ata_blk.name = "ata";
+        ata_blk.sectors = ata_info.sectors;
+        ata_blk.max_sectors = ata_info.lba48 ? ATA_DMA_MAX_SECTORS : ATA_LBA28_SECTORS;
+        ata_blk.max_segments = ATA_MAX_SEGMENTS;
+        ata_blk.queue_depth = 1;
+        ata_blk.start = ata_blk_start;
+        ata_blk.service = ata_blk_service;
+        ata_blk.timeout = ata_blk_timeout;
+        ata_blk.priv = NULL;
+        if (blk_register(&ata_blk) < 0) {
+            ata_drive_present = 0;  /* Another backend serves the disk queue */
+        }
+    }
+}
+
+/**
+ * Check if drive is present
+ */
+int ata_is_present(void) {
+    return ata_drive_present;
+}
+
+/**
+ * Check if transfers use bus-master DMA
+ */
+int ata_dma_enabled(void) {
+    return bm_base != 0;
+}
+
+/**
+ * Get the parsed IDENTIFY data of the drive
+ */
+const ata_info_t* ata_get_info(void) {
+    return ata_drive_present ? &ata_info : NULL;
+}
@@ -0,0 +1,455 @@
+/**
+ * MiniOS - Block Cache
+ * 
+ * One cache block per 512-byte sector. Blocks are found through a hash of
+ * the LBA and kept on an LRU list; the least recently used block is
+ * reclaimed when a new sector needs room. Misses are read as one run of
+ * consecutive sectors, extended by a read-ahead window that doubles while
+ * reads stay sequential and collapses on a seek. Writes only dirty the
+ * cache; write-back gathers each dirty block's contiguous dirty
+ * neighbours into a single multi-sector write.
+ * 
+ * Write-back happens when a dirty block is reclaimed, when half the cache
+ * is dirty, and on bcache_flush(). It is never started from a timer: the
+ * disk wait runs softirqs, so a softirq must not re-enter the cache.
+ */
+
+#include "types.h"
+#include "bcache.h"
+#include "blk.h"
+#include "pmm.h"
+#include "heap.h"
+#include "string.h"
+
+/* Staging buffer size: the largest single read or coalesced write */
+#define BCACHE_IO_SECTORS   128
+#define BCACHE_IO_PAGES     (BCACHE_IO_SECTORS * BLK_SECTOR_SIZE / PAGE_SIZE)
+
+/* Read-ahead window limits (sectors) */
+#define BCACHE_RA_MIN       8
+#define BCACHE_RA_MAX       128
+
+/* Block flags */
+#define BCACHE_VALID        0x01    /* Holds the sector's data */
+#define BCACHE_DIRTY        0x02    /* Newer than the disk */
+#define BCACHE_READAHEAD    0x04    /* Read ahead, not requested yet */
+
+/* Cache block */
+typedef struct bcache_block {
+    uint64_t lba;
+    uint8_t* data;                  /* BLK_SECTOR_SIZE bytes */
+    struct bcache_block* hash_next;
+    struct bcache_block* lru_prev;  /* Towards most recently used */
+    struct bcache_block* lru_next;  /* Towards least recently used */
+    uint8_t flags;
+} bcache_block_t;
+
+/* Cache state */
+static bcache_block_t* blocks = NULL;
+static uint32_t block_count = 0;
+static uint8_t* block_data = NULL;
+static uint8_t* staging = NULL;
+static uint32_t io_max = 0;         /* Sectors per read or write-back run */
+
+/* LBA hash */
+static bcache_block_t** hash_table = NULL;
+static int hash_bits = 0;
+
+/* LRU list of blocks in the hash, and unused blocks */
+static bcache_block_t* lru_head = NULL;
+static bcache_block_t* lru_tail = NULL;
+static bcache_block_t* free_list = NULL;
+
+/* Sequential read detection */
+static uint64_t ra_next = ~0ULL;    /* LBA a sequential reader asks for next */
+static uint32_t ra_window = 0;
+
+static bcache_stats_t bcache_stats;
+
+/**
+ * Hash bucket of an LBA (Fibonacci hashing)
+ */
+static inline uint32_t bcache_hash(uint64_t lba) {
+    return (uint32_t)((lba * 0x9E3779B97F4A7C15ULL) >> (64 - hash_bits));
+}
+
+/**
+ * Find the block caching an LBA
+ */
+static bcache_block_t* bcache_lookup(uint64_t lba) {
+    for (bcache_block_t* b = hash_table[bcache_hash(lba)]; b; b = b->hash_next) {
+        if (b->lba == lba) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check if an LBA's data is in the cache
+ */
+static inline int bcache_cached(uint64_t lba) {
+    bcache_block_t* b = bcache_lookup(lba);
+    return b && (b->flags & BCACHE_VALID);
+}
+
+/**
+ * Check if an LBA is cached and dirty
+ */
+static inline int bcache_dirty(uint64_t lba) {
+    bcache_block_t* b = bcache_lookup(lba);
+    return b && (b->flags & BCACHE_DIRTY);
+}
+
+/**
+ * Remove a block from the hash
+ */
+static void hash_remove(bcache_block_t* b) {
+    bcache_block_t** link = &hash_table[bcache_hash(b->lba)];
+    while (*link && *link != b) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = b->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+/**
+ * Take a block off the LRU list
+ */
+static void lru_unlink(bcache_block_t* b) {
+    if (b->lru_prev) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        lru_head = b->lru_next;
+    }
+    if (b->lru_next) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        lru_tail = b->lru_prev;
+    }
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+}
+
+/**
+ * Put a block at the most recently used end of the LRU list
+ */
+static void lru_push_front(bcache_block_t* b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = b;
+    } else {
+        lru_tail = b;
+    }
+    lru_head = b;
+}
+
+/**
+ * Mark a block as just used
+ */
+static inline void lru_touch(bcache_block_t* b) {
+    if (b != lru_head) {
+        lru_unlink(b);
+        lru_push_front(b);
+    }
+}
+
+/**
+ * Write back the run of contiguous dirty blocks around 'b' in one command
+ */
+static int bcache_writeback_run(bcache_block_t* b) {
+    /* Walk back to the start of the run, then gather forward */
+    uint64_t start = b->lba;
+    while (start > 0 && b->lba - start + 1 < io_max && bcache_dirty(start - 1)) {
+        start--;
+    }
+    
+    uint32_t n = 0;
+    while (n < io_max) {
+        bcache_block_t* d = bcache_lookup(start + n);
+        if (!d || !(d->flags & BCACHE_DIRTY)) {
+            break;
+        }
+        memcpy(staging + n * BLK_SECTOR_SIZE, d->data, BLK_SECTOR_SIZE);
+        n++;
+    }
+    
+    if (blk_write(start, n, staging) < 0) {
+        return -1;
+    }
+    bcache_stats.disk_writes++;
+    bcache_stats.written += n;
+    
+    for (uint32_t i = 0; i < n; i++) {
+        bcache_lookup(start + i)->flags &= ~BCACHE_DIRTY;
+    }
+    bcache_stats.dirty -= n;
+    return 0;
+}
+
+/**
+ * Drop a block from the cache (it must be clean)
+ */
+static void bcache_release(bcache_block_t* b) {
+    if (b->flags & BCACHE_VALID) {
+        bcache_stats.cached--;
+    }
+    hash_remove(b);
+    lru_unlink(b);
+    b->flags = 0;
+    b->lru_next = free_list;
+    free_list = b;
+}
+
+/**
+ * Get a block for an LBA that isn't cached, reclaiming the LRU block
+ * The block is returned without data (not VALID).
+ * @return The block, or NULL if reclaiming needed a write-back that failed
+ */
+static bcache_block_t* bcache_alloc(uint64_t lba) {
+    bcache_block_t* b = free_list;
+    if (b) {
+        free_list = b->lru_next;
+        b->lru_next = NULL;
+    } else {
+        b = lru_tail;
+        if ((b->flags & BCACHE_DIRTY) && bcache_writeback_run(b) < 0) {
+            return NULL;
+        }
+        bcache_release(b);
+        free_list = b->lru_next;
+        b->lru_next = NULL;
+    }
+    
+    b->lba = lba;
+    b->flags = 0;
+    uint32_t bucket = bcache_hash(lba);
+    b->hash_next = hash_table[bucket];
+    hash_table[bucket] = b;
+    lru_push_front(b);
+    return b;
+}
+
+/**
+ * Read 'n' uncached sectors from 'lba' into new blocks (and the staging buffer)
+ * Sectors from 'wanted' on are read ahead of the request.
+ */
+static int bcache_fill(uint64_t lba, uint32_t n, uint32_t wanted) {
+    bcache_block_t* run[BCACHE_IO_SECTORS];
+    
+    /* Claim the blocks first: a reclaim may need the staging buffer */
+    for (uint32_t i = 0; i < n; i++) {
+        run[i] = bcache_alloc(lba + i);
+        if (!run[i]) {
+            while (i--) {
+                bcache_release(run[i]);
+            }
+            return -1;
+        }
+    }
+    
+    if (blk_read(lba, n, staging) < 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            bcache_release(run[i]);
+        }
+        return -1;
+    }
+    bcache_stats.disk_reads++;
+    
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(run[i]->data, staging + i * BLK_SECTOR_SIZE, BLK_SECTOR_SIZE);
+        run[i]->flags = BCACHE_VALID | (i >= wanted ? BCACHE_READAHEAD : 0);
+    }
+    bcache_stats.cached += n;
+    return 0;
+}
+
+/**
+ * Set up the cache with a memory budget
+ */
+int bcache_init(size_t bytes) {
+    size_t pages = bytes / PAGE_SIZE;
+    if (pages > (1U << PMM_MAX_ORDER)) {
+        pages = 1U << PMM_MAX_ORDER;
+    }
+    
+    /* Reads and write-backs must fit in half the cache */
+    uint32_t count = (uint32_t)(pages * PAGE_SIZE / BLK_SECTOR_SIZE);
+    if (count < 2 * BCACHE_RA_MIN) {
+        return -1;
+    }
+    
+    hash_bits = 1;
+    while ((1U << hash_bits) < count) {
+        hash_bits++;
+    }
+    
+    blocks = (bcache_block_t*)kcalloc(count, sizeof(bcache_block_t));
+    hash_table = (bcache_block_t**)kcalloc(1U << hash_bits, sizeof(bcache_block_t*));
+    block_data = (uint8_t*)pmm_alloc_pages(pages);
+    staging = (uint8_t*)pmm_alloc_pages(BCACHE_IO_PAGES);
+    if (!blocks || !hash_table || !block_data || !staging) {
+        kfree(blocks);
+        kfree(hash_table);
+        if (block_data) pmm_free_pages(block_data, pages);
+        if (staging) pmm_free_pages(staging, BCACHE_IO_PAGES);
+        blocks = NULL;
+        hash_table = NULL;
+        block_data = NULL;
+        staging = NULL;
+        return -1;
+    }
+    
+    block_count = count;
+    io_max = count / 2 < BCACHE_IO_SECTORS ? count / 2 : BCACHE_IO_SECTORS;
+    
+    free_list = NULL;
+    for (uint32_t i = count; i-- > 0;) {
+        blocks[i].data = block_data + i * BLK_SECTOR_SIZE;
+        blocks[i].lru_next = free_list;
+        free_list = &blocks[i];
+    }
+    
+    memset(&bcache_stats, 0, sizeof(bcache_stats));
+    bcache_stats.blocks = count;
+    return 0;
+}
+
+/**
+ * Read sectors through the cache
+ */
+int bcache_read(uint64_t lba, uint32_t count, void* buffer) {
+    if (!blocks) {
+        return blk_read(lba, count, buffer);
+    }
+    
+    uint64_t capacity = blk_get_capacity();
+    if (lba >= capacity || count > capacity - lba) {
+        return -1;
+    }
+    
+    /* A read that continues the last one grows the window, a seek resets it */
+    if (lba == ra_next) {
+        ra_window = ra_window ? ra_window * 2 : BCACHE_RA_MIN;
+        if (ra_window > BCACHE_RA_MAX) {
+            ra_window = BCACHE_RA_MAX;
+        }
+    } else {
+        ra_window = 0;
+    }
+    
+    uint64_t end = lba + count;
+    ra_next = end;
+    uint8_t* out = (uint8_t*)buffer;
+    
+    while (lba < end) {
+        bcache_block_t* b = bcache_lookup(lba);
+        if (b && (b->flags & BCACHE_VALID)) {
+            if (b->flags & BCACHE_READAHEAD) {
+                b->flags &= ~BCACHE_READAHEAD;
+                bcache_stats.readahead_hits++;
+            }
+            memcpy(out, b->data, BLK_SECTOR_SIZE);
+            lru_touch(b);
+            bcache_stats.hits++;
+            lba++;
+            out += BLK_SECTOR_SIZE;
+            continue;
+        }
+        
+        /* Miss: read the whole run of missing sectors in one command */
+        uint32_t wanted = 1;
+        while (lba + wanted < end && wanted < io_max && !bcache_cached(lba + wanted)) {
+            wanted++;
+        }
+        
+        /* A run reaching the end of a sequential request reads ahead too */
+        uint32_t n = wanted;
+        if (lba + n == end) {
+            while (n < wanted + ra_window && n < io_max && lba + n < capacity &&
+                   !bcache_cached(lba + n)) {
+                n++;
+            }
+        }
+        
+        if (bcache_fill(lba, n, wanted) < 0) {
+            return -1;
+        }
+        memcpy(out, staging, wanted * BLK_SECTOR_SIZE);
+        
+        bcache_stats.misses += wanted;
+        bcache_stats.readahead += n - wanted;
+        lba += wanted;
+        out += wanted * BLK_SECTOR_SIZE;
+    }
+    
+    return 0;
+}
+
+/**
+ * Write sectors into the cache
+ */
+int bcache_write(uint64_t lba, uint32_t count, const void* buffer) {
+    if (!blocks) {
+        return blk_write(lba, count, buffer);
+    }
+    
+    uint64_t capacity = blk_get_capacity();
+    if (lba >= capacity || count > capacity - lba) {
+        return -1;
+    }
+    
+    const uint8_t* in = (const uint8_t*)buffer;
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_block_t* b = bcache_lookup(lba + i);
+        if (!b) {
+            b = bcache_alloc(lba + i);
+            if (!b) {
+                return -1;
+            }
+        } else {
+            lru_touch(b);
+        }
+        
+        /* Whole sectors are written, so there's nothing to read first */
+        memcpy(b->data, in + i * BLK_SECTOR_SIZE, BLK_SECTOR_SIZE);
+        if (!(b->flags & BCACHE_VALID)) {
+            bcache_stats.cached++;
+        }
+        if (!(b->flags & BCACHE_DIRTY)) {
+            bcache_stats.dirty++;
+        }
+        b->flags = BCACHE_VALID | BCACHE_DIRTY;
+    }
+    
+    /* Don't let reclaim turn into one write-back per block */
+    if (bcache_stats.dirty > block_count / 2) {
+        return bcache_flush();
+    }
+    return 0;
+}
+
+/**
+ * Write all dirty sectors back to the disk
+ */
+int bcache_flush(void) {
+    int result = 0;
+    
+    for (uint32_t i = 0; i < block_count && bcache_stats.dirty; i++) {
+        if ((blocks[i].flags & BCACHE_DIRTY) && bcache_writeback_run(&blocks[i]) < 0) {
+            result = -1;
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * Get cache counters
+ */
+void bcache_get_stats(bcache_stats_t* stats) {
+    *stats = bcache_stats;
+}
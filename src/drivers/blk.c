@@ -0,0 +1,395 @@
+/**
+ * MiniOS - Block Request Queue
+ * 
+ * Requests wait on a list sorted by LBA. A new request that continues (or
+ * precedes) a queued one in the same direction is merged into it, so the
+ * driver issues one command for both. Dispatch is a one-way elevator
+ * (C-LOOK): the next command is the first request at or beyond the last
+ * one, wrapping to the lowest LBA at the end of a sweep. A request that
+ * has waited longer than BLK_DEADLINE is served first instead, so a
+ * stream of nearby requests cannot starve a distant one.
+ * 
+ * Up to the device's queue depth of commands are in flight at once (one
+ * for ATA, up to 32 NCQ tags for AHCI). The driver's interrupt handler
+ * calls blk_interrupt(), which wakes the block softirq thread; it lets the
+ * driver service the device, the driver reports each finished command with
+ * blk_end_request(), and the freed slots are refilled from the queue. The
+ * synchronous helpers sleep on a wait queue until their request ends.
+ */
+
+#include "types.h"
+#include "blk.h"
+#include "softirq.h"
+#include "perf.h"
+#include "timer.h"
+#include "thread.h"
+
+/* Oldest a queued request may get before it jumps the elevator */
+#define BLK_DEADLINE        MS_TO_TICKS(500)
+
+/* How long the driver gets to report progress on a command */
+#define BLK_TIMEOUT         MS_TO_TICKS(2000)
+
+static blk_device_t* blk_dev = NULL;
+static blk_request_t* blk_queue = NULL;     /* Sorted by LBA */
+static blk_request_t* blk_active = NULL;    /* Commands in flight */
+static uint32_t blk_inflight = 0;
+static uint64_t blk_head_pos = 0;           /* Sector after the last command */
+static volatile int blk_irq = 0;
+static ktimer_t blk_timer;
+static blk_stats_t blk_stats;
+
+/* Threads waiting in the synchronous helpers */
+static wait_queue_t blk_sync_wait = WAIT_QUEUE_INIT;
+
+/**
+ * Complete every request of a merged chain
+ */
+static void blk_finish(blk_request_t* req, int status) {
+    if (status < 0) {
+        blk_stats.errors++;
+    }
+    
+    /* Callbacks may recycle their request: read the link first */
+    while (req) {
+        blk_request_t* next = req->merge_next;
+        req->next = NULL;
+        req->merge_next = NULL;
+        if (status >= 0) {
+            perf_add(req->write ? PERF_BLK_WRITE : PERF_BLK_READ, req->count);
+        }
+        perf_lat(req->write ? PERF_LAT_BLK_WRITE : PERF_LAT_BLK_READ, req->submit_tsc);
+        if (req->done) {
+            req->done(req, status < 0 ? -1 : 0);
+        }
+        req = next;
+    }
+}
+
+/**
+ * Arm the timer for the earliest command deadline
+ */
+static void blk_timer_update(void) {
+    if (!blk_active) {
+        ktimer_cancel(&blk_timer);
+        return;
+    }
+    
+    uint64_t deadline = blk_active->deadline;
+    for (blk_request_t* req = blk_active->next; req; req = req->next) {
+        if (req->deadline < deadline) {
+            deadline = req->deadline;
+        }
+    }
+    
+    uint64_t now = timer_ticks();
+    ktimer_arm(&blk_timer, deadline > now ? (uint32_t)(deadline - now) : 1);
+}
+
+/**
+ * Driver completion for a command in flight
+ */
+void blk_end_request(blk_request_t* req, int status) {
+    blk_request_t** link = &blk_active;
+    while (*link && *link != req) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return;     /* Not in flight (already ended) */
+    }
+    *link = req->next;
+    blk_inflight--;
+    
+    blk_timer_update();
+    blk_finish(req, status);
+    
+    /* Refill the slot from the softirq, not from inside the driver */
+    softirq_raise(SOFTIRQ_BLOCK);
+}
+
+/**
+ * Driver reports progress on a long command
+ */
+void blk_request_progress(blk_request_t* req) {
+    req->deadline = timer_ticks() + BLK_TIMEOUT;
+    blk_timer_update();
+}
+
+/**
+ * Pick the next chain to issue and remove it from the queue
+ */
+static blk_request_t* blk_pick(void) {
+    blk_request_t** pick = NULL;
+    blk_request_t** oldest = NULL;
+    uint64_t now = timer_ticks();
+    
+    for (blk_request_t** link = &blk_queue; *link; link = &(*link)->next) {
+        if (!pick && (*link)->lba >= blk_head_pos) {
+            pick = link;
+        }
+        if (!oldest || (*link)->queued < (*oldest)->queued) {
+            oldest = link;
+        }
+    }
+    
+    if (oldest && now - (*oldest)->queued > BLK_DEADLINE) {
+        if (pick != oldest) {
+            blk_stats.expired++;
+        }
+        pick = oldest;
+    } else if (!pick) {
+        pick = &blk_queue;  /* End of the sweep: wrap to the lowest LBA */
+    }
+    
+    blk_request_t* req = *pick;
+    *pick = req->next;
+    req->next = NULL;
+    blk_stats.queued -= req->segments;
+    return req;
+}
+
+/**
+ * Start commands while the device has free slots
+ */
+static void blk_dispatch(void) {
+    while (blk_inflight < blk_dev->queue_depth && blk_queue) {
+        blk_request_t* req = blk_pick();
+        blk_head_pos = req->lba + req->total;
+        req->deadline = timer_ticks() + BLK_TIMEOUT;
+        req->next = blk_active;
+        blk_active = req;
+        blk_inflight++;
+        blk_stats.dispatched++;
+        
+        /* Polled drivers may finish (or fail) right away */
+        int result = blk_dev->start(blk_dev, req);
+        if (result != BLK_PENDING) {
+            blk_end_request(req, result);
+        }
+    }
+    blk_timer_update();
+}
+
+/**
+ * Block softirq: let the driver service its interrupt, then keep the disk busy
+ */
+static void blk_softirq(void) {
+    if (blk_active && blk_irq) {
+        blk_irq = 0;
+        blk_dev->service(blk_dev);
+    }
+    blk_dispatch();
+}
+
+/**
+ * A command made no progress in time
+ */
+static void blk_timeout(void* arg) {
+    (void)arg;
+    
+    /* The driver may end or restart any number of commands: rescan after each */
+    for (;;) {
+        uint64_t now = timer_ticks();
+        blk_request_t* req = blk_active;
+        while (req && req->deadline > now) {
+            req = req->next;
+        }
+        if (!req) {
+            break;
+        }
+        
+        req->deadline = now + BLK_TIMEOUT;
+        blk_irq = 0;
+        blk_dev->timeout(blk_dev, req);
+    }
+    
+    blk_timer_update();
+    blk_dispatch();
+}
+
+/**
+ * Attach the disk driver that serves the queue
+ */
+int blk_register(blk_device_t* dev) {
+    if (blk_dev) {
+        return -1;      /* One disk: the first backend found serves the queue */
+    }
+    if (dev->queue_depth == 0) {
+        dev->queue_depth = 1;
+    }
+    
+    blk_dev = dev;
+    ktimer_init(&blk_timer, blk_timeout, NULL);
+    softirq_register(SOFTIRQ_BLOCK, blk_softirq);
+    return 0;
+}
+
+/**
+ * Driver interrupt hook
+ */
+void blk_interrupt(void) {
+    blk_irq = 1;
+    softirq_raise(SOFTIRQ_BLOCK);
+}
+
+/**
+ * Check if a disk is attached
+ */
+int blk_is_present(void) {
+    return blk_dev != NULL;
+}
+
+/**
+ * Get the attached disk's capacity
+ */
+uint64_t blk_get_capacity(void) {
+    return blk_dev ? blk_dev->sectors : 0;
+}
+
+/**
+ * Get the attached disk backend
+ */
+const blk_device_t* blk_get_device(void) {
+    return blk_dev;
+}
+
+/**
+ * Try to merge a request into a queued chain
+ * @return non-zero if merged
+ */
+static int blk_try_merge(blk_request_t* req) {
+    for (blk_request_t** link = &blk_queue; *link; link = &(*link)->next) {
+        blk_request_t* q = *link;
+        if (q->write != req->write ||
+            q->total + req->count > blk_dev->max_sectors ||
+            q->segments >= blk_dev->max_segments) {
+            continue;
+        }
+        
+        /* Back merge: req continues the chain */
+        if (q->lba + q->total == req->lba) {
+            q->merge_tail->merge_next = req;
+            q->merge_tail = req;
+            q->total += req->count;
+            q->segments++;
+            return 1;
+        }
+        
+        /* Front merge: req becomes the chain head, in the same list slot */
+        if (req->lba + req->count == q->lba) {
+            req->merge_next = q;
+            req->merge_tail = q->merge_tail;
+            req->total = req->count + q->total;
+            req->segments = q->segments + 1;
+            req->queued = q->queued;
+            req->next = q->next;
+            q->next = NULL;
+            q->merge_tail = NULL;
+            *link = req;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue a request
+ */
+int blk_submit(blk_request_t* req) {
+    if (!blk_dev || req->count == 0 || req->count > blk_dev->max_sectors ||
+        req->lba >= blk_dev->sectors || req->count > blk_dev->sectors - req->lba) {
+        return -1;
+    }
+    
+    req->next = NULL;
+    req->merge_next = NULL;
+    req->merge_tail = req;
+    req->total = req->count;
+    req->segments = 1;
+    req->queued = timer_ticks();
+    req->submit_tsc = rdtsc();
+    
+    blk_stats.submitted++;
+    blk_stats.queued++;
+    
+    if (blk_try_merge(req)) {
+        blk_stats.merged++;
+    } else {
+        blk_request_t** link = &blk_queue;
+        while (*link && (*link)->lba <= req->lba) {
+            link = &(*link)->next;
+        }
+        req->next = *link;
+        *link = req;
+    }
+    
+    softirq_raise(SOFTIRQ_BLOCK);
+    return 0;
+}
+
+/**
+ * Completion for the synchronous helpers
+ */
+static void blk_sync_done(blk_request_t* req, int status) {
+    *(volatile int*)req->priv = status < 0 ? -1 : 1;
+    wake_up(&blk_sync_wait);
+}
+
+/**
+ * Submit one request per max_sectors piece and wait for all of them
+ */
+static int blk_sync(uint64_t lba, uint32_t count, void* buffer, int write) {
+    if (!blk_dev) {
+        return -1;
+    }
+    
+    while (count) {
+        uint32_t n = count < blk_dev->max_sectors ? count : blk_dev->max_sectors;
+        volatile int state = 0;
+        blk_request_t req;
+        
+        req.lba = lba;
+        req.count = n;
+        req.buffer = buffer;
+        req.write = write;
+        req.done = blk_sync_done;
+        req.priv = (void*)&state;
+        
+        if (blk_submit(&req) < 0) {
+            return -1;
+        }
+        
+        /* Sleeps without the kernel lock, so other subsystems carry on */
+        wait_event(&blk_sync_wait, state != 0);
+        if (state < 0) {
+            return -1;
+        }
+        
+        lba += n;
+        count -= n;
+        buffer = (uint8_t*)buffer + (size_t)n * BLK_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * Read sectors and wait for them
+ */
+int blk_read(uint64_t lba, uint32_t count, void* buffer) {
+    return blk_sync(lba, count, buffer, 0);
+}
+
+/**
+ * Write sectors and wait for them
+ */
+int blk_write(uint64_t lba, uint32_t count, const void* buffer) {
+    return blk_sync(lba, count, (void*)buffer, 1);
+}
+
+/**
+ * Get queue counters
+ */
+void blk_get_stats(blk_stats_t* stats) {
+    *stats = blk_stats;
+    stats->inflight = blk_inflight;
+}
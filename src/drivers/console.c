@@ -0,0 +1,55 @@
+/**
+ * MiniOS - Console Layer
+ * 
+ * Passes kernel output to each registered console. One lock keeps the
+ * buffers of concurrent writers (on other CPUs, or interrupt handlers)
+ * from interleaving within a console.
+ */
+
+#include "types.h"
+#include "console.h"
+#include "spinlock.h"
+
+static const console_t* consoles[CONSOLE_MAX];
+static int console_count = 0;
+static spinlock_t console_lock = SPINLOCK_INIT;
+
+/**
+ * Register a console
+ */
+int console_register(const console_t* con) {
+    uint64_t flags = spin_lock_irqsave(&console_lock);
+    
+    if (console_count >= CONSOLE_MAX) {
+        spin_unlock_irqrestore(&console_lock, flags);
+        return -1;
+    }
+    consoles[console_count++] = con;
+    
+    spin_unlock_irqrestore(&console_lock, flags);
+    return 0;
+}
+
+/**
+ * Write to every console
+ */
+void console_write(const char* buf, size_t len) {
+    uint64_t flags = spin_lock_irqsave(&console_lock);
+    
+    for (int i = 0; i < console_count; i++) {
+        consoles[i]->write(buf, len);
+    }
+    
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/**
+ * Wait for every console's queued output
+ */
+void console_flush(void) {
+    for (int i = 0; i < console_count; i++) {
+        if (consoles[i]->flush) {
+            consoles[i]->flush();
+        }
+    }
+}
@@ -8,17 +8,23 @@
 #include "keyboard.h"
 #include "ports.h"
 #include "idt.h"
+#include "softirq.h"
+#include "thread.h"
+#include "ring.h"
+#include "vga.h"
 
 /* PS/2 controller ports */
 #define KBD_DATA_PORT       0x60
 #define KBD_STATUS_PORT     0x64
 #define KBD_COMMAND_PORT    0x64
 
-/* Keyboard buffer */
+/* Keyboard buffer: the interrupt handler produces, keyboard_getchar() consumes */
 #define KBD_BUFFER_SIZE     256
 static char kbd_buffer[KBD_BUFFER_SIZE];
-static volatile int kbd_buffer_head = 0;
-static volatile int kbd_buffer_tail = 0;
+static ring_t kbd_ring;
+
+/* Threads waiting in keyboard_getchar() */
+static wait_queue_t kbd_wait = WAIT_QUEUE_INIT;
 
 /* Modifier key states */
 static volatile int shift_pressed = 0;
@@ -56,16 +62,19 @@ static const char scancode_to_ascii_shift[128] = {
 #define SC_CTRL         0x1D
 #define SC_ALT          0x38
 #define SC_CAPS         0x3A
+#define SC_PGUP         0x49
+#define SC_PGDN         0x51
 
 /**
  * Add character to keyboard buffer
  */
 static void kbd_buffer_put(char c) {
-    int next = (kbd_buffer_head + 1) % KBD_BUFFER_SIZE;
-    if (next != kbd_buffer_tail) {
-        kbd_buffer[kbd_buffer_head] = c;
-        kbd_buffer_head = next;
-    }
+    /* A full buffer drops the key */
+    ring_sp_enqueue(&kbd_ring, &c);
+    
+    /* Readers, and polling loops that also watch the keyboard */
+    wake_up(&kbd_wait);
+    cpu_idle_wake();
 }
 
 /**
@@ -102,6 +111,12 @@ static void keyboard_interrupt_handler(void) {
         return;
     }
     
+    /* Shift+PgUp/PgDn page through the screen's history */
+    if (shift_pressed && (scancode == SC_PGUP || scancode == SC_PGDN)) {
+        vga_scroll_view(scancode == SC_PGUP ? VGA_HEIGHT / 2 : -VGA_HEIGHT / 2);
+        return;
+    }
+    
     /* Get ASCII character */
     char c;
     if (shift_pressed) {
@@ -133,8 +148,7 @@ static void keyboard_interrupt_handler(void) {
  */
 void keyboard_init(void) {
     /* Clear buffer */
-    kbd_buffer_head = 0;
-    kbd_buffer_tail = 0;
+    ring_init(&kbd_ring, kbd_buffer, KBD_BUFFER_SIZE, sizeof(char));
     
     /* Clear modifier states */
     shift_pressed = 0;
@@ -155,20 +169,18 @@ void keyboard_init(void) {
  * Check if a character is available
  */
 int keyboard_haschar(void) {
-    return kbd_buffer_head != kbd_buffer_tail;
+    return !ring_empty(&kbd_ring);
 }
 
 /**
  * Get a character (blocking)
  */
 char keyboard_getchar(void) {
-    /* Wait for character */
-    while (!keyboard_haschar()) {
-        hlt();  /* Wait for interrupt */
-    }
+    /* Wait for character (the interrupt handler wakes us) */
+    wait_event(&kbd_wait, keyboard_haschar());
     
-    char c = kbd_buffer[kbd_buffer_tail];
-    kbd_buffer_tail = (kbd_buffer_tail + 1) % KBD_BUFFER_SIZE;
+    char c;
+    ring_sc_dequeue(&kbd_ring, &c);
     return c;
 }
 
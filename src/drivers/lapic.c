@@ -0,0 +1,150 @@
+/**
+ * MiniOS - Local APIC
+ * 
+ * Each CPU's local APIC sits at the physical address in IA32_APIC_BASE
+ * (normally 0xFEE00000), inside the boot identity map. The kernel leaves
+ * interrupt routing to the 8259 PIC: the firmware has LINT0 in ExtINT
+ * mode on the boot CPU, so enabling the APIC in software does not change
+ * how device interrupts arrive. What it adds is the APIC timer, a per-CPU
+ * one-shot down counter that needs no I/O port access to reprogram, and
+ * the interrupt command register for interrupts between CPUs.
+ */
+
+#include "types.h"
+#include "lapic.h"
+#include "idt.h"
+#include "ports.h"
+
+/* CPUID.1:EDX - on-chip APIC */
+#define CPUID_FEAT_EDX_APIC     (1 << 9)
+
+/* IA32_APIC_BASE MSR */
+#define IA32_APIC_BASE          0x1B
+#define APIC_BASE_ENABLE        (1 << 11)
+#define APIC_BASE_ADDR_MASK     0x000FFFFFFFFFF000ULL
+
+/* Register offsets */
+#define LAPIC_ID                0x020
+#define LAPIC_TPR               0x080
+#define LAPIC_EOI               0x0B0
+#define LAPIC_SVR               0x0F0
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_LVT_TIMER         0x320
+#define LAPIC_TIMER_INIT        0x380
+#define LAPIC_TIMER_CURRENT     0x390
+#define LAPIC_TIMER_DIVIDE      0x3E0
+
+/* Register bits */
+#define LAPIC_SVR_ENABLE        0x100
+#define LAPIC_LVT_MASKED        (1 << 16)
+#define LAPIC_TIMER_DIV_16      0x03
+#define LAPIC_ICR_PENDING       (1 << 12)   /* Delivery status: send pending */
+
+/* Highest physical address covered by the boot identity map */
+extern uint64_t phys_mapped_top;
+
+static volatile uint32_t* lapic_base = NULL;
+
+/**
+ * Register access (32-bit, 16-byte aligned)
+ */
+static inline uint32_t lapic_read(int reg) {
+    return lapic_base[reg / 4];
+}
+
+static inline void lapic_write(int reg, uint32_t value) {
+    lapic_base[reg / 4] = value;
+}
+
+/**
+ * Enable the calling CPU's local APIC
+ */
+int lapic_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEAT_EDX_APIC)) {
+        return -1;
+    }
+    
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    uint64_t addr = base & APIC_BASE_ADDR_MASK;
+    if (addr == 0 || addr + PAGE_SIZE > phys_mapped_top) {
+        return -1;
+    }
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    lapic_base = (volatile uint32_t*)(uintptr_t)addr;
+    
+    /* Accept every priority, software-enable with our spurious vector */
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    
+    /* Timer: one-shot, masked until first started */
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    return 0;
+}
+
+/**
+ * Check if the local APIC is enabled
+ */
+int lapic_is_enabled(void) {
+    return lapic_base != NULL;
+}
+
+/**
+ * Get this CPU's local APIC ID
+ */
+uint32_t lapic_id(void) {
+    return lapic_base ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+/**
+ * End-Of-Interrupt
+ */
+void lapic_eoi(void) {
+    if (lapic_base) {
+        lapic_write(LAPIC_EOI, 0);
+    }
+}
+
+/**
+ * Start a one-shot countdown
+ */
+void lapic_timer_start(uint32_t count) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+/**
+ * Stop the timer
+ */
+void lapic_timer_stop(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+/**
+ * Current count
+ */
+uint32_t lapic_timer_current(void) {
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+/**
+ * Send an inter-processor interrupt
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    /* The two ICR writes must not be split by an interrupt that sends too */
+    uint64_t flags = irq_save();
+    
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    
+    irq_restore(flags);
+}
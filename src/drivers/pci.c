@@ -49,7 +49,7 @@ void pci_config_write(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset,
 /**
  * Read 16-bit value from PCI configuration space
  */
-static uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset) {
+uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset) {
     uint32_t value = pci_config_read(bus, device, func, offset);
     return (value >> ((offset & 2) * 8)) & 0xFFFF;
 }
@@ -57,7 +57,7 @@ static uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t func, uin
 /**
  * Read 8-bit value from PCI configuration space
  */
-static uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset) {
+uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset) {
     uint32_t value = pci_config_read(bus, device, func, offset);
     return (value >> ((offset & 3) * 8)) & 0xFF;
 }
@@ -171,6 +171,59 @@ void pci_enable_bus_master(pci_device_t* dev) {
     pci_config_write(dev->bus, dev->device, dev->function, 0x04, command);
 }
 
+/**
+ * Enable memory-mapped register access for a device
+ */
+void pci_enable_mmio(pci_device_t* dev) {
+    uint32_t command = pci_config_read(dev->bus, dev->device, dev->function, 0x04);
+    command |= (1 << 1);  /* Set Memory Space Enable bit */
+    pci_config_write(dev->bus, dev->device, dev->function, 0x04, command);
+}
+
+/**
+ * Get the address a BAR decodes (handles 64-bit memory BARs)
+ */
+uint64_t pci_bar_address(const pci_device_t* dev, int bar) {
+    uint32_t value = dev->bar[bar];
+    
+    if (value & 1) {
+        return value & 0xFFFC;  /* I/O space */
+    }
+    
+    uint64_t addr = value & 0xFFFFFFF0;
+    if (((value >> 1) & 3) == 2 && bar < 5) {
+        addr |= (uint64_t)dev->bar[bar + 1] << 32;
+    }
+    return addr;
+}
+
+/**
+ * Find a capability in the device's capability list
+ */
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id, uint8_t start) {
+    uint8_t offset;
+    
+    if (start == 0) {
+        uint16_t status = pci_config_read16(dev->bus, dev->device, dev->function, 0x06);
+        if (!(status & (1 << 4))) {
+            return 0;  /* No capability list */
+        }
+        offset = pci_config_read8(dev->bus, dev->device, dev->function, 0x34);
+    } else {
+        offset = pci_config_read8(dev->bus, dev->device, dev->function, start + 1);
+    }
+    
+    /* Bound the walk in case of a malformed (looping) list */
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        offset &= 0xFC;
+        if (pci_config_read8(dev->bus, dev->device, dev->function, offset) == cap_id) {
+            return offset;
+        }
+        offset = pci_config_read8(dev->bus, dev->device, dev->function, offset + 1);
+    }
+    return 0;
+}
+
 /**
  * Get number of detected devices
  */
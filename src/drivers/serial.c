@@ -0,0 +1,236 @@
+/**
+ * MiniOS - Serial Port Driver
+ * 
+ * The UART is checked with its loopback mode first, so a machine without
+ * one (or with the port unwired) reports no serial port instead of
+ * hanging on a transmitter that never drains.
+ * 
+ * Writers add bytes to a lock-free ring and return. Whoever finds the
+ * transmitter idle loads its FIFO and enables the THRE interrupt; each
+ * interrupt then loads the next FIFO's worth until the ring is empty.
+ * Only the ring's consumer side and the UART registers are locked. A
+ * writer that finds the ring full (early boot, or interrupts off) sends
+ * by polling until there is room.
+ */
+
+#include "types.h"
+#include "serial.h"
+#include "console.h"
+#include "ports.h"
+#include "idt.h"
+#include "ring.h"
+#include "spinlock.h"
+
+/* COM1 registers (offsets from the base port) */
+#define COM1_BASE           0x3F8
+#define COM1_IRQ            4
+#define UART_DATA           0       /* TX/RX buffer; divisor low with DLAB */
+#define UART_IER            1       /* Interrupt enable; divisor high with DLAB */
+#define UART_IIR            2       /* Interrupt identification (read) */
+#define UART_FCR            2       /* FIFO control (write) */
+#define UART_LCR            3       /* Line control */
+#define UART_MCR            4       /* Modem control */
+#define UART_LSR            5       /* Line status */
+
+#define UART_IER_THRE       0x02    /* Interrupt when the transmitter empties */
+#define UART_LCR_8N1        0x03
+#define UART_LCR_DLAB       0x80
+#define UART_FCR_ENABLE     0xC7    /* Enable and clear FIFOs, 14-byte trigger */
+#define UART_MCR_DTR_RTS    0x03
+#define UART_MCR_OUT2       0x08    /* Routes the UART interrupt to the PIC */
+#define UART_MCR_LOOPBACK   0x10
+#define UART_LSR_DR         0x01    /* Received byte waiting */
+#define UART_LSR_THRE       0x20    /* Transmit holding register (FIFO) empty */
+#define UART_LSR_TEMT       0x40    /* Transmitter completely idle */
+
+/* Bytes the transmit FIFO takes once it reports empty */
+#define UART_FIFO_SIZE      16
+
+/* Divisor of the 115200 Hz UART clock (1.8432 MHz / 16) */
+#define UART_DIVISOR        (115200 / SERIAL_BAUD)
+
+/* How long to wait for the transmitter before giving up on it */
+#define UART_TX_SPINS       100000
+
+/* Bytes translated ('\n' to "\r\n") on the stack per ring enqueue */
+#define SERIAL_STAGE_SIZE   128
+
+static int serial_present = 0;
+
+/* Transmit ring: any CPU produces, the holder of serial_tx_lock consumes */
+static char serial_tx_buf[SERIAL_TX_SIZE];
+static ring_t serial_tx;
+static spinlock_t serial_tx_lock = SPINLOCK_INIT;
+static int serial_tx_busy = 0;      /* THRE interrupt enabled, more to come */
+
+static const console_t serial_console = {
+    .name = "serial",
+    .write = serial_write,
+    .flush = serial_flush,
+};
+
+/**
+ * Load the transmit FIFO from the ring if the UART has room for it
+ * Called with serial_tx_lock held.
+ */
+static void serial_tx_fill(void) {
+    if (inb(COM1_BASE + UART_LSR) & UART_LSR_THRE) {
+        char bytes[UART_FIFO_SIZE];
+        uint32_t n = ring_sc_dequeue_bulk(&serial_tx, bytes, UART_FIFO_SIZE);
+        
+        for (uint32_t i = 0; i < n; i++) {
+            outb(COM1_BASE + UART_DATA, (uint8_t)bytes[i]);
+        }
+    }
+    
+    /* The interrupt keeps the ring draining; with nothing left, stay quiet */
+    int busy = !ring_empty(&serial_tx);
+    if (busy != serial_tx_busy) {
+        outb(COM1_BASE + UART_IER, busy ? UART_IER_THRE : 0);
+        serial_tx_busy = busy;
+    }
+}
+
+/**
+ * COM1 interrupt: the transmit FIFO has emptied
+ */
+static void serial_interrupt_handler(void) {
+    (void)inb(COM1_BASE + UART_IIR);
+    
+    spin_lock(&serial_tx_lock);
+    serial_tx_fill();
+    spin_unlock(&serial_tx_lock);
+}
+
+/**
+ * Send from the ring by polling, once the UART has room
+ * @return 0 if the UART took more bytes, -1 if it stayed busy
+ */
+static int serial_tx_poll(void) {
+    int ready = 0;
+    
+    for (int i = 0; i < UART_TX_SPINS && !ready; i++) {
+        ready = inb(COM1_BASE + UART_LSR) & UART_LSR_THRE;
+        if (!ready) cpu_relax();
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&serial_tx_lock);
+    serial_tx_fill();
+    spin_unlock_irqrestore(&serial_tx_lock, flags);
+    return ready ? 0 : -1;
+}
+
+/**
+ * Add bytes to the ring, sending by polling while it is full
+ */
+static void serial_queue(const char* buf, uint32_t len) {
+    while (len > 0) {
+        uint32_t n = ring_mp_enqueue_bulk(&serial_tx, buf, len);
+        buf += n;
+        len -= n;
+        
+        if (len > 0 && serial_tx_poll() < 0) {
+            return;  /* Transmitter stuck: drop the rest */
+        }
+    }
+    
+    /* Start the transmitter if it is idle */
+    uint64_t flags = spin_lock_irqsave(&serial_tx_lock);
+    if (!serial_tx_busy) {
+        serial_tx_fill();
+    }
+    spin_unlock_irqrestore(&serial_tx_lock, flags);
+}
+
+/**
+ * Initialize COM1
+ */
+int serial_init(void) {
+    outb(COM1_BASE + UART_IER, 0x00);
+    outb(COM1_BASE + UART_LCR, UART_LCR_DLAB);
+    outb(COM1_BASE + UART_DATA, UART_DIVISOR & 0xFF);
+    outb(COM1_BASE + UART_IER, UART_DIVISOR >> 8);
+    outb(COM1_BASE + UART_LCR, UART_LCR_8N1);
+    outb(COM1_BASE + UART_FCR, UART_FCR_ENABLE);
+    
+    /* A byte sent in loopback mode must come straight back */
+    outb(COM1_BASE + UART_MCR, UART_MCR_LOOPBACK | UART_MCR_DTR_RTS);
+    outb(COM1_BASE + UART_DATA, 0xAE);
+    for (int i = 0; i < UART_TX_SPINS && !(inb(COM1_BASE + UART_LSR) & UART_LSR_DR); i++) {
+        cpu_relax();
+    }
+    if (inb(COM1_BASE + UART_DATA) != 0xAE) {
+        serial_present = 0;
+        return -1;
+    }
+    
+    outb(COM1_BASE + UART_MCR, UART_MCR_DTR_RTS | UART_MCR_OUT2);
+    ring_init(&serial_tx, serial_tx_buf, SERIAL_TX_SIZE, sizeof(char));
+    serial_tx_busy = 0;
+    serial_present = 1;
+    
+    idt_set_handler(IRQ_BASE + COM1_IRQ, serial_interrupt_handler);
+    pic_unmask_irq(COM1_IRQ);
+    console_register(&serial_console);
+    return 0;
+}
+
+/**
+ * Check if a UART was found
+ */
+int serial_is_present(void) {
+    return serial_present;
+}
+
+/**
+ * Queue bytes for sending
+ */
+void serial_write(const char* buf, size_t len) {
+    char staged[SERIAL_STAGE_SIZE];
+    uint32_t n = 0;
+    
+    if (!serial_present) {
+        return;
+    }
+    
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            staged[n++] = '\r';
+        }
+        staged[n++] = buf[i];
+        
+        if (n >= SERIAL_STAGE_SIZE - 1) {
+            serial_queue(staged, n);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        serial_queue(staged, n);
+    }
+}
+
+/**
+ * Send a character
+ */
+void serial_putchar(char c) {
+    serial_write(&c, 1);
+}
+
+/**
+ * Wait until the ring and the UART are empty
+ * Polls, so it also works with interrupts off.
+ */
+void serial_flush(void) {
+    if (!serial_present) {
+        return;
+    }
+    
+    while (!ring_empty(&serial_tx)) {
+        if (serial_tx_poll() < 0) {
+            return;
+        }
+    }
+    for (int i = 0; i < UART_TX_SPINS && !(inb(COM1_BASE + UART_LSR) & UART_LSR_TEMT); i++) {
+        cpu_relax();
+    }
+}
@@ -0,0 +1,509 @@
+/**
+ * MiniOS - System Timer
+ * 
+ * Timekeeping: at boot, PIT channel 2 counts down a 10ms window during
+ * which the TSC and the local APIC timer are sampled, giving both their
+ * frequencies (best of a few runs, since an SMI or a preempted vCPU only
+ * ever makes a window look longer). ktime_ns() is then the TSC scaled to
+ * nanoseconds with a 32.32 fixed-point multiplier, and a tick is simply
+ * 1/TIMER_HZ of that.
+ * 
+ * Kernel timers hang off a hierarchical timer wheel. Level 0 has 256
+ * one-tick slots for the next 256 ticks; each of the four levels above has
+ * 64 slots, each slot spanning 64 times a slot of the level below, which
+ * covers any 32-bit delay. Arming and cancelling are O(1). Whenever level
+ * 0 comes round, the next slot of level 1 is cascaded down into it (and,
+ * when that level wraps too, the next level's).
+ * 
+ * With a local APIC the clock is tickless: its timer is programmed one-shot
+ * for the next tick the wheel has work on (an expiry or a cascade), so an
+ * idle CPU stays halted until then. Without one the PIT interrupts at
+ * TIMER_HZ as before. Either interrupt only raises the timer softirq,
+ * which runs the wheel up to the current tick.
+ * 
+ * The wheel is only touched under the kernel lock, from whichever CPU the
+ * holder is on, so the one-shot lives in the local APIC of the CPU that
+ * last programmed it; an early or stale interrupt just finds nothing due.
+ * timer_set_every_tick() makes one CPU's one-shot re-arm itself from its
+ * interrupt handler, so it ticks at TIMER_HZ even while the kernel lock is
+ * held for long (the profiler samples on those interrupts).
+ */
+
+#include "types.h"
+#include "timer.h"
+#include "ports.h"
+#include "idt.h"
+#include "softirq.h"
+#include "lapic.h"
+#include "smp.h"
+
+/* PIT ports and input clock */
+#define PIT_CHANNEL0        0x40
+#define PIT_CHANNEL2        0x42
+#define PIT_COMMAND         0x43
+#define PIT_FREQUENCY       1193182
+
+/* Port 0x61: channel 2 gate and output, PC speaker enable */
+#define PIT_GATE            0x61
+#define PIT_GATE_CH2        0x01
+#define PIT_GATE_SPEAKER    0x02
+#define PIT_GATE_OUT2       0x20
+
+/* Channel 0, lobyte/hibyte access, mode 3 (square wave) */
+#define PIT_CMD_CH0_MODE3   0x36
+
+/* Channel 2, lobyte/hibyte access, mode 0 (output high at terminal count) */
+#define PIT_CMD_CH2_MODE0   0xB0
+
+/* Calibration window and how long to wait for it before giving up */
+#define CALIBRATE_MS        10
+#define CALIBRATE_RUNS      3
+#define CALIBRATE_MAX_SPINS 10000000
+
+/* Timer wheel geometry */
+#define WHEEL0_BITS         8
+#define WHEELN_BITS         6
+#define WHEEL_LEVELS        5
+#define WHEEL0_SIZE         (1 << WHEEL0_BITS)
+#define WHEELN_SIZE         (1 << WHEELN_BITS)
+#define WHEEL0_MASK         (WHEEL0_SIZE - 1)
+#define WHEELN_MASK         (WHEELN_SIZE - 1)
+
+/* log2 of the ticks one slot of 'level' (>= 1) spans */
+#define WHEEL_SHIFT(level)  (WHEEL0_BITS + ((level) - 1) * WHEELN_BITS)
+
+/* Clocks */
+static uint64_t tsc_base = 0;
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_mult = 0;           /* ns per TSC cycle, 32.32 */
+static uint64_t lapic_mult = 0;         /* APIC timer counts per ns, 32.32 */
+static int tickless = 0;
+static volatile uint64_t pit_ticks = 0; /* PIT mode only */
+
+/* Wheel */
+static ktimer_t* wheel0[WHEEL0_SIZE];
+static ktimer_t* wheeln[WHEEL_LEVELS - 1][WHEELN_SIZE];
+static uint64_t wheel_tick = 0;         /* Next tick the wheel runs */
+static volatile int timers_armed = 0;
+static int wheel0_armed = 0;            /* Timers in level 0 */
+static volatile uint64_t programmed_tick = 0;  /* One-shot set for (0 = none) */
+static volatile int every_tick_cpu = -1;        /* CPU kept ticking (timer_set_every_tick) */
+
+/**
+ * Check if a slot belongs to level 0
+ */
+static inline int timer_in_wheel0(ktimer_t** slot) {
+    return slot >= &wheel0[0] && slot < &wheel0[WHEEL0_SIZE];
+}
+
+/**
+ * Put a timer on the slot for its expiry (expires >= wheel_tick)
+ */
+static void timer_enqueue(ktimer_t* timer) {
+    uint64_t delta = timer->expires - wheel_tick;
+    ktimer_t** slot;
+    
+    if (delta < WHEEL0_SIZE) {
+        slot = &wheel0[timer->expires & WHEEL0_MASK];
+        wheel0_armed++;
+    } else {
+        int level = 1;
+        while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << WHEEL_SHIFT(level + 1))) {
+            level++;
+        }
+        slot = &wheeln[level - 1][(timer->expires >> WHEEL_SHIFT(level)) & WHEELN_MASK];
+    }
+    
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+/**
+ * Unlink a timer from its wheel slot
+ */
+static void timer_unlink(ktimer_t* timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    if (timer_in_wheel0(timer->slot)) {
+        wheel0_armed--;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+    timer->pending = 0;
+    timers_armed--;
+}
+
+/**
+ * Move the current slot of 'level' down to the levels below
+ * A level wrapping to slot 0 cascades the next level up first.
+ */
+static void timer_cascade(int level) {
+    uint32_t index = (wheel_tick >> WHEEL_SHIFT(level)) & WHEELN_MASK;
+    ktimer_t* timer = wheeln[level - 1][index];
+    wheeln[level - 1][index] = NULL;
+    
+    while (timer) {
+        ktimer_t* next = timer->next;
+        timer_enqueue(timer);
+        timer = next;
+    }
+    
+    if (index == 0 && level < WHEEL_LEVELS - 1) {
+        timer_cascade(level + 1);
+    }
+}
+
+/**
+ * Earliest tick the wheel has work on: a level-0 expiry or a cascade
+ * @return 0 if no timer is armed
+ */
+static uint64_t timer_next_tick(void) {
+    if (!timers_armed) {
+        return 0;
+    }
+    
+    /* Timers above level 0 need the wheel to run at the next wrap */
+    uint64_t next = 0;
+    if (timers_armed > wheel0_armed) {
+        next = ALIGN_UP(wheel_tick, WHEEL0_SIZE);
+    }
+    
+    /* Level 0 holds only the next 256 ticks */
+    for (uint32_t i = 0; wheel0_armed && i < WHEEL0_SIZE; i++) {
+        uint64_t tick = wheel_tick + i;
+        if (next && tick >= next) {
+            break;
+        }
+        if (wheel0[tick & WHEEL0_MASK]) {
+            return tick;
+        }
+    }
+    return next;
+}
+
+/**
+ * Program the one-shot APIC timer for a tick (0 = stop it)
+ */
+static void timer_program(uint64_t tick) {
+    uint64_t flags = irq_save();
+    
+    /* The CPU kept ticking never waits longer than the next tick */
+    if ((int)smp_cpu_id() == every_tick_cpu) {
+        uint64_t next = timer_ticks() + 1;
+        if (tick == 0 || tick > next) {
+            tick = next;
+        }
+    }
+    
+    programmed_tick = tick;
+    if (tick == 0) {
+        lapic_timer_stop();
+    } else {
+        uint64_t now = ktime_ns();
+        uint64_t when = tick * TICK_NS;
+        uint64_t delta = when > now ? when - now : 0;
+        
+        /* Too far for the 32-bit counter: wake early and program again */
+        uint64_t count = (uint64_t)(((unsigned __int128)delta * lapic_mult) >> 32) + 1;
+        lapic_timer_start(count > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)count);
+    }
+    
+    irq_restore(flags);
+}
+
+/**
+ * PIT interrupt (periodic mode)
+ */
+static void timer_pit_interrupt(void) {
+    pit_ticks++;
+    if (timers_armed) {
+        softirq_raise(SOFTIRQ_TIMER);
+    }
+}
+
+/**
+ * APIC timer interrupt (tickless mode): the one-shot is spent
+ */
+static void timer_lapic_interrupt(void) {
+    /* Re-armed here, not by the softirq: that may wait long for the kernel lock */
+    if ((int)smp_cpu_id() == every_tick_cpu) {
+        timer_program(timer_ticks() + 1);
+    } else {
+        programmed_tick = 0;
+    }
+    softirq_raise(SOFTIRQ_TIMER);
+}
+
+/**
+ * Timer softirq: run the wheel up to the current tick
+ */
+static void timer_softirq(void) {
+    uint64_t now = timer_ticks();
+    
+    while (wheel_tick <= now) {
+        if (!timers_armed) {
+            wheel_tick = now + 1;
+            break;
+        }
+        
+        uint32_t index = wheel_tick & WHEEL0_MASK;
+        if (index == 0) {
+            timer_cascade(1);
+        } else if (!wheel0_armed) {
+            /* Nothing on level 0: skip ahead to the next cascade */
+            wheel_tick = MIN(ALIGN_UP(wheel_tick, WHEEL0_SIZE), now + 1);
+            continue;
+        }
+        
+        ktimer_t** slot = &wheel0[index];
+        wheel_tick++;
+        
+        ktimer_t* timer = *slot;
+        while (timer) {
+            ktimer_t* next = timer->next;
+            if (timer->expires <= now) {
+                /* Unlink first: the callback may re-arm the timer */
+                timer_unlink(timer);
+                timer->fn(timer->arg);
+                
+                /* The callback may also have cancelled the next timer */
+                next = *slot;
+            }
+            timer = next;
+        }
+    }
+    
+    if (tickless) {
+        timer_program(timer_next_tick());
+    }
+}
+
+/**
+ * Time one PIT channel 2 countdown with the TSC and the APIC timer
+ * @return 0 on success, -1 if the countdown never finished
+ */
+static int timer_calibrate_once(uint16_t latch, uint64_t* cycles, uint32_t* counts) {
+    /* Gate channel 2 on with the speaker off; OUT2 drops when the mode is set */
+    outb(PIT_GATE, (inb(PIT_GATE) & ~PIT_GATE_SPEAKER) | PIT_GATE_CH2);
+    outb(PIT_COMMAND, PIT_CMD_CH2_MODE0);
+    outb(PIT_CHANNEL2, latch & 0xFF);
+    
+    if (lapic_is_enabled()) {
+        lapic_timer_start(0xFFFFFFFF);
+    }
+    
+    /* Counting starts once the high byte is written */
+    outb(PIT_CHANNEL2, latch >> 8);
+    uint64_t start = rdtsc();
+    
+    for (uint32_t spins = 0; !(inb(PIT_GATE) & PIT_GATE_OUT2); spins++) {
+        if (spins >= CALIBRATE_MAX_SPINS) {
+            return -1;
+        }
+    }
+    
+    uint64_t end = rdtsc();
+    *cycles = end - start;
+    *counts = 0;
+    if (lapic_is_enabled()) {
+        *counts = 0xFFFFFFFF - lapic_timer_current();
+        lapic_timer_stop();
+    }
+    return 0;
+}
+
+/**
+ * Measure the TSC and APIC timer frequencies against the PIT
+ */
+static void timer_calibrate(void) {
+    uint16_t latch = PIT_FREQUENCY * CALIBRATE_MS / 1000;
+    uint64_t best_cycles = 0;
+    uint32_t best_counts = 0;
+    
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint64_t cycles;
+        uint32_t counts;
+        
+        uint64_t flags = irq_save();
+        int result = timer_calibrate_once(latch, &cycles, &counts);
+        irq_restore(flags);
+        
+        if (result < 0) {
+            return;     /* No PIT channel 2: stay on PIT ticks */
+        }
+        if (best_cycles == 0 || cycles < best_cycles) {
+            best_cycles = cycles;
+            best_counts = counts;
+        }
+    }
+    if (best_cycles == 0) {
+        return;
+    }
+    
+    tsc_hz = best_cycles * PIT_FREQUENCY / latch;
+    tsc_mult = (NS_PER_SEC << 32) / tsc_hz;
+    
+    uint64_t lapic_hz = (uint64_t)best_counts * PIT_FREQUENCY / latch;
+    lapic_mult = (lapic_hz << 32) / NS_PER_SEC;
+    
+    tsc_base = rdtsc();
+}
+
+/**
+ * Calibrate the clocks and start the timer interrupt
+ */
+void timer_init(void) {
+    lapic_init();
+    timer_calibrate();
+    
+    softirq_register(SOFTIRQ_TIMER, timer_softirq);
+    
+    /* Tickless needs both the TSC (for the time) and the APIC timer */
+    if (tsc_mult && lapic_mult) {
+        tickless = 1;
+        idt_set_handler(LAPIC_TIMER_VECTOR, timer_lapic_interrupt);
+        pic_mask_irq(0);
+        return;
+    }
+    
+    uint16_t divisor = PIT_FREQUENCY / TIMER_HZ;
+    
+    outb(PIT_COMMAND, PIT_CMD_CH0_MODE3);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, divisor >> 8);
+    
+    /* Register interrupt handler (IRQ0 = INT 32) */
+    idt_set_handler(IRQ0_TIMER, timer_pit_interrupt);
+}
+
+/**
+ * Nanoseconds since timer_init
+ */
+uint64_t ktime_ns(void) {
+    if (!tsc_mult) {
+        return pit_ticks * TICK_NS;
+    }
+    uint64_t cycles = rdtsc() - tsc_base;
+    return (uint64_t)(((unsigned __int128)cycles * tsc_mult) >> 32);
+}
+
+/**
+ * Get the number of timer ticks since timer_init
+ */
+uint64_t timer_ticks(void) {
+    return tickless ? ktime_ns() / TICK_NS : pit_ticks;
+}
+
+/**
+ * Busy-wait
+ */
+void udelay(uint32_t us) {
+    uint64_t end = ktime_ns() + us * NS_PER_US;
+    while (ktime_ns() < end) {
+        __asm__ volatile("pause");
+    }
+}
+
+/**
+ * Calibrated TSC frequency
+ */
+uint64_t timer_tsc_hz(void) {
+    return tsc_hz;
+}
+
+/**
+ * Check for the one-shot APIC clock
+ */
+int timer_is_tickless(void) {
+    return tickless;
+}
+
+/**
+ * Get the CPU kept ticking by timer_set_every_tick()
+ */
+int timer_every_tick_cpu(void) {
+    return every_tick_cpu;
+}
+
+/**
+ * Keep the calling CPU's clock interrupting every tick, or stop doing so
+ * Called with the kernel lock held.
+ */
+void timer_set_every_tick(int on) {
+    if (!tickless) {
+        return;  /* The PIT interrupts every tick anyway */
+    }
+    
+    uint64_t flags = irq_save();
+    every_tick_cpu = on ? (int)smp_cpu_id() : -1;
+    timer_program(on ? timer_ticks() + 1 : timer_next_tick());
+    irq_restore(flags);
+}
+
+/**
+ * Set up a timer
+ */
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->pending = 0;
+}
+
+/**
+ * Arm a timer
+ */
+void ktimer_arm(ktimer_t* timer, uint32_t delay) {
+    if (timer->pending) {
+        timer_unlink(timer);
+    }
+    
+    /* An empty wheel stops running while idle: catch it up first */
+    uint64_t now = timer_ticks();
+    if (!timers_armed && wheel_tick < now) {
+        wheel_tick = now;
+    }
+    
+    /* Never land in a slot the wheel has already passed */
+    if (delay == 0) {
+        delay = 1;
+    }
+    timer->expires = now + delay;
+    if (timer->expires < wheel_tick) {
+        timer->expires = wheel_tick;
+    }
+    
+    timer_enqueue(timer);
+    timer->pending = 1;
+    timers_armed++;
+    
+    /* Wake earlier if this is now the first thing due */
+    if (tickless && (programmed_tick == 0 || timer->expires < programmed_tick)) {
+        timer_program(timer_next_tick());
+    }
+}
+
+/**
+ * Disarm a timer
+ * A tickless clock may still wake for it once; the softirq finds nothing.
+ */
+void ktimer_cancel(ktimer_t* timer) {
+    if (timer->pending) {
+        timer_unlink(timer);
+    }
+}
@@ -2,11 +2,21 @@
  * MiniOS - VGA Text Mode Driver
  * 
  * Implements 80x25 VGA text mode display with colors and scrolling.
+ * 
+ * Text is written to a shadow copy in RAM: a ring of lines holding the
+ * screen and the history above it. Scrolling moves the ring's top line
+ * instead of copying the screen up, and keeps what scrolled off for
+ * Shift+PgUp. Writes mark the screen rows they touch; a flush at the end
+ * of each write copies just those rows to video memory, in one copy per
+ * run of rows, and moves the hardware cursor once.
  */
 
 #include "types.h"
 #include "vga.h"
 #include "ports.h"
+#include "string.h"
+#include "console.h"
+#include "spinlock.h"
 
 /* VGA memory-mapped I/O address */
 #define VGA_MEMORY  0xB8000
@@ -15,9 +25,29 @@
 #define VGA_CTRL_REGISTER   0x3D4
 #define VGA_DATA_REGISTER   0x3D5
 
+/* Lines of screen plus scrollback (a power of two) */
+#define VGA_RING_LINES      256
+#define VGA_RING_MASK       (VGA_RING_LINES - 1)
+#define VGA_HISTORY_LINES   (VGA_RING_LINES - VGA_HEIGHT)
+
+#define VGA_ROWS_ALL        ((1U << VGA_HEIGHT) - 1)
+
+/* Cursor position past the screen, which hides it */
+#define VGA_CURSOR_HIDDEN   (VGA_WIDTH * VGA_HEIGHT)
+
 /* VGA buffer */
 static volatile uint16_t* vga_buffer = (volatile uint16_t*)VGA_MEMORY;
 
+/* Shadow screen and history; ring line (vga_top + y) is screen row y */
+static uint16_t vga_ring[VGA_RING_LINES][VGA_WIDTH];
+static uint32_t vga_top = 0;                /* Free-running */
+static int view_back = 0;                   /* Rows scrolled back into history */
+static uint32_t dirty_rows = 0;             /* Screen rows to copy at the next flush */
+static int hw_cursor = -1;                  /* Position last sent to the CRTC */
+
+/* Writers on several CPUs (through printf and directly) */
+static spinlock_t vga_lock = SPINLOCK_INIT;
+
 /* Current cursor position */
 static int cursor_x = 0;
 static int cursor_y = 0;
@@ -25,6 +55,12 @@ static int cursor_y = 0;
 /* Current color attribute */
 static uint8_t current_color = 0x07;  /* Light grey on black */
 
+/* printf output reaches the screen through the console layer */
+static const console_t vga_console = {
+    .name = "vga",
+    .write = vga_write,
+};
+
 /**
  * Create a VGA entry (character + color)
  */
@@ -39,11 +75,40 @@ static inline uint8_t vga_color(uint8_t fg, uint8_t bg) {
     return fg | (bg << 4);
 }
 
+/**
+ * Shadow copy of a screen row
+ */
+static inline uint16_t* vga_row(int y) {
+    return vga_ring[(vga_top + y) & VGA_RING_MASK];
+}
+
+/**
+ * Write a cell of the shadow screen
+ */
+static inline void vga_set_cell(int x, int y, uint16_t entry) {
+    vga_row(y)[x] = entry;
+    dirty_rows |= 1U << y;
+}
+
+/**
+ * Blank a ring line in the current color
+ */
+static void clear_line(uint16_t* line) {
+    uint16_t blank = vga_entry(' ', current_color);
+    
+    for (int x = 0; x < VGA_WIDTH; x++) {
+        line[x] = blank;
+    }
+}
+
 /**
  * Update the hardware cursor position
  */
-static void update_cursor(void) {
-    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
+static void update_cursor(int pos) {
+    if (pos == hw_cursor) {
+        return;
+    }
+    hw_cursor = pos;
     
     outb(VGA_CTRL_REGISTER, 0x0F);
     outb(VGA_DATA_REGISTER, (uint8_t)(pos & 0xFF));
@@ -52,19 +117,45 @@ static void update_cursor(void) {
 }
 
 /**
- * Scroll the screen up by one line
+ * Copy the dirty rows of the visible lines to video memory
+ * Consecutive dirty rows that are also consecutive in the ring go in one copy.
  */
-static void scroll(void) {
-    /* Move all lines up by one */
-    for (int y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            vga_buffer[y * VGA_WIDTH + x] = vga_buffer[(y + 1) * VGA_WIDTH + x];
+static void vga_flush(void) {
+    uint32_t first = vga_top - view_back;
+    
+    while (dirty_rows) {
+        int y = __builtin_ctz(dirty_rows);
+        int end = y + 1;
+        
+        while (end < VGA_HEIGHT && (dirty_rows & (1U << end)) && ((first + end) & VGA_RING_MASK)) {
+            end++;
         }
+        memcpy((void*)(vga_buffer + y * VGA_WIDTH), vga_ring[(first + y) & VGA_RING_MASK],
+               (end - y) * VGA_WIDTH * sizeof(uint16_t));
+        dirty_rows &= ~(((1U << end) - 1) & ~((1U << y) - 1));
     }
     
-    /* Clear the last line */
-    for (int x = 0; x < VGA_WIDTH; x++) {
-        vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = vga_entry(' ', current_color);
+    /* History on screen: the cursor's row isn't */
+    update_cursor(view_back ? VGA_CURSOR_HIDDEN : cursor_y * VGA_WIDTH + cursor_x);
+}
+
+/**
+ * Scroll the screen up by one line
+ */
+static void scroll(void) {
+    /* The old top row becomes history; a blank line enters at the bottom */
+    vga_top++;
+    clear_line(vga_row(VGA_HEIGHT - 1));
+    dirty_rows = VGA_ROWS_ALL;
+}
+
+/**
+ * Go back to the live screen before writing to it
+ */
+static void vga_unscroll(void) {
+    if (view_back) {
+        view_back = 0;
+        dirty_rows = VGA_ROWS_ALL;
     }
 }
 
@@ -76,25 +167,43 @@ void vga_init(void) {
     cursor_y = 0;
     current_color = vga_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
     
+    /* Start from a blank shadow; nothing is shown until the first flush */
+    for (int i = 0; i < VGA_RING_LINES; i++) {
+        clear_line(vga_ring[i]);
+    }
+    vga_top = 0;
+    view_back = 0;
+    dirty_rows = 0;
+    
     /* Enable cursor (shape: lines 14-15) */
     outb(VGA_CTRL_REGISTER, 0x0A);
     outb(VGA_DATA_REGISTER, (inb(VGA_DATA_REGISTER) & 0xC0) | 14);
     outb(VGA_CTRL_REGISTER, 0x0B);
     outb(VGA_DATA_REGISTER, (inb(VGA_DATA_REGISTER) & 0xE0) | 15);
     
-    update_cursor();
+    hw_cursor = -1;
+    update_cursor(0);
+    console_register(&vga_console);
 }
 
 /**
  * Clear the screen
+ * What was on it stays in the history.
  */
 void vga_clear(void) {
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        vga_buffer[i] = vga_entry(' ', current_color);
+    uint64_t flags = spin_lock_irqsave(&vga_lock);
+    
+    vga_unscroll();
+    vga_top += cursor_y + (cursor_x > 0);
+    for (int y = 0; y < VGA_HEIGHT; y++) {
+        clear_line(vga_row(y));
     }
+    dirty_rows = VGA_ROWS_ALL;
     cursor_x = 0;
     cursor_y = 0;
-    update_cursor();
+    vga_flush();
+    
+    spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 /**
@@ -105,21 +214,21 @@ void vga_set_color(uint8_t fg, uint8_t bg) {
 }
 
 /**
- * Put a single character at current cursor position
+ * Put a character at the cursor in the shadow screen
  */
-void vga_putchar(char c) {
+static void vga_put(char c) {
     switch (c) {
         case '\n':
             /* Newline */
             cursor_x = 0;
             cursor_y++;
             break;
-            
+        
         case '\r':
             /* Carriage return */
             cursor_x = 0;
             break;
-            
+        
         case '\t':
             /* Tab - move to next 8-character boundary */
             cursor_x = (cursor_x + 8) & ~7;
@@ -128,19 +237,19 @@ void vga_putchar(char c) {
                 cursor_y++;
             }
             break;
-            
+        
         case '\b':
             /* Backspace */
             if (cursor_x > 0) {
                 cursor_x--;
-                vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = vga_entry(' ', current_color);
+                vga_set_cell(cursor_x, cursor_y, vga_entry(' ', current_color));
             }
             break;
-            
+        
         default:
             /* Regular character */
             if (c >= ' ') {
-                vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = vga_entry(c, current_color);
+                vga_set_cell(cursor_x, cursor_y, vga_entry(c, current_color));
                 cursor_x++;
                 if (cursor_x >= VGA_WIDTH) {
                     cursor_x = 0;
@@ -155,17 +264,55 @@ void vga_putchar(char c) {
         scroll();
         cursor_y--;
     }
+}
+
+/**
+ * Put a single character at current cursor position
+ */
+void vga_putchar(char c) {
+    vga_write(&c, 1);
+}
+
+/**
+ * Write a buffer, then flush it to the screen once
+ */
+void vga_write(const char* buf, size_t len) {
+    uint64_t flags = spin_lock_irqsave(&vga_lock);
+    
+    vga_unscroll();
+    for (size_t i = 0; i < len; i++) {
+        vga_put(buf[i]);
+    }
+    vga_flush();
     
-    update_cursor();
+    spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 /**
  * Print a null-terminated string
  */
 void vga_puts(const char* str) {
-    while (*str) {
-        vga_putchar(*str++);
+    vga_write(str, strlen(str));
+}
+
+/**
+ * Move the view 'lines' rows back into the history (negative: forward)
+ */
+void vga_scroll_view(int lines) {
+    uint64_t flags = spin_lock_irqsave(&vga_lock);
+    
+    int history = (int)MIN(vga_top, (uint32_t)VGA_HISTORY_LINES);
+    int back = view_back + lines;
+    if (back < 0) back = 0;
+    if (back > history) back = history;
+    
+    if (back != view_back) {
+        view_back = back;
+        dirty_rows = VGA_ROWS_ALL;
+        vga_flush();
     }
+    
+    spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 /**
@@ -173,9 +320,11 @@ void vga_puts(const char* str) {
  */
 void vga_set_cursor(int x, int y) {
     if (x >= 0 && x < VGA_WIDTH && y >= 0 && y < VGA_HEIGHT) {
+        uint64_t flags = spin_lock_irqsave(&vga_lock);
         cursor_x = x;
         cursor_y = y;
-        update_cursor();
+        vga_flush();
+        spin_unlock_irqrestore(&vga_lock, flags);
     }
 }
 
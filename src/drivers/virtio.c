@@ -0,0 +1,712 @@
+/**
+ * MiniOS - Virtio Transport and Virtqueues
+ * 
+ * Common code for the virtio-pci drivers: transport detection (modern
+ * MMIO capabilities, or the legacy I/O-port interface), status and
+ * feature negotiation, config space access, and virtqueues.
+ * 
+ * A split virtqueue's descriptors sit on a free list threaded through
+ * their 'next' fields. virtq_add() takes a chain off the head of the list
+ * (the links are already in place, so only the last descriptor's flags end
+ * it), virtq_get() walks a used chain and splices it back. Chains are
+ * published to the device in batches by virtq_kick(), which also honours
+ * the device's notification suppression (flags or event index).
+ * 
+ * A packed virtqueue is one ring of descriptors filled in order. A chain
+ * takes the next free slots and a buffer ID; flipping the AVAIL/USED bits
+ * of its first descriptor (written last) hands it to the device, which
+ * writes one used descriptor per chain back into the same ring. The wrap
+ * counters tell this lap's entries from the last one's, so neither side
+ * keeps an index the other has to read, and a descriptor and its
+ * completion share a cache line.
+ */
+
+#include "types.h"
+#include "virtio.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#include "string.h"
+#include "heap.h"
+
+/* Legacy virtio-pci register offsets (I/O BAR0) */
+#define VIRTIO_PCI_HOST_FEATURES    0x00
+#define VIRTIO_PCI_GUEST_FEATURES   0x04
+#define VIRTIO_PCI_QUEUE_PFN        0x08
+#define VIRTIO_PCI_QUEUE_SIZE       0x0C
+#define VIRTIO_PCI_QUEUE_SEL        0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY     0x10
+#define VIRTIO_PCI_STATUS           0x12
+#define VIRTIO_PCI_ISR              0x13
+#define VIRTIO_PCI_CONFIG           0x14
+
+/* Virtio PCI capability (modern) */
+#define PCI_CAP_ID_VENDOR           0x09
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+
+/* Common configuration structure offsets (modern) */
+#define VIRTIO_COMMON_DFSELECT      0x00
+#define VIRTIO_COMMON_DF            0x04
+#define VIRTIO_COMMON_GFSELECT      0x08
+#define VIRTIO_COMMON_GF            0x0C
+#define VIRTIO_COMMON_STATUS        0x14
+#define VIRTIO_COMMON_Q_SELECT      0x16
+#define VIRTIO_COMMON_Q_SIZE        0x18
+#define VIRTIO_COMMON_Q_ENABLE      0x1C
+#define VIRTIO_COMMON_Q_NOFF        0x1E
+#define VIRTIO_COMMON_Q_DESC        0x20
+#define VIRTIO_COMMON_Q_DRIVER      0x28
+#define VIRTIO_COMMON_Q_DEVICE      0x30
+
+/* Highest physical address covered by the boot identity map */
+extern uint64_t phys_mapped_top;
+
+/**
+ * MMIO register access
+ */
+static inline uint8_t mmio_read8(volatile uint8_t* base, int off) {
+    return *(volatile uint8_t*)(base + off);
+}
+
+static inline uint16_t mmio_read16(volatile uint8_t* base, int off) {
+    return *(volatile uint16_t*)(base + off);
+}
+
+static inline uint32_t mmio_read32(volatile uint8_t* base, int off) {
+    return *(volatile uint32_t*)(base + off);
+}
+
+static inline void mmio_write8(volatile uint8_t* base, int off, uint8_t value) {
+    *(volatile uint8_t*)(base + off) = value;
+}
+
+static inline void mmio_write16(volatile uint8_t* base, int off, uint16_t value) {
+    *(volatile uint16_t*)(base + off) = value;
+}
+
+static inline void mmio_write32(volatile uint8_t* base, int off, uint32_t value) {
+    *(volatile uint32_t*)(base + off) = value;
+}
+
+static inline void mmio_write64(volatile uint8_t* base, int off, uint64_t value) {
+    mmio_write32(base, off, (uint32_t)value);
+    mmio_write32(base, off + 4, (uint32_t)(value >> 32));
+}
+
+/**
+ * Device status register
+ */
+static uint8_t virtio_get_status(virtio_dev_t* vdev) {
+    return vdev->modern ? mmio_read8(vdev->common_cfg, VIRTIO_COMMON_STATUS)
+                        : inb(vdev->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void virtio_set_status(virtio_dev_t* vdev, uint8_t status) {
+    if (vdev->modern) {
+        mmio_write8(vdev->common_cfg, VIRTIO_COMMON_STATUS, status);
+    } else {
+        outb(vdev->io_base + VIRTIO_PCI_STATUS, status);
+    }
+}
+
+/**
+ * Map a virtio capability's region, if it lies inside the identity map
+ */
+static volatile uint8_t* virtio_map_cap(pci_device_t* dev, uint8_t cap) {
+    uint8_t bar = pci_config_read8(dev->bus, dev->device, dev->function, cap + 4);
+    uint32_t offset = pci_config_read(dev->bus, dev->device, dev->function, cap + 8);
+    uint32_t length = pci_config_read(dev->bus, dev->device, dev->function, cap + 12);
+    
+    if (bar > 5 || (dev->bar[bar] & 1)) {
+        return NULL;  /* Not a memory BAR */
+    }
+    
+    uint64_t addr = pci_bar_address(dev, bar);
+    if (addr == 0 || addr + offset + length > phys_mapped_top) {
+        return NULL;
+    }
+    return (volatile uint8_t*)(uintptr_t)(addr + offset);
+}
+
+/**
+ * Find the modern transport's register regions
+ * @return 0 if all four are present and mapped, -1 to fall back to legacy
+ */
+static int virtio_probe_modern(virtio_dev_t* vdev, pci_device_t* dev) {
+    uint8_t cap = 0;
+    
+    while ((cap = pci_find_capability(dev, PCI_CAP_ID_VENDOR, cap)) != 0) {
+        uint8_t type = pci_config_read8(dev->bus, dev->device, dev->function, cap + 3);
+        
+        /* The first capability of each type is the preferred one */
+        if (type == VIRTIO_PCI_CAP_COMMON_CFG && !vdev->common_cfg) {
+            vdev->common_cfg = virtio_map_cap(dev, cap);
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY_CFG && !vdev->notify_base) {
+            vdev->notify_base = virtio_map_cap(dev, cap);
+            vdev->notify_multiplier = pci_config_read(dev->bus, dev->device,
+                                                      dev->function, cap + 16);
+        } else if (type == VIRTIO_PCI_CAP_ISR_CFG && !vdev->isr_cfg) {
+            vdev->isr_cfg = virtio_map_cap(dev, cap);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE_CFG && !vdev->device_cfg) {
+            vdev->device_cfg = virtio_map_cap(dev, cap);
+        }
+    }
+    
+    if (!vdev->common_cfg || !vdev->notify_base || !vdev->isr_cfg || !vdev->device_cfg) {
+        vdev->common_cfg = vdev->notify_base = vdev->isr_cfg = vdev->device_cfg = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Bring up the transport, reset the device and announce the driver
+ */
+int virtio_pci_init(virtio_dev_t* vdev, pci_device_t* pci) {
+    memset(vdev, 0, sizeof(*vdev));
+    
+    /* Enable bus mastering */
+    pci_enable_bus_master(pci);
+    
+    /* Prefer the modern transport; transitional devices also have BAR0 I/O */
+    if (virtio_probe_modern(vdev, pci) == 0) {
+        vdev->modern = 1;
+        pci_enable_mmio(pci);
+    } else if (pci->bar[0] & 1) {
+        vdev->io_base = pci->bar[0] & 0xFFFC;  /* Remove I/O space bit */
+    } else {
+        return -1;
+    }
+    
+    /* Reset device (modern devices finish the reset before reading back 0) */
+    virtio_set_status(vdev, 0);
+    while (vdev->modern && virtio_get_status(vdev) != 0) {
+        __asm__ volatile("pause");
+    }
+    
+    virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    return 0;
+}
+
+/**
+ * Get the offered feature bits
+ */
+uint64_t virtio_get_features(virtio_dev_t* vdev) {
+    if (!vdev->modern) {
+        return inl(vdev->io_base + VIRTIO_PCI_HOST_FEATURES);
+    }
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_DFSELECT, 0);
+    uint64_t low = mmio_read32(vdev->common_cfg, VIRTIO_COMMON_DF);
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_DFSELECT, 1);
+    uint64_t high = mmio_read32(vdev->common_cfg, VIRTIO_COMMON_DF);
+    return low | (high << 32);
+}
+
+/**
+ * Accept features (modern devices must confirm them)
+ */
+int virtio_set_features(virtio_dev_t* vdev, uint64_t features) {
+    vdev->features = features;
+    
+    if (!vdev->modern) {
+        outl(vdev->io_base + VIRTIO_PCI_GUEST_FEATURES, (uint32_t)features);
+        return 0;
+    }
+    
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_GFSELECT, 0);
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_GF, (uint32_t)features);
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_GFSELECT, 1);
+    mmio_write32(vdev->common_cfg, VIRTIO_COMMON_GF, (uint32_t)(features >> 32));
+    
+    virtio_set_status(vdev, virtio_get_status(vdev) | VIRTIO_STATUS_FEATURES_OK);
+    if (!(virtio_get_status(vdev) & VIRTIO_STATUS_FEATURES_OK)) {
+        virtio_fail(vdev);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Driver ready
+ */
+void virtio_driver_ok(virtio_dev_t* vdev) {
+    virtio_set_status(vdev, virtio_get_status(vdev) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+/**
+ * Mark the device failed
+ */
+void virtio_fail(virtio_dev_t* vdev) {
+    virtio_set_status(vdev, VIRTIO_STATUS_FAILED);
+}
+
+/**
+ * Interrupt status (reading it acknowledges the interrupt)
+ */
+uint8_t virtio_read_isr(virtio_dev_t* vdev) {
+    return vdev->modern ? mmio_read8(vdev->isr_cfg, 0)
+                        : inb(vdev->io_base + VIRTIO_PCI_ISR);
+}
+
+/**
+ * Device configuration space
+ */
+uint8_t virtio_config_read8(virtio_dev_t* vdev, int off) {
+    return vdev->modern ? mmio_read8(vdev->device_cfg, off)
+                        : inb(vdev->io_base + VIRTIO_PCI_CONFIG + off);
+}
+
+uint16_t virtio_config_read16(virtio_dev_t* vdev, int off) {
+    return vdev->modern ? mmio_read16(vdev->device_cfg, off)
+                        : inw(vdev->io_base + VIRTIO_PCI_CONFIG + off);
+}
+
+uint32_t virtio_config_read32(virtio_dev_t* vdev, int off) {
+    return vdev->modern ? mmio_read32(vdev->device_cfg, off)
+                        : inl(vdev->io_base + VIRTIO_PCI_CONFIG + off);
+}
+
+uint64_t virtio_config_read64(virtio_dev_t* vdev, int off) {
+    return (uint64_t)virtio_config_read32(vdev, off) |
+           ((uint64_t)virtio_config_read32(vdev, off + 4) << 32);
+}
+
+/**
+ * Event index fields living past the end of each ring
+ */
+static inline volatile uint16_t* virtq_used_event(virtq_t* vq) {
+    return (volatile uint16_t*)((uint8_t*)vq->avail + sizeof(virtq_avail_t) +
+                                vq->size * sizeof(uint16_t));
+}
+
+static inline volatile uint16_t* virtq_avail_event(virtq_t* vq) {
+    return (volatile uint16_t*)((uint8_t*)vq->used + sizeof(virtq_used_t) +
+                                vq->size * sizeof(virtq_used_elem_t));
+}
+
+/**
+ * Check if moving an index from 'old' to 'new_idx' crosses 'event'
+ */
+static inline int virtq_need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/**
+ * Allocate the rings and put every descriptor on the free list
+ */
+static int virtq_alloc(virtq_t* vq, uint16_t size) {
+    size_t desc_size = size * sizeof(virtq_desc_t);
+    size_t avail_size = sizeof(uint16_t) * (3 + size);
+    size_t used_size = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * size;
+    
+    /* The legacy layout puts the used ring on the next page boundary */
+    size_t used_offset = ALIGN_UP(desc_size + avail_size, PAGE_SIZE);
+    size_t pages = (used_offset + ALIGN_UP(used_size, PAGE_SIZE)) / PAGE_SIZE;
+    
+    uint8_t* mem = (uint8_t*)pmm_alloc_pages(pages);
+    vq->cookies = (void**)kcalloc(size, sizeof(void*));
+    if (!mem || !vq->cookies) {
+        if (mem) pmm_free_pages(mem, pages);
+        kfree(vq->cookies);
+        vq->cookies = NULL;
+        return -1;
+    }
+    memset(mem, 0, pages * PAGE_SIZE);
+    
+    vq->desc = (virtq_desc_t*)mem;
+    vq->avail = (virtq_avail_t*)(mem + desc_size);
+    vq->used = (virtq_used_t*)(mem + used_offset);
+    vq->size = size;
+    vq->avail_idx = 0;
+    vq->kicked_idx = 0;
+    vq->last_used_idx = 0;
+    
+    for (uint16_t i = 0; i < size; i++) {
+        vq->desc[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+    return 0;
+}
+
+/**
+ * Allocate a packed ring and put every buffer ID on the free list
+ */
+static int virtq_alloc_packed(virtq_t* vq, uint16_t size) {
+    size_t ring_size = size * sizeof(virtq_packed_desc_t);
+    size_t pages = ALIGN_UP(ring_size + 2 * sizeof(virtq_event_t), PAGE_SIZE) / PAGE_SIZE;
+    
+    uint8_t* mem = (uint8_t*)pmm_alloc_pages(pages);
+    vq->cookies = (void**)kcalloc(size, sizeof(void*));
+    vq->id_next = (uint16_t*)kcalloc(2 * (size_t)size, sizeof(uint16_t));
+    if (!mem || !vq->cookies || !vq->id_next) {
+        if (mem) pmm_free_pages(mem, pages);
+        kfree(vq->cookies);
+        kfree(vq->id_next);
+        vq->cookies = NULL;
+        vq->id_next = NULL;
+        return -1;
+    }
+    memset(mem, 0, pages * PAGE_SIZE);
+    
+    /* Both event areas start out 0: notifications and interrupts enabled */
+    vq->ring = (virtq_packed_desc_t*)mem;
+    vq->driver_event = (virtq_event_t*)(mem + ring_size);
+    vq->device_event = vq->driver_event + 1;
+    vq->id_count = vq->id_next + size;
+    vq->size = size;
+    vq->avail_idx = 0;
+    vq->kicked_idx = 0;
+    vq->last_used_idx = 0;
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    
+    for (uint16_t i = 0; i < size; i++) {
+        vq->id_next[i] = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+    return 0;
+}
+
+/**
+ * Set up a virtqueue in the device
+ */
+int virtq_setup(virtio_dev_t* vdev, virtq_t* vq, int queue_idx, uint16_t max_size) {
+    uint16_t size;
+    
+    spin_init(&vq->lock);
+    
+    /* Packed rings need the modern transport (the feature bit is above 31) */
+    vq->packed = vdev->modern && (vdev->features & VIRTIO_F_RING_PACKED);
+    
+    /* Select queue; a size of 0 means the queue doesn't exist */
+    if (vdev->modern) {
+        mmio_write16(vdev->common_cfg, VIRTIO_COMMON_Q_SELECT, queue_idx);
+        size = mmio_read16(vdev->common_cfg, VIRTIO_COMMON_Q_SIZE);
+        
+        /* Modern devices accept a smaller ring (still a power of two) */
+        while (size > max_size && size > 1) {
+            size /= 2;
+        }
+    } else {
+        /* Legacy devices fix the ring size */
+        outw(vdev->io_base + VIRTIO_PCI_QUEUE_SEL, queue_idx);
+        size = inw(vdev->io_base + VIRTIO_PCI_QUEUE_SIZE);
+    }
+    if (size == 0) {
+        return -1;
+    }
+    if (vq->packed) {
+        /* Any size will do: slots wrap explicitly rather than by masking */
+        if (virtq_alloc_packed(vq, size) < 0) {
+            return -1;
+        }
+    } else if ((size & (size - 1)) || virtq_alloc(vq, size) < 0) {
+        return -1;
+    }
+    
+    vq->dev = vdev;
+    vq->queue_idx = queue_idx;
+    vq->event_idx = (vdev->features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    
+    if (!vdev->modern) {
+        /* Tell device about queue location (page frame number) */
+        uint32_t pfn = (uint32_t)((uintptr_t)vq->desc / PAGE_SIZE);
+        outl(vdev->io_base + VIRTIO_PCI_QUEUE_PFN, pfn);
+        return 0;
+    }
+    
+    /* Modern devices take each area's address separately; for a packed
+     * ring the driver and device areas are the event suppression structures */
+    mmio_write16(vdev->common_cfg, VIRTIO_COMMON_Q_SIZE, size);
+    if (vq->packed) {
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DESC, (uintptr_t)vq->ring);
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DRIVER, (uintptr_t)vq->driver_event);
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DEVICE, (uintptr_t)vq->device_event);
+    } else {
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DESC, (uintptr_t)vq->desc);
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DRIVER, (uintptr_t)vq->avail);
+        mmio_write64(vdev->common_cfg, VIRTIO_COMMON_Q_DEVICE, (uintptr_t)vq->used);
+    }
+    
+    uint16_t notify_off = mmio_read16(vdev->common_cfg, VIRTIO_COMMON_Q_NOFF);
+    vq->notify = (volatile uint16_t*)(vdev->notify_base + notify_off * vdev->notify_multiplier);
+    
+    mmio_write16(vdev->common_cfg, VIRTIO_COMMON_Q_ENABLE, 1);
+    return 0;
+}
+
+/**
+ * Packed ring: fill the next slots with a chain under a free buffer ID
+ */
+static int virtq_add_packed(virtq_t* vq, const virtq_buf_t* bufs, int out, int in,
+                            void* cookie) {
+    int count = out + in;
+    
+    /* There are as many IDs as slots, so an ID is free whenever slots are */
+    uint16_t id = vq->free_head;
+    vq->free_head = vq->id_next[id];
+    vq->id_count[id] = count;
+    vq->cookies[id] = cookie;
+    
+    /* AVAIL set to our wrap counter and USED to its inverse marks a slot
+     * available; the first slot's flags wait so the chain appears at once */
+    uint16_t head = vq->avail_idx;
+    uint16_t head_flags = 0;
+    uint16_t slot = head;
+    for (int i = 0; i < count; i++) {
+        virtq_packed_desc_t* d = &vq->ring[slot];
+        uint16_t flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                         (i < count - 1 ? VIRTQ_DESC_F_NEXT : 0) |
+                         (vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+        d->addr = (uint64_t)(uintptr_t)bufs[i].addr;
+        d->len = bufs[i].len;
+        d->id = id;
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            d->flags = flags;
+        }
+        
+        if (++slot == vq->size) {
+            slot = 0;
+            vq->avail_wrap ^= 1;
+        }
+    }
+    vq->avail_idx = slot;
+    vq->kicked_idx += count;
+    vq->num_free -= count;
+    
+    /* The rest of the chain must be visible before its head */
+    virtio_wmb();
+    ((volatile virtq_packed_desc_t*)vq->ring)[head].flags = head_flags;
+    return 0;
+}
+
+/**
+ * Queue a descriptor chain
+ */
+int virtq_add(virtq_t* vq, const virtq_buf_t* bufs, int out, int in, void* cookie) {
+    int count = out + in;
+    if (count == 0 || count > vq->num_free) {
+        return -1;
+    }
+    if (vq->packed) {
+        return virtq_add_packed(vq, bufs, out, in, cookie);
+    }
+    
+    /* Free descriptors are already linked: fill them in along the list */
+    uint16_t head = vq->free_head;
+    uint16_t id = head;
+    for (int i = 0; i < count; i++) {
+        virtq_desc_t* d = &vq->desc[id];
+        d->addr = (uint64_t)(uintptr_t)bufs[i].addr;
+        d->len = bufs[i].len;
+        d->flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                   (i < count - 1 ? VIRTQ_DESC_F_NEXT : 0);
+        id = d->next;
+    }
+    vq->free_head = id;
+    vq->num_free -= count;
+    vq->cookies[head] = cookie;
+    
+    vq->avail->ring[vq->avail_idx & (vq->size - 1)] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+/**
+ * Ring the queue's doorbell
+ */
+static void virtq_notify(virtq_t* vq) {
+    if (vq->dev->modern) {
+        *vq->notify = vq->queue_idx;
+    } else {
+        outw(vq->dev->io_base + VIRTIO_PCI_QUEUE_NOTIFY, vq->queue_idx);
+    }
+}
+
+/**
+ * Packed ring: the chains are already visible, decide whether to notify
+ */
+static void virtq_kick_packed(virtq_t* vq) {
+    uint16_t added = vq->kicked_idx;
+    if (added == 0) {
+        return;
+    }
+    vq->kicked_idx = 0;
+    
+    /* Publish the descriptors before reading the device's suppression state */
+    virtio_mb();
+    
+    /* Read both fields at once so they belong together */
+    uint32_t event = *(volatile uint32_t*)vq->device_event;
+    uint16_t off_wrap = (uint16_t)event;
+    uint16_t flags = (uint16_t)(event >> 16);
+    
+    int need;
+    if (flags == VIRTQ_EVENT_F_DESC) {
+        /* Slots counted across laps: an event from the other lap is a lap back */
+        uint16_t new_idx = vq->avail_idx;
+        uint16_t old = new_idx - added;
+        uint16_t event_idx = off_wrap & 0x7FFF;
+        if ((off_wrap >> 15) != vq->avail_wrap) {
+            event_idx -= vq->size;
+        }
+        need = virtq_need_event(event_idx, new_idx, old);
+    } else {
+        need = flags != VIRTQ_EVENT_F_DISABLE;
+    }
+    
+    if (need) {
+        virtq_notify(vq);
+    }
+}
+
+/**
+ * Publish new chains and notify the device
+ */
+void virtq_kick(virtq_t* vq) {
+    if (vq->packed) {
+        virtq_kick_packed(vq);
+        return;
+    }
+    
+    uint16_t new_idx = vq->avail_idx;
+    uint16_t old = vq->kicked_idx;
+    
+    if (new_idx == old) {
+        return;
+    }
+    
+    /* Descriptors and ring entries must be visible before the index */
+    virtio_wmb();
+    vq->avail->idx = new_idx;
+    vq->kicked_idx = new_idx;
+    
+    /* Publish avail->idx before reading the device's suppression state */
+    virtio_mb();
+    
+    int need;
+    if (vq->event_idx) {
+        need = virtq_need_event(*virtq_avail_event(vq), new_idx, old);
+    } else {
+        need = !(*(volatile uint16_t*)&vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    
+    if (need) {
+        virtq_notify(vq);
+    }
+}
+
+/**
+ * Packed ring: take the used descriptor in the next slot
+ */
+static void* virtq_get_packed(virtq_t* vq, uint32_t* len) {
+    /* Read the entry only after seeing the flags that cover it */
+    virtio_rmb();
+    
+    virtq_packed_desc_t* d = &vq->ring[vq->last_used_idx];
+    uint16_t id = d->id;
+    if (len) {
+        *len = d->len;
+    }
+    
+    /* The device used the chain's slots too, even though it wrote only one */
+    uint16_t count = vq->id_count[id];
+    vq->last_used_idx += count;
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap ^= 1;
+    }
+    
+    void* cookie = vq->cookies[id];
+    vq->cookies[id] = NULL;
+    vq->id_next[id] = vq->free_head;
+    vq->free_head = id;
+    vq->num_free += count;
+    
+    return cookie;
+}
+
+/**
+ * Take the next used chain
+ */
+void* virtq_get(virtq_t* vq, uint32_t* len) {
+    if (!virtq_has_used(vq)) {
+        return NULL;
+    }
+    if (vq->packed) {
+        return virtq_get_packed(vq, len);
+    }
+    
+    /* Read the entry only after seeing the index that covers it */
+    virtio_rmb();
+    
+    virtq_used_elem_t* elem = &vq->used->ring[vq->last_used_idx & (vq->size - 1)];
+    uint16_t head = (uint16_t)elem->id;
+    if (len) {
+        *len = elem->len;
+    }
+    vq->last_used_idx++;
+    
+    void* cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+    
+    /* Splice the whole chain back onto the free list */
+    uint16_t tail = head;
+    uint16_t count = 1;
+    while (vq->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+        tail = vq->desc[tail].next;
+        count++;
+    }
+    vq->desc[tail].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+    
+    return cookie;
+}
+
+/**
+ * Stop used-buffer interrupts
+ */
+void virtq_disable_irq(virtq_t* vq) {
+    if (vq->packed) {
+        ((volatile virtq_event_t*)vq->driver_event)->flags = VIRTQ_EVENT_F_DISABLE;
+    } else if (vq->event_idx) {
+        /* Park the event index half the ring space away */
+        *virtq_used_event(vq) = vq->last_used_idx + 0x8000;
+    } else {
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+/**
+ * Restart used-buffer interrupts
+ */
+int virtq_enable_irq(virtq_t* vq) {
+    if (vq->packed) {
+        volatile virtq_event_t* event = (volatile virtq_event_t*)vq->driver_event;
+        if (vq->event_idx) {
+            /* Interrupt once the device reaches the next slot we'd look at */
+            event->off_wrap = vq->last_used_idx | ((uint16_t)vq->used_wrap << 15);
+            virtio_wmb();
+            event->flags = VIRTQ_EVENT_F_DESC;
+        } else {
+            event->flags = VIRTQ_EVENT_F_ENABLE;
+        }
+    } else if (vq->event_idx) {
+        *virtq_used_event(vq) = vq->last_used_idx;
+    } else {
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+    
+    /* The re-arm must be visible before we look at the used ring */
+    virtio_mb();
+    return virtq_has_used(vq);
+}
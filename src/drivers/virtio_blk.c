@@ -0,0 +1,314 @@
+/**
+ * MiniOS - Virtio Block Driver
+ * 
+ * Backend for the block request queue on QEMU's paravirtual disk. Each
+ * command is one descriptor chain on the request virtqueue: a header
+ * (type and sector) the device reads, the data buffers of the merged chain,
+ * and a status byte the device writes. Several commands are in flight at
+ * once, as many as the ring has descriptors for.
+ * 
+ * The device transfers straight to and from the callers' buffers, without
+ * emulating any disk controller, so this is the fastest backend under QEMU
+ * and the one probed first.
+ */
+
+#include "types.h"
+#include "virtio_blk.h"
+#include "virtio.h"
+#include "pci.h"
+#include "heap.h"
+#include "idt.h"
+#include "string.h"
+#include "timer.h"
+#include "blk.h"
+
+/* Virtio block device IDs */
+#define VIRTIO_BLK_DEVICE_ID    0x1001  /* Legacy (transitional) block device */
+#define VIRTIO_BLK_MODERN_ID    0x1042  /* Modern-only block device */
+
+/* Device configuration offsets */
+#define VIRTIO_BLK_CFG_CAPACITY 0x00    /* 512-byte sectors (64-bit) */
+#define VIRTIO_BLK_CFG_SIZE_MAX 0x08    /* Largest single buffer */
+#define VIRTIO_BLK_CFG_SEG_MAX  0x0C    /* Most data buffers per request */
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX   (1ULL << 1)
+#define VIRTIO_BLK_F_SEG_MAX    (1ULL << 2)
+#define VIRTIO_BLK_F_RO         (1ULL << 5)     /* Read-only disk */
+
+/* Features we know how to use. FLUSH is left out: without it the device
+ * must complete writes only once they are stable. */
+#define VIRTIO_BLK_DRIVER_FEATURES  (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | \
+                                     VIRTIO_BLK_F_RO | VIRTIO_RING_F_EVENT_IDX | \
+                                     VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED)
+
+/* Request types and status */
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_S_OK         0
+
+/* Limits on one command */
+#define VIRTIO_BLK_MAX_SEGMENTS 16
+#define VIRTIO_BLK_MAX_SECTORS  2048        /* 1MB */
+#define VIRTIO_BLK_MAX_DEPTH    32
+
+/* Request header (device-readable) */
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} PACKED virtio_blk_req_hdr_t;
+
+/* One command slot: the chain's cookie */
+typedef struct {
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;        /* Written by the device */
+    uint8_t busy;                   /* Chain owned by the device */
+    blk_request_t* req;
+} vblk_cmd_t;
+
+/* Driver state */
+static virtio_dev_t vdev;
+static virtq_t req_queue;
+static int vblk_present = 0;
+static int vblk_readonly = 0;
+static uint8_t irq_line = 0;            /* 0 = no interrupt, poll */
+static vblk_cmd_t* cmds = NULL;
+static uint32_t num_cmds = 0;
+static ktimer_t poll_timer;
+static blk_device_t vblk_blk;
+
+/**
+ * Reap the chains the device has used
+ */
+static void vblk_complete(void) {
+    vblk_cmd_t* cmd;
+    
+    while ((cmd = (vblk_cmd_t*)virtq_get(&req_queue, NULL)) != NULL) {
+        blk_request_t* req = cmd->req;
+        cmd->busy = 0;
+        cmd->req = NULL;
+        blk_end_request(req, cmd->status == VIRTIO_BLK_S_OK ? 0 : -1);
+    }
+}
+
+/**
+ * Device interrupt (the PCI line may be shared)
+ */
+static void vblk_interrupt(void) {
+    /* Reading the ISR status acknowledges the interrupt */
+    if (virtio_read_isr(&vdev) & VIRTIO_ISR_QUEUE) {
+        blk_interrupt();
+    }
+}
+
+/**
+ * No interrupt line: look at the ring every tick while commands are out
+ */
+static void vblk_poll(void* arg) {
+    (void)arg;
+    blk_interrupt();
+}
+
+/**
+ * Block queue: queue a chain for a merged request
+ */
+static int vblk_blk_start(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    
+    if (req->write && vblk_readonly) {
+        return -1;
+    }
+    
+    /* The queue depth keeps the block layer within the slots */
+    vblk_cmd_t* cmd = NULL;
+    for (uint32_t i = 0; i < num_cmds; i++) {
+        if (!cmds[i].busy) {
+            cmd = &cmds[i];
+            break;
+        }
+    }
+    if (!cmd) {
+        return -1;
+    }
+    
+    virtq_buf_t bufs[VIRTIO_BLK_MAX_SEGMENTS + 2];
+    int n = 0;
+    
+    cmd->hdr.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    cmd->hdr.reserved = 0;
+    cmd->hdr.sector = req->lba;
+    cmd->status = 0xFF;
+    bufs[n].addr = &cmd->hdr;
+    bufs[n].len = sizeof(cmd->hdr);
+    n++;
+    
+    for (blk_request_t* seg = req; seg; seg = seg->merge_next) {
+        bufs[n].addr = seg->buffer;
+        bufs[n].len = seg->count * BLK_SECTOR_SIZE;
+        n++;
+    }
+    
+    bufs[n].addr = (void*)&cmd->status;
+    bufs[n].len = 1;
+    n++;
+    
+    /* Writes: header and data out, status in. Reads: header out, rest in */
+    int out = req->write ? n - 1 : 1;
+    if (virtq_add(&req_queue, bufs, out, n - out, cmd) < 0) {
+        return -1;
+    }
+    cmd->busy = 1;
+    cmd->req = req;
+    virtq_kick(&req_queue);
+    
+    if (!irq_line && !ktimer_pending(&poll_timer)) {
+        ktimer_arm(&poll_timer, 1);
+    }
+    return BLK_PENDING;
+}
+
+/**
+ * Block queue: the device used some chains
+ */
+static void vblk_blk_service(blk_device_t* dev) {
+    (void)dev;
+    
+    /* Drain, then re-arm; loop if more arrived before the re-arm */
+    do {
+        vblk_complete();
+    } while (virtq_enable_irq(&req_queue));
+    
+    if (!irq_line) {
+        for (uint32_t i = 0; i < num_cmds; i++) {
+            if (cmds[i].busy) {
+                ktimer_arm(&poll_timer, 1);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Block queue: a command got no answer in time
+ * A virtqueue can't take a chain back short of resetting the device, and
+ * until it does the device may still transfer into the request's buffer.
+ * So the request stays in flight (blk_timeout has already pushed its
+ * deadline on): reap anything the device finished without telling us, and
+ * notify it again in case a kick was lost.
+ */
+static void vblk_blk_timeout(blk_device_t* dev, blk_request_t* req) {
+    (void)dev;
+    (void)req;
+    
+    vblk_complete();
+    virtq_kick(&req_queue);
+}
+
+/**
+ * Initialize the virtio-blk driver
+ */
+void virtio_blk_init(void) {
+    pci_device_t dev;
+    vblk_present = 0;
+    
+    if (!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &dev) &&
+        !pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_MODERN_ID, &dev)) {
+        return;
+    }
+    if (virtio_pci_init(&vdev, &dev) < 0) {
+        return;
+    }
+    
+    uint64_t features = virtio_get_features(&vdev) & VIRTIO_BLK_DRIVER_FEATURES;
+    if (virtio_set_features(&vdev, features) < 0) {
+        return;
+    }
+    
+    /* The device's limits on a request's buffers */
+    uint32_t max_segments = VIRTIO_BLK_MAX_SEGMENTS;
+    uint32_t max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = virtio_config_read32(&vdev, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max > 0 && seg_max < max_segments) {
+            max_segments = seg_max;
+        }
+    }
+    if (features & VIRTIO_BLK_F_SIZE_MAX) {
+        /* Merged buffers are whole requests; keep each under the limit */
+        uint32_t seg_bytes_max = virtio_config_read32(&vdev, VIRTIO_BLK_CFG_SIZE_MAX);
+        if (seg_bytes_max >= BLK_SECTOR_SIZE && seg_bytes_max / BLK_SECTOR_SIZE < max_sectors) {
+            max_sectors = seg_bytes_max / BLK_SECTOR_SIZE;
+        }
+    }
+    vblk_readonly = (features & VIRTIO_BLK_F_RO) != 0;
+    
+    if (virtq_setup(&vdev, &req_queue, 0, VIRTQ_MAX_SIZE) < 0) {
+        virtio_fail(&vdev);
+        return;
+    }
+    
+    /* Every command takes its data buffers plus header and status */
+    num_cmds = req_queue.size / (max_segments + 2);
+    if (num_cmds > VIRTIO_BLK_MAX_DEPTH) {
+        num_cmds = VIRTIO_BLK_MAX_DEPTH;
+    }
+    cmds = (vblk_cmd_t*)kcalloc(num_cmds, sizeof(vblk_cmd_t));
+    if (num_cmds == 0 || !cmds) {
+        virtio_fail(&vdev);
+        return;
+    }
+    
+    ktimer_init(&poll_timer, vblk_poll, NULL);
+    virtio_driver_ok(&vdev);
+    
+    /* Route the device's PCI interrupt line through the PIC */
+    if (dev.irq_line > 0 && dev.irq_line < 16 && dev.irq_line != 2 &&
+        idt_share_handler(IRQ_BASE + dev.irq_line, vblk_interrupt) == 0) {
+        irq_line = dev.irq_line;
+        pic_unmask_irq(irq_line);
+    } else {
+        virtq_disable_irq(&req_queue);
+    }
+    
+    vblk_blk.name = "virtio-blk";
+    vblk_blk.sectors = virtio_config_read64(&vdev, VIRTIO_BLK_CFG_CAPACITY);
+    vblk_blk.max_sectors = max_sectors;
+    vblk_blk.max_segments = max_segments;
+    vblk_blk.queue_depth = num_cmds;
+    vblk_blk.start = vblk_blk_start;
+    vblk_blk.service = vblk_blk_service;
+    vblk_blk.timeout = vblk_blk_timeout;
+    vblk_blk.priv = NULL;
+    if (vblk_blk.sectors != 0 && blk_register(&vblk_blk) == 0) {
+        vblk_present = 1;
+    }
+}
+
+/**
+ * Check if a virtio disk is attached
+ */
+int virtio_blk_is_present(void) {
+    return vblk_present;
+}
+
+/**
+ * Check if the disk refuses writes
+ */
+int virtio_blk_is_readonly(void) {
+    return vblk_present && vblk_readonly;
+}
+
+/**
+ * Check if the driver uses the modern virtio-pci transport
+ */
+int virtio_blk_is_modern(void) {
+    return vblk_present && vdev.modern;
+}
+
+/**
+ * Check if the request queue uses the packed ring layout
+ */
+int virtio_blk_is_packed(void) {
+    return vblk_present && req_queue.packed;
+}
@@ -2,84 +2,71 @@
  * MiniOS - Virtio Network Driver
  * 
  * Driver for QEMU's virtio-net virtual network card.
- * Uses legacy (transitional) virtio interface for simplicity.
+ * Uses the modern virtio-pci transport (PCI capabilities and MMIO
+ * registers) when the device offers it, with one RX/TX queue pair per
+ * CPU and RSS spreading received flows across them. Legacy-only
+ * devices are driven through the I/O-port interface with a single pair.
  */
 
 #include "types.h"
 #include "pci.h"
-#include "ports.h"
+#include "virtio.h"
 #include "string.h"
 #include "heap.h"
+#include "pktbuf.h"
+#include "idt.h"
+#include "softirq.h"
+#include "perf.h"
+#include "net.h"
+#include "smp.h"
+#include "spinlock.h"
 
-/* Virtio PCI vendor/device IDs */
-#define VIRTIO_VENDOR_ID        0x1AF4
-#define VIRTIO_NET_DEVICE_ID    0x1000  /* Legacy network device */
-
-/* Virtio PCI configuration offsets (legacy) */
-#define VIRTIO_PCI_HOST_FEATURES    0x00
-#define VIRTIO_PCI_GUEST_FEATURES   0x04
-#define VIRTIO_PCI_QUEUE_PFN        0x08
-#define VIRTIO_PCI_QUEUE_SIZE       0x0C
-#define VIRTIO_PCI_QUEUE_SEL        0x0E
-#define VIRTIO_PCI_QUEUE_NOTIFY     0x10
-#define VIRTIO_PCI_STATUS           0x12
-#define VIRTIO_PCI_ISR              0x13
-#define VIRTIO_PCI_CONFIG           0x14
-
-/* Virtio status bits */
-#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
-#define VIRTIO_STATUS_DRIVER        0x02
-#define VIRTIO_STATUS_DRIVER_OK     0x04
-#define VIRTIO_STATUS_FEATURES_OK   0x08
-#define VIRTIO_STATUS_FAILED        0x80
-
-/* Virtio ring descriptor flags */
-#define VIRTQ_DESC_F_NEXT       0x01
-#define VIRTQ_DESC_F_WRITE      0x02
-
-/* Virtio queue sizes */
-#define VIRTQ_RX_SIZE   16
-#define VIRTQ_TX_SIZE   16
-
-/* Virtio ring descriptor */
-typedef struct {
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t next;
-} PACKED virtq_desc_t;
+/* Virtio network device IDs */
+#define VIRTIO_NET_DEVICE_ID    0x1000  /* Legacy (transitional) network device */
+#define VIRTIO_NET_MODERN_ID    0x1041  /* Modern-only network device */
 
-/* Virtio available ring */
-typedef struct {
-    uint16_t flags;
-    uint16_t idx;
-    uint16_t ring[VIRTQ_RX_SIZE];
-    uint16_t used_event;
-} PACKED virtq_avail_t;
+/* Virtio-net device configuration offsets */
+#define VIRTIO_NET_CFG_MAC              0x00
+#define VIRTIO_NET_CFG_MAX_PAIRS        0x08
+#define VIRTIO_NET_CFG_RSS_MAX_KEY      0x11
+#define VIRTIO_NET_CFG_HASH_TYPES       0x14
 
-/* Virtio used ring element */
-typedef struct {
-    uint32_t id;
-    uint32_t len;
-} PACKED virtq_used_elem_t;
+/* Feature bits */
+#define VIRTIO_NET_F_CSUM           (1ULL << 0)     /* Device checksums TX */
+#define VIRTIO_NET_F_GUEST_CSUM     (1ULL << 1)     /* Device validates RX */
+#define VIRTIO_NET_F_HOST_TSO4      (1ULL << 11)    /* Device segments TCPv4 */
+#define VIRTIO_NET_F_MRG_RXBUF      (1ULL << 15)    /* RX may span buffers */
+#define VIRTIO_NET_F_CTRL_VQ        (1ULL << 17)    /* Control virtqueue */
+#define VIRTIO_NET_F_MQ             (1ULL << 22)    /* Multiple queue pairs */
+#define VIRTIO_NET_F_RSS            (1ULL << 60)    /* Receive side scaling */
 
-/* Virtio used ring */
-typedef struct {
-    uint16_t flags;
-    uint16_t idx;
-    virtq_used_elem_t ring[VIRTQ_RX_SIZE];
-    uint16_t avail_event;
-} PACKED virtq_used_t;
+/* Features we know how to use */
+#define VIRTIO_NET_DRIVER_FEATURES  (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+                                     VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_MRG_RXBUF | \
+                                     VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ | \
+                                     VIRTIO_RING_F_EVENT_IDX | VIRTIO_F_VERSION_1 | \
+                                     VIRTIO_F_RING_PACKED | VIRTIO_NET_F_RSS)
 
-/* Virtio queue */
-typedef struct {
-    virtq_desc_t* desc;
-    virtq_avail_t* avail;
-    virtq_used_t* used;
-    uint16_t size;
-    uint16_t last_used_idx;
-    uint8_t** buffers;
-} virtq_t;
+/* Control virtqueue commands */
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG   1
+#define VIRTIO_NET_OK                   0
+
+/* RSS hash types */
+#define VIRTIO_NET_RSS_HASH_IPV4    (1U << 0)
+#define VIRTIO_NET_RSS_HASH_TCPV4   (1U << 1)
+#define VIRTIO_NET_RSS_HASH_UDPV4   (1U << 6)
+#define VIRTIO_NET_RSS_TABLE_SIZE   16
+
+/* Virtio net header flags and GSO types */
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM     0x01
+#define VIRTIO_NET_HDR_F_DATA_VALID     0x02
+#define VIRTIO_NET_HDR_GSO_NONE         0
+#define VIRTIO_NET_HDR_GSO_TCPV4        1
+
+/* Queue pairs we drive at most (one per CPU) */
+#define VIRTIO_NET_MAX_PAIRS    8
 
 /* Virtio net header */
 typedef struct {
@@ -89,97 +76,173 @@ typedef struct {
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
+    uint16_t num_buffers;       /* Only with MRG_RXBUF or VERSION_1 */
 } PACKED virtio_net_hdr_t;
 
 /* Driver state */
+static virtio_dev_t vdev;
 static int virtio_initialized = 0;
-static uint16_t io_base = 0;
+static uint8_t irq_line = 0;            /* 0 = no interrupt, poll only */
+static uint64_t net_features = 0;       /* Negotiated feature bits */
+static uint16_t net_hdr_len = 10;       /* Header size, 12 with MRG_RXBUF/VERSION_1 */
 static uint8_t mac_addr[6];
-static virtq_t rx_queue;
-static virtq_t tx_queue;
+
+/* Queues: pair i is RX virtqueue 2i and TX virtqueue 2i+1. RX chains carry
+ * the packet buffer wrapping their DMA memory as cookie, TX chains the
+ * packet being sent. */
+static virtq_t rx_queues[VIRTIO_NET_MAX_PAIRS];
+static virtq_t tx_queues[VIRTIO_NET_MAX_PAIRS];
+static virtq_t ctrl_queue;
+static int num_pairs = 1;
+static int rx_next = 0;                 /* Queue to poll first (round robin) */
+
+/* Control queue command buffer: header, payload, ack */
+static uint8_t* ctrl_buf = NULL;
 
 /* Buffer size for network packets */
-#define NET_BUFFER_SIZE 2048
+#define NET_BUFFER_SIZE PKTBUF_SIZE
+
+static void virtio_rx_release(pktbuf_t* pb);
 
 /**
- * Allocate and initialize a virtqueue
+ * Give an RX buffer (back) to the device
+ * The packet buffer keeps wrapping the same DMA memory; it is reset when
+ * the device fills it again.
  */
-static int virtq_init(virtq_t* vq, uint16_t size) {
-    /* Calculate sizes */
-    size_t desc_size = size * sizeof(virtq_desc_t);
-    size_t avail_size = sizeof(uint16_t) * 3 + sizeof(uint16_t) * size;
-    size_t used_size = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * size;
-    
-    /* Allocate memory (needs to be page-aligned for virtio) */
-    size_t total_size = ALIGN_UP(desc_size + avail_size, PAGE_SIZE) + 
-                        ALIGN_UP(used_size, PAGE_SIZE);
-    
-    uint8_t* mem = (uint8_t*)kcalloc(1, total_size + PAGE_SIZE);
-    if (!mem) return -1;
-    
-    /* Align to page boundary */
-    mem = (uint8_t*)ALIGN_UP((uintptr_t)mem, PAGE_SIZE);
-    
-    vq->desc = (virtq_desc_t*)mem;
-    vq->avail = (virtq_avail_t*)(mem + desc_size);
-    vq->used = (virtq_used_t*)ALIGN_UP((uintptr_t)(mem + desc_size + avail_size), PAGE_SIZE);
-    vq->size = size;
-    vq->last_used_idx = 0;
-    
-    /* Allocate buffer pointers */
-    vq->buffers = (uint8_t**)kcalloc(size, sizeof(uint8_t*));
-    if (!vq->buffers) return -1;
-    
-    /* Allocate individual buffers */
-    for (int i = 0; i < size; i++) {
-        vq->buffers[i] = (uint8_t*)kmalloc(NET_BUFFER_SIZE);
-        if (!vq->buffers[i]) return -1;
+static void virtio_net_post_rx(virtq_t* vq, pktbuf_t* pb) {
+    virtq_add_buf(vq, pb->head, NET_BUFFER_SIZE, 1, pb);
+}
+
+/**
+ * Set up the buffers of an RX queue
+ */
+static int virtio_net_fill_rx(virtq_t* vq) {
+    pktbuf_t* pkts = (pktbuf_t*)kcalloc(vq->size, sizeof(pktbuf_t));
+    if (!pkts) {
+        return -1;
     }
     
+    for (int i = 0; i < vq->size; i++) {
+        uint8_t* buffer = (uint8_t*)pktbuf_data_alloc();
+        if (!buffer) {
+            return -1;
+        }
+        pktbuf_wrap(&pkts[i], buffer, NET_BUFFER_SIZE, virtio_rx_release, vq);
+        virtio_net_post_rx(vq, &pkts[i]);
+    }
     return 0;
 }
 
 /**
- * Set up a virtqueue in the device
+ * Send a command on the control queue and wait for the device's ack
+ * @return 0 if the device accepted the command, -1 otherwise
  */
-static void virtq_setup(int queue_idx, virtq_t* vq) {
-    /* Select queue */
-    outw(io_base + VIRTIO_PCI_QUEUE_SEL, queue_idx);
+static int virtio_net_ctrl(uint8_t class, uint8_t cmd, const void* data, uint16_t len) {
+    virtq_t* vq = &ctrl_queue;
     
-    /* Get queue size */
-    uint16_t size = inw(io_base + VIRTIO_PCI_QUEUE_SIZE);
-    if (size == 0 || size > 256) {
-        size = 16;  /* Use smaller default */
+    if (!ctrl_buf || len > PAGE_SIZE - 4) {
+        return -1;
     }
     
-    /* Initialize queue */
-    if (virtq_init(vq, size) < 0) {
-        return;
+    /* Header, payload and ack live in one buffer */
+    ctrl_buf[0] = class;
+    ctrl_buf[1] = cmd;
+    memcpy(ctrl_buf + 2, data, len);
+    uint8_t* ack = ctrl_buf + 2 + len;
+    *ack = 0xFF;
+    
+    virtq_buf_t bufs[3] = {
+        { ctrl_buf, 2 },
+        { ctrl_buf + 2, len },
+        { ack, 1 },
+    };
+    if (virtq_add(vq, bufs, 2, 1, ctrl_buf) < 0) {
+        return -1;
     }
-    
-    /* Tell device about queue location (page frame number) */
-    uint32_t pfn = (uint32_t)((uintptr_t)vq->desc / PAGE_SIZE);
-    outl(io_base + VIRTIO_PCI_QUEUE_PFN, pfn);
+    virtq_kick(vq);
+    
+    /* The device answers synchronously under QEMU; bound the wait anyway */
+    for (int spin = 0; spin < 10000000; spin++) {
+        if (virtq_get(vq, NULL)) {
+            return *(volatile uint8_t*)ack == VIRTIO_NET_OK ? 0 : -1;
+        }
+        __asm__ volatile("pause" ::: "memory");
+    }
+    return -1;
 }
 
 /**
- * Add a buffer to the RX queue
+ * Tell the device how many queue pairs to use
+ * With RSS the device hashes flows onto pairs through an indirection
+ * table; otherwise it does its own flow steering across them.
  */
-static void virtq_add_rx_buffer(virtq_t* vq, int idx) {
-    /* Set up descriptor */
-    vq->desc[idx].addr = (uint64_t)(uintptr_t)vq->buffers[idx];
-    vq->desc[idx].len = NET_BUFFER_SIZE;
-    vq->desc[idx].flags = VIRTQ_DESC_F_WRITE;  /* Device writes to this buffer */
-    vq->desc[idx].next = 0;
-    
-    /* Add to available ring */
-    uint16_t avail_idx = vq->avail->idx;
-    vq->avail->ring[avail_idx % vq->size] = idx;
-    
-    /* Memory barrier */
-    __asm__ volatile("" ::: "memory");
+static int virtio_net_set_pairs(int pairs) {
+    if (net_features & VIRTIO_NET_F_RSS) {
+        /* Standard Toeplitz key (as used by most NICs) */
+        static const uint8_t rss_key[40] = {
+            0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+            0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+            0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+            0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+            0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+        };
+        uint8_t cfg[4 + 2 + 2 + VIRTIO_NET_RSS_TABLE_SIZE * 2 + 2 + 1 + sizeof(rss_key)];
+        uint8_t key_len = virtio_config_read8(&vdev, VIRTIO_NET_CFG_RSS_MAX_KEY);
+        uint32_t hash_types = virtio_config_read32(&vdev, VIRTIO_NET_CFG_HASH_TYPES) &
+                              (VIRTIO_NET_RSS_HASH_IPV4 | VIRTIO_NET_RSS_HASH_TCPV4 |
+                               VIRTIO_NET_RSS_HASH_UDPV4);
+        uint16_t value;
+        uint8_t* p = cfg;
+        
+        if (key_len > sizeof(rss_key)) {
+            key_len = sizeof(rss_key);
+        }
+        
+        memcpy(p, &hash_types, 4);
+        p += 4;
+        value = VIRTIO_NET_RSS_TABLE_SIZE - 1;      /* Indirection table mask */
+        memcpy(p, &value, 2);
+        p += 2;
+        value = 0;                                  /* Unclassified -> pair 0 */
+        memcpy(p, &value, 2);
+        p += 2;
+        for (int i = 0; i < VIRTIO_NET_RSS_TABLE_SIZE; i++) {
+            value = i % pairs;
+            memcpy(p, &value, 2);
+            p += 2;
+        }
+        value = pairs;                              /* TX queues in use */
+        memcpy(p, &value, 2);
+        p += 2;
+        *p++ = key_len;
+        memcpy(p, rss_key, key_len);
+        p += key_len;
+        
+        return virtio_net_ctrl(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                               cfg, (uint16_t)(p - cfg));
+    }
     
-    vq->avail->idx = avail_idx + 1;
+    uint16_t value = pairs;
+    return virtio_net_ctrl(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                           &value, sizeof(value));
+}
+
+/**
+ * Device interrupt handler
+ * Reading the ISR status acknowledges the interrupt. RX interrupts are
+ * then suppressed until the poll loop has drained the rings.
+ */
+static void virtio_net_interrupt(void) {
+    uint8_t isr = virtio_read_isr(&vdev);
+    
+    if (isr & VIRTIO_ISR_QUEUE) {
+        for (int i = 0; i < num_pairs; i++) {
+            spin_lock(&rx_queues[i].lock);
+            virtq_disable_irq(&rx_queues[i]);
+            spin_unlock(&rx_queues[i].lock);
+        }
+        softirq_raise(SOFTIRQ_NET_RX);
+    }
 }
 
 /**
@@ -189,58 +252,150 @@ int virtio_net_init(void) {
     pci_device_t dev;
     
     /* Find virtio network device */
-    if (!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_ID, &dev)) {
+    if (!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_ID, &dev) &&
+        !pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_MODERN_ID, &dev)) {
         return -1;  /* Not found */
     }
     
-    /* Get I/O base from BAR0 */
-    io_base = dev.bar[0] & 0xFFFC;  /* Remove I/O space bit */
-    
-    /* Enable bus mastering */
-    pci_enable_bus_master(&dev);
-    
-    /* Reset device */
-    outb(io_base + VIRTIO_PCI_STATUS, 0);
-    
-    /* Acknowledge device */
-    outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
-    
-    /* We're a driver */
-    outb(io_base + VIRTIO_PCI_STATUS, 
-         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    if (virtio_pci_init(&vdev, &dev) < 0) {
+        return -1;
+    }
     
-    /* Read features (we don't need any special features) */
-    uint32_t features = inl(io_base + VIRTIO_PCI_HOST_FEATURES);
-    (void)features;
+    /* Negotiate offloads, event indexes and multiqueue */
+    uint64_t features = virtio_get_features(&vdev);
+    uint64_t guest_features = features & VIRTIO_NET_DRIVER_FEATURES;
     
-    /* Accept no special features */
-    outl(io_base + VIRTIO_PCI_GUEST_FEATURES, 0);
+    /* TSO depends on the device filling in checksums */
+    if (!(guest_features & VIRTIO_NET_F_CSUM)) {
+        guest_features &= ~VIRTIO_NET_F_HOST_TSO4;
+    }
     
-    /* Set up virtqueues (0 = RX, 1 = TX) */
-    virtq_setup(0, &rx_queue);
-    virtq_setup(1, &tx_queue);
+    /* Multiqueue needs the control queue and the modern transport */
+    if (!vdev.modern || !(guest_features & VIRTIO_NET_F_CTRL_VQ)) {
+        guest_features &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS | VIRTIO_NET_F_CTRL_VQ);
+    }
+    if (!(guest_features & VIRTIO_NET_F_MQ)) {
+        guest_features &= ~VIRTIO_NET_F_RSS;
+    }
     
-    /* Add buffers to RX queue */
-    for (int i = 0; i < rx_queue.size; i++) {
-        virtq_add_rx_buffer(&rx_queue, i);
+    if (virtio_set_features(&vdev, guest_features) < 0) {
+        return -1;
+    }
+    net_features = guest_features;
+    net_hdr_len = (guest_features & (VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_VERSION_1)) ?
+                  sizeof(virtio_net_hdr_t) : sizeof(virtio_net_hdr_t) - sizeof(uint16_t);
+    
+    /* Queue pairs the device supports (the control queue comes after them) */
+    int max_pairs = 1;
+    if (net_features & VIRTIO_NET_F_MQ) {
+        max_pairs = virtio_config_read16(&vdev, VIRTIO_NET_CFG_MAX_PAIRS);
+        if (max_pairs < 1) {
+            max_pairs = 1;
+        }
+    }
+    num_pairs = MIN(MIN(max_pairs, VIRTIO_NET_MAX_PAIRS), smp_cpu_count());
+    
+    /* Set up virtqueues (2i = RX, 2i+1 = TX) */
+    for (int i = 0; i < num_pairs; i++) {
+        if (virtq_setup(&vdev, &rx_queues[i], 2 * i, VIRTQ_MAX_SIZE) < 0 ||
+            virtq_setup(&vdev, &tx_queues[i], 2 * i + 1, VIRTQ_MAX_SIZE) < 0 ||
+            virtio_net_fill_rx(&rx_queues[i]) < 0) {
+            virtio_fail(&vdev);
+            return -1;
+        }
+    }
+    if (net_features & VIRTIO_NET_F_CTRL_VQ) {
+        ctrl_buf = (uint8_t*)kmalloc(PAGE_SIZE);
+        if (!ctrl_buf || virtq_setup(&vdev, &ctrl_queue, 2 * max_pairs, VIRTQ_MAX_SIZE) < 0) {
+            virtio_fail(&vdev);
+            return -1;
+        }
     }
     
-    /* Notify device about RX queue */
-    outw(io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    /* TX completions are reclaimed lazily, so don't interrupt for them */
+    for (int q = 0; q < num_pairs; q++) {
+        virtq_disable_irq(&tx_queues[q]);
+    }
     
     /* Read MAC address from config space */
     for (int i = 0; i < 6; i++) {
-        mac_addr[i] = inb(io_base + VIRTIO_PCI_CONFIG + i);
+        mac_addr[i] = virtio_config_read8(&vdev, VIRTIO_NET_CFG_MAC + i);
     }
     
     /* Driver ready */
-    outb(io_base + VIRTIO_PCI_STATUS,
-         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    virtio_driver_ok(&vdev);
+    
+    /* Notify device about RX queues */
+    for (int q = 0; q < num_pairs; q++) {
+        virtq_kick(&rx_queues[q]);
+    }
+    
+    /* The device starts with one pair; switch the rest on */
+    if (num_pairs > 1 && virtio_net_set_pairs(num_pairs) < 0) {
+        num_pairs = 1;
+    }
     
     virtio_initialized = 1;
+    
+    /* Route the device's PCI interrupt line through the PIC */
+    if (dev.irq_line > 0 && dev.irq_line < 16 && dev.irq_line != 2 &&
+        idt_share_handler(IRQ_BASE + dev.irq_line, virtio_net_interrupt) == 0) {
+        irq_line = dev.irq_line;
+        pic_unmask_irq(irq_line);
+    }
+    
     return 0;
 }
 
+/**
+ * Get the offloads the device accepted (NET_OFFLOAD_* bits)
+ */
+int virtio_net_offloads(void) {
+    int offloads = 0;
+    
+    if (net_features & VIRTIO_NET_F_CSUM)       offloads |= NET_OFFLOAD_TX_CSUM;
+    if (net_features & VIRTIO_NET_F_GUEST_CSUM) offloads |= NET_OFFLOAD_RX_CSUM;
+    if (net_features & VIRTIO_NET_F_HOST_TSO4)  offloads |= NET_OFFLOAD_TSO4;
+    return offloads;
+}
+
+/**
+ * Get the number of active queue pairs
+ */
+int virtio_net_queue_pairs(void) {
+    return virtio_initialized ? num_pairs : 0;
+}
+
+/**
+ * Check if the driver uses the modern virtio-pci transport
+ */
+int virtio_net_is_modern(void) {
+    return vdev.modern;
+}
+
+/**
+ * Check if the device delivers RX interrupts
+ */
+int virtio_net_has_irq(void) {
+    return irq_line != 0;
+}
+
+/**
+ * Re-enable RX interrupts after the rings have been drained
+ * @return Non-zero if packets arrived meanwhile (poll again instead of
+ *         waiting for an interrupt)
+ */
+int virtio_net_rx_irq_enable(void) {
+    int pending = 0;
+    
+    for (int i = 0; i < num_pairs; i++) {
+        uint64_t flags = spin_lock_irqsave(&rx_queues[i].lock);
+        pending |= virtq_enable_irq(&rx_queues[i]);
+        spin_unlock_irqrestore(&rx_queues[i].lock, flags);
+    }
+    return pending;
+}
+
 /**
  * Check if initialized
  */
@@ -256,76 +411,266 @@ void virtio_net_get_mac(uint8_t mac[6]) {
 }
 
 /**
- * Send a packet
+ * Return a received buffer to its RX ring once its last reference is gone
  */
-int virtio_net_send(const void* data, uint16_t len) {
-    if (!virtio_initialized || len > NET_BUFFER_SIZE - sizeof(virtio_net_hdr_t)) {
-        return -1;
+static void virtio_rx_release(pktbuf_t* pb) {
+    virtq_t* vq = (virtq_t*)pb->priv;
+    
+    uint64_t flags = spin_lock_irqsave(&vq->lock);
+    virtio_net_post_rx(vq, pb);
+    virtq_kick(vq);
+    spin_unlock_irqrestore(&vq->lock, flags);
+}
+
+/**
+ * Reclaim descriptors on one TX queue (queue lock held)
+ */
+static int virtq_tx_reclaim(virtq_t* vq) {
+    int done = 0;
+    pktbuf_t* pb;
+    
+    while ((pb = (pktbuf_t*)virtq_get(vq, NULL)) != NULL) {
+        pktbuf_free(pb);
+        done++;
     }
     
-    /* Find a free TX buffer (simple: use index 0) */
-    static int tx_idx = 0;
-    uint8_t* buffer = tx_queue.buffers[tx_idx];
+    if (done) {
+        virtq_disable_irq(vq);
+    }
+    return done;
+}
+
+/**
+ * Reclaim TX descriptors the device has finished with
+ * @return Number of packets completed
+ */
+int virtio_net_tx_reclaim(void) {
+    int done = 0;
     
-    /* Prepare virtio header */
-    virtio_net_hdr_t* hdr = (virtio_net_hdr_t*)buffer;
-    memset(hdr, 0, sizeof(*hdr));
+    if (!virtio_initialized) {
+        return 0;
+    }
+    
+    for (int i = 0; i < num_pairs; i++) {
+        uint64_t flags = spin_lock_irqsave(&tx_queues[i].lock);
+        done += virtq_tx_reclaim(&tx_queues[i]);
+        spin_unlock_irqrestore(&tx_queues[i].lock, flags);
+    }
+    return done;
+}
+
+/**
+ * Push and fill in the virtio header for an outgoing frame
+ * Checksums marked CSUM_PARTIAL go to the device when it offers CSUM,
+ * otherwise they are finished here.
+ * @return The header, or NULL if the buffer has no headroom for it
+ */
+static virtio_net_hdr_t* virtio_net_fill_hdr(pktbuf_t* pb) {
+    if ((pb->flags & PKTBUF_F_CSUM_PARTIAL) && !(net_features & VIRTIO_NET_F_CSUM)) {
+        pktbuf_csum_finish(pb);
+    }
     
-    /* Copy packet data */
-    memcpy(buffer + sizeof(virtio_net_hdr_t), data, len);
+    /* Offsets in the header are relative to the start of the frame */
+    uint16_t frame_start = pktbuf_headroom(pb);
     
-    /* Set up descriptor */
-    tx_queue.desc[tx_idx].addr = (uint64_t)(uintptr_t)buffer;
-    tx_queue.desc[tx_idx].len = sizeof(virtio_net_hdr_t) + len;
-    tx_queue.desc[tx_idx].flags = 0;  /* Device reads from this buffer */
-    tx_queue.desc[tx_idx].next = 0;
+    virtio_net_hdr_t* hdr = (virtio_net_hdr_t*)pktbuf_push(pb, net_hdr_len);
+    if (!hdr) {
+        return NULL;
+    }
+    memset(hdr, 0, net_hdr_len);
     
-    /* Add to available ring */
-    uint16_t avail_idx = tx_queue.avail->idx;
-    tx_queue.avail->ring[avail_idx % tx_queue.size] = tx_idx;
-    __asm__ volatile("" ::: "memory");
-    tx_queue.avail->idx = avail_idx + 1;
+    if (pb->flags & PKTBUF_F_CSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = pb->csum_start - frame_start;
+        hdr->csum_offset = pb->csum_offset;
+    }
     
-    /* Notify device */
-    outw(io_base + VIRTIO_PCI_QUEUE_NOTIFY, 1);
+    if (pb->gso_type == PKTBUF_GSO_TCPV4) {
+        /* Headers run up to the end of the TCP header (data offset) */
+        uint8_t tcp_doff = pb->head[pb->csum_start + 12] >> 4;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = pb->gso_size;
+        hdr->hdr_len = pb->csum_start - frame_start + tcp_doff * 4;
+    }
     
-    tx_idx = (tx_idx + 1) % tx_queue.size;
-    return 0;
+    return hdr;
 }
 
 /**
- * Receive a packet (non-blocking)
+ * Pick the TX queue for the calling CPU
+ * With a pair per CPU each CPU has a queue to itself, so its lock is only
+ * contended by reclaim; with fewer pairs, CPUs share them.
  */
-int virtio_net_receive(void* buffer, uint16_t max_len) {
+static inline virtq_t* virtio_net_tx_queue(void) {
+    return &tx_queues[smp_cpu_id() % num_pairs];
+}
+
+/**
+ * Send a batch of packet buffers with a single notification
+ * Takes ownership of every packet, including ones that can't be sent.
+ * The virtio header goes into each buffer's headroom and the device
+ * reads the frames in place.
+ * @return Number of packets queued
+ */
+int virtio_net_send_batch(pktbuf_t** pkts, int count) {
     if (!virtio_initialized) {
-        return -1;
+        for (int i = 0; i < count; i++) {
+            pktbuf_free(pkts[i]);
+        }
+        return 0;
     }
     
-    /* Check if there are used buffers */
-    if (rx_queue.last_used_idx == rx_queue.used->idx) {
-        return 0;  /* No packets */
+    uint64_t start = rdtsc();
+    virtq_t* vq = virtio_net_tx_queue();
+    uint64_t flags = spin_lock_irqsave(&vq->lock);
+    
+    /* Free descriptors the device is done with before taking new ones */
+    if (vq->num_free < count) {
+        virtq_tx_reclaim(vq);
     }
     
-    /* Get used buffer */
-    uint16_t used_idx = rx_queue.last_used_idx % rx_queue.size;
-    uint32_t desc_idx = rx_queue.used->ring[used_idx].id;
-    uint32_t len = rx_queue.used->ring[used_idx].len;
+    int queued = 0;
+    
+    for (int i = 0; i < count; i++) {
+        pktbuf_t* pb = pkts[i];
+        virtio_net_hdr_t* hdr = NULL;
+        
+        if (pb->gso_type == PKTBUF_GSO_NONE || (net_features & VIRTIO_NET_F_HOST_TSO4)) {
+            hdr = virtio_net_fill_hdr(pb);
+        }
+        /* The device reads the frame in place */
+        if (!hdr || virtq_add_buf(vq, pb->data, pb->len, 0, pb) < 0) {
+            pktbuf_free(pb);  /* Can't offload, no headroom, or ring full */
+            continue;
+        }
+        queued++;
+    }
     
-    rx_queue.last_used_idx++;
+    virtq_kick(vq);
+    spin_unlock_irqrestore(&vq->lock, flags);
     
-    /* Copy data (skip virtio header) */
-    if (len > sizeof(virtio_net_hdr_t)) {
-        len -= sizeof(virtio_net_hdr_t);
-        if (len > max_len) len = max_len;
-        memcpy(buffer, rx_queue.buffers[desc_idx] + sizeof(virtio_net_hdr_t), len);
-    } else {
-        len = 0;
+    perf_add(PERF_NET_TX, queued);
+    perf_lat(PERF_LAT_NET_TX, start);
+    return queued;
+}
+
+/**
+ * Send a packet buffer (takes ownership of the caller's reference)
+ */
+int virtio_net_send_pkt(pktbuf_t* pb) {
+    return virtio_net_send_batch(&pb, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Take the next received packet off one RX queue
+ */
+static pktbuf_t* virtq_rx_next(virtq_t* vq) {
+    pktbuf_t* pb;
+    uint32_t len;
+    
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&vq->lock);
+        pb = (pktbuf_t*)virtq_get(vq, &len);
+        if (!pb) {
+            spin_unlock_irqrestore(&vq->lock, flags);
+            return NULL;
+        }
+        
+        if (len < net_hdr_len) {
+            len = net_hdr_len;
+        } else if (len > NET_BUFFER_SIZE) {
+            len = NET_BUFFER_SIZE;
+        }
+        
+        pktbuf_wrap(pb, pb->head, NET_BUFFER_SIZE, virtio_rx_release, vq);
+        pb->len = len;
+        
+        const virtio_net_hdr_t* hdr = (const virtio_net_hdr_t*)pktbuf_pull(pb, net_hdr_len);
+        
+        /* Without guest TSO every frame fits one buffer; drop anything that
+         * was merged across several (freeing the head reposts it, which
+         * takes the lock again) */
+        if ((net_features & VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+            for (int extra = 1; extra < hdr->num_buffers && virtq_has_used(vq); extra++) {
+                virtio_net_post_rx(vq, (pktbuf_t*)virtq_get(vq, NULL));
+            }
+            virtq_kick(vq);
+            spin_unlock_irqrestore(&vq->lock, flags);
+            pktbuf_free(pb);
+            continue;
+        }
+        spin_unlock_irqrestore(&vq->lock, flags);
+        
+        /* The host either checked the checksum or never computed one */
+        if (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            pb->flags |= PKTBUF_F_CSUM_VALID;
+        }
+        
+        return pb;
+    }
+}
+
+/**
+ * Receive a packet buffer (non-blocking)
+ * The buffer wraps the RX DMA memory directly; the descriptor goes back
+ * to the device when the returned buffer's last reference is dropped.
+ * Queues are served round robin so one busy flow can't starve the rest.
+ * @return Packet with the virtio header stripped, or NULL if none pending
+ */
+pktbuf_t* virtio_net_receive_pkt(void) {
+    if (!virtio_initialized) {
+        return NULL;
     }
     
-    /* Re-add buffer to available ring */
-    virtq_add_rx_buffer(&rx_queue, desc_idx);
-    outw(io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    for (int i = 0; i < num_pairs; i++) {
+        int q = (rx_next + i) % num_pairs;
+        pktbuf_t* pb = virtq_rx_next(&rx_queues[q]);
+        if (pb) {
+            rx_next = (q + 1) % num_pairs;
+            perf_count(PERF_NET_RX);
+            return pb;
+        }
+    }
     
-    return len;
+    return NULL;  /* No packets */
 }
 
+/**
+ * Send a packet (copies into a fresh packet buffer)
+ */
+int virtio_net_send(const void* data, uint16_t len) {
+    pktbuf_t* pb = pktbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    
+    void* payload = pktbuf_append(pb, len);
+    if (!payload) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    memcpy(payload, data, len);
+    
+    return virtio_net_send_pkt(pb);
+}
+
+/**
+ * Receive a packet into a caller buffer (non-blocking)
+ */
+int virtio_net_receive(void* buffer, uint16_t max_len) {
+    if (!virtio_initialized) {
+        return -1;
+    }
+    
+    pktbuf_t* pb = virtio_net_receive_pkt();
+    if (!pb) {
+        return 0;  /* No packets */
+    }
+    
+    uint16_t len = pb->len;
+    if (len > max_len) len = max_len;
+    memcpy(buffer, pb->data, len);
+    pktbuf_free(pb);
+    
+    return len;
+}
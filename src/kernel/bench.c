@@ -0,0 +1,361 @@
+/**
+ * MiniOS - Benchmark Harness
+ * 
+ * Microbenchmarks (allocators, memory primitives, checksums, ARP) time a
+ * fixed amount of work BENCH_RUNS times and report the fastest, which
+ * filters out interrupts and preemption. Device benchmarks (network round
+ * trips and transmit rate, disk reads) run once over enough I/O to be
+ * stable. Pseudo-random choices come from a fixed seed, so every run does
+ * identical work. Disk benchmarks only read.
+ */
+
+#include "types.h"
+#include "bench.h"
+#include "printf.h"
+#include "string.h"
+#include "console.h"
+#include "ports.h"
+#include "timer.h"
+#include "perf.h"
+#include "pmm.h"
+#include "heap.h"
+#include "checksum.h"
+#include "net.h"
+#include "udp.h"
+#include "blk.h"
+#include "smp.h"
+#include "softirq.h"
+#include "thread.h"
+
+extern int arp_lookup(uint32_t ip, uint8_t mac_out[6]);
+
+/* QEMU's isa-debug-exit device ("make bench" adds it) */
+#define QEMU_EXIT_PORT      0xF4
+
+/* Network peers: QEMU user networking's gateway, and an address nobody has */
+#define BENCH_GATEWAY_IP    0x0202000A  /* 10.0.2.2 */
+#define BENCH_UNKNOWN_IP    0x6302000A  /* 10.0.2.99 */
+#define BENCH_DISCARD_PORT  9
+
+/* Amount of work per benchmark */
+#define PMM_BATCH           256
+#define PMM_ROUNDS          16
+#define KMALLOC_BATCH       128
+#define KMALLOC_ROUNDS      16
+#define MEM_BYTES           (4 * 1024 * 1024)   /* Moved per memory benchmark */
+#define MEM_BUF_SIZE        65536
+#define ARP_LOOKUPS         100000
+#define PING_COUNT          100
+#define UDP_DATAGRAMS       10000
+#define UDP_PAYLOAD         18                  /* Minimum-size Ethernet frame */
+#define DISK_SEQ_BYTES      (8 * 1024 * 1024)
+#define DISK_SEQ_CHUNK      128                 /* Sectors per read */
+#define DISK_RAND_READS     512
+#define DISK_RAND_SECTORS   8                   /* 4KB reads */
+
+/* Scratch buffers for the memory and disk benchmarks */
+#define BUF_PAGES           (MEM_BUF_SIZE / PAGE_SIZE + 1)
+static uint8_t* buf_a;
+static uint8_t* buf_b;
+
+static uint32_t bench_seed;
+
+/* Ping timeout, as in the shell */
+static volatile int ping_timed_out;
+
+/**
+ * Fixed-sequence pseudo-random numbers (xorshift32)
+ */
+static uint32_t bench_rand(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+/**
+ * Print a result line (the consoles copy it to the serial port)
+ */
+static void bench_report(const char* name, uint64_t value, const char* unit) {
+    printf("BENCH %s %u %s\n", name, (unsigned int)value, unit);
+}
+
+/**
+ * Throughput in MB/s of 'bytes' moved in 'cycles'
+ */
+static uint64_t bench_mbps(uint64_t bytes, uint64_t cycles) {
+    uint64_t ns = perf_cycles_to_ns(cycles);
+    return ns ? bytes * 1000 / ns : 0;
+}
+
+/**
+ * Rate per second of 'count' events in 'ns'
+ */
+static uint64_t bench_rate(uint64_t count, uint64_t ns) {
+    return ns ? count * NS_PER_SEC / ns : 0;
+}
+
+/**
+ * Run a microbenchmark BENCH_RUNS times
+ * @return Fewest cycles any run took
+ */
+static uint64_t bench_best(uint64_t (*fn)(size_t), size_t arg) {
+    uint64_t best = ~0ULL;
+    
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        bench_seed = 0x2545F491;
+        uint64_t cycles = fn(arg);
+        best = MIN(best, cycles);
+    }
+    return best;
+}
+
+/**
+ * Allocate and free batches of pages
+ */
+static uint64_t bench_pmm(size_t batch) {
+    static void* pages[PMM_BATCH];
+    uint64_t start = rdtsc();
+    
+    for (int r = 0; r < PMM_ROUNDS; r++) {
+        for (size_t i = 0; i < batch; i++) {
+            pages[i] = pmm_alloc_page();
+        }
+        for (size_t i = 0; i < batch; i++) {
+            if (pages[i]) pmm_free_page(pages[i]);
+        }
+    }
+    return rdtsc() - start;
+}
+
+/**
+ * Allocate a batch of mixed sizes, then free it
+ */
+static uint64_t bench_kmalloc(size_t unused) {
+    static const size_t sizes[] = {16, 24, 64, 100, 256, 512, 1000, 2048, 4096, 16384};
+    static void* objs[KMALLOC_BATCH];
+    (void)unused;
+    
+    uint64_t start = rdtsc();
+    for (int r = 0; r < KMALLOC_ROUNDS; r++) {
+        for (int i = 0; i < KMALLOC_BATCH; i++) {
+            objs[i] = kmalloc(sizes[bench_rand() % ARRAY_SIZE(sizes)]);
+        }
+        for (int i = 0; i < KMALLOC_BATCH; i++) {
+            kfree(objs[i]);
+        }
+    }
+    return rdtsc() - start;
+}
+
+static uint64_t bench_memcpy(size_t size) {
+    uint64_t start = rdtsc();
+    for (size_t done = 0; done < MEM_BYTES; done += size) {
+        memcpy(buf_b, buf_a, size);
+    }
+    return rdtsc() - start;
+}
+
+static uint64_t bench_memset(size_t size) {
+    uint64_t start = rdtsc();
+    for (size_t done = 0; done < MEM_BYTES; done += size) {
+        memset(buf_b, (int)done, size);
+    }
+    return rdtsc() - start;
+}
+
+static uint64_t bench_csum(size_t size) {
+    volatile uint32_t sink = 0;
+    uint64_t start = rdtsc();
+    for (size_t done = 0; done < MEM_BYTES; done += size) {
+        sink += csum_partial(buf_a, size, 0);
+    }
+    (void)sink;
+    return rdtsc() - start;
+}
+
+static uint64_t bench_arp(size_t ip) {
+    uint8_t mac[6];
+    uint64_t start = rdtsc();
+    for (int i = 0; i < ARP_LOOKUPS; i++) {
+        arp_lookup((uint32_t)ip, mac);
+    }
+    return rdtsc() - start;
+}
+
+/**
+ * Memory primitives and checksums over a range of sizes
+ */
+static void bench_memory(void) {
+    static const size_t sizes[] = {64, 1024, 4096, 65536};
+    char name[32];
+    
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); i++) {
+        snprintf(name, sizeof(name), "memcpy_%u", (unsigned int)sizes[i]);
+        bench_report(name, bench_mbps(MEM_BYTES, bench_best(bench_memcpy, sizes[i])), "MB/s");
+        snprintf(name, sizeof(name), "memset_%u", (unsigned int)sizes[i]);
+        bench_report(name, bench_mbps(MEM_BYTES, bench_best(bench_memset, sizes[i])), "MB/s");
+    }
+    
+    /* A full-size frame, and a TSO-sized segment */
+    bench_report("csum_1500", bench_mbps(MEM_BYTES, bench_best(bench_csum, 1500)), "MB/s");
+    bench_report("csum_65536", bench_mbps(MEM_BYTES, bench_best(bench_csum, 65536)), "MB/s");
+}
+
+static void bench_ping_expired(void* arg) {
+    (void)arg;
+    ping_timed_out = 1;
+}
+
+/**
+ * Ping the gateway and wait up to a second for the reply
+ * @return 0 with the round trip in 'rtt', or -1 if it timed out
+ */
+static int bench_ping(uint64_t* rtt) {
+    ktimer_t timeout;
+    ktimer_init(&timeout, bench_ping_expired, NULL);
+    ping_timed_out = 0;
+    ktimer_arm(&timeout, TIMER_HZ);
+    
+    int seq = net_ping(BENCH_GATEWAY_IP);
+    int ok = 0;
+    if (seq >= 0) {
+        while (!(ok = net_ping_reply((uint16_t)seq, rtt)) && !ping_timed_out) {
+            cpu_idle();
+        }
+    }
+    ktimer_cancel(&timeout);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Network: ARP cache lookups, ping round trips, UDP send rate
+ */
+static void bench_net(void) {
+    uint64_t rtt;
+    
+    /* The first ping also resolves the gateway's MAC address */
+    if (!net_is_initialized() || bench_ping(&rtt) < 0) {
+        printf("BENCH-SKIP net\n");
+        return;
+    }
+    
+    bench_report("arp_lookup_hit", bench_best(bench_arp, BENCH_GATEWAY_IP) / ARP_LOOKUPS, "cycles/op");
+    bench_report("arp_lookup_miss", bench_best(bench_arp, BENCH_UNKNOWN_IP) / ARP_LOOKUPS, "cycles/op");
+    
+    /* Round trips through the NIC and the host, one at a time */
+    int replies = 0;
+    uint64_t rtt_sum = 0;
+    uint64_t start = ktime_ns();
+    for (int i = 0; i < PING_COUNT; i++) {
+        if (bench_ping(&rtt) == 0) {
+            rtt_sum += rtt;
+            replies++;
+        }
+    }
+    uint64_t elapsed = ktime_ns() - start;
+    bench_report("net_ping_rtt", replies ? rtt_sum / replies / NS_PER_US : 0, "us");
+    bench_report("net_ping_rate", bench_rate(replies, elapsed), "round-trips/s");
+    
+    /*
+     * Minimum-size datagrams to the discard port, as fast as udp_send()
+     * takes them. The stack has no loopback device, so this counts what the
+     * stack accepts for sending, not frames the NIC put on the wire.
+     */
+    udp_socket_t* sock = udp_bind(0, NULL);
+    if (!sock) {
+        printf("BENCH-SKIP net_udp_tx_queued\n");
+        return;
+    }
+    static const uint8_t payload[UDP_PAYLOAD];
+    int sent = 0;
+    start = ktime_ns();
+    for (int i = 0; i < UDP_DATAGRAMS; i++) {
+        if (udp_send(sock, BENCH_GATEWAY_IP, BENCH_DISCARD_PORT, payload, sizeof(payload)) == 0) {
+            sent++;
+        }
+    }
+    elapsed = ktime_ns() - start;
+    udp_close(sock);
+    bench_report("net_udp_tx_queued", bench_rate(sent, elapsed), "datagrams/s");
+    bench_report("net_udp_tx_rejected", UDP_DATAGRAMS - sent, "datagrams");
+}
+
+/**
+ * Disk: sequential and random reads through the block queue
+ */
+static void bench_disk(void) {
+    if (!blk_is_present()) {
+        printf("BENCH-SKIP disk\n");
+        return;
+    }
+    
+    uint64_t capacity = blk_get_capacity();
+    uint32_t chunk = MIN(DISK_SEQ_CHUNK, blk_get_device()->max_sectors);
+    uint64_t seq_sectors = MIN(DISK_SEQ_BYTES / BLK_SECTOR_SIZE, capacity - capacity % chunk);
+    
+    uint64_t start = rdtsc();
+    for (uint64_t lba = 0; lba < seq_sectors; lba += chunk) {
+        if (blk_read(lba, chunk, buf_a) < 0) {
+            printf("BENCH-SKIP disk (read error)\n");
+            return;
+        }
+    }
+    bench_report("disk_seq_read", bench_mbps(seq_sectors * BLK_SECTOR_SIZE, rdtsc() - start), "MB/s");
+    
+    /* Random reads need at least one whole 4KB slot */
+    uint64_t slots = capacity / DISK_RAND_SECTORS;
+    if (slots == 0) {
+        printf("BENCH-SKIP disk_rand_read (disk too small)\n");
+        return;
+    }
+    
+    bench_seed = 0x2545F491;
+    start = rdtsc();
+    for (int i = 0; i < DISK_RAND_READS; i++) {
+        uint64_t lba = (bench_rand() % slots) * DISK_RAND_SECTORS;
+        if (blk_read(lba, DISK_RAND_SECTORS, buf_a) < 0) {
+            printf("BENCH-SKIP disk (read error)\n");
+            return;
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    bench_report("disk_rand_read", bench_mbps((uint64_t)DISK_RAND_READS * DISK_RAND_SECTORS * BLK_SECTOR_SIZE, cycles), "MB/s");
+    bench_report("disk_rand_iops", bench_rate(DISK_RAND_READS, perf_cycles_to_ns(cycles)), "IOPS");
+}
+
+/**
+ * Run every benchmark
+ */
+void bench_run(void) {
+    buf_a = (uint8_t*)pmm_alloc_pages(BUF_PAGES);
+    buf_b = (uint8_t*)pmm_alloc_pages(BUF_PAGES);
+    
+    printf("BENCH-BEGIN cpus=%d tsc_mhz=%u runs=%d\n", smp_cpu_count(),
+           (unsigned int)(timer_tsc_hz() / 1000000), BENCH_RUNS);
+    
+    if (!buf_a || !buf_b) {
+        printf("BENCH-SKIP all (out of memory)\n");
+    } else {
+        memset(buf_a, 0x5A, BUF_PAGES * PAGE_SIZE);
+        memset(buf_b, 0xA5, BUF_PAGES * PAGE_SIZE);
+        
+        bench_report("pmm_alloc_free", bench_best(bench_pmm, 1) / PMM_ROUNDS, "cycles/op");
+        bench_report("pmm_alloc_free_batch",
+                     bench_best(bench_pmm, PMM_BATCH) / (PMM_ROUNDS * PMM_BATCH), "cycles/op");
+        bench_report("kmalloc_mix", bench_best(bench_kmalloc, 0) / (KMALLOC_ROUNDS * KMALLOC_BATCH),
+                     "cycles/op");
+        bench_memory();
+        bench_net();
+        bench_disk();
+    }
+    
+    printf("BENCH-END\n");
+    console_flush();
+    
+    /* Under "make bench" this ends QEMU; elsewhere nothing listens there */
+    outb(QEMU_EXIT_PORT, 0);
+    for (;;) {
+        thread_sleep(1000);
+    }
+}
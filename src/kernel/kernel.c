@@ -9,19 +9,34 @@
 #include "vga.h"
 #include "keyboard.h"
 #include "ata.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "blk.h"
+#include "bcache.h"
 #include "pci.h"
 #include "net.h"
 #include "shell.h"
 #include "heap.h"
 #include "idt.h"
 #include "printf.h"
+#include "string.h"
+#include "ports.h"
+#include "pmm.h"
+#include "slab.h"
+#include "multiboot.h"
+#include "timer.h"
+#include "lapic.h"
+#include "acpi.h"
+#include "smp.h"
+#include "thread.h"
+#include "softirq.h"
+#include "serial.h"
+#include "bench.h"
 
 /* External functions from boot code */
 extern void gdt_init(void);
-extern void pmm_init(void);
 
-/* Heap memory region */
-#define HEAP_START  0x400000    /* 4MB */
+/* Heap memory region (one max-order block from the PMM) */
 #define HEAP_SIZE   (4 * 1024 * 1024)  /* 4MB heap */
 
 /**
@@ -53,9 +68,16 @@ static void print_system_info(void) {
     vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
     printf("  Heap: %d KB total, %d KB free\n", 
            (int)(heap_total / 1024), (int)(heap_free / 1024));
+    printf("  CPUs: %d online\n", smp_cpu_count());
     
-    if (ata_is_present()) {
-        printf("  Disk: ATA drive detected\n");
+    if (virtio_blk_is_present()) {
+        printf("  Disk: virtio disk detected (%s)\n",
+               virtio_blk_is_readonly() ? "read-only" : "read-write");
+    } else if (ahci_is_present()) {
+        printf("  Disk: SATA drive detected (AHCI, %s)\n",
+               ahci_ncq_enabled() ? "NCQ" : "no NCQ");
+    } else if (ata_is_present()) {
+        printf("  Disk: ATA drive detected (%s)\n", ata_dma_enabled() ? "DMA" : "PIO");
     } else {
         printf("  Disk: No drive detected\n");
     }
@@ -72,6 +94,27 @@ static void print_system_info(void) {
     printf("\n");
 }
 
+/**
+ * Shell thread: shell commands call into every subsystem, so it holds the
+ * kernel lock except while it waits
+ */
+static void shell_thread(void* arg) {
+    (void)arg;
+    
+    kernel_lock();
+    shell_run();
+}
+
+/**
+ * Benchmark thread: runs instead of the shell when booted with "bench"
+ */
+static void bench_thread(void* arg) {
+    (void)arg;
+    
+    kernel_lock();
+    bench_run();
+}
+
 /**
  * Kernel main entry point
  * 
@@ -79,9 +122,14 @@ static void print_system_info(void) {
  * @param mb_info   Pointer to multiboot info structure
  */
 void kernel_main(uint32_t magic, void* mb_info) {
-    /* Unused for now */
-    (void)magic;
-    (void)mb_info;
+    /* Per-CPU data first: the allocators index their caches by CPU */
+    smp_early_init();
+    
+    /* Pick memcpy/memset strategy before any bulk copies happen */
+    string_init();
+    
+    /* Capture the memory map before anything can allocate over it */
+    int mb_ok = multiboot_init(magic, mb_info);
     
     /* Initialize VGA display first so we can see output */
     vga_init();
@@ -104,16 +152,70 @@ void kernel_main(uint32_t magic, void* mb_info) {
     idt_init();
     printf("OK\n");
     
+    /* Serial console: benchmark results and logs leave the machine here */
+    printf("  - Serial port... ");
+    if (serial_init() == 0) {
+        printf("OK (COM1, %d baud)\n", SERIAL_BAUD);
+    } else {
+        printf("NOT FOUND\n");
+    }
+    
     /* Initialize physical memory manager */
     printf("  - Physical memory manager... ");
     pmm_init();
-    printf("OK\n");
+    printf("OK (%d MB in %d regions%s)\n",
+           (int)(pmm_get_total_memory() / (1024 * 1024)), pmm_get_zone_count(),
+           mb_ok < 0 ? ", no memory map" : "");
     
     /* Initialize kernel heap */
     printf("  - Kernel heap... ");
-    heap_init((void*)HEAP_START, HEAP_SIZE);
+    void* heap_mem = pmm_alloc_pages(HEAP_SIZE / PAGE_SIZE);
+    if (!heap_mem) {
+        printf("FAILED\n");
+        for (;;) hlt();
+    }
+    heap_init(heap_mem, HEAP_SIZE);
     printf("OK\n");
     
+    /* Initialize slab caches (kmalloc uses them for small sizes) */
+    printf("  - Slab allocator... ");
+    slab_init();
+    printf("OK (%d caches)\n", kmem_cache_count());
+    
+    /* Scheduler state and the boot CPU's idle thread (APs need it to start) */
+    printf("  - Scheduler... ");
+    if (sched_init() < 0) {
+        printf("FAILED\n");
+        for (;;) hlt();
+    }
+    printf("OK (%d ms slices)\n", SCHED_SLICE_MS);
+    
+    /* Initialize system timer */
+    printf("  - System timer... ");
+    timer_init();
+    if (timer_is_tickless()) {
+        printf("OK (TSC %u MHz, tickless APIC timer)\n",
+               (unsigned int)(timer_tsc_hz() / 1000000));
+    } else {
+        printf("OK (%d Hz PIT)\n", TIMER_HZ);
+    }
+    
+    /* Find the other processors and start them */
+    printf("  - ACPI tables... ");
+    if (acpi_init() == 0) {
+        printf("OK (%d CPUs in MADT)\n", acpi_cpu_count());
+    } else {
+        printf("NOT FOUND\n");
+    }
+    
+    printf("  - SMP bring-up... ");
+    int cpus = smp_init();
+    if (!lapic_is_enabled()) {
+        printf("OK (1 CPU, no local APIC)\n");
+    } else {
+        printf("OK (%d of %d CPUs online)\n", cpus, MAX(acpi_cpu_count(), 1));
+    }
+    
     /* Initialize keyboard */
     printf("  - Keyboard driver... ");
     keyboard_init();
@@ -124,15 +226,49 @@ void kernel_main(uint32_t magic, void* mb_info) {
     pci_init();
     printf("OK (%d devices)\n", pci_get_device_count());
     
-    /* Initialize ATA disk */
-    printf("  - ATA disk driver... ");
-    ata_init();
-    if (ata_is_present()) {
-        printf("OK\n");
+    /* Disk backends, fastest first: the first disk found serves the block queue */
+    printf("  - Virtio block driver... ");
+    virtio_blk_init();
+    if (virtio_blk_is_present()) {
+        printf("OK (%s, %s ring, depth %d)\n", virtio_blk_is_modern() ? "modern" : "legacy",
+               virtio_blk_is_packed() ? "packed" : "split",
+               (int)blk_get_device()->queue_depth);
     } else {
         printf("NO DISK\n");
     }
     
+    if (!blk_is_present()) {
+        printf("  - AHCI SATA driver... ");
+        ahci_init();
+        if (ahci_is_present()) {
+            printf("OK (%s, depth %d)\n", ahci_ncq_enabled() ? "NCQ" : "no NCQ",
+                   (int)blk_get_device()->queue_depth);
+        } else {
+            printf("NO DISK\n");
+        }
+    }
+    
+    /* Otherwise fall back to the legacy IDE disk */
+    if (!blk_is_present()) {
+        printf("  - ATA disk driver... ");
+        ata_init();
+        if (ata_is_present()) {
+            printf("OK (%s)\n", ata_dma_enabled() ? "DMA" : "PIO");
+        } else {
+            printf("NO DISK\n");
+        }
+    }
+    
+    /* Initialize the block cache in front of it */
+    if (blk_is_present()) {
+        printf("  - Block cache... ");
+        if (bcache_init(BCACHE_DEFAULT_SIZE) == 0) {
+            printf("OK (%d KB)\n", BCACHE_DEFAULT_SIZE / 1024);
+        } else {
+            printf("FAILED\n");
+        }
+    }
+    
     /* Initialize networking */
     printf("  - Network driver... ");
     net_init();
@@ -142,6 +278,16 @@ void kernel_main(uint32_t magic, void* mb_info) {
         printf("NO DEVICE\n");
     }
     
+    /* Deferred work and the shell (or the benchmarks) become threads of their own */
+    printf("  - Kernel threads... ");
+    int softirqs = softirq_start();
+    int bench = multiboot_cmdline_has("bench");
+    if (!thread_create(bench ? "bench" : "shell", bench ? bench_thread : shell_thread, NULL)) {
+        printf("FAILED\n");
+        for (;;) hlt();
+    }
+    printf("OK (%d softirq threads, %s)\n", softirqs, bench ? "bench" : "shell");
+    
     printf("\n");
     vga_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
     printf("[BOOT] Initialization complete!\n\n");
@@ -150,13 +296,7 @@ void kernel_main(uint32_t magic, void* mb_info) {
     /* Print system info */
     print_system_info();
     
-    /* Start the shell */
-    shell_run();
-    
-    /* Should never reach here */
-    printf("\nKernel halted.\n");
-    for (;;) {
-        __asm__ volatile("hlt");
-    }
+    /* Leave the boot stack: from here on everything runs in threads */
+    sched_start();
 }
 
@@ -0,0 +1,46 @@
+/**
+ * MiniOS - Kernel Symbol Table
+ * 
+ * Lookups binary-search the generated table. An address past the last
+ * function still resolves to it: the table records where functions
+ * start, not where they end.
+ */
+
+#include "types.h"
+#include "ksyms.h"
+
+/**
+ * Find the function containing an address
+ */
+int ksym_find(uint64_t addr) {
+    if (ksym_count == 0 || addr < ksyms[0].addr) {
+        return -1;
+    }
+    
+    /* Last entry starting at or below addr */
+    uint32_t lo = 0, hi = ksym_count - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (ksyms[mid].addr <= addr) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return (int)lo;
+}
+
+/**
+ * Name the function containing an address
+ */
+const char* ksym_lookup(uint64_t addr, uint64_t* offset) {
+    int i = ksym_find(addr);
+    if (i < 0) {
+        return NULL;
+    }
+    
+    if (offset) {
+        *offset = addr - ksyms[i].addr;
+    }
+    return ksyms[i].name;
+}
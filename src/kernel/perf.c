@@ -0,0 +1,96 @@
+/**
+ * MiniOS - Performance Counters
+ * 
+ * The counters themselves live in each CPU's percpu_t and are updated
+ * inline (perf.h). This file only sums them for the shell and keeps the
+ * baseline that perf_reset() moves.
+ */
+
+#include "types.h"
+#include "perf.h"
+#include "smp.h"
+#include "string.h"
+#include "timer.h"
+
+static perf_cpu_t perf_base;            /* Sums at the last reset */
+static uint64_t perf_base_ns = 0;
+
+static const char* const counter_names[PERF_NR_COUNTERS] = {
+    "net tx frames", "net rx frames", "arp hits", "arp misses",
+    "blk sectors read", "blk sectors written"
+};
+
+static const char* const hist_names[PERF_NR_HISTS] = {
+    "net_tx", "net_poll", "blk_read", "blk_write", "kmalloc", "kfree"
+};
+
+/**
+ * Add every online CPU's counters into 'sum'
+ */
+static void perf_sum(perf_cpu_t* sum) {
+    uint64_t* out = (uint64_t*)sum;
+    
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        /* Each field is one aligned 64-bit word, so a racing add is seen whole */
+        const volatile uint64_t* in = (const volatile uint64_t*)&smp_get_cpu(i)->perf;
+        for (size_t w = 0; w < sizeof(perf_cpu_t) / sizeof(uint64_t); w++) {
+            out[w] += in[w];
+        }
+    }
+}
+
+/**
+ * Sum every CPU's counters since the last reset
+ */
+void perf_read(perf_snapshot_t* snap) {
+    uint64_t* out = (uint64_t*)&snap->total;
+    const uint64_t* base = (const uint64_t*)&perf_base;
+    
+    perf_sum(&snap->total);
+    for (size_t w = 0; w < sizeof(perf_cpu_t) / sizeof(uint64_t); w++) {
+        out[w] -= base[w];
+    }
+    snap->elapsed_ns = ktime_ns() - perf_base_ns;
+}
+
+/**
+ * Start counting from zero again
+ */
+void perf_reset(void) {
+    perf_sum(&perf_base);
+    perf_base_ns = ktime_ns();
+}
+
+/**
+ * Convert TSC cycles to nanoseconds
+ */
+uint64_t perf_cycles_to_ns(uint64_t cycles) {
+    uint64_t hz = timer_tsc_hz();
+    if (hz == 0) {
+        return 0;
+    }
+    
+    /* Split so cycles * 10^9 can't overflow */
+    return (cycles / hz) * NS_PER_SEC + (cycles % hz) * NS_PER_SEC / hz;
+}
+
+/**
+ * Get a counter's name
+ */
+const char* perf_counter_name(int counter) {
+    if (counter < 0 || counter >= PERF_NR_COUNTERS) {
+        return "?";
+    }
+    return counter_names[counter];
+}
+
+/**
+ * Get a histogram's name
+ */
+const char* perf_hist_name(int hist) {
+    if (hist < 0 || hist >= PERF_NR_HISTS) {
+        return "?";
+    }
+    return hist_names[hist];
+}
@@ -0,0 +1,162 @@
+/**
+ * MiniOS - Sampling Profiler
+ * 
+ * While the profiler runs the clock interrupts every tick: the PIT always
+ * does, and a tickless APIC timer is told to re-arm itself from its own
+ * interrupt (timer_set_every_tick), so sampling goes on while a thread
+ * holds the kernel lock for long. Whichever CPU takes that interrupt
+ * samples itself and IPIs the rest, so every CPU is sampled at the same
+ * rate, halted ones included (their samples land in the idle loop).
+ * 
+ * Each CPU appends only to its own buffer, with interrupts off, so a
+ * sample is a bounds check and a store. A full buffer counts what it
+ * drops instead.
+ */
+
+#include "types.h"
+#include "profile.h"
+#include "ksyms.h"
+#include "smp.h"
+#include "idt.h"
+#include "timer.h"
+#include "heap.h"
+#include "string.h"
+
+/* One CPU's samples */
+typedef struct {
+    uint32_t count;
+    uint32_t dropped;
+    uint64_t rips[PROFILE_SAMPLES];
+} profile_cpu_t;
+
+static profile_cpu_t profile_cpus[SMP_MAX_CPUS];
+static volatile int profile_running = 0;
+static uint64_t profile_last_tick = 0;  /* Last tick sampled (the ticking CPU only) */
+
+/**
+ * Clear the samples and start sampling
+ */
+int profile_start(void) {
+    if (profile_running) {
+        return -1;
+    }
+    
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        profile_cpus[i].count = 0;
+        profile_cpus[i].dropped = 0;
+    }
+    
+    __atomic_store_n(&profile_running, 1, __ATOMIC_RELEASE);
+    timer_set_every_tick(1);
+    return 0;
+}
+
+/**
+ * Stop sampling
+ */
+void profile_stop(void) {
+    __atomic_store_n(&profile_running, 0, __ATOMIC_RELEASE);
+    timer_set_every_tick(0);
+}
+
+/**
+ * Check if the profiler is sampling
+ */
+int profile_is_running(void) {
+    return profile_running;
+}
+
+/**
+ * Record a sample if this is a profiling tick
+ */
+void profile_interrupt(uint64_t vector, uint64_t rip) {
+    if (!profile_running) {
+        return;
+    }
+    
+    /*
+     * A profiling tick is the PIT's interrupt, or the APIC timer of the CPU
+     * kept ticking; other CPUs' one-shots fire whenever the wheel needs.
+     * Once per tick, in case the one-shot was reprogrammed for one it had
+     * already covered.
+     */
+    uint32_t self = smp_cpu_id();
+    int tick;
+    if (timer_is_tickless()) {
+        tick = vector == LAPIC_TIMER_VECTOR && (int)self == timer_every_tick_cpu();
+    } else {
+        tick = vector == IRQ0_TIMER;
+    }
+    if (tick) {
+        uint64_t now = timer_ticks();
+        if (now == profile_last_tick) {
+            return;
+        }
+        profile_last_tick = now;
+    } else if (vector != IPI_PROFILE_VECTOR) {
+        return;
+    }
+    
+    profile_cpu_t* buf = &profile_cpus[self];
+    if (buf->count < PROFILE_SAMPLES) {
+        buf->rips[buf->count++] = rip;
+    } else {
+        buf->dropped++;
+    }
+    
+    if (tick) {
+        for (int i = 0; i < smp_cpu_count(); i++) {
+            if ((uint32_t)i != self) {
+                smp_send_ipi(i, IPI_PROFILE_VECTOR);
+            }
+        }
+    }
+}
+
+/**
+ * Get the functions with the most samples
+ */
+int profile_top(profile_entry_t* out, int max, uint32_t* total, uint32_t* dropped) {
+    /* Last slot: samples outside every known function */
+    uint32_t slots = ksym_count + 1;
+    uint32_t* hits = (uint32_t*)kcalloc(slots, sizeof(uint32_t));
+    if (!hits) {
+        return -1;
+    }
+    
+    *total = 0;
+    *dropped = 0;
+    for (int c = 0; c < smp_cpu_count(); c++) {
+        profile_cpu_t* buf = &profile_cpus[c];
+        uint32_t count = MIN(__atomic_load_n(&buf->count, __ATOMIC_ACQUIRE), PROFILE_SAMPLES);
+        
+        for (uint32_t s = 0; s < count; s++) {
+            int sym = ksym_find(buf->rips[s]);
+            hits[sym < 0 ? ksym_count : (uint32_t)sym]++;
+        }
+        *total += count;
+        *dropped += buf->dropped;
+    }
+    
+    /* Few entries wanted: pick the largest remaining each time */
+    int filled = 0;
+    while (filled < max) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i < slots; i++) {
+            if (hits[i] > hits[best]) {
+                best = i;
+            }
+        }
+        if (hits[best] == 0) {
+            break;
+        }
+        
+        out[filled].name = best < ksym_count ? ksyms[best].name : NULL;
+        out[filled].samples = hits[best];
+        hits[best] = 0;
+        filled++;
+    }
+    
+    kfree(hits);
+    return filled;
+}
@@ -0,0 +1,278 @@
+/**
+ * MiniOS - Multiprocessor Bring-up
+ * 
+ * The boot CPU starts each processor the MADT lists with the INIT,
+ * STARTUP, STARTUP sequence, one at a time: the trampoline (trampoline.asm)
+ * is copied below 1MB, its argument block is pointed at the next AP's
+ * stack and per-CPU area, and the AP reports in by setting 'online'.
+ * 
+ * Each CPU's GS base points at its percpu_t. Cross-CPU calls go through a
+ * one-entry mailbox in the target's area and IPI_CALL_VECTOR.
+ * 
+ * Device interrupts keep arriving at the boot CPU (the PIC is wired to its
+ * LINT0 only), but the threads they wake run wherever the scheduler puts
+ * them: once up, each AP switches to its idle thread and takes (or steals)
+ * work from the run queues.
+ */
+
+#include "types.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "lapic.h"
+#include "acpi.h"
+#include "idt.h"
+#include "pmm.h"
+#include "ports.h"
+#include "string.h"
+#include "timer.h"
+#include "thread.h"
+
+/* GS base MSR */
+#define IA32_GS_BASE            0xC0000101
+
+/* Where the trampoline runs (a STARTUP IPI gives the page number) */
+#define SMP_TRAMPOLINE_BASE     0x8000
+
+/* AP boot stacks, used only until the AP switches to its idle thread */
+#define SMP_STACK_PAGES         1
+
+/* Intel MP spec delays, and how long an AP gets to report in */
+#define SMP_INIT_DELAY_US       10000
+#define SMP_BOOT_WAIT_NS        (100 * NS_PER_MS)
+
+/* Argument block at the end of the trampoline */
+typedef struct {
+    uint32_t cr3;
+    uint16_t gdt_limit;
+    uint64_t gdt_base;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} PACKED smp_boot_args_t;
+
+/* GDTR contents (sgdt) */
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} PACKED smp_gdtr_t;
+
+/* Trampoline image (trampoline.asm) */
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_args[];
+
+static percpu_t cpus[SMP_MAX_CPUS];
+static int cpu_count = 1;
+
+/**
+ * Load a CPU's GS base with its per-CPU area
+ */
+static void smp_set_percpu(percpu_t* cpu) {
+    cpu->self = cpu;
+    wrmsr(IA32_GS_BASE, (uint64_t)(uintptr_t)cpu);
+}
+
+/**
+ * Cross-CPU call IPI: run what the mailbox holds
+ */
+static void smp_call_interrupt(void) {
+    percpu_t* cpu = this_cpu();
+    smp_call_fn_t fn = cpu->call_fn;
+    
+    if (fn) {
+        cpu->call_fn = NULL;
+        fn(cpu->call_arg);
+        cpu->calls++;
+        __atomic_store_n(&cpu->call_done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * C entry of an application processor (from the trampoline)
+ */
+static void smp_ap_main(percpu_t* cpu) {
+    smp_set_percpu(cpu);
+    idt_load();
+    lapic_init();
+    
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+    sched_ap_start();
+}
+
+/**
+ * Wait for a starting AP to set its online flag
+ */
+static int smp_wait_online(percpu_t* cpu) {
+    uint64_t deadline = ktime_ns() + SMP_BOOT_WAIT_NS;
+    
+    while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+        if (ktime_ns() >= deadline) {
+            return -1;
+        }
+        cpu_relax();
+    }
+    return 0;
+}
+
+/**
+ * Start one AP
+ */
+static int smp_boot_ap(percpu_t* cpu, smp_boot_args_t* args) {
+    /* Stays allocated even on failure: a late AP may still be using it */
+    void* stack = pmm_alloc_pages(SMP_STACK_PAGES);
+    if (!stack) {
+        return -1;
+    }
+    args->stack = (uint64_t)(uintptr_t)stack + SMP_STACK_PAGES * PAGE_SIZE;
+    args->cpu = (uint64_t)(uintptr_t)cpu;
+    
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    udelay(SMP_INIT_DELAY_US);
+    
+    /* A second STARTUP only if the first was lost */
+    for (int tries = 0; tries < 2; tries++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_BASE >> 12));
+        if (smp_wait_online(cpu) == 0) {
+            return 0;
+        }
+    }
+    
+    /* Park it again so it can't come up later on a reused per-CPU area */
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    return -1;
+}
+
+/**
+ * Set up the boot CPU's per-CPU area
+ */
+void smp_early_init(void) {
+    memset(cpus, 0, sizeof(cpus));
+    cpus[0].id = 0;
+    cpus[0].online = 1;
+    cpu_count = 1;
+    smp_set_percpu(&cpus[0]);
+}
+
+/**
+ * Start the application processors
+ */
+int smp_init(void) {
+    if (!lapic_is_enabled()) {
+        return cpu_count;
+    }
+    
+    cpus[0].apic_id = lapic_id();
+    idt_set_handler(IPI_CALL_VECTOR, smp_call_interrupt);
+    
+    if (acpi_cpu_count() <= 1) {
+        return cpu_count;
+    }
+    
+    /* Copy the trampoline down and give it the boot CPU's paging and GDT */
+    memcpy((void*)(uintptr_t)SMP_TRAMPOLINE_BASE, smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+    smp_boot_args_t* args = (smp_boot_args_t*)(uintptr_t)(SMP_TRAMPOLINE_BASE +
+                            (smp_trampoline_args - smp_trampoline_start));
+    
+    uint64_t cr3;
+    smp_gdtr_t gdtr;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("sgdt %0" : "=m"(gdtr));
+    args->cr3 = (uint32_t)cr3;
+    args->gdt_limit = gdtr.limit;
+    args->gdt_base = gdtr.base;
+    args->entry = (uint64_t)(uintptr_t)smp_ap_main;
+    
+    for (int i = 0; i < acpi_cpu_count() && cpu_count < SMP_MAX_CPUS; i++) {
+        uint32_t apic_id = acpi_cpu_apic_id(i);
+        if (apic_id == cpus[0].apic_id) {
+            continue;
+        }
+        
+        percpu_t* cpu = &cpus[cpu_count];
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->id = cpu_count;
+        cpu->apic_id = apic_id;
+        if (smp_boot_ap(cpu, args) == 0) {
+            cpu_count++;
+        }
+    }
+    
+    return cpu_count;
+}
+
+/**
+ * Get the number of CPUs online
+ */
+int smp_cpu_count(void) {
+    return cpu_count;
+}
+
+/**
+ * Get a CPU's per-CPU area
+ */
+percpu_t* smp_get_cpu(int id) {
+    if (id < 0 || id >= cpu_count) {
+        return NULL;
+    }
+    return &cpus[id];
+}
+
+/**
+ * Send an interrupt to another CPU
+ */
+void smp_send_ipi(int id, uint8_t vector) {
+    if (id >= 0 && id < cpu_count) {
+        lapic_send_ipi(cpus[id].apic_id, LAPIC_ICR_FIXED | vector);
+    }
+}
+
+/**
+ * Run a function on a CPU and wait for it
+ */
+int smp_call_function(int id, smp_call_fn_t fn, void* arg) {
+    if (id < 0 || id >= cpu_count || !fn) {
+        return -1;
+    }
+    
+    /* On ourselves: just call it, as the IPI handler would */
+    if ((uint32_t)id == smp_cpu_id()) {
+        uint64_t flags = irq_save();
+        fn(arg);
+        irq_restore(flags);
+        return 0;
+    }
+    
+    percpu_t* cpu = &cpus[id];
+    spin_lock(&cpu->call_lock);
+    
+    cpu->call_arg = arg;
+    cpu->call_done = 0;
+    __atomic_store_n(&cpu->call_fn, fn, __ATOMIC_RELEASE);
+    smp_send_ipi(id, IPI_CALL_VECTOR);
+    
+    while (!__atomic_load_n(&cpu->call_done, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+    }
+    
+    spin_unlock(&cpu->call_lock);
+    return 0;
+}
+
+/**
+ * Run a function on every online CPU
+ */
+int smp_call_all(smp_call_fn_t fn, void* arg) {
+    uint32_t self = smp_cpu_id();
+    int ran = 0;
+    
+    for (int i = 0; i < cpu_count; i++) {
+        if ((uint32_t)i != self && smp_call_function(i, fn, arg) == 0) {
+            ran++;
+        }
+    }
+    if (smp_call_function(self, fn, arg) == 0) {
+        ran++;
+    }
+    return ran;
+}
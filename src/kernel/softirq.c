@@ -0,0 +1,149 @@
+/**
+ * MiniOS - Deferred Interrupt Work
+ *
+ * Pending softirqs are a bitmask set from interrupt handlers. The idle
+ * loop drains it during boot; softirq_start() then gives each registered
+ * softirq a thread that sleeps on a wait queue until its bit is set, so a
+ * slow block request no longer holds up the network, or the reverse.
+ */
+
+#include "types.h"
+#include "ports.h"
+#include "softirq.h"
+#include "thread.h"
+
+static softirq_handler_t softirq_handlers[SOFTIRQ_MAX];
+static volatile uint32_t softirq_mask = 0;
+
+/* Thread names, by softirq number */
+static const char* const softirq_names[SOFTIRQ_MAX] = {
+    "net-rx", "timer", "block", "sched"
+};
+
+/* Once set, raising a softirq wakes its thread */
+static volatile int softirq_threaded = 0;
+static wait_queue_t softirq_wait[SOFTIRQ_MAX];
+
+/* Threads in cpu_idle(), and the count of events that release them */
+static wait_queue_t idle_wait = WAIT_QUEUE_INIT;
+static volatile uint64_t idle_events = 0;
+
+/**
+ * Register the handler for a softirq
+ */
+void softirq_register(int nr, softirq_handler_t handler) {
+    if (nr >= 0 && nr < SOFTIRQ_MAX) {
+        softirq_handlers[nr] = handler;
+    }
+}
+
+/**
+ * Mark a softirq as pending
+ */
+void softirq_raise(int nr) {
+    if (nr >= 0 && nr < SOFTIRQ_MAX) {
+        __atomic_or_fetch(&softirq_mask, 1U << nr, __ATOMIC_SEQ_CST);
+        if (softirq_threaded) {
+            wake_up(&softirq_wait[nr]);
+        }
+    }
+}
+
+/**
+ * Check if any softirq is pending
+ */
+int softirq_pending(void) {
+    return softirq_mask != 0;
+}
+
+/**
+ * Run all pending softirq handlers
+ * Handlers that re-raise themselves run again on the next pass, so one
+ * busy source cannot starve the rest of the system.
+ */
+void softirq_run(void) {
+    uint32_t pending = __atomic_exchange_n(&softirq_mask, 0, __ATOMIC_SEQ_CST);
+    
+    while (pending) {
+        int nr = __builtin_ctz(pending);
+        pending &= pending - 1;
+        if (softirq_handlers[nr]) {
+            softirq_handlers[nr]();
+        }
+    }
+}
+
+/**
+ * Softirq thread: run one handler each time it is raised
+ */
+static void softirq_thread(void* arg) {
+    int nr = (int)(uintptr_t)arg;
+    uint32_t bit = 1U << nr;
+    
+    for (;;) {
+        wait_event(&softirq_wait[nr], softirq_mask & bit);
+        __atomic_and_fetch(&softirq_mask, ~bit, __ATOMIC_SEQ_CST);
+        
+        kernel_lock();
+        softirq_handlers[nr]();
+        kernel_unlock();
+        cpu_idle_wake();
+        
+        /* Re-raised (out of budget): let the other threads in first */
+        if (softirq_mask & bit) {
+            thread_yield();
+        }
+    }
+}
+
+/**
+ * Start the softirq threads
+ */
+int softirq_start(void) {
+    int started = 0;
+    
+    for (int nr = 0; nr < SOFTIRQ_MAX; nr++) {
+        wait_queue_init(&softirq_wait[nr]);
+    }
+    for (int nr = 0; nr < SOFTIRQ_MAX; nr++) {
+        if (softirq_handlers[nr] &&
+            thread_create(softirq_names[nr] ? softirq_names[nr] : "softirq",
+                          softirq_thread, (void*)(uintptr_t)nr)) {
+            started++;
+        }
+    }
+    
+    /* Anything raised before this is found by the threads' first check */
+    softirq_threaded = 1;
+    return started;
+}
+
+/**
+ * Idle the CPU
+ */
+void cpu_idle(void) {
+    if (softirq_threaded && thread_current()) {
+        uint64_t seen = idle_events;
+        wait_event(&idle_wait, idle_events != seen);
+        return;
+    }
+    
+    cli();
+    if (softirq_mask) {
+        sti();
+        softirq_run();
+        return;
+    }
+    
+    /* sti only takes effect after the next instruction, so an interrupt
+     * arriving here still wakes the hlt instead of being missed */
+    __asm__ volatile("sti; hlt" ::: "memory");
+}
+
+/**
+ * Release the threads in cpu_idle()
+ */
+void cpu_idle_wake(void) {
+    __atomic_add_fetch(&idle_events, 1, __ATOMIC_SEQ_CST);
+    wake_up(&idle_wait);
+}
@@ -0,0 +1,42 @@
+; MiniOS - Thread Context Switch
+; A switch happens inside a function call, so only the callee-saved
+; registers need saving: they are pushed on the old thread's stack, the
+; stack pointers are exchanged, and the new thread's are popped. Everything
+; else (including the interrupt flag) was saved by whoever called
+; schedule() on that thread, or by the interrupt frame below it.
+
+section .text
+bits 64
+
+extern thread_bootstrap
+
+global context_switch
+global thread_start
+
+; thread_t* context_switch(uint64_t* save_rsp, uint64_t load_rsp, thread_t* prev)
+; Returns 'prev' on the new stack, so the new thread learns whom it replaced.
+context_switch:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+    mov rax, rdx
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; First switch into a new thread returns here (thread.c builds the frame)
+thread_start:
+    mov rdi, rax            ; Thread switched away from
+    call thread_bootstrap   ; Never returns
+    ud2
@@ -0,0 +1,758 @@
+/**
+ * MiniOS - Kernel Threads and Scheduler
+ * 
+ * Each CPU has a FIFO run queue in its percpu_t, guarded by rq_lock with
+ * interrupts off. schedule() puts the running thread back at the tail
+ * (unless it is blocking or exiting) and takes the head; with its own
+ * queue empty a CPU steals the head of the longest other queue, and with
+ * nothing anywhere it switches to its idle thread, which halts.
+ * 
+ * A wake-up goes to the thread's last CPU, or to an idle CPU if that one
+ * is busy, and asks the target to reschedule (by IPI if it is another
+ * CPU): a thread woken by an interrupt preempts whatever was running, so
+ * the network and disk threads see their events at once. CPU-bound
+ * threads are sliced by a scheduler tick that only runs while some
+ * thread is waiting for a CPU.
+ * 
+ * A thread can be woken and queued before it has finished switching out
+ * (the wake-up raced with its wait): 'on_cpu' stays set until the next
+ * thread is running, and whichever CPU picks it up waits for that first.
+ */
+
+#include "types.h"
+#include "thread.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "softirq.h"
+#include "idt.h"
+#include "pmm.h"
+#include "heap.h"
+#include "string.h"
+#include "ports.h"
+#include "timer.h"
+
+/* Context switch (switch.asm) */
+extern thread_t* context_switch(uint64_t* save_rsp, uint64_t load_rsp, thread_t* prev);
+extern void thread_start(void);
+
+#define SCHED_SLICE_NS      (SCHED_SLICE_MS * NS_PER_MS)
+
+static volatile int sched_running = 0;
+static volatile uint32_t idle_mask = 0;     /* CPUs halted in their idle loop */
+static uint32_t next_thread_id = 0;
+
+/* Every thread, for thread_get_info() */
+static spinlock_t thread_list_lock = SPINLOCK_INIT;
+static thread_t* thread_list = NULL;
+
+/* Kernel lock */
+static thread_t* volatile klock_owner = NULL;
+static wait_queue_t klock_wait = WAIT_QUEUE_INIT;
+
+/* Scheduler tick, armed while any thread waits for a CPU */
+static ktimer_t sched_timer;
+static volatile int sched_tick_armed = 0;
+
+static const char* const state_names[] = { "running", "ready", "blocked", "dead" };
+
+/**
+ * Append a thread to a run queue (rq_lock held)
+ */
+static void rq_push(percpu_t* cpu, thread_t* thread) {
+    thread->rq_next = NULL;
+    if (cpu->rq_tail) {
+        cpu->rq_tail->rq_next = thread;
+    } else {
+        cpu->rq_head = thread;
+    }
+    cpu->rq_tail = thread;
+    cpu->rq_len++;
+}
+
+/**
+ * Take the first thread off a run queue (rq_lock held)
+ */
+static thread_t* rq_pop(percpu_t* cpu) {
+    thread_t* thread = cpu->rq_head;
+    if (thread) {
+        cpu->rq_head = thread->rq_next;
+        if (!cpu->rq_head) {
+            cpu->rq_tail = NULL;
+        }
+        thread->rq_next = NULL;
+        cpu->rq_len--;
+    }
+    return thread;
+}
+
+/**
+ * Take the longest-waiting thread of the busiest other CPU
+ */
+static thread_t* sched_steal(percpu_t* self) {
+    percpu_t* victim = NULL;
+    
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        if (cpu != self && cpu->rq_len && (!victim || cpu->rq_len > victim->rq_len)) {
+            victim = cpu;
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+    
+    spin_lock(&victim->rq_lock);
+    thread_t* thread = rq_pop(victim);
+    spin_unlock(&victim->rq_lock);
+    
+    if (thread) {
+        self->steals++;
+    }
+    return thread;
+}
+
+/**
+ * Check if this CPU has anything to run, here or stealable elsewhere
+ */
+static int sched_has_work(void) {
+    if (!sched_running) {
+        return 0;
+    }
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        if (smp_get_cpu(i)->rq_len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Start the scheduler tick if it is not running
+ */
+static void sched_tick_start(void) {
+    if (!__atomic_exchange_n(&sched_tick_armed, 1, __ATOMIC_SEQ_CST)) {
+        softirq_raise(SOFTIRQ_SCHED);
+    }
+}
+
+/**
+ * Free an exited thread once it is off its CPU
+ */
+static void thread_free(thread_t* thread) {
+    uint64_t flags = spin_lock_irqsave(&thread_list_lock);
+    for (thread_t** link = &thread_list; *link; link = &(*link)->all_next) {
+        if (*link == thread) {
+            *link = thread->all_next;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&thread_list_lock, flags);
+    
+    pmm_free_pages(thread->stack, THREAD_STACK_PAGES);
+    kfree(thread);
+}
+
+/**
+ * Finish a switch on the new thread's stack: the old one is off its CPU
+ */
+static void sched_finish(thread_t* last) {
+    if (!last) {
+        return;
+    }
+    if (last->state == THREAD_DEAD) {
+        thread_free(last);
+        return;
+    }
+    __atomic_store_n(&last->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Switch to the next thread on this CPU (interrupts off)
+ * The caller has set its own state: RUNNING to stay runnable, BLOCKED to
+ * wait, DEAD to exit. READY means a wake-up has queued it already.
+ */
+static void schedule(void) {
+    percpu_t* cpu = this_cpu();
+    thread_t* prev = cpu->curr;
+    
+    spin_lock(&cpu->rq_lock);
+    cpu->need_resched = 0;
+    if (prev != cpu->idle && prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        rq_push(cpu, prev);
+    }
+    thread_t* next = rq_pop(cpu);
+    uint32_t waiting = cpu->rq_len;
+    spin_unlock(&cpu->rq_lock);
+    
+    if (!next) {
+        next = sched_steal(cpu);
+    }
+    if (!next) {
+        next = cpu->idle;
+    } else {
+        __atomic_and_fetch(&idle_mask, ~(1U << cpu->id), __ATOMIC_SEQ_CST);
+    }
+    
+    /* Another CPU is idle and could run what is still queued here */
+    uint32_t idle = __atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST) & ~(1U << cpu->id);
+    if (waiting && idle) {
+        smp_send_ipi(__builtin_ctz(idle), IPI_RESCHED_VECTOR);
+    }
+    
+    next->state = THREAD_RUNNING;
+    if (next == prev) {
+        return;
+    }
+    
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+    }
+    next->on_cpu = 1;
+    next->cpu = cpu->id;
+    next->switches++;
+    cpu->curr = next;
+    cpu->switches++;
+    
+    uint64_t now = ktime_ns();
+    prev->runtime_ns += now - prev->run_start;
+    next->run_start = now;
+    cpu->slice_start = now;
+    
+    thread_t* last = context_switch(&prev->rsp, next->rsp, prev);
+    sched_finish(last);
+}
+
+/**
+ * Queue a runnable thread and make sure a CPU notices
+ */
+static void sched_enqueue(thread_t* thread) {
+    percpu_t* self = this_cpu();
+    uint32_t id = thread->cpu;
+    
+    /* A busy CPU hands the thread to an idle one */
+    uint32_t idle = __atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST);
+    if (sched_running && idle && !(idle & (1U << id))) {
+        id = __builtin_ctz(idle);
+    }
+    percpu_t* target = smp_get_cpu(id);
+    
+    uint64_t flags = spin_lock_irqsave(&target->rq_lock);
+    rq_push(target, thread);
+    target->need_resched = 1;
+    int busy = target->curr && target->curr != target->idle;
+    spin_unlock_irqrestore(&target->rq_lock, flags);
+    
+    if (!sched_running) {
+        return;
+    }
+    if (target != self) {
+        smp_send_ipi(id, IPI_RESCHED_VECTOR);
+    }
+    if (busy) {
+        sched_tick_start();
+    }
+}
+
+/**
+ * Scheduler tick: preempt threads that used up their slice while others wait
+ */
+static void sched_tick(void* arg) {
+    (void)arg;
+    uint64_t now = ktime_ns();
+    int waiting = 0;
+    
+    __atomic_store_n(&sched_tick_armed, 0, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        if (!cpu->rq_len) {
+            continue;
+        }
+        waiting = 1;
+        if (now - cpu->slice_start >= SCHED_SLICE_NS) {
+            cpu->need_resched = 1;
+            if (cpu != this_cpu()) {
+                smp_send_ipi(i, IPI_RESCHED_VECTOR);
+            }
+        }
+    }
+    
+    if (waiting && !__atomic_exchange_n(&sched_tick_armed, 1, __ATOMIC_SEQ_CST)) {
+        ktimer_arm(&sched_timer, MS_TO_TICKS(SCHED_SLICE_MS));
+    }
+}
+
+/**
+ * Scheduler softirq: start the tick (ktimers need the kernel lock)
+ */
+static void sched_softirq(void) {
+    if (!ktimer_pending(&sched_timer)) {
+        ktimer_arm(&sched_timer, MS_TO_TICKS(SCHED_SLICE_MS));
+    }
+}
+
+/**
+ * Reschedule IPI: the work is done on the way out, in sched_irq_exit()
+ */
+static void sched_resched_interrupt(void) {
+    this_cpu()->need_resched = 1;
+}
+
+/**
+ * Idle thread: halt until there is something to run
+ */
+static void sched_idle(void* arg) {
+    (void)arg;
+    percpu_t* cpu = this_cpu();
+    uint32_t bit = 1U << cpu->id;
+    
+    for (;;) {
+        /* Marked idle before checking, so a wake-up from now on sends an IPI */
+        cli();
+        __atomic_or_fetch(&idle_mask, bit, __ATOMIC_SEQ_CST);
+        if (!sched_has_work()) {
+            __asm__ volatile("sti; hlt; cli" ::: "memory");
+        }
+        __atomic_and_fetch(&idle_mask, ~bit, __ATOMIC_SEQ_CST);
+        schedule();
+        sti();
+    }
+}
+
+/**
+ * First code a new thread runs (from switch.asm)
+ */
+void thread_bootstrap(thread_t* last) {
+    sched_finish(last);
+    sti();
+    
+    thread_t* self = thread_current();
+    self->fn(self->arg);
+    thread_exit();
+}
+
+/**
+ * Allocate a thread and the frame its first switch returns through
+ */
+static thread_t* thread_alloc(const char* name, thread_fn_t fn, void* arg) {
+    thread_t* thread = (thread_t*)kcalloc(1, sizeof(thread_t));
+    if (!thread) {
+        return NULL;
+    }
+    thread->stack = pmm_alloc_pages(THREAD_STACK_PAGES);
+    if (!thread->stack) {
+        kfree(thread);
+        return NULL;
+    }
+    
+    thread->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+    strncpy(thread->name, name, THREAD_NAME_LEN - 1);
+    thread->fn = fn;
+    thread->arg = arg;
+    thread->cpu = smp_cpu_id();
+    thread->state = THREAD_READY;
+    
+    /* context_switch() pops six callee-saved registers, then returns into
+     * thread_start with the stack 16-byte aligned */
+    uint64_t* sp = (uint64_t*)((uint8_t*)thread->stack + THREAD_STACK_PAGES * PAGE_SIZE - 16);
+    *--sp = (uint64_t)(uintptr_t)thread_start;
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;
+    }
+    thread->rsp = (uint64_t)(uintptr_t)sp;
+    
+    uint64_t flags = spin_lock_irqsave(&thread_list_lock);
+    thread->all_next = thread_list;
+    thread_list = thread;
+    spin_unlock_irqrestore(&thread_list_lock, flags);
+    return thread;
+}
+
+/**
+ * Create the calling CPU's idle thread
+ */
+static int sched_create_idle(percpu_t* cpu) {
+    char name[THREAD_NAME_LEN] = "idle";
+    name[4] = '0' + cpu->id % 10;
+    
+    cpu->idle = thread_alloc(name, sched_idle, NULL);
+    if (!cpu->idle) {
+        return -1;
+    }
+    cpu->idle->state = THREAD_RUNNING;
+    return 0;
+}
+
+/**
+ * Leave the boot stack for this CPU's idle thread
+ */
+static void __attribute__((noreturn)) sched_enter(percpu_t* cpu) {
+    thread_t* idle = cpu->idle;
+    uint64_t boot_rsp;
+    
+    idle->on_cpu = 1;
+    idle->switches++;
+    idle->run_start = ktime_ns();
+    cpu->slice_start = idle->run_start;
+    cpu->curr = idle;
+    
+    context_switch(&boot_rsp, idle->rsp, NULL);
+    __builtin_unreachable();
+}
+
+/**
+ * Set up the boot CPU's scheduler state
+ */
+int sched_init(void) {
+    ktimer_init(&sched_timer, sched_tick, NULL);
+    softirq_register(SOFTIRQ_SCHED, sched_softirq);
+    idt_set_handler(IPI_RESCHED_VECTOR, sched_resched_interrupt);
+    return sched_create_idle(this_cpu());
+}
+
+/**
+ * Start scheduling on the boot CPU
+ */
+void sched_start(void) {
+    percpu_t* self = this_cpu();
+    
+    cli();
+    sched_running = 1;
+    
+    /* The APs have been halted in their idle loops: let them look for work */
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        if ((uint32_t)i != self->id) {
+            smp_send_ipi(i, IPI_RESCHED_VECTOR);
+        }
+    }
+    sched_enter(self);
+}
+
+/**
+ * Enter the scheduler on an application processor
+ */
+void sched_ap_start(void) {
+    percpu_t* cpu = this_cpu();
+    
+    if (sched_create_idle(cpu) < 0) {
+        /* Without an idle thread it can still run cross-CPU calls */
+        for (;;) {
+            __asm__ volatile("sti; hlt" ::: "memory");
+        }
+    }
+    sched_enter(cpu);
+}
+
+/**
+ * Check if threads are being scheduled
+ */
+int sched_is_running(void) {
+    return sched_running;
+}
+
+/**
+ * Preempt on the way out of an interrupt
+ * Only a thread in the RUNNING state: one between wait_prepare() and
+ * wait_block() is about to switch anyway, and may hold the kernel lock.
+ */
+void sched_irq_exit(void) {
+    if (!sched_running) {
+        return;
+    }
+    
+    percpu_t* cpu = this_cpu();
+    if (cpu->need_resched && cpu->curr && cpu->curr->state == THREAD_RUNNING) {
+        schedule();
+    }
+}
+
+/**
+ * Create a thread
+ */
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg) {
+    thread_t* thread = thread_alloc(name, fn, arg);
+    if (thread) {
+        sched_enqueue(thread);
+    }
+    return thread;
+}
+
+/**
+ * Get the running thread
+ */
+thread_t* thread_current(void) {
+    return sched_running ? this_cpu()->curr : NULL;
+}
+
+/**
+ * Give up the whole kernel lock before switching away
+ * @return Nesting depth to restore
+ */
+static uint32_t klock_drop(thread_t* self) {
+    uint32_t depth = self->klock_depth;
+    if (depth) {
+        self->klock_depth = 1;
+        kernel_unlock();
+    }
+    return depth;
+}
+
+/**
+ * Take the kernel lock back after switching in
+ */
+static void klock_retake(uint32_t depth) {
+    if (depth) {
+        kernel_lock();
+        thread_current()->klock_depth = depth;
+    }
+}
+
+/**
+ * Switch away voluntarily, without the kernel lock
+ */
+static void sched_switch(void) {
+    thread_t* self = thread_current();
+    uint32_t depth = klock_drop(self);
+    
+    uint64_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+    
+    klock_retake(depth);
+}
+
+/**
+ * Yield the CPU
+ */
+void thread_yield(void) {
+    if (sched_running) {
+        sched_switch();
+    }
+}
+
+/**
+ * Sleep timer expired
+ */
+static void thread_sleep_expired(void* arg) {
+    thread_wake((thread_t*)arg);
+}
+
+/**
+ * Block for a while
+ */
+void thread_sleep(uint32_t ms) {
+    thread_t* self = thread_current();
+    if (!self) {
+        udelay(ms * 1000);
+        return;
+    }
+    
+    /* The timer wheel belongs to kernel lock holders */
+    kernel_lock();
+    ktimer_init(&self->sleep_timer, thread_sleep_expired, self);
+    __atomic_store_n(&self->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+    ktimer_arm(&self->sleep_timer, MS_TO_TICKS(ms));
+    sched_switch();
+    ktimer_cancel(&self->sleep_timer);
+    kernel_unlock();
+}
+
+/**
+ * Make a blocked thread runnable
+ */
+int thread_wake(thread_t* thread) {
+    int expected = THREAD_BLOCKED;
+    if (!__atomic_compare_exchange_n(&thread->state, &expected, THREAD_READY, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+    sched_enqueue(thread);
+    return 1;
+}
+
+/**
+ * End the current thread
+ */
+void thread_exit(void) {
+    thread_t* self = thread_current();
+    
+    klock_drop(self);
+    cli();
+    self->state = THREAD_DEAD;
+    schedule();
+    
+    /* The next thread freed this one's stack */
+    for (;;) {
+        hlt();
+    }
+}
+
+/**
+ * Snapshot the thread list
+ */
+int thread_get_info(thread_info_t* info, int max) {
+    int count = 0;
+    
+    uint64_t flags = spin_lock_irqsave(&thread_list_lock);
+    for (thread_t* t = thread_list; t && count < max; t = t->all_next) {
+        thread_info_t* out = &info[count++];
+        out->id = t->id;
+        memcpy(out->name, t->name, THREAD_NAME_LEN);
+        out->state = t->state;
+        out->cpu = t->cpu;
+        out->switches = t->switches;
+        out->runtime_ns = t->runtime_ns;
+        if (t->state == THREAD_RUNNING) {
+            out->runtime_ns += ktime_ns() - t->run_start;
+        }
+    }
+    spin_unlock_irqrestore(&thread_list_lock, flags);
+    return count;
+}
+
+/**
+ * Get a thread state's name
+ */
+const char* thread_state_name(int state) {
+    if (state < 0 || state >= (int)ARRAY_SIZE(state_names)) {
+        return "?";
+    }
+    return state_names[state];
+}
+
+/**
+ * Initialize a wait queue
+ */
+void wait_queue_init(wait_queue_t* wq) {
+    spin_init(&wq->lock);
+    wq->head = NULL;
+}
+
+/**
+ * Put the current thread on a wait queue
+ */
+void wait_prepare(wait_queue_t* wq) {
+    thread_t* self = thread_current();
+    if (!self) {
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (!self->wq) {
+        self->wq = wq;
+        self->wq_next = wq->head;
+        wq->head = self;
+    }
+    
+    /* Ordered before the caller's next look at its condition */
+    __atomic_store_n(&self->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * Switch away until woken
+ */
+void wait_block(void) {
+    if (!thread_current()) {
+        cpu_idle();
+        return;
+    }
+    sched_switch();
+}
+
+/**
+ * Take the current thread off a wait queue
+ */
+void wait_finish(wait_queue_t* wq) {
+    thread_t* self = thread_current();
+    if (!self) {
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (self->wq == wq) {
+        for (thread_t** link = &wq->head; *link; link = &(*link)->wq_next) {
+            if (*link == self) {
+                *link = self->wq_next;
+                break;
+            }
+        }
+        self->wq = NULL;
+        self->wq_next = NULL;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    
+    /* Woken without having blocked: it is queued, so let the queue run it */
+    int expected = THREAD_BLOCKED;
+    if (!__atomic_compare_exchange_n(&self->state, &expected, THREAD_RUNNING, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+        expected == THREAD_READY) {
+        flags = irq_save();
+        schedule();
+        irq_restore(flags);
+    }
+}
+
+/**
+ * Wake every waiter
+ */
+void wake_up(wait_queue_t* wq) {
+    /* The waker's condition update is ordered before this check */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&wq->head, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    thread_t* thread = wq->head;
+    wq->head = NULL;
+    while (thread) {
+        thread_t* next = thread->wq_next;
+        thread->wq = NULL;
+        thread->wq_next = NULL;
+        thread_wake(thread);
+        thread = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * Try to become the kernel lock owner (or already be it)
+ */
+static int klock_try(thread_t* self) {
+    thread_t* expected = NULL;
+    return klock_owner == self ||
+           __atomic_compare_exchange_n(&klock_owner, &expected, self, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the kernel lock
+ */
+void kernel_lock(void) {
+    thread_t* self = thread_current();
+    if (!self) {
+        return;
+    }
+    if (klock_owner == self) {
+        self->klock_depth++;
+        return;
+    }
+    
+    wait_event(&klock_wait, klock_try(self));
+    self->klock_depth = 1;
+}
+
+/**
+ * Release the kernel lock
+ */
+void kernel_unlock(void) {
+    thread_t* self = thread_current();
+    if (!self || klock_owner != self) {
+        return;
+    }
+    if (--self->klock_depth == 0) {
+        __atomic_store_n(&klock_owner, NULL, __ATOMIC_RELEASE);
+        wake_up(&klock_wait);
+    }
+}
@@ -2,91 +2,193 @@
  * MiniOS - Printf Implementation
  * 
  * Formatted printing for kernel output.
+ * Console output is collected in a buffer on the stack and handed to the
+ * console sinks (screen, serial port) a chunk at a time, so a typical
+ * printf costs each sink one call instead of one per character.
  */
 
 #include "types.h"
 #include "printf.h"
-#include "vga.h"
+#include "console.h"
 #include "string.h"
 #include <stdarg.h>
 
+/* Console output is passed on in chunks of this many characters */
+#define PRINTF_CHUNK    256
+
+/* Where formatted characters go */
+typedef struct {
+    char* buf;
+    size_t len;                 /* Characters in buf */
+    size_t room;                /* Characters buf can still take */
+    int console;                /* Pass full chunks to the consoles */
+    int count;                  /* Characters produced */
+} printf_out_t;
+
 /**
- * Print an unsigned integer in given base
+ * Hand buffered console output to the sinks
  */
-static int print_num(char* buffer, uint64_t value, int base, int width, char pad, int uppercase) {
-    static const char digits_lower[] = "0123456789abcdef";
-    static const char digits_upper[] = "0123456789ABCDEF";
-    const char* digits = uppercase ? digits_upper : digits_lower;
-    
-    char tmp[24];
-    int i = 0;
-    int len = 0;
+static void out_flush(printf_out_t* out) {
+    if (out->console && out->len) {
+        console_write(out->buf, out->len);
+        out->len = 0;
+    }
+}
+
+/**
+ * Emit one character; a full buffer drops it (or flushes, for the console)
+ */
+static void out_char(printf_out_t* out, char c) {
+    if (out->len == out->room) {
+        if (!out->console) {
+            return;
+        }
+        out_flush(out);
+    }
+    out->buf[out->len++] = c;
+    out->count++;
+}
+
+/**
+ * Emit 'len' characters at once
+ */
+static void out_write(printf_out_t* out, const char* str, size_t len) {
+    while (len > 0) {
+        if (out->len == out->room) {
+            if (!out->console) {
+                return;
+            }
+            out_flush(out);
+        }
+        size_t n = MIN(len, out->room - out->len);
+        memcpy(out->buf + out->len, str, n);
+        out->len += n;
+        out->count += n;
+        str += n;
+        len -= n;
+    }
+}
+
+/**
+ * Check if a buffer target has run out of room
+ */
+static inline int out_full(const printf_out_t* out) {
+    return !out->console && out->len == out->room;
+}
+
+/* Two-digit conversion tables: entry n is the two characters of n */
+#define DEC_ROW(d)  d "0" d "1" d "2" d "3" d "4" d "5" d "6" d "7" d "8" d "9"
+#define HEX_ROW(h, a, b, c, d, e, f) \
+    h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h a h b h c h d h e h f
+#define HEX_TABLE(a, b, c, d, e, f) \
+    HEX_ROW("0", a, b, c, d, e, f) HEX_ROW("1", a, b, c, d, e, f) \
+    HEX_ROW("2", a, b, c, d, e, f) HEX_ROW("3", a, b, c, d, e, f) \
+    HEX_ROW("4", a, b, c, d, e, f) HEX_ROW("5", a, b, c, d, e, f) \
+    HEX_ROW("6", a, b, c, d, e, f) HEX_ROW("7", a, b, c, d, e, f) \
+    HEX_ROW("8", a, b, c, d, e, f) HEX_ROW("9", a, b, c, d, e, f) \
+    HEX_ROW(a, a, b, c, d, e, f) HEX_ROW(b, a, b, c, d, e, f) \
+    HEX_ROW(c, a, b, c, d, e, f) HEX_ROW(d, a, b, c, d, e, f) \
+    HEX_ROW(e, a, b, c, d, e, f) HEX_ROW(f, a, b, c, d, e, f)
+
+static const char dec_pairs[] =
+    DEC_ROW("0") DEC_ROW("1") DEC_ROW("2") DEC_ROW("3") DEC_ROW("4")
+    DEC_ROW("5") DEC_ROW("6") DEC_ROW("7") DEC_ROW("8") DEC_ROW("9");
+static const char hex_pairs_lower[] = HEX_TABLE("a", "b", "c", "d", "e", "f");
+static const char hex_pairs_upper[] = HEX_TABLE("A", "B", "C", "D", "E", "F");
+
+/* Longest number: 20 decimal digits */
+#define NUM_MAX_DIGITS  24
+
+/**
+ * Write the decimal digits of 'value' backwards from 'end'
+ * @return Number of digits
+ */
+static int format_dec(char* end, uint64_t value) {
+    char* p = end;
     
-    /* Convert to string (reversed) */
-    if (value == 0) {
-        tmp[i++] = '0';
+    while (value >= 100) {
+        const char* pair = &dec_pairs[(value % 100) * 2];
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10) {
+        *--p = dec_pairs[value * 2 + 1];
+        *--p = dec_pairs[value * 2];
     } else {
-        while (value > 0) {
-            tmp[i++] = digits[value % base];
-            value /= base;
-        }
+        *--p = (char)('0' + value);
     }
+    return end - p;
+}
+
+/**
+ * Write the hex digits of 'value' backwards from 'end'
+ * @return Number of digits
+ */
+static int format_hex(char* end, uint64_t value, const char* pairs) {
+    char* p = end;
     
-    /* Pad if needed */
-    while (i < width) {
-        tmp[i++] = pad;
+    while (value >= 0x100) {
+        const char* pair = &pairs[(value & 0xFF) * 2];
+        value >>= 8;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 0x10) {
+        *--p = pairs[value * 2 + 1];
+        *--p = pairs[value * 2];
+    } else {
+        *--p = pairs[value * 2 + 1];
     }
+    return end - p;
+}
+
+/**
+ * Print an unsigned integer in given base (10 or 16)
+ */
+static void print_num(printf_out_t* out, uint64_t value, int base, int width, char pad, int uppercase) {
+    char tmp[NUM_MAX_DIGITS];
+    char* end = tmp + sizeof(tmp);
+    int len;
     
-    /* Reverse and output */
-    while (i > 0) {
-        if (buffer) {
-            *buffer++ = tmp[--i];
-        } else {
-            vga_putchar(tmp[--i]);
-        }
-        len++;
+    if (base == 16) {
+        len = format_hex(end, value, uppercase ? hex_pairs_upper : hex_pairs_lower);
+    } else {
+        len = format_dec(end, value);
     }
     
-    return len;
+    /* Pad if needed */
+    for (int i = len; i < width; i++) {
+        out_char(out, pad);
+    }
+    out_write(out, end - len, len);
 }
 
 /**
  * Print a signed integer
  */
-static int print_int(char* buffer, int64_t value, int width, char pad) {
-    int len = 0;
-    
+static void print_int(printf_out_t* out, int64_t value, int width, char pad) {
     if (value < 0) {
-        if (buffer) {
-            *buffer++ = '-';
-        } else {
-            vga_putchar('-');
-        }
-        len++;
+        out_char(out, '-');
         value = -value;
         if (width > 0) width--;
     }
     
-    return len + print_num(buffer ? buffer : NULL, (uint64_t)value, 10, width, pad, 0);
+    print_num(out, (uint64_t)value, 10, width, pad, 0);
 }
 
 /**
  * Core printf implementation
  */
-static int do_printf(char* buffer, size_t size, const char* format, va_list args) {
-    int count = 0;
-    size_t remaining = size ? size - 1 : (size_t)-1;  /* Reserve space for null */
-    
-    while (*format && remaining > 0) {
+static void do_printf(printf_out_t* out, const char* format, va_list args) {
+    while (*format && !out_full(out)) {
+        /* Copy the literal text up to the next conversion in one go */
         if (*format != '%') {
-            if (buffer) {
-                *buffer++ = *format;
-            } else {
-                vga_putchar(*format);
+            const char* run = format;
+            while (*format && *format != '%') {
+                format++;
             }
-            count++;
-            remaining--;
-            format++;
+            out_write(out, run, format - run);
             continue;
         }
         
@@ -94,13 +196,7 @@ static int do_printf(char* buffer, size_t size, const char* format, va_list args
         
         /* Handle %% */
         if (*format == '%') {
-            if (buffer) {
-                *buffer++ = '%';
-            } else {
-                vga_putchar('%');
-            }
-            count++;
-            remaining--;
+            out_char(out, '%');
             format++;
             continue;
         }
@@ -122,119 +218,76 @@ static int do_printf(char* buffer, size_t size, const char* format, va_list args
         /* Handle format specifier */
         switch (*format) {
             case 'd':
-            case 'i': {
-                int value = va_arg(args, int);
-                int printed = print_int(buffer, value, width, pad);
-                if (buffer) buffer += printed;
-                count += printed;
-                remaining -= printed;
+            case 'i':
+                print_int(out, va_arg(args, int), width, pad);
                 break;
-            }
             
-            case 'u': {
-                unsigned int value = va_arg(args, unsigned int);
-                int printed = print_num(buffer, value, 10, width, pad, 0);
-                if (buffer) buffer += printed;
-                count += printed;
-                remaining -= printed;
+            case 'u':
+                print_num(out, va_arg(args, unsigned int), 10, width, pad, 0);
                 break;
-            }
             
-            case 'x': {
-                unsigned int value = va_arg(args, unsigned int);
-                int printed = print_num(buffer, value, 16, width, pad, 0);
-                if (buffer) buffer += printed;
-                count += printed;
-                remaining -= printed;
+            case 'x':
+                print_num(out, va_arg(args, unsigned int), 16, width, pad, 0);
                 break;
-            }
             
-            case 'X': {
-                unsigned int value = va_arg(args, unsigned int);
-                int printed = print_num(buffer, value, 16, width, pad, 1);
-                if (buffer) buffer += printed;
-                count += printed;
-                remaining -= printed;
+            case 'X':
+                print_num(out, va_arg(args, unsigned int), 16, width, pad, 1);
                 break;
-            }
             
             case 'p': {
                 void* ptr = va_arg(args, void*);
-                if (buffer) {
-                    *buffer++ = '0';
-                    *buffer++ = 'x';
-                } else {
-                    vga_putchar('0');
-                    vga_putchar('x');
-                }
-                count += 2;
-                remaining -= 2;
-                int printed = print_num(buffer, (uint64_t)ptr, 16, 16, '0', 0);
-                if (buffer) buffer += printed;
-                count += printed;
-                remaining -= printed;
+                out_char(out, '0');
+                out_char(out, 'x');
+                print_num(out, (uint64_t)ptr, 16, 16, '0', 0);
                 break;
             }
             
             case 's': {
                 const char* str = va_arg(args, const char*);
                 if (!str) str = "(null)";
-                while (*str && remaining > 0) {
-                    if (buffer) {
-                        *buffer++ = *str;
-                    } else {
-                        vga_putchar(*str);
-                    }
-                    str++;
-                    count++;
-                    remaining--;
-                }
+                out_write(out, str, strlen(str));
                 break;
             }
             
-            case 'c': {
-                char c = (char)va_arg(args, int);
-                if (buffer) {
-                    *buffer++ = c;
-                } else {
-                    vga_putchar(c);
-                }
-                count++;
-                remaining--;
+            case 'c':
+                out_char(out, (char)va_arg(args, int));
                 break;
-            }
             
             default:
                 /* Unknown format, just print it */
-                if (buffer) {
-                    *buffer++ = '%';
-                    *buffer++ = *format;
-                } else {
-                    vga_putchar('%');
-                    vga_putchar(*format);
-                }
-                count += 2;
-                remaining -= 2;
+                out_char(out, '%');
+                out_char(out, *format);
                 break;
         }
         
+        if (!*format) {
+            break;  /* '%' at the very end */
+        }
         format++;
     }
-    
-    if (buffer) {
-        *buffer = '\0';
+}
+
+/**
+ * Format into a caller's buffer of 'size' bytes (terminator included)
+ */
+static int buffer_printf(char* buffer, size_t size, const char* format, va_list args) {
+    if (size == 0) {
+        return 0;
     }
     
-    return count;
+    printf_out_t out = { .buf = buffer, .room = size - 1 };
+    do_printf(&out, format, args);
+    buffer[out.len] = '\0';
+    return out.count;
 }
 
 /**
- * Printf to VGA console
+ * Printf to the consoles
  */
-int printf(const char* format, ...) {
+int (printf)(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    int result = do_printf(NULL, 0, format, args);
+    int result = vprintf(format, args);
     va_end(args);
     return result;
 }
@@ -245,7 +298,7 @@ int printf(const char* format, ...) {
 int sprintf(char* buffer, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    int result = do_printf(buffer, (size_t)-1, format, args);
+    int result = buffer_printf(buffer, (size_t)-1, format, args);
     va_end(args);
     return result;
 }
@@ -256,7 +309,7 @@ int sprintf(char* buffer, const char* format, ...) {
 int snprintf(char* buffer, size_t size, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    int result = do_printf(buffer, size, format, args);
+    int result = buffer_printf(buffer, size, format, args);
     va_end(args);
     return result;
 }
@@ -265,13 +318,71 @@ int snprintf(char* buffer, size_t size, const char* format, ...) {
  * Vprintf with va_list
  */
 int vprintf(const char* format, va_list args) {
-    return do_printf(NULL, 0, format, args);
+    char chunk[PRINTF_CHUNK];
+    printf_out_t out = { .buf = chunk, .room = sizeof(chunk), .console = 1 };
+    
+    do_printf(&out, format, args);
+    out_flush(&out);
+    return out.count;
+}
+
+/**
+ * Print text that needs no formatting (printf() of a literal without '%')
+ */
+int printf_literal(const char* str, size_t len) {
+    console_write(str, len);
+    return (int)len;
+}
+
+/**
+ * Hex dump, one console write per line
+ */
+void hexdump(const void* data, size_t len, uint32_t offset) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    
+    for (size_t i = 0; i < len; i += HEXDUMP_WIDTH) {
+        /* "0000: " + "xx " per byte + " " + one character per byte + "\n" */
+        char line[NUM_MAX_DIGITS + 2 + HEXDUMP_WIDTH * 4 + 2];
+        char tmp[NUM_MAX_DIGITS];
+        char* p = line;
+        size_t n = MIN(len - i, (size_t)HEXDUMP_WIDTH);
+        
+        int digits = format_hex(tmp + sizeof(tmp), offset + i, hex_pairs_lower);
+        for (int d = digits; d < 4; d++) {
+            *p++ = '0';
+        }
+        memcpy(p, tmp + sizeof(tmp) - digits, digits);
+        p += digits;
+        *p++ = ':';
+        *p++ = ' ';
+        
+        for (size_t j = 0; j < HEXDUMP_WIDTH; j++) {
+            if (j < n) {
+                const char* pair = &hex_pairs_lower[bytes[i + j] * 2];
+                p[0] = pair[0];
+                p[1] = pair[1];
+            } else {
+                p[0] = ' ';
+                p[1] = ' ';
+            }
+            p[2] = ' ';
+            p += 3;
+        }
+        *p++ = ' ';
+        
+        for (size_t j = 0; j < n; j++) {
+            uint8_t c = bytes[i + j];
+            *p++ = (c >= 32 && c < 127) ? (char)c : '.';
+        }
+        *p++ = '\n';
+        
+        console_write(line, p - line);
+    }
 }
 
 /**
  * Vsprintf with va_list
  */
 int vsprintf(char* buffer, const char* format, va_list args) {
-    return do_printf(buffer, (size_t)-1, format, args);
+    return buffer_printf(buffer, (size_t)-1, format, args);
 }
-
@@ -0,0 +1,129 @@
+/**
+ * MiniOS - Lock-free Rings
+ *
+ * A producer reads the consumer's index to see how much room there is,
+ * copies its elements in, then moves prod.tail past them. Several
+ * producers first claim their slots by moving prod.head with a
+ * compare-and-swap, and publish in the order they claimed, so the
+ * consumer never sees a slot that is claimed but not yet written.
+ */
+
+#include "types.h"
+#include "ring.h"
+#include "string.h"
+#include "ports.h"
+#include "spinlock.h"
+
+/**
+ * Set up a ring
+ */
+int ring_init(ring_t* ring, void* slots, uint32_t size, uint32_t esize) {
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return -1;
+    }
+
+    ring->slots = (uint8_t*)slots;
+    ring->mask = size - 1;
+    ring->esize = esize;
+    ring->prod.head = 0;
+    ring->prod.tail = 0;
+    ring->cons.tail = 0;
+    return 0;
+}
+
+/**
+ * Copy 'n' elements into the ring from index 'idx', wrapping at the end
+ */
+static void ring_copy_in(ring_t* ring, uint32_t idx, const void* objs, uint32_t n) {
+    uint32_t first = idx & ring->mask;
+    uint32_t chunk = MIN(n, ring->mask + 1 - first);
+
+    memcpy(ring->slots + first * ring->esize, objs, chunk * ring->esize);
+    if (chunk < n) {
+        memcpy(ring->slots, (const uint8_t*)objs + chunk * ring->esize,
+               (n - chunk) * ring->esize);
+    }
+}
+
+/**
+ * Copy 'n' elements out of the ring from index 'idx', wrapping at the end
+ */
+static void ring_copy_out(ring_t* ring, uint32_t idx, void* objs, uint32_t n) {
+    uint32_t first = idx & ring->mask;
+    uint32_t chunk = MIN(n, ring->mask + 1 - first);
+
+    memcpy(objs, ring->slots + first * ring->esize, chunk * ring->esize);
+    if (chunk < n) {
+        memcpy((uint8_t*)objs + chunk * ring->esize, ring->slots,
+               (n - chunk) * ring->esize);
+    }
+}
+
+/**
+ * Append up to 'n' elements (single producer)
+ */
+uint32_t ring_sp_enqueue_bulk(ring_t* ring, const void* objs, uint32_t n) {
+    uint32_t head = ring->prod.head;
+    uint32_t cons = __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+
+    n = MIN(n, ring->mask + 1 - (head - cons));
+    if (n == 0) {
+        return 0;
+    }
+
+    ring_copy_in(ring, head, objs, n);
+    ring->prod.head = head + n;
+    __atomic_store_n(&ring->prod.tail, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * Append up to 'n' elements (several producers)
+ * Interrupts stay off from claiming the slots to publishing them: an
+ * interrupt handler producing on the same CPU would otherwise wait
+ * forever for the publish it interrupted.
+ */
+uint32_t ring_mp_enqueue_bulk(ring_t* ring, const void* objs, uint32_t n) {
+    uint64_t flags = irq_save();
+    uint32_t head = __atomic_load_n(&ring->prod.head, __ATOMIC_RELAXED);
+    uint32_t count;
+
+    /* Claim slots; a failed CAS reloads 'head' */
+    do {
+        uint32_t cons = __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+        count = MIN(n, ring->mask + 1 - (head - cons));
+        if (count == 0) {
+            irq_restore(flags);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->prod.head, &head, head + count, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    ring_copy_in(ring, head, objs, count);
+
+    /* Producers that claimed earlier slots publish first */
+    while (__atomic_load_n(&ring->prod.tail, __ATOMIC_RELAXED) != head) {
+        cpu_relax();
+    }
+    __atomic_store_n(&ring->prod.tail, head + count, __ATOMIC_RELEASE);
+
+    irq_restore(flags);
+    return count;
+}
+
+/**
+ * Remove up to 'n' elements (single consumer)
+ */
+uint32_t ring_sc_dequeue_bulk(ring_t* ring, void* objs, uint32_t n) {
+    uint32_t tail = ring->cons.tail;
+    uint32_t prod = __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE);
+
+    n = MIN(n, prod - tail);
+    if (n == 0) {
+        return 0;
+    }
+
+    ring_copy_out(ring, tail, objs, n);
+    __atomic_store_n(&ring->cons.tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
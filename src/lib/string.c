@@ -92,12 +92,82 @@ char* strchr(const char* str, int c) {
     return (c == '\0') ? (char*)str : NULL;
 }
 
+/*
+ * Memory primitives
+ *
+ * The kernel is built without SSE, so bulk operations use aligned 8-byte
+ * word loops with byte head/tail handling. Large sizes switch to
+ * "rep movs/stos", using the byte form when the CPU advertises Enhanced
+ * REP MOVSB/STOSB (ERMS) and the qword form otherwise.
+ */
+
+/* Word type that may alias any object */
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+/* Sizes at or above this use rep string instructions */
+#define STRING_REP_THRESHOLD    256
+
+/* Keep GCC from turning these loops back into calls to themselves */
+#define STRING_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+/* Set by string_init() when CPUID reports ERMS */
+static int string_erms = 0;
+
+/**
+ * Detect CPU string-instruction features
+ */
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7) {
+        return;
+    }
+
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    string_erms = (ebx >> 9) & 1;
+}
+
+/**
+ * Check if Enhanced REP MOVSB/STOSB is in use
+ */
+int string_has_erms(void) {
+    return string_erms;
+}
+
 /**
  * Copy n bytes from src to dest
  */
-void* memcpy(void* dest, const void* src, size_t n) {
+STRING_NO_LIBCALL void* memcpy(void* dest, const void* src, size_t n) {
     uint8_t* d = (uint8_t*)dest;
     const uint8_t* s = (const uint8_t*)src;
+
+    if (n >= STRING_REP_THRESHOLD && string_erms) {
+        __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+        return dest;
+    }
+
+    if (n >= 8) {
+        /* Align the destination */
+        while ((uintptr_t)d & 7) {
+            *d++ = *s++;
+            n--;
+        }
+
+        if (n >= STRING_REP_THRESHOLD) {
+            size_t words = n / 8;
+            __asm__ volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+            n &= 7;
+        } else {
+            while (n >= 8) {
+                *(word_t*)d = *(const word_t*)s;
+                d += 8;
+                s += 8;
+                n -= 8;
+            }
+        }
+    }
+
     while (n--) {
         *d++ = *s++;
     }
@@ -107,10 +177,39 @@ void* memcpy(void* dest, const void* src, size_t n) {
 /**
  * Set n bytes of memory to value c
  */
-void* memset(void* ptr, int c, size_t n) {
+STRING_NO_LIBCALL void* memset(void* ptr, int c, size_t n) {
     uint8_t* p = (uint8_t*)ptr;
+    uint8_t byte = (uint8_t)c;
+
+    if (n >= STRING_REP_THRESHOLD && string_erms) {
+        __asm__ volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(byte) : "memory");
+        return ptr;
+    }
+
+    if (n >= 8) {
+        uint64_t pattern = byte * 0x0101010101010101ULL;
+
+        /* Align the destination */
+        while ((uintptr_t)p & 7) {
+            *p++ = byte;
+            n--;
+        }
+
+        if (n >= STRING_REP_THRESHOLD) {
+            size_t words = n / 8;
+            __asm__ volatile("rep stosq" : "+D"(p), "+c"(words) : "a"(pattern) : "memory");
+            n &= 7;
+        } else {
+            while (n >= 8) {
+                *(word_t*)p = pattern;
+                p += 8;
+                n -= 8;
+            }
+        }
+    }
+
     while (n--) {
-        *p++ = (uint8_t)c;
+        *p++ = byte;
     }
     return ptr;
 }
@@ -118,9 +217,17 @@ void* memset(void* ptr, int c, size_t n) {
 /**
  * Compare n bytes of memory
  */
-int memcmp(const void* s1, const void* s2, size_t n) {
+STRING_NO_LIBCALL int memcmp(const void* s1, const void* s2, size_t n) {
     const uint8_t* p1 = (const uint8_t*)s1;
     const uint8_t* p2 = (const uint8_t*)s2;
+
+    /* Skip equal words; the byte loop below locates the first difference */
+    while (n >= 8 && *(const word_t*)p1 == *(const word_t*)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     while (n--) {
         if (*p1 != *p2) {
             return *p1 - *p2;
@@ -134,20 +241,31 @@ int memcmp(const void* s1, const void* s2, size_t n) {
 /**
  * Copy n bytes, handles overlapping memory
  */
-void* memmove(void* dest, const void* src, size_t n) {
+STRING_NO_LIBCALL void* memmove(void* dest, const void* src, size_t n) {
     uint8_t* d = (uint8_t*)dest;
     const uint8_t* s = (const uint8_t*)src;
-    
-    if (d < s) {
-        while (n--) {
-            *d++ = *s++;
-        }
-    } else if (d > s) {
-        d += n;
-        s += n;
-        while (n--) {
-            *--d = *--s;
-        }
+
+    if (d <= s || d >= s + n) {
+        /* Forward copy is safe (rep movs copies in ascending order) */
+        return memcpy(dest, src, n);
+    }
+
+    /* Overlapping with dest above src: copy backwards */
+    d += n;
+    s += n;
+
+    while (n && ((uintptr_t)d & 7)) {
+        *--d = *--s;
+        n--;
+    }
+    while (n >= 8) {
+        d -= 8;
+        s -= 8;
+        *(word_t*)d = *(const word_t*)s;
+        n -= 8;
+    }
+    while (n--) {
+        *--d = *--s;
     }
     return dest;
 }
@@ -2,11 +2,21 @@
  * MiniOS - ARP Protocol
  * 
  * Address Resolution Protocol for mapping IP to MAC addresses.
+ * The neighbour cache is an open-addressed hash table with linear probing.
+ * Entries carry timestamps for aging and LRU eviction, and an unresolved
+ * entry holds the outbound packets waiting for its reply.
+ *
+ * The table is behind one lock. Packets are never sent with it held:
+ * sending may come back into the ARP code.
  */
 
 #include "types.h"
 #include "net.h"
 #include "string.h"
+#include "pktbuf.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "perf.h"
 
 /* ARP header */
 typedef struct {
@@ -25,123 +35,391 @@ typedef struct {
 #define ARP_REQUEST     1
 #define ARP_REPLY       2
 
+/* Neighbour cache geometry (table kept at most half full) */
+#define ARP_TABLE_BITS  9
+#define ARP_TABLE_SIZE  (1 << ARP_TABLE_BITS)
+#define ARP_TABLE_MASK  (ARP_TABLE_SIZE - 1)
+#define ARP_MAX_ENTRIES (ARP_TABLE_SIZE / 2)
+
+/* Aging, in timer ticks */
+#define ARP_REACHABLE_TICKS (60 * TIMER_HZ)     /* Refresh after this long */
+#define ARP_EXPIRE_TICKS    (120 * TIMER_HZ)    /* Forget after this long */
+#define ARP_RETRY_TICKS     (1 * TIMER_HZ)      /* Between requests */
+#define ARP_MAX_RETRIES     3
+
+/* Packets held per unresolved neighbour */
+#define ARP_MAX_PENDING 8
+
+/* Entry states */
+#define ARP_STATE_INCOMPLETE    1   /* Request sent, no reply yet */
+#define ARP_STATE_RESOLVED      2
+
 /* ARP cache entry */
 typedef struct {
-    uint32_t ip;
+    uint32_t ip;                /* 0 marks an empty slot */
     uint8_t mac[6];
-    int valid;
+    uint8_t state;              /* ARP_STATE_* */
+    uint8_t retries;            /* Requests sent while incomplete */
+    uint64_t updated;           /* Last confirmation or request */
+    uint64_t used;              /* Last lookup, for LRU eviction */
+    pktbuf_t* pending;          /* Packets waiting for resolution */
+    pktbuf_t* pending_tail;
+    uint16_t pending_count;
 } arp_entry_t;
 
 /* ARP cache */
-#define ARP_CACHE_SIZE  16
-static arp_entry_t arp_cache[ARP_CACHE_SIZE];
+static arp_entry_t arp_table[ARP_TABLE_SIZE];
+static int arp_count = 0;
+static spinlock_t arp_lock = SPINLOCK_INIT;
 
 /* External ethernet functions */
 extern void eth_get_mac(uint8_t mac[6]);
-extern int eth_send(const uint8_t dest[6], uint16_t ethertype, const void* data, uint16_t len);
-extern int eth_send_broadcast(uint16_t ethertype, const void* data, uint16_t len);
+extern int eth_send_pkt(const uint8_t dest[6], uint16_t ethertype, pktbuf_t* pb);
+extern int eth_send_broadcast_pkt(uint16_t ethertype, pktbuf_t* pb);
+
+int arp_request(uint32_t target_ip);
+int arp_announce(void);
 
 /**
- * Initialize ARP
+ * Home slot of an address (Fibonacci hashing)
  */
-void arp_init(void) {
-    memset(arp_cache, 0, sizeof(arp_cache));
+static inline int arp_hash(uint32_t ip) {
+    return (int)((ip * 0x9E3779B1U) >> (32 - ARP_TABLE_BITS));
 }
 
 /**
- * Look up IP in ARP cache
+ * Find the slot holding an address, or -1
  */
-int arp_lookup(uint32_t ip, uint8_t mac_out[6]) {
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            memcpy(mac_out, arp_cache[i].mac, 6);
-            return 1;
+static int arp_find(uint32_t ip) {
+    int slot = arp_hash(ip);
+    
+    while (arp_table[slot].ip) {
+        if (arp_table[slot].ip == ip) {
+            return slot;
         }
+        slot = (slot + 1) & ARP_TABLE_MASK;
     }
-    return 0;
+    return -1;
 }
 
 /**
- * Add entry to ARP cache
+ * Drop the packets queued on an entry
  */
-static void arp_cache_add(uint32_t ip, const uint8_t mac[6]) {
-    /* Find empty or existing slot */
-    int slot = -1;
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (!arp_cache[i].valid) {
-            slot = i;
+static void arp_drop_pending(arp_entry_t* entry) {
+    pktbuf_t* pb = entry->pending;
+    
+    while (pb) {
+        pktbuf_t* next = pb->next;
+        pb->next = NULL;
+        pktbuf_free(pb);
+        pb = next;
+    }
+    entry->pending = NULL;
+    entry->pending_tail = NULL;
+    entry->pending_count = 0;
+}
+
+/**
+ * Remove an entry, shifting later members of its probe run back
+ * so lookups never stop early at the hole.
+ */
+static void arp_remove(int slot) {
+    arp_drop_pending(&arp_table[slot]);
+    
+    int hole = slot;
+    int i = slot;
+    for (;;) {
+        i = (i + 1) & ARP_TABLE_MASK;
+        if (!arp_table[i].ip) {
             break;
         }
-        if (arp_cache[i].ip == ip) {
-            slot = i;
+        /* Move the entry if the hole lies between its home slot and i */
+        int home = arp_hash(arp_table[i].ip);
+        if (((i - home) & ARP_TABLE_MASK) >= ((i - hole) & ARP_TABLE_MASK)) {
+            arp_table[hole] = arp_table[i];
+            hole = i;
+        }
+    }
+    
+    memset(&arp_table[hole], 0, sizeof(arp_entry_t));
+    arp_count--;
+}
+
+/**
+ * Make room for a new entry
+ * Expired entries go first, then the least recently used resolved entry.
+ * Entries with queued packets are only taken as a last resort.
+ */
+static void arp_evict(uint64_t now) {
+    int victim = -1;
+    int busy_victim = -1;
+    
+    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+        arp_entry_t* entry = &arp_table[i];
+        if (!entry->ip) {
+            continue;
+        }
+        if (now - entry->updated >= ARP_EXPIRE_TICKS) {
+            victim = i;
             break;
         }
+        if (entry->pending) {
+            if (busy_victim < 0 || entry->used < arp_table[busy_victim].used) {
+                busy_victim = i;
+            }
+        } else if (victim < 0 || entry->used < arp_table[victim].used) {
+            victim = i;
+        }
     }
     
+    if (victim < 0) {
+        victim = busy_victim;
+    }
+    if (victim >= 0) {
+        arp_remove(victim);
+    }
+}
+
+/**
+ * Create an entry for an address that is not in the table
+ */
+static arp_entry_t* arp_insert(uint32_t ip, uint64_t now) {
+    if (arp_count >= ARP_MAX_ENTRIES) {
+        arp_evict(now);
+    }
+    
+    int slot = arp_hash(ip);
+    while (arp_table[slot].ip) {
+        slot = (slot + 1) & ARP_TABLE_MASK;
+    }
+    
+    arp_entry_t* entry = &arp_table[slot];
+    memset(entry, 0, sizeof(arp_entry_t));
+    entry->ip = ip;
+    entry->state = ARP_STATE_INCOMPLETE;
+    entry->updated = now;
+    entry->used = now;
+    arp_count++;
+    return entry;
+}
+
+/**
+ * Send the packets that were queued on a freshly resolved entry
+ * The list is detached from the entry (under the lock) beforehand.
+ */
+static void arp_flush_pending(const uint8_t mac[6], pktbuf_t* pb) {
+    while (pb) {
+        pktbuf_t* next = pb->next;
+        pb->next = NULL;
+        eth_send_pkt(mac, ETHERTYPE_IPV4, pb);
+        pb = next;
+    }
+}
+
+/**
+ * Initialize ARP
+ */
+void arp_init(void) {
+    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+        arp_drop_pending(&arp_table[i]);
+    }
+    memset(arp_table, 0, sizeof(arp_table));
+    arp_count = 0;
+    
+    /* Announce ourselves so neighbours replace any stale mapping */
+    arp_announce();
+}
+
+/**
+ * Look up a resolved address (arp_lock held)
+ * @param refresh  Set if the mapping is stale and should be asked for again
+ */
+static int arp_lookup_locked(uint32_t ip, uint8_t mac_out[6], int* refresh) {
+    int slot = arp_find(ip);
     if (slot < 0) {
-        slot = 0;  /* Overwrite first entry if cache is full */
+        return 0;
     }
     
-    arp_cache[slot].ip = ip;
-    memcpy(arp_cache[slot].mac, mac, 6);
-    arp_cache[slot].valid = 1;
+    arp_entry_t* entry = &arp_table[slot];
+    uint64_t now = timer_ticks();
+    
+    if (entry->state != ARP_STATE_RESOLVED) {
+        return 0;
+    }
+    if (now - entry->updated >= ARP_EXPIRE_TICKS) {
+        arp_remove(slot);
+        return 0;
+    }
+    
+    /* Stale: keep using the mapping, but ask again (once per retry period) */
+    if (now - entry->updated >= ARP_REACHABLE_TICKS &&
+        now - entry->used >= ARP_RETRY_TICKS) {
+        *refresh = 1;
+    }
+    
+    entry->used = now;
+    memcpy(mac_out, entry->mac, 6);
+    return 1;
+}
+
+/**
+ * Look up IP in ARP cache
+ */
+int arp_lookup(uint32_t ip, uint8_t mac_out[6]) {
+    int refresh = 0;
+    
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    int found = arp_lookup_locked(ip, mac_out, &refresh);
+    spin_unlock_irqrestore(&arp_lock, flags);
+    
+    perf_count(found ? PERF_ARP_HIT : PERF_ARP_MISS);
+    
+    if (refresh) {
+        arp_request(ip);
+    }
+    return found;
+}
+
+/**
+ * Send an IPv4 packet to a neighbour (takes ownership of the packet buffer)
+ * If the address is not resolved yet, the packet is queued and sent when
+ * the reply arrives.
+ * @return 0 if sent or queued, negative on error
+ */
+int arp_send(uint32_t ip, pktbuf_t* pb) {
+    uint8_t mac[6];
+    int request = 0;
+    
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    
+    if (arp_lookup_locked(ip, mac, &request)) {
+        spin_unlock_irqrestore(&arp_lock, flags);
+        perf_count(PERF_ARP_HIT);
+        if (request) {
+            arp_request(ip);
+        }
+        return eth_send_pkt(mac, ETHERTYPE_IPV4, pb);
+    }
+    
+    perf_count(PERF_ARP_MISS);
+    uint64_t now = timer_ticks();
+    int slot = arp_find(ip);
+    arp_entry_t* entry;
+    
+    if (slot < 0) {
+        entry = arp_insert(ip, now);
+        entry->retries = 1;
+        request = 1;
+    } else {
+        entry = &arp_table[slot];
+        entry->used = now;
+        
+        if (now - entry->updated >= ARP_RETRY_TICKS) {
+            if (entry->retries >= ARP_MAX_RETRIES) {
+                /* Unreachable: give up on what is queued and start over */
+                arp_drop_pending(entry);
+                entry->retries = 0;
+            }
+            entry->retries++;
+            entry->updated = now;
+            request = 1;
+        }
+    }
+    
+    int queued = entry->pending_count < ARP_MAX_PENDING;
+    if (queued) {
+        pb->next = NULL;
+        if (entry->pending_tail) {
+            entry->pending_tail->next = pb;
+        } else {
+            entry->pending = pb;
+        }
+        entry->pending_tail = pb;
+        entry->pending_count++;
+    }
+    
+    spin_unlock_irqrestore(&arp_lock, flags);
+    
+    if (request) {
+        arp_request(ip);
+    }
+    if (!queued) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Send an ARP request
  */
 int arp_request(uint32_t target_ip) {
-    arp_packet_t pkt;
+    pktbuf_t* pb = pktbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    
+    arp_packet_t* pkt = (arp_packet_t*)pktbuf_append(pb, sizeof(arp_packet_t));
     uint8_t our_mac[6];
     
     eth_get_mac(our_mac);
     
-    pkt.htype = __builtin_bswap16(1);       /* Ethernet */
-    pkt.ptype = __builtin_bswap16(0x0800);  /* IPv4 */
-    pkt.hlen = 6;
-    pkt.plen = 4;
-    pkt.oper = __builtin_bswap16(ARP_REQUEST);
+    pkt->htype = __builtin_bswap16(1);       /* Ethernet */
+    pkt->ptype = __builtin_bswap16(0x0800);  /* IPv4 */
+    pkt->hlen = 6;
+    pkt->plen = 4;
+    pkt->oper = __builtin_bswap16(ARP_REQUEST);
     
-    memcpy(pkt.sha, our_mac, 6);
-    pkt.spa = net_get_ip();
-    memset(pkt.tha, 0, 6);
-    pkt.tpa = target_ip;
+    memcpy(pkt->sha, our_mac, 6);
+    pkt->spa = net_get_ip();
+    memset(pkt->tha, 0, 6);
+    pkt->tpa = target_ip;
     
-    return eth_send_broadcast(ETHERTYPE_ARP, &pkt, sizeof(pkt));
+    return eth_send_broadcast_pkt(ETHERTYPE_ARP, pb);
+}
+
+/**
+ * Send a gratuitous ARP request for our own address
+ */
+int arp_announce(void) {
+    uint32_t ip = net_get_ip();
+    if (ip == 0) {
+        return -1;
+    }
+    return arp_request(ip);
 }
 
 /**
- * Send an ARP reply
+ * Send an ARP reply by rewriting the request in place
  */
-static int arp_reply(const uint8_t dest_mac[6], uint32_t dest_ip) {
-    arp_packet_t pkt;
+static int arp_reply(pktbuf_t* pb, arp_packet_t* pkt) {
     uint8_t our_mac[6];
+    uint8_t dest_mac[6];
     
     eth_get_mac(our_mac);
+    memcpy(dest_mac, pkt->sha, 6);
     
-    pkt.htype = __builtin_bswap16(1);       /* Ethernet */
-    pkt.ptype = __builtin_bswap16(0x0800);  /* IPv4 */
-    pkt.hlen = 6;
-    pkt.plen = 4;
-    pkt.oper = __builtin_bswap16(ARP_REPLY);
+    pkt->oper = __builtin_bswap16(ARP_REPLY);
     
-    memcpy(pkt.sha, our_mac, 6);
-    pkt.spa = net_get_ip();
-    memcpy(pkt.tha, dest_mac, 6);
-    pkt.tpa = dest_ip;
+    memcpy(pkt->tha, pkt->sha, 6);
+    pkt->tpa = pkt->spa;
+    memcpy(pkt->sha, our_mac, 6);
+    pkt->spa = net_get_ip();
     
-    return eth_send(dest_mac, ETHERTYPE_ARP, &pkt, sizeof(pkt));
+    /* Drop Ethernet padding and send the same buffer back */
+    pktbuf_trim(pb, sizeof(arp_packet_t));
+    return eth_send_pkt(dest_mac, ETHERTYPE_ARP, pktbuf_ref(pb));
 }
 
 /**
  * Process an incoming ARP packet
  */
-void arp_process(const void* data, uint16_t len) {
-    if (len < sizeof(arp_packet_t)) {
+void arp_process(pktbuf_t* pb) {
+    if (pb->len < sizeof(arp_packet_t)) {
         return;
     }
     
-    const arp_packet_t* pkt = (const arp_packet_t*)data;
+    arp_packet_t* pkt = (arp_packet_t*)pb->data;
     
     /* Verify it's Ethernet + IPv4 */
     if (__builtin_bswap16(pkt->htype) != 1 || 
@@ -150,11 +428,45 @@ void arp_process(const void* data, uint16_t len) {
         return;
     }
     
-    /* Always update ARP cache with sender info */
-    arp_cache_add(pkt->spa, pkt->sha);
+    /* Merge the sender into the cache (RFC 826) */
+    uint32_t our_ip = net_get_ip();
+    if (pkt->spa == 0 || pkt->spa == our_ip) {
+        return;  /* Probe, or our own announcement */
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    int slot = arp_find(pkt->spa);
+    int for_us = (pkt->tpa == our_ip);
+    
+    /* Only learn new neighbours that are talking to us */
+    if (slot < 0 && !for_us) {
+        spin_unlock_irqrestore(&arp_lock, flags);
+        return;
+    }
+    
+    uint64_t now = timer_ticks();
+    arp_entry_t* entry = (slot >= 0) ? &arp_table[slot] : arp_insert(pkt->spa, now);
     
-    /* Check if this is for us */
-    if (pkt->tpa != net_get_ip()) {
+    memcpy(entry->mac, pkt->sha, 6);
+    entry->state = ARP_STATE_RESOLVED;
+    entry->retries = 0;
+    entry->updated = now;
+    
+    /* Take the waiting packets; they go out once the lock is dropped */
+    pktbuf_t* pending = entry->pending;
+    uint8_t mac[6];
+    memcpy(mac, entry->mac, 6);
+    entry->pending = NULL;
+    entry->pending_tail = NULL;
+    entry->pending_count = 0;
+    
+    spin_unlock_irqrestore(&arp_lock, flags);
+    
+    if (pending) {
+        arp_flush_pending(mac, pending);
+    }
+    
+    if (!for_us) {
         return;
     }
     
@@ -162,8 +474,7 @@ void arp_process(const void* data, uint16_t len) {
     
     if (oper == ARP_REQUEST) {
         /* Send reply */
-        arp_reply(pkt->sha, pkt->spa);
+        arp_reply(pb, pkt);
     }
-    /* For ARP_REPLY, we already cached the info above */
+    /* For ARP_REPLY, the sender was merged above */
 }
-
@@ -0,0 +1,122 @@
+/**
+ * MiniOS - Internet Checksum
+ * 
+ * One's complement sums for the protocol layers. The buffer is summed
+ * eight bytes at a time into a 64-bit accumulator with end-around carry;
+ * folding to 16 bits is deferred until the caller needs the checksum,
+ * so partial sums of headers and payload combine without re-reading data.
+ */
+
+#include "types.h"
+#include "checksum.h"
+
+/* Unaligned, alias-safe loads and stores */
+typedef uint64_t __attribute__((may_alias, aligned(1))) csum_u64_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) csum_u32_t;
+typedef uint16_t __attribute__((may_alias, aligned(1))) csum_u16_t;
+
+/**
+ * 64-bit add with end-around carry
+ */
+static inline uint64_t csum_add64(uint64_t sum, uint64_t value) {
+    sum += value;
+    return sum + (sum < value);
+}
+
+/**
+ * Fold a 64-bit accumulator to a 32-bit partial sum
+ */
+static inline uint32_t csum_fold64(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+/**
+ * Sum the last 0-7 bytes of a buffer
+ * An odd final byte is the first byte of a zero-padded word.
+ */
+static inline uint64_t csum_tail(const uint8_t* p, size_t len, uint64_t acc) {
+    if (len & 4) {
+        acc = csum_add64(acc, *(const csum_u32_t*)p);
+        p += 4;
+    }
+    if (len & 2) {
+        acc = csum_add64(acc, *(const csum_u16_t*)p);
+        p += 2;
+    }
+    if (len & 1) {
+        acc = csum_add64(acc, *p);
+    }
+    return acc;
+}
+
+/**
+ * Add a buffer to a partial sum
+ */
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t acc = sum;
+    
+    /* Four independent words per iteration keep the adds pipelined */
+    while (len >= 32) {
+        uint64_t a = *(const csum_u64_t*)(p + 0);
+        uint64_t b = *(const csum_u64_t*)(p + 8);
+        uint64_t c = *(const csum_u64_t*)(p + 16);
+        uint64_t d = *(const csum_u64_t*)(p + 24);
+        acc = csum_add64(acc, a);
+        acc = csum_add64(acc, b);
+        acc = csum_add64(acc, c);
+        acc = csum_add64(acc, d);
+        p += 32;
+        len -= 32;
+    }
+    
+    while (len >= 8) {
+        acc = csum_add64(acc, *(const csum_u64_t*)p);
+        p += 8;
+        len -= 8;
+    }
+    
+    return csum_fold64(csum_tail(p, len, acc));
+}
+
+/**
+ * Copy a buffer and add it to a partial sum in the same pass
+ */
+uint32_t csum_partial_copy(void* dest, const void* src, size_t len, uint32_t sum) {
+    const uint8_t* s = (const uint8_t*)src;
+    uint8_t* d = (uint8_t*)dest;
+    uint64_t acc = sum;
+    
+    while (len >= 8) {
+        uint64_t word = *(const csum_u64_t*)s;
+        *(csum_u64_t*)d = word;
+        acc = csum_add64(acc, word);
+        s += 8;
+        d += 8;
+        len -= 8;
+    }
+    
+    for (size_t i = 0; i < len; i++) {
+        d[i] = s[i];
+    }
+    
+    return csum_fold64(csum_tail(s, len, acc));
+}
+
+/**
+ * Sum of the TCP/UDP pseudo-header added to a partial sum
+ */
+uint32_t csum_tcpudp_nofold(uint32_t src_ip, uint32_t dest_ip, uint16_t len,
+                            uint8_t protocol, uint32_t sum) {
+    uint64_t acc = sum;
+    
+    acc += src_ip;
+    acc += dest_ip;
+    
+    /* Zero byte + protocol, then the length, both big-endian */
+    acc += (uint32_t)__builtin_bswap16(len) + ((uint32_t)protocol << 8);
+    
+    return csum_fold64(acc);
+}
@@ -7,10 +7,11 @@
 #include "types.h"
 #include "net.h"
 #include "string.h"
+#include "pktbuf.h"
 
 /* External virtio driver functions */
-extern int virtio_net_send(const void* data, uint16_t len);
-extern int virtio_net_receive(void* buffer, uint16_t max_len);
+extern int virtio_net_send_pkt(pktbuf_t* pb);
+extern pktbuf_t* virtio_net_receive_pkt(void);
 extern void virtio_net_get_mac(uint8_t mac[6]);
 
 /* Our MAC address */
@@ -34,13 +35,19 @@ void eth_get_mac(uint8_t mac[6]) {
 }
 
 /**
- * Send an Ethernet frame
+ * Send an Ethernet frame (takes ownership of the packet buffer)
+ * The header is pushed into the buffer's headroom.
  */
-int eth_send(const uint8_t dest[6], uint16_t ethertype, const void* data, uint16_t len) {
-    uint8_t frame[ETH_FRAME_MAX];
-    eth_header_t* hdr = (eth_header_t*)frame;
+int eth_send_pkt(const uint8_t dest[6], uint16_t ethertype, pktbuf_t* pb) {
+    /* TSO frames are cut down to the MTU by the device */
+    if (pb->len > ETH_MTU && pb->gso_type == PKTBUF_GSO_NONE) {
+        pktbuf_free(pb);
+        return -1;
+    }
     
-    if (len > ETH_MTU) {
+    eth_header_t* hdr = (eth_header_t*)pktbuf_push(pb, sizeof(eth_header_t));
+    if (!hdr) {
+        pktbuf_free(pb);
         return -1;
     }
     
@@ -49,11 +56,34 @@ int eth_send(const uint8_t dest[6], uint16_t ethertype, const void* data, uint16
     memcpy(hdr->src, our_mac, 6);
     hdr->ethertype = __builtin_bswap16(ethertype);  /* Convert to network byte order */
     
+    /* Send frame */
+    return virtio_net_send_pkt(pb);
+}
+
+/**
+ * Send a broadcast Ethernet frame (takes ownership of the packet buffer)
+ */
+int eth_send_broadcast_pkt(uint16_t ethertype, pktbuf_t* pb) {
+    return eth_send_pkt(broadcast_mac, ethertype, pb);
+}
+
+/**
+ * Send an Ethernet frame from a flat payload
+ */
+int eth_send(const uint8_t dest[6], uint16_t ethertype, const void* data, uint16_t len) {
+    if (len > ETH_MTU) {
+        return -1;
+    }
+    
+    pktbuf_t* pb = pktbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    
     /* Copy payload */
-    memcpy(frame + sizeof(eth_header_t), data, len);
+    memcpy(pktbuf_append(pb, len), data, len);
     
-    /* Send frame */
-    return virtio_net_send(frame, sizeof(eth_header_t) + len);
+    return eth_send_pkt(dest, ethertype, pb);
 }
 
 /**
@@ -65,25 +95,25 @@ int eth_send_broadcast(uint16_t ethertype, const void* data, uint16_t len) {
 
 /**
  * Receive an Ethernet frame
+ * @param hdr_out  Set to the frame's header (still in network byte order)
+ * @return         Packet with the Ethernet header pulled, or NULL if none
  */
-int eth_receive(eth_header_t* hdr_out, void* data, uint16_t max_len) {
-    uint8_t frame[ETH_FRAME_MAX];
-    
-    int len = virtio_net_receive(frame, sizeof(frame));
-    if (len <= (int)sizeof(eth_header_t)) {
-        return 0;  /* No packet or too small */
+pktbuf_t* eth_receive(const eth_header_t** hdr_out) {
+    for (;;) {
+        pktbuf_t* pb = virtio_net_receive_pkt();
+        if (!pb) {
+            return NULL;
+        }
+        
+        const eth_header_t* hdr = (const eth_header_t*)pktbuf_pull(pb, sizeof(eth_header_t));
+        if (hdr && pb->len > 0) {
+            *hdr_out = hdr;
+            return pb;
+        }
+        
+        /* Too small, drop it */
+        pktbuf_free(pb);
     }
-    
-    /* Copy header */
-    memcpy(hdr_out, frame, sizeof(eth_header_t));
-    hdr_out->ethertype = __builtin_bswap16(hdr_out->ethertype);  /* Convert to host byte order */
-    
-    /* Copy payload */
-    int payload_len = len - sizeof(eth_header_t);
-    if (payload_len > max_len) payload_len = max_len;
-    memcpy(data, frame + sizeof(eth_header_t), payload_len);
-    
-    return payload_len;
 }
 
 /**
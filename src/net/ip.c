@@ -0,0 +1,118 @@
+/**
+ * MiniOS - IPv4
+ * 
+ * Builds and validates IP headers and hands payloads to the transport
+ * protocols. Fragments are not reassembled.
+ */
+
+#include "types.h"
+#include "net.h"
+#include "ip.h"
+#include "pktbuf.h"
+#include "checksum.h"
+
+/* Transport protocols */
+extern void icmp_process(const ip_header_t* ip, pktbuf_t* pb);
+extern void udp_process(const ip_header_t* ip, pktbuf_t* pb);
+extern void tcp_process(const ip_header_t* ip, pktbuf_t* pb);
+
+/* Next-hop resolution */
+extern int arp_send(uint32_t ip, pktbuf_t* pb);
+
+/* Identification for outgoing packets */
+static uint16_t ip_next_id = 0;
+
+/**
+ * Send an IP packet (takes ownership of the packet buffer)
+ * The IP header is pushed in front of the payload already in the buffer.
+ */
+int ip_send(uint32_t dest_ip, uint8_t protocol, pktbuf_t* pb) {
+    /* TSO segments are cut down to the MTU by the device */
+    if (pb->len > IP_MAX_PAYLOAD && pb->gso_type == PKTBUF_GSO_NONE) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    ip_header_t* ip = (ip_header_t*)pktbuf_push(pb, sizeof(ip_header_t));
+    if (!ip) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    /* A buffer turned around from the receive path is no longer verified */
+    pb->flags &= ~PKTBUF_F_CSUM_VALID;
+    
+    /* Build IP header */
+    ip->version_ihl = 0x45;  /* IPv4, 5 dwords header length */
+    ip->tos = 0;
+    ip->total_len = __builtin_bswap16(pb->len);
+    ip->id = __builtin_bswap16(ip_next_id++);
+    ip->flags_frag = 0;
+    ip->ttl = IP_DEFAULT_TTL;
+    ip->protocol = protocol;
+    ip->checksum = 0;
+    ip->src_ip = net_get_ip();
+    ip->dest_ip = dest_ip;
+    
+    /* Calculate header checksum */
+    ip->checksum = csum_buffer(ip, sizeof(ip_header_t));
+    
+    /* Resolve the next hop; the packet waits in the ARP cache if needed */
+    return arp_send(dest_ip, pb);
+}
+
+/**
+ * Process an incoming IP packet
+ */
+void ip_process(pktbuf_t* pb) {
+    if (pb->len < sizeof(ip_header_t)) {
+        return;
+    }
+    
+    const ip_header_t* ip = (const ip_header_t*)pb->data;
+    
+    /* Verify IP version */
+    if ((ip->version_ihl >> 4) != 4) {
+        return;
+    }
+    
+    /* Verify it's for us */
+    if (ip->dest_ip != net_get_ip()) {
+        return;
+    }
+    
+    /* Get header length and payload */
+    int ihl = (ip->version_ihl & 0x0F) * 4;
+    uint16_t total_len = __builtin_bswap16(ip->total_len);
+    if (ihl < (int)sizeof(ip_header_t) || total_len < ihl || total_len > pb->len) {
+        return;
+    }
+    
+    if (csum_buffer(ip, ihl) != 0) {
+        return;
+    }
+    
+    /* No reassembly: drop anything with MF set or a fragment offset */
+    if (__builtin_bswap16(ip->flags_frag) & 0x3FFF) {
+        return;
+    }
+    
+    /* Drop Ethernet padding and strip the IP header */
+    pktbuf_trim(pb, total_len);
+    pktbuf_pull(pb, ihl);
+    
+    /* The header stays in front of the payload for the transport layer */
+    switch (ip->protocol) {
+        case IP_PROTO_ICMP:
+            icmp_process(ip, pb);
+            break;
+        case IP_PROTO_UDP:
+            udp_process(ip, pb);
+            break;
+        case IP_PROTO_TCP:
+            tcp_process(ip, pb);
+            break;
+        default:
+            break;
+    }
+}
@@ -7,22 +7,31 @@
 #include "types.h"
 #include "net.h"
 #include "string.h"
+#include "pktbuf.h"
+#include "ip.h"
+#include "softirq.h"
+#include "perf.h"
 
 /* External driver/layer functions */
 extern int virtio_net_init(void);
 extern int virtio_net_is_initialized(void);
 extern void virtio_net_get_mac(uint8_t mac[6]);
+extern int virtio_net_has_irq(void);
+extern int virtio_net_rx_irq_enable(void);
+extern int virtio_net_tx_reclaim(void);
+extern int virtio_net_offloads(void);
 
 extern void eth_init(void);
 extern void eth_get_mac(uint8_t mac[6]);
-extern int eth_receive(eth_header_t* hdr_out, void* data, uint16_t max_len);
+extern pktbuf_t* eth_receive(const eth_header_t** hdr_out);
 extern int eth_is_for_us(const uint8_t mac[6]);
 
 extern void arp_init(void);
-extern void arp_process(const void* data, uint16_t len);
+extern void arp_process(pktbuf_t* pb);
+extern int arp_announce(void);
 
-extern void ip_process(const void* data, uint16_t len);
 extern int icmp_ping(uint32_t dest_ip);
+extern int icmp_ping_reply(uint16_t seq, uint64_t* rtt_ns);
 
 /* Our IP address (default: 10.0.2.15 - QEMU user networking default) */
 static uint32_t our_ip = 0x0F02000A;  /* 10.0.2.15 in little-endian */
@@ -30,10 +39,18 @@ static uint32_t our_ip = 0x0F02000A;  /* 10.0.2.15 in little-endian */
 /* Initialization state */
 static int net_inited = 0;
 
+/* Packets handled per softirq run before yielding to the rest of the system */
+#define NET_RX_BUDGET   16
+
+static void net_rx_action(void);
+
 /**
  * Initialize the network subsystem
  */
 void net_init(void) {
+    /* Packet buffers are needed before the driver fills its RX ring */
+    pktbuf_init();
+    
     /* Initialize virtio-net driver */
     if (virtio_net_init() < 0) {
         return;  /* No network device */
@@ -46,6 +63,10 @@ void net_init(void) {
     arp_init();
     
     net_inited = 1;
+    
+    /* Received packets are processed from the network softirq */
+    softirq_register(SOFTIRQ_NET_RX, net_rx_action);
+    softirq_raise(SOFTIRQ_NET_RX);
 }
 
 /**
@@ -66,6 +87,13 @@ void net_get_mac(uint8_t mac[6]) {
     }
 }
 
+/**
+ * Get the offloads the network device accepted
+ */
+int net_get_offloads(void) {
+    return net_inited ? virtio_net_offloads() : 0;
+}
+
 /**
  * Get our IP address
  */
@@ -78,6 +106,11 @@ uint32_t net_get_ip(void) {
  */
 void net_set_ip(uint32_t ip) {
     our_ip = ip;
+    
+    /* Tell the neighbours about the new address */
+    if (net_inited) {
+        arp_announce();
+    }
 }
 
 /**
@@ -99,37 +132,71 @@ int net_receive_packet(void* buffer, uint16_t max_len) {
 }
 
 /**
- * Poll for and process incoming packets
+ * Receive and process one packet
+ * @return Non-zero if a packet was taken off the ring
  */
-void net_poll(void) {
-    if (!net_inited) return;
-    
-    eth_header_t hdr;
-    uint8_t data[ETH_MTU];
+static int net_rx_one(void) {
+    const eth_header_t* hdr;
     
     /* Receive packet */
-    int len = eth_receive(&hdr, data, sizeof(data));
-    if (len <= 0) {
-        return;
+    pktbuf_t* pb = eth_receive(&hdr);
+    if (!pb) {
+        return 0;
     }
     
     /* Check if it's for us */
-    if (!eth_is_for_us(hdr.dest)) {
-        return;
+    if (!eth_is_for_us(hdr->dest)) {
+        pktbuf_free(pb);
+        return 1;
     }
     
     /* Process based on ethertype */
-    switch (hdr.ethertype) {
+    switch (__builtin_bswap16(hdr->ethertype)) {
         case ETHERTYPE_ARP:
-            arp_process(data, len);
+            arp_process(pb);
             break;
         case ETHERTYPE_IPV4:
-            ip_process(data, len);
+            ip_process(pb);
             break;
         default:
             /* Unknown protocol, ignore */
             break;
     }
+    
+    pktbuf_free(pb);
+    return 1;
+}
+
+/**
+ * Poll for and process incoming packets
+ */
+int net_poll(int budget) {
+    if (!net_inited) return 0;
+    
+    uint64_t start = rdtsc();
+    int done = 0;
+    while (done < budget && net_rx_one()) {
+        done++;
+    }
+    
+    perf_lat(PERF_LAT_NET_POLL, start);
+    return done;
+}
+
+/**
+ * Network RX softirq
+ * Drains up to NET_RX_BUDGET packets and reclaims finished transmits
+ * (replies may hold RX buffers). If the ring is empty the device
+ * interrupt is re-armed; otherwise the softirq runs again on the next
+ * idle pass, after the keyboard and other work have had a turn.
+ */
+static void net_rx_action(void) {
+    int done = net_poll(NET_RX_BUDGET);
+    virtio_net_tx_reclaim();
+    
+    if (done == NET_RX_BUDGET || !virtio_net_has_irq() || virtio_net_rx_irq_enable()) {
+        softirq_raise(SOFTIRQ_NET_RX);
+    }
 }
 
 /**
@@ -140,3 +207,10 @@ int net_ping(uint32_t dest_ip) {
     return icmp_ping(dest_ip);
 }
 
+/**
+ * Check for a ping reply
+ */
+int net_ping_reply(uint16_t seq, uint64_t* rtt_ns) {
+    return net_inited && icmp_ping_reply(seq, rtt_ns);
+}
+
@@ -0,0 +1,161 @@
+/**
+ * MiniOS - Packet Buffers
+ *
+ * Allocation and reference counting for network packet buffers.
+ */
+
+#include "types.h"
+#include "pktbuf.h"
+#include "slab.h"
+#include "heap.h"
+#include "string.h"
+#include "checksum.h"
+
+/* Caches for pktbuf_t headers and their data buffers */
+static kmem_cache_t* pktbuf_cache = NULL;
+static kmem_cache_t* pktbuf_data_cache = NULL;
+
+/**
+ * Release callback for buffers from pktbuf_alloc
+ */
+static void pktbuf_release_own(pktbuf_t* pb) {
+    kmem_cache_free(pktbuf_data_cache, pb->head);
+    kmem_cache_free(pktbuf_cache, pb);
+}
+
+/**
+ * Release callback for buffers from pktbuf_alloc_len with a heap buffer
+ */
+static void pktbuf_release_heap(pktbuf_t* pb) {
+    kfree(pb->head);
+    kmem_cache_free(pktbuf_cache, pb);
+}
+
+/**
+ * Initialize the packet buffer caches
+ */
+void pktbuf_init(void) {
+    if (!pktbuf_cache) {
+        pktbuf_cache = kmem_cache_create("pktbuf", sizeof(pktbuf_t), 0);
+    }
+    if (!pktbuf_data_cache) {
+        pktbuf_data_cache = kmem_cache_create("net_buf", PKTBUF_SIZE, 0);
+    }
+}
+
+/**
+ * Allocate a raw data buffer
+ */
+void* pktbuf_data_alloc(void) {
+    if (!pktbuf_data_cache) {
+        return NULL;
+    }
+    return kmem_cache_alloc(pktbuf_data_cache);
+}
+
+/**
+ * Free a raw data buffer
+ */
+void pktbuf_data_free(void* data) {
+    kmem_cache_free(pktbuf_data_cache, data);
+}
+
+/**
+ * Set up a packet buffer around externally owned memory
+ */
+void pktbuf_wrap(pktbuf_t* pb, uint8_t* buffer, uint16_t size,
+                 pktbuf_release_t release, void* priv) {
+    pb->head = buffer;
+    pb->data = buffer;
+    pb->len = 0;
+    pb->size = size;
+    pb->refcnt = 1;
+    pb->flags = 0;
+    pb->csum_start = 0;
+    pb->csum_offset = 0;
+    pb->gso_size = 0;
+    pb->gso_type = PKTBUF_GSO_NONE;
+    pb->release = release;
+    pb->priv = priv;
+    pb->next = NULL;
+}
+
+/**
+ * Allocate a packet buffer with default headroom
+ */
+pktbuf_t* pktbuf_alloc(void) {
+    if (!pktbuf_cache) {
+        return NULL;
+    }
+
+    pktbuf_t* pb = (pktbuf_t*)kmem_cache_alloc(pktbuf_cache);
+    if (!pb) {
+        return NULL;
+    }
+
+    uint8_t* data = (uint8_t*)kmem_cache_alloc(pktbuf_data_cache);
+    if (!data) {
+        kmem_cache_free(pktbuf_cache, pb);
+        return NULL;
+    }
+
+    pktbuf_wrap(pb, data, PKTBUF_SIZE, pktbuf_release_own, NULL);
+    pb->data += PKTBUF_HEADROOM;
+    return pb;
+}
+
+/**
+ * Drop a reference
+ */
+void pktbuf_free(pktbuf_t* pb) {
+    if (!pb || pb->refcnt == 0) {
+        return;
+    }
+    if (--pb->refcnt == 0 && pb->release) {
+        pb->release(pb);
+    }
+}
+
+/**
+ * Fill in a CSUM_PARTIAL checksum in software
+ */
+void pktbuf_csum_finish(pktbuf_t* pb) {
+    if (!(pb->flags & PKTBUF_F_CSUM_PARTIAL)) {
+        return;
+    }
+
+    const uint8_t* start = pb->head + pb->csum_start;
+    size_t len = (size_t)(pb->data + pb->len - start);
+    uint16_t csum = csum_fold(csum_partial(start, len, 0));
+    memcpy(pb->head + pb->csum_start + pb->csum_offset, &csum, sizeof(csum));
+    pb->flags &= ~PKTBUF_F_CSUM_PARTIAL;
+}
+
+/**
+ * Allocate a packet buffer for 'len' bytes of data
+ */
+pktbuf_t* pktbuf_alloc_len(uint32_t len) {
+    uint32_t size = PKTBUF_HEADROOM + len;
+    if (size <= PKTBUF_SIZE) {
+        return pktbuf_alloc();
+    }
+    if (!pktbuf_cache || size > 0xFFFF) {
+        return NULL;
+    }
+
+    pktbuf_t* pb = (pktbuf_t*)kmem_cache_alloc(pktbuf_cache);
+    if (!pb) {
+        return NULL;
+    }
+
+    /* The heap is identity mapped and contiguous, so the device can DMA it */
+    uint8_t* data = (uint8_t*)kmalloc(size);
+    if (!data) {
+        kmem_cache_free(pktbuf_cache, pb);
+        return NULL;
+    }
+
+    pktbuf_wrap(pb, data, (uint16_t)size, pktbuf_release_heap, NULL);
+    pb->data += PKTBUF_HEADROOM;
+    return pb;
+}
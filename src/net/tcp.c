@@ -0,0 +1,1404 @@
+/**
+ * MiniOS - TCP Protocol
+ * 
+ * Transmission Control Protocol.
+ * Connections are found through a hash table keyed by the 4-tuple;
+ * listeners sit on a short list of their own. Each connection keeps a
+ * send ring holding everything from the oldest unacknowledged byte to
+ * the newest queued one, so retransmissions are rebuilt from the ring.
+ * Sending is limited by the peer's window and a Reno-style congestion
+ * window, with several segments in flight. Retransmission timeouts
+ * follow Jacobson/Karels (RFC 6298), ACKs are delayed for up to two
+ * segments, and out-of-order segments are dropped (and answered with a
+ * duplicate ACK) rather than reassembled. With the offloads negotiated,
+ * checksums are left to the device and bulk data goes out as TSO frames.
+ */
+
+#include "types.h"
+#include "net.h"
+#include "ip.h"
+#include "tcp.h"
+#include "pktbuf.h"
+#include "checksum.h"
+#include "heap.h"
+#include "string.h"
+#include "timer.h"
+
+/* TCP header */
+typedef struct {
+    uint16_t src_port;
+    uint16_t dest_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t  data_off;      /* Header length in dwords (upper 4 bits) */
+    uint8_t  flags;
+    uint16_t window;
+    uint16_t checksum;
+    uint16_t urgent;
+} PACKED tcp_header_t;
+
+/* Header flags */
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+#define TCP_PSH             0x08
+#define TCP_ACK             0x10
+
+/* Options */
+#define TCP_OPT_END         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_MSS         2
+
+/* Segment sizes */
+#define TCP_MSS_DEFAULT     536
+#define TCP_MSS_LOCAL       (IP_MAX_PAYLOAD - sizeof(tcp_header_t))
+#define TCP_TSO_MAX_SEGS    16      /* MSS-sized segments per TSO frame */
+#define TCP_INIT_CWND_SEGS  10      /* RFC 6928 */
+
+/* Timers, in ticks */
+#define TCP_RTO_INITIAL     (1 * TIMER_HZ)
+#define TCP_RTO_MIN         MS_TO_TICKS(200)
+#define TCP_RTO_MAX         (60 * TIMER_HZ)
+#define TCP_DELACK_TICKS    MS_TO_TICKS(40)
+#define TCP_TIMEWAIT_TICKS  (2 * TIMER_HZ)      /* 2*MSL, shortened */
+
+/* Retransmissions before giving up */
+#define TCP_SYN_RETRIES     5
+#define TCP_MAX_RETRIES     8
+
+/* Connection hash table */
+#define TCP_HASH_BITS       8
+#define TCP_HASH_SIZE       (1 << TCP_HASH_BITS)
+
+/* Ephemeral ports for tcp_connect */
+#define TCP_EPHEMERAL_FIRST 49152
+#define TCP_EPHEMERAL_LAST  65535
+
+/* Sequence number comparisons (modulo 2^32) */
+#define SEQ_LT(a, b)        ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)       ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)        ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b)       ((int32_t)((a) - (b)) >= 0)
+
+/* Socket flags */
+#define TCP_SF_DETACHED     0x01    /* No user handle: free once closed */
+#define TCP_SF_FIN_QUEUED   0x02    /* Send FIN after the buffered data */
+#define TCP_SF_ACK_NOW      0x04    /* Send an ACK on the next output */
+#define TCP_SF_RCVD_FIN     0x08    /* Peer has closed its side */
+
+/* Parsed incoming segment */
+typedef struct {
+    uint32_t seq;
+    uint32_t ack;
+    uint16_t window;
+    uint8_t flags;
+    uint16_t mss;               /* MSS option, 0 if absent */
+    const uint8_t* data;
+    uint32_t len;               /* Payload bytes */
+} tcp_seg_t;
+
+/* TCP socket (transmission control block) */
+struct tcp_socket {
+    struct tcp_socket* hash_next;   /* Hash chain, or listener list */
+    
+    /* Connection identity (addresses network order, ports host order) */
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+    
+    uint8_t state;                  /* TCP_* */
+    uint8_t error;                  /* TCP_ERR_* */
+    uint8_t flags;                  /* TCP_SF_* */
+    uint8_t retries;                /* Consecutive timeouts */
+    
+    /* Send sequence space */
+    uint32_t iss;
+    uint32_t snd_una;               /* Oldest unacknowledged */
+    uint32_t snd_nxt;               /* Next to send */
+    uint32_t snd_max;               /* Highest ever sent */
+    uint32_t snd_end;               /* After the last queued byte (FIN goes here) */
+    uint32_t snd_wnd;               /* Peer's advertised window */
+    uint32_t snd_wl1;               /* Segment seq of last window update */
+    uint32_t snd_wl2;               /* Segment ack of last window update */
+    uint8_t* sndbuf;
+    
+    /* Congestion control */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint16_t mss;
+    uint8_t dupacks;
+    
+    /* Receive sequence space */
+    uint32_t irs;
+    uint32_t rcv_nxt;
+    uint32_t rcv_adv;               /* Right edge of the window we advertised */
+    uint32_t rcv_head;              /* Ring offset of the next unread byte */
+    uint32_t rcv_len;               /* Unread bytes */
+    uint8_t* rcvbuf;
+    uint8_t delack_segs;            /* Segments received since our last ACK */
+    
+    /* Round-trip timing (RFC 6298, in ticks) */
+    int rtt_timing;
+    uint32_t rtt_seq;               /* Timed segment is acked when ack passes this */
+    uint64_t rtt_start;
+    uint32_t srtt;                  /* Smoothed RTT << 3 */
+    uint32_t rttvar;                /* RTT variance << 2 */
+    uint32_t rto;
+    
+    ktimer_t rexmit_timer;          /* Retransmit, persist, SYN and TIME_WAIT */
+    ktimer_t delack_timer;
+    
+    /* Listener state */
+    struct tcp_socket* parent;      /* Listener of a half-open connection */
+    struct tcp_socket* accept_queue[TCP_BACKLOG];
+    int accept_count;
+    int half_open;
+};
+
+static tcp_socket_t* tcp_hash[TCP_HASH_SIZE];
+static tcp_socket_t* tcp_listeners = NULL;
+static uint16_t tcp_next_ephemeral = TCP_EPHEMERAL_FIRST;
+static uint32_t tcp_iss_seed = 0;
+static tcp_stats_t tcp_stats;
+
+static const char* tcp_state_names[] = {
+    "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED",
+    "FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK",
+    "TIME_WAIT"
+};
+
+static void tcp_output(tcp_socket_t* s, int force);
+static void tcp_rexmit_timeout(void* arg);
+static void tcp_delack_timeout(void* arg);
+
+/**
+ * Hash bucket of a 4-tuple
+ */
+static inline uint32_t tcp_hashfn(uint32_t local_ip, uint16_t local_port,
+                                  uint32_t remote_ip, uint16_t remote_port) {
+    uint32_t key = local_ip ^ remote_ip ^ (((uint32_t)remote_port << 16) | local_port);
+    return (key * 0x9E3779B1U) >> (32 - TCP_HASH_BITS);
+}
+
+/**
+ * Find the connection for a 4-tuple
+ */
+static tcp_socket_t* tcp_lookup(uint32_t local_ip, uint16_t local_port,
+                                uint32_t remote_ip, uint16_t remote_port) {
+    tcp_socket_t* s = tcp_hash[tcp_hashfn(local_ip, local_port, remote_ip, remote_port)];
+    
+    while (s) {
+        if (s->remote_ip == remote_ip && s->remote_port == remote_port &&
+            s->local_port == local_port && s->local_ip == local_ip) {
+            return s;
+        }
+        s = s->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * Find the listener on a port
+ */
+static tcp_socket_t* tcp_find_listener(uint16_t port) {
+    for (tcp_socket_t* s = tcp_listeners; s; s = s->hash_next) {
+        if (s->local_port == port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add a connection to the hash table
+ */
+static void tcp_hash_insert(tcp_socket_t* s) {
+    uint32_t bucket = tcp_hashfn(s->local_ip, s->local_port, s->remote_ip, s->remote_port);
+    s->hash_next = tcp_hash[bucket];
+    tcp_hash[bucket] = s;
+}
+
+/**
+ * Take a connection out of the hash table (no-op if it isn't there)
+ */
+static void tcp_hash_remove(tcp_socket_t* s) {
+    uint32_t bucket = tcp_hashfn(s->local_ip, s->local_port, s->remote_ip, s->remote_port);
+    tcp_socket_t** link = &tcp_hash[bucket];
+    
+    while (*link) {
+        if (*link == s) {
+            *link = s->hash_next;
+            s->hash_next = NULL;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+/**
+ * Allocate a socket (buffers only for connections, not listeners)
+ */
+static tcp_socket_t* tcp_alloc(int with_buffers) {
+    tcp_socket_t* s = (tcp_socket_t*)kcalloc(1, sizeof(tcp_socket_t));
+    if (!s) {
+        return NULL;
+    }
+    
+    if (with_buffers) {
+        s->sndbuf = (uint8_t*)kmalloc(TCP_SNDBUF_SIZE);
+        s->rcvbuf = (uint8_t*)kmalloc(TCP_RCVBUF_SIZE);
+        if (!s->sndbuf || !s->rcvbuf) {
+            kfree(s->sndbuf);
+            kfree(s->rcvbuf);
+            kfree(s);
+            return NULL;
+        }
+    }
+    
+    s->mss = TCP_MSS_DEFAULT;
+    s->rto = TCP_RTO_INITIAL;
+    ktimer_init(&s->rexmit_timer, tcp_rexmit_timeout, s);
+    ktimer_init(&s->delack_timer, tcp_delack_timeout, s);
+    return s;
+}
+
+/**
+ * Free a socket
+ */
+static void tcp_free(tcp_socket_t* s) {
+    ktimer_cancel(&s->rexmit_timer);
+    ktimer_cancel(&s->delack_timer);
+    kfree(s->sndbuf);
+    kfree(s->rcvbuf);
+    kfree(s);
+}
+
+/**
+ * Pick an initial send sequence number and set up the send side
+ */
+static void tcp_init_send(tcp_socket_t* s) {
+    /* Clock-driven ISN (RFC 793's clock ticks every 4us) */
+    tcp_iss_seed += 64000;
+    s->iss = (uint32_t)(ktime_ns() / (4 * NS_PER_US)) + tcp_iss_seed;
+    s->snd_una = s->iss;
+    s->snd_nxt = s->iss;
+    s->snd_max = s->iss;
+    s->snd_end = s->iss + 1;    /* Data starts after the SYN */
+}
+
+/**
+ * Settle the segment size once the peer's MSS option is known
+ */
+static void tcp_set_mss(tcp_socket_t* s, uint16_t peer_mss) {
+    uint16_t mss = peer_mss ? peer_mss : TCP_MSS_DEFAULT;
+    if (mss > TCP_MSS_LOCAL) {
+        mss = TCP_MSS_LOCAL;
+    }
+    s->mss = mss;
+    s->cwnd = TCP_INIT_CWND_SEGS * mss;
+    s->ssthresh = 0xFFFFFFFF;
+}
+
+/**
+ * Close a connection: it leaves the hash table, and is freed unless
+ * the user (or a listener's accept queue) still holds it
+ */
+static void tcp_drop(tcp_socket_t* s, int error) {
+    s->state = TCP_CLOSED;
+    if (error) {
+        s->error = error;
+    }
+    ktimer_cancel(&s->rexmit_timer);
+    ktimer_cancel(&s->delack_timer);
+    tcp_hash_remove(s);
+    
+    if (s->parent) {
+        s->parent->half_open--;
+        s->parent = NULL;
+    }
+    if (s->flags & TCP_SF_DETACHED) {
+        tcp_free(s);
+    }
+}
+
+/**
+ * Window to advertise: free receive buffer space
+ * Data is only accepted into free space, so this never shrinks a
+ * window that was already advertised.
+ */
+static uint32_t tcp_rcv_window(const tcp_socket_t* s) {
+    uint32_t space = TCP_RCVBUF_SIZE - s->rcv_len;
+    return space > 0xFFFF ? 0xFFFF : space;
+}
+
+/**
+ * Offset of the oldest byte still held in the send ring
+ */
+static uint32_t tcp_snd_start(const tcp_socket_t* s) {
+    uint32_t start = s->snd_una;
+    if (SEQ_LT(start, s->iss + 1)) {
+        start = s->iss + 1;     /* SYN not acked yet */
+    }
+    if (SEQ_GT(start, s->snd_end)) {
+        start = s->snd_end;     /* FIN acked */
+    }
+    return start;
+}
+
+/**
+ * Copy send-ring data starting at sequence number 'seq'
+ */
+static void tcp_snd_copy(const tcp_socket_t* s, uint32_t seq, uint8_t* dest, uint32_t len) {
+    uint32_t offset = (seq - (s->iss + 1)) & (TCP_SNDBUF_SIZE - 1);
+    uint32_t first = TCP_SNDBUF_SIZE - offset;
+    
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dest, s->sndbuf + offset, first);
+    memcpy(dest + first, s->sndbuf, len - first);
+}
+
+/**
+ * Copy send-ring data like tcp_snd_copy, returning its partial checksum
+ */
+static uint32_t tcp_snd_copy_csum(const tcp_socket_t* s, uint32_t seq, uint8_t* dest, uint32_t len) {
+    uint32_t offset = (seq - (s->iss + 1)) & (TCP_SNDBUF_SIZE - 1);
+    uint32_t first = TCP_SNDBUF_SIZE - offset;
+    
+    if (first > len) {
+        first = len;
+    }
+    uint32_t sum = csum_partial_copy(dest, s->sndbuf + offset, first, 0);
+    uint32_t wrapped = csum_partial_copy(dest + first, s->sndbuf, len - first, 0);
+    return csum_block_add(sum, wrapped, first);
+}
+
+/**
+ * Fill in the checksum of an outgoing segment
+ * Left to the device when it offers checksum offload; otherwise the
+ * header is summed here and combined with the payload's partial sum.
+ */
+static void tcp_set_checksum(pktbuf_t* pb, tcp_header_t* tcp, uint16_t hdr_len,
+                             uint32_t src_ip, uint32_t dest_ip, uint32_t payload_sum) {
+    if (net_get_offloads() & NET_OFFLOAD_TX_CSUM) {
+        tcp->checksum = csum_pseudo_seed(src_ip, dest_ip, pb->len, IP_PROTO_TCP);
+        pktbuf_set_csum_partial(pb, offsetof(tcp_header_t, checksum));
+        return;
+    }
+    
+    tcp->checksum = 0;
+    uint32_t sum = csum_block_add(csum_partial(tcp, hdr_len, 0), payload_sum, hdr_len);
+    tcp->checksum = csum_tcpudp_magic(src_ip, dest_ip, pb->len, IP_PROTO_TCP, sum);
+}
+
+/**
+ * Build and send one segment from the connection's send ring
+ */
+static int tcp_xmit(tcp_socket_t* s, uint32_t seq, uint8_t flags, uint32_t len) {
+    uint16_t hdr_len = sizeof(tcp_header_t) + ((flags & TCP_SYN) ? 4 : 0);
+    
+    pktbuf_t* pb = pktbuf_alloc_len(hdr_len + len);
+    if (!pb) {
+        return -1;
+    }
+    
+    tcp_header_t* tcp = (tcp_header_t*)pktbuf_append(pb, hdr_len + len);
+    uint32_t window = tcp_rcv_window(s);
+    
+    tcp->src_port = __builtin_bswap16(s->local_port);
+    tcp->dest_port = __builtin_bswap16(s->remote_port);
+    tcp->seq = __builtin_bswap32(seq);
+    tcp->ack = (flags & TCP_ACK) ? __builtin_bswap32(s->rcv_nxt) : 0;
+    tcp->data_off = (hdr_len / 4) << 4;
+    tcp->flags = flags;
+    tcp->window = __builtin_bswap16((uint16_t)window);
+    tcp->urgent = 0;
+    
+    uint8_t* opts = (uint8_t*)(tcp + 1);
+    if (flags & TCP_SYN) {
+        opts[0] = TCP_OPT_MSS;
+        opts[1] = 4;
+        opts[2] = TCP_MSS_LOCAL >> 8;
+        opts[3] = TCP_MSS_LOCAL & 0xFF;
+    }
+    
+    /* Without checksum offload the payload is summed as it is copied */
+    uint32_t payload_sum = 0;
+    if (len) {
+        if (net_get_offloads() & NET_OFFLOAD_TX_CSUM) {
+            tcp_snd_copy(s, seq, (uint8_t*)tcp + hdr_len, len);
+        } else {
+            payload_sum = tcp_snd_copy_csum(s, seq, (uint8_t*)tcp + hdr_len, len);
+        }
+    }
+    tcp_set_checksum(pb, tcp, hdr_len, s->local_ip, s->remote_ip, payload_sum);
+    
+    /* The device cuts anything longer than one MSS into segments */
+    if (len > s->mss) {
+        pb->gso_type = PKTBUF_GSO_TCPV4;
+        pb->gso_size = s->mss;
+    }
+    
+    /* Every segment carries an ACK: nothing is left to delay */
+    if (flags & TCP_ACK) {
+        s->flags &= ~TCP_SF_ACK_NOW;
+        s->delack_segs = 0;
+        s->rcv_adv = s->rcv_nxt + window;
+        ktimer_cancel(&s->delack_timer);
+    }
+    
+    if (len && SEQ_LT(seq, s->snd_max)) {
+        tcp_stats.retransmits++;
+    }
+    tcp_stats.segs_out++;
+    return ip_send(s->remote_ip, IP_PROTO_TCP, pb);
+}
+
+/**
+ * Answer a segment that has no connection with RST
+ */
+static void tcp_reset_reply(const ip_header_t* ip, const tcp_header_t* in, const tcp_seg_t* seg) {
+    if (seg->flags & TCP_RST) {
+        return;
+    }
+    
+    pktbuf_t* pb = pktbuf_alloc();
+    if (!pb) {
+        return;
+    }
+    
+    tcp_header_t* tcp = (tcp_header_t*)pktbuf_append(pb, sizeof(tcp_header_t));
+    memset(tcp, 0, sizeof(tcp_header_t));
+    tcp->src_port = in->dest_port;
+    tcp->dest_port = in->src_port;
+    tcp->data_off = (sizeof(tcp_header_t) / 4) << 4;
+    
+    if (seg->flags & TCP_ACK) {
+        tcp->seq = __builtin_bswap32(seg->ack);
+        tcp->flags = TCP_RST;
+    } else {
+        uint32_t seg_len = seg->len + ((seg->flags & TCP_SYN) ? 1 : 0) +
+                           ((seg->flags & TCP_FIN) ? 1 : 0);
+        tcp->ack = __builtin_bswap32(seg->seq + seg_len);
+        tcp->flags = TCP_RST | TCP_ACK;
+    }
+    
+    tcp_set_checksum(pb, tcp, sizeof(tcp_header_t), ip->dest_ip, ip->src_ip, 0);
+    
+    tcp_stats.resets_out++;
+    tcp_stats.segs_out++;
+    ip_send(ip->src_ip, IP_PROTO_TCP, pb);
+}
+
+/**
+ * Send data, FIN, SYN or a pending ACK as the windows allow
+ * @param force  Send at least one segment even if the window is closed
+ *               (retransmit timeout and zero-window probe)
+ */
+static void tcp_output(tcp_socket_t* s, int force) {
+    if (s->state == TCP_CLOSED || s->state == TCP_LISTEN) {
+        return;
+    }
+    
+    /* Handshake: SYN, or SYN-ACK for a passive open */
+    if (s->state == TCP_SYN_SENT || s->state == TCP_SYN_RECEIVED) {
+        if (s->snd_nxt == s->iss) {
+            uint8_t flags = TCP_SYN | (s->state == TCP_SYN_RECEIVED ? TCP_ACK : 0);
+            tcp_xmit(s, s->iss, flags, 0);
+            s->snd_nxt = s->iss + 1;
+            if (SEQ_GT(s->snd_nxt, s->snd_max)) {
+                s->snd_max = s->snd_nxt;
+            }
+            if (!ktimer_pending(&s->rexmit_timer)) {
+                ktimer_arm(&s->rexmit_timer, s->rto);
+            }
+        }
+        return;
+    }
+    
+    uint32_t max_seg = s->mss;
+    if (net_get_offloads() & NET_OFFLOAD_TSO4) {
+        max_seg = s->mss * TCP_TSO_MAX_SEGS;
+    }
+    
+    int sent = 0;
+    for (;;) {
+        uint32_t win = s->snd_wnd < s->cwnd ? s->snd_wnd : s->cwnd;
+        uint32_t in_flight = s->snd_nxt - s->snd_una;
+        uint32_t usable = win > in_flight ? win - in_flight : 0;
+        uint32_t unsent = SEQ_LT(s->snd_nxt, s->snd_end) ? s->snd_end - s->snd_nxt : 0;
+        
+        if (force && usable == 0) {
+            usable = 1;  /* Window probe */
+        }
+        
+        uint32_t len = unsent < usable ? unsent : usable;
+        if (len > max_seg) {
+            len = max_seg;
+        }
+        
+        /* Nagle: while data is in flight, hold back a small segment until
+         * an ACK opens the window or more data fills it, unless it is the
+         * final piece before our FIN */
+        if (len < s->mss && in_flight > 0 && !force &&
+            !(len == unsent && (s->flags & TCP_SF_FIN_QUEUED))) {
+            len = 0;
+        }
+        
+        int fin = (s->flags & TCP_SF_FIN_QUEUED) && SEQ_LEQ(s->snd_nxt, s->snd_end) &&
+                  s->snd_nxt + len == s->snd_end;
+        if (len == 0 && !fin) {
+            break;
+        }
+        
+        uint8_t flags = TCP_ACK;
+        if (fin) {
+            flags |= TCP_FIN;
+        }
+        if (len && s->snd_nxt + len == s->snd_end) {
+            flags |= TCP_PSH;
+        }
+        
+        /* Time one segment per window, never a retransmission (Karn) */
+        if (len && !s->rtt_timing && s->snd_nxt == s->snd_max) {
+            s->rtt_timing = 1;
+            s->rtt_seq = s->snd_nxt + len;
+            s->rtt_start = timer_ticks();
+        }
+        
+        if (tcp_xmit(s, s->snd_nxt, flags, len) < 0 && len == 0) {
+            break;
+        }
+        s->snd_nxt += len + (fin ? 1 : 0);
+        if (SEQ_GT(s->snd_nxt, s->snd_max)) {
+            s->snd_max = s->snd_nxt;
+        }
+        if (!ktimer_pending(&s->rexmit_timer)) {
+            ktimer_arm(&s->rexmit_timer, s->rto);
+        }
+        
+        sent = 1;
+        force = 0;
+        if (fin) {
+            break;
+        }
+    }
+    
+    if (!sent && (s->flags & TCP_SF_ACK_NOW)) {
+        tcp_xmit(s, s->snd_nxt, TCP_ACK, 0);
+    }
+    
+    /* Persist: data waits on a closed window with nothing in flight */
+    if (!sent && SEQ_LT(s->snd_nxt, s->snd_end) && s->snd_nxt == s->snd_una &&
+        !ktimer_pending(&s->rexmit_timer)) {
+        ktimer_arm(&s->rexmit_timer, s->rto);
+    }
+}
+
+/**
+ * Fold a round-trip sample into the estimator (RFC 6298)
+ */
+static void tcp_rtt_sample(tcp_socket_t* s, uint32_t rtt) {
+    if (rtt == 0) {
+        rtt = 1;  /* Tick resolution */
+    }
+    
+    if (s->srtt == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(s->srtt >> 3);
+        s->srtt = (uint32_t)((int32_t)s->srtt + delta);
+        if (delta < 0) {
+            delta = -delta;
+        }
+        s->rttvar = (uint32_t)((int32_t)s->rttvar + delta - (int32_t)(s->rttvar >> 2));
+    }
+    
+    /* RTO = SRTT + 4 * RTTVAR */
+    s->rto = (s->srtt >> 3) + s->rttvar;
+    if (s->rto < TCP_RTO_MIN) {
+        s->rto = TCP_RTO_MIN;
+    }
+    if (s->rto > TCP_RTO_MAX) {
+        s->rto = TCP_RTO_MAX;
+    }
+}
+
+/**
+ * Enter TIME_WAIT; the connection is dropped when the timer runs out
+ */
+static void tcp_time_wait(tcp_socket_t* s) {
+    s->state = TCP_TIME_WAIT;
+    ktimer_arm(&s->rexmit_timer, TCP_TIMEWAIT_TICKS);
+}
+
+/**
+ * Retransmit timer: resend from the oldest unacknowledged byte
+ */
+static void tcp_rexmit_timeout(void* arg) {
+    tcp_socket_t* s = (tcp_socket_t*)arg;
+    
+    if (s->state == TCP_TIME_WAIT) {
+        tcp_drop(s, 0);
+        return;
+    }
+    
+    int handshake = (s->state == TCP_SYN_SENT || s->state == TCP_SYN_RECEIVED);
+    
+    /* Persist: a closed window with at most the probe byte out is not
+     * loss, so it never counts toward the retry limit (RFC 1122 4.2.2.17) */
+    int persist = !handshake && s->snd_wnd == 0 && SEQ_LT(s->snd_una, s->snd_end) &&
+                  SEQ_LEQ(s->snd_nxt, s->snd_una + 1);
+    if (!persist && ++s->retries > (handshake ? TCP_SYN_RETRIES : TCP_MAX_RETRIES)) {
+        if (!handshake) {
+            tcp_xmit(s, s->snd_nxt, TCP_RST, 0);
+            tcp_stats.resets_out++;
+        }
+        tcp_drop(s, TCP_ERR_TIMEOUT);
+        return;
+    }
+    
+    /* Exponential backoff; the next clean sample resets it */
+    s->rto = s->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : s->rto * 2;
+    s->rtt_timing = 0;
+    
+    if (handshake) {
+        tcp_stats.retransmits++;
+        s->snd_nxt = s->iss;
+        tcp_output(s, 0);
+        return;
+    }
+    
+    /* Loss: collapse the congestion window and go back to snd_una */
+    uint32_t flight = s->snd_max - s->snd_una;
+    if (flight > 0) {
+        s->ssthresh = flight / 2 > 2U * s->mss ? flight / 2 : 2U * s->mss;
+        s->cwnd = s->mss;
+        s->dupacks = 0;
+    }
+    s->snd_nxt = s->snd_una;
+    tcp_output(s, 1);
+}
+
+/**
+ * Delayed ACK timer
+ */
+static void tcp_delack_timeout(void* arg) {
+    tcp_socket_t* s = (tcp_socket_t*)arg;
+    
+    s->flags |= TCP_SF_ACK_NOW;
+    tcp_output(s, 0);
+}
+
+/**
+ * A passive open finished its handshake: hand it to the listener
+ * @return 0, or -1 if the accept queue was full and it was reset
+ */
+static int tcp_established_child(tcp_socket_t* s) {
+    tcp_socket_t* listener = s->parent;
+    
+    s->state = TCP_ESTABLISHED;
+    s->parent = NULL;
+    listener->half_open--;
+    
+    if (listener->accept_count >= TCP_BACKLOG) {
+        tcp_xmit(s, s->snd_nxt, TCP_RST, 0);
+        tcp_stats.resets_out++;
+        tcp_drop(s, TCP_ERR_RESET);
+        return -1;
+    }
+    
+    /* The queue now holds it until tcp_accept passes it on */
+    s->flags &= ~TCP_SF_DETACHED;
+    listener->accept_queue[listener->accept_count++] = s;
+    tcp_stats.passive_opens++;
+    return 0;
+}
+
+/**
+ * Process an acknowledgment
+ * @return 0, or -1 if the connection was closed (and may be freed)
+ */
+static int tcp_ack(tcp_socket_t* s, const tcp_seg_t* seg) {
+    if (SEQ_GT(seg->ack, s->snd_una)) {
+        uint32_t acked = seg->ack - s->snd_una;
+        
+        if (s->rtt_timing && SEQ_GEQ(seg->ack, s->rtt_seq)) {
+            tcp_rtt_sample(s, (uint32_t)(timer_ticks() - s->rtt_start));
+            s->rtt_timing = 0;
+        }
+        
+        s->snd_una = seg->ack;
+        if (SEQ_LT(s->snd_nxt, s->snd_una)) {
+            s->snd_nxt = s->snd_una;
+        }
+        
+        /* Slow start, then one MSS per window; leaving fast recovery deflates */
+        if (s->dupacks >= 3) {
+            s->cwnd = s->ssthresh;
+        } else if (s->cwnd < s->ssthresh) {
+            s->cwnd += acked < s->mss ? acked : s->mss;
+        } else {
+            uint32_t inc = (uint32_t)s->mss * s->mss / s->cwnd;
+            s->cwnd += inc ? inc : 1;
+        }
+        s->dupacks = 0;
+        
+        if (s->snd_una == s->snd_max) {
+            ktimer_cancel(&s->rexmit_timer);
+        } else {
+            ktimer_arm(&s->rexmit_timer, s->rto);
+        }
+        
+        /* Our FIN has been acknowledged */
+        if ((s->flags & TCP_SF_FIN_QUEUED) && SEQ_GT(s->snd_una, s->snd_end)) {
+            if (s->state == TCP_FIN_WAIT_1) {
+                s->state = TCP_FIN_WAIT_2;
+            } else if (s->state == TCP_CLOSING) {
+                tcp_time_wait(s);
+            } else if (s->state == TCP_LAST_ACK) {
+                tcp_drop(s, 0);
+                return -1;
+            }
+        }
+    } else if (seg->ack == s->snd_una && seg->len == 0 && !(seg->flags & TCP_FIN) &&
+               seg->window == s->snd_wnd && s->snd_max != s->snd_una) {
+        /* Duplicate ACK: three in a row means the oldest segment was lost */
+        s->dupacks++;
+        if (s->dupacks == 3) {
+            uint32_t flight = s->snd_max - s->snd_una;
+            uint32_t len = SEQ_LT(s->snd_una, s->snd_end) ? s->snd_end - s->snd_una : 0;
+            
+            s->ssthresh = flight / 2 > 2U * s->mss ? flight / 2 : 2U * s->mss;
+            s->cwnd = s->ssthresh + 3U * s->mss;
+            s->rtt_timing = 0;
+            if (len) {
+                tcp_xmit(s, s->snd_una, TCP_ACK, len < s->mss ? len : s->mss);
+            }
+        } else if (s->dupacks > 3) {
+            s->cwnd += s->mss;
+        }
+    }
+    
+    /* Window update from a newer segment */
+    if (SEQ_LT(s->snd_wl1, seg->seq) ||
+        (s->snd_wl1 == seg->seq && SEQ_LEQ(s->snd_wl2, seg->ack))) {
+        s->snd_wnd = seg->window;
+        s->snd_wl1 = seg->seq;
+        s->snd_wl2 = seg->ack;
+    }
+    return 0;
+}
+
+/**
+ * Queue in-order payload into the receive buffer
+ */
+static void tcp_data(tcp_socket_t* s, const tcp_seg_t* seg) {
+    const uint8_t* data = seg->data;
+    uint32_t len = seg->len;
+    
+    /* Out of order: no reassembly, the duplicate ACK asks for a resend */
+    if (SEQ_GT(seg->seq, s->rcv_nxt)) {
+        s->flags |= TCP_SF_ACK_NOW;
+        return;
+    }
+    
+    /* Skip any part we already have */
+    uint32_t dup = s->rcv_nxt - seg->seq;
+    if (dup >= len) {
+        s->flags |= TCP_SF_ACK_NOW;
+        return;
+    }
+    data += dup;
+    len -= dup;
+    
+    uint32_t space = TCP_RCVBUF_SIZE - s->rcv_len;
+    if (len > space) {
+        len = space;
+        s->flags |= TCP_SF_ACK_NOW;
+    }
+    
+    uint32_t offset = (s->rcv_head + s->rcv_len) & (TCP_RCVBUF_SIZE - 1);
+    uint32_t first = TCP_RCVBUF_SIZE - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(s->rcvbuf + offset, data, first);
+    memcpy(s->rcvbuf, data + first, len - first);
+    
+    s->rcv_len += len;
+    s->rcv_nxt += len;
+    
+    /* ACK every second segment, otherwise within the delayed-ACK time */
+    if (++s->delack_segs >= 2) {
+        s->flags |= TCP_SF_ACK_NOW;
+    } else if (!ktimer_pending(&s->delack_timer)) {
+        ktimer_arm(&s->delack_timer, TCP_DELACK_TICKS);
+    }
+}
+
+/**
+ * Process the peer's FIN once everything before it has arrived
+ */
+static void tcp_fin(tcp_socket_t* s) {
+    s->flags |= TCP_SF_ACK_NOW;
+    if (s->flags & TCP_SF_RCVD_FIN) {
+        if (s->state == TCP_TIME_WAIT) {
+            tcp_time_wait(s);  /* Our ACK was lost: restart the wait */
+        }
+        return;
+    }
+    
+    s->flags |= TCP_SF_RCVD_FIN;
+    s->rcv_nxt++;
+    
+    switch (s->state) {
+        case TCP_ESTABLISHED:
+            s->state = TCP_CLOSE_WAIT;
+            break;
+        case TCP_FIN_WAIT_1:
+            s->state = TCP_CLOSING;
+            break;
+        case TCP_FIN_WAIT_2:
+            tcp_time_wait(s);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Check that a segment overlaps the receive window (RFC 793)
+ */
+static int tcp_seq_acceptable(const tcp_socket_t* s, const tcp_seg_t* seg) {
+    uint32_t wnd = tcp_rcv_window(s);
+    uint32_t seg_len = seg->len + ((seg->flags & TCP_FIN) ? 1 : 0);
+    
+    if (seg_len == 0) {
+        return wnd == 0 ? seg->seq == s->rcv_nxt :
+               SEQ_GEQ(seg->seq, s->rcv_nxt) && SEQ_LT(seg->seq, s->rcv_nxt + wnd);
+    }
+    if (wnd == 0) {
+        /* Still take the ACK and FIN of a segment at the window edge */
+        return seg->seq == s->rcv_nxt;
+    }
+    
+    uint32_t last = seg->seq + seg_len - 1;
+    return (SEQ_GEQ(seg->seq, s->rcv_nxt) && SEQ_LT(seg->seq, s->rcv_nxt + wnd)) ||
+           (SEQ_GEQ(last, s->rcv_nxt) && SEQ_LT(last, s->rcv_nxt + wnd));
+}
+
+/**
+ * Process a SYN arriving at a listener
+ */
+static void tcp_listen_input(tcp_socket_t* listener, const ip_header_t* ip,
+                             const tcp_header_t* tcp, const tcp_seg_t* seg) {
+    if (seg->flags & TCP_RST) {
+        return;
+    }
+    if (seg->flags & TCP_ACK) {
+        tcp_reset_reply(ip, tcp, seg);
+        return;
+    }
+    if (!(seg->flags & TCP_SYN)) {
+        return;
+    }
+    
+    /* Full: drop the SYN and let the peer retry */
+    if (listener->accept_count + listener->half_open >= TCP_BACKLOG) {
+        return;
+    }
+    
+    tcp_socket_t* s = tcp_alloc(1);
+    if (!s) {
+        return;
+    }
+    
+    s->local_ip = ip->dest_ip;
+    s->remote_ip = ip->src_ip;
+    s->local_port = listener->local_port;
+    s->remote_port = __builtin_bswap16(tcp->src_port);
+    s->flags = TCP_SF_DETACHED;
+    s->parent = listener;
+    listener->half_open++;
+    
+    s->irs = seg->seq;
+    s->rcv_nxt = seg->seq + 1;
+    s->snd_wnd = seg->window;
+    s->snd_wl1 = seg->seq;
+    tcp_set_mss(s, seg->mss);
+    tcp_init_send(s);
+    s->snd_wl2 = s->iss;
+    
+    s->state = TCP_SYN_RECEIVED;
+    tcp_hash_insert(s);
+    tcp_output(s, 0);
+}
+
+/**
+ * Process a segment for a connection
+ */
+static void tcp_input(tcp_socket_t* s, const ip_header_t* ip,
+                      const tcp_header_t* tcp, const tcp_seg_t* seg) {
+    if (s->state == TCP_SYN_SENT) {
+        if ((seg->flags & TCP_ACK) && seg->ack != s->iss + 1) {
+            tcp_reset_reply(ip, tcp, seg);
+            return;
+        }
+        if (seg->flags & TCP_RST) {
+            if (seg->flags & TCP_ACK) {
+                tcp_drop(s, TCP_ERR_REFUSED);
+            }
+            return;
+        }
+        if (!(seg->flags & TCP_SYN)) {
+            return;
+        }
+        
+        s->irs = seg->seq;
+        s->rcv_nxt = seg->seq + 1;
+        tcp_set_mss(s, seg->mss);
+        s->flags |= TCP_SF_ACK_NOW;
+        
+        if (seg->flags & TCP_ACK) {
+            tcp_ack(s, seg);
+            s->snd_wnd = seg->window;
+            s->snd_wl1 = seg->seq;
+            s->snd_wl2 = seg->ack;
+            s->retries = 0;
+            s->state = TCP_ESTABLISHED;
+        } else {
+            /* Simultaneous open: answer with SYN-ACK */
+            s->state = TCP_SYN_RECEIVED;
+            s->snd_nxt = s->iss;
+        }
+        tcp_output(s, 0);
+        return;
+    }
+    
+    if (!tcp_seq_acceptable(s, seg)) {
+        if (!(seg->flags & TCP_RST)) {
+            s->flags |= TCP_SF_ACK_NOW;
+            tcp_output(s, 0);
+        }
+        return;
+    }
+    
+    if (seg->flags & TCP_RST) {
+        tcp_drop(s, TCP_ERR_RESET);
+        return;
+    }
+    
+    if (seg->flags & TCP_SYN) {
+        /* SYN inside the window: the peer has lost the connection */
+        tcp_xmit(s, s->snd_nxt, TCP_RST, 0);
+        tcp_stats.resets_out++;
+        tcp_drop(s, TCP_ERR_RESET);
+        return;
+    }
+    
+    if (!(seg->flags & TCP_ACK)) {
+        return;
+    }
+    
+    if (s->state == TCP_SYN_RECEIVED) {
+        if (SEQ_LEQ(seg->ack, s->snd_una) || SEQ_GT(seg->ack, s->snd_max)) {
+            tcp_reset_reply(ip, tcp, seg);
+            return;
+        }
+        if (s->parent) {
+            if (tcp_established_child(s) < 0) {
+                return;
+            }
+        } else {
+            s->state = TCP_ESTABLISHED;
+        }
+        s->snd_wnd = seg->window;
+        s->snd_wl1 = seg->seq;
+        s->snd_wl2 = seg->ack;
+    }
+    
+    /* Acknowledges something we never sent */
+    if (SEQ_GT(seg->ack, s->snd_max)) {
+        s->flags |= TCP_SF_ACK_NOW;
+        tcp_output(s, 0);
+        return;
+    }
+    
+    /* The peer is alive: timeouts start counting again */
+    s->retries = 0;
+    if (tcp_ack(s, seg) < 0) {
+        return;
+    }
+    
+    if (seg->len > 0 && (s->state == TCP_ESTABLISHED || s->state == TCP_FIN_WAIT_1 ||
+                         s->state == TCP_FIN_WAIT_2)) {
+        tcp_data(s, seg);
+    }
+    
+    if ((seg->flags & TCP_FIN) && seg->seq + seg->len == s->rcv_nxt -
+        ((s->flags & TCP_SF_RCVD_FIN) ? 1 : 0)) {
+        tcp_fin(s);
+    }
+    
+    tcp_output(s, 0);
+}
+
+/**
+ * Read the MSS option from a SYN
+ */
+static uint16_t tcp_parse_mss(const uint8_t* opts, int len) {
+    int i = 0;
+    
+    while (i < len) {
+        if (opts[i] == TCP_OPT_END) {
+            break;
+        }
+        if (opts[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len) {
+            break;
+        }
+        if (opts[i] == TCP_OPT_MSS && opts[i + 1] == 4) {
+            return (uint16_t)((opts[i + 2] << 8) | opts[i + 3]);
+        }
+        i += opts[i + 1];
+    }
+    return 0;
+}
+
+/**
+ * Process an incoming TCP segment ('pb' starts after the IP header)
+ */
+void tcp_process(const ip_header_t* ip, pktbuf_t* pb) {
+    const tcp_header_t* tcp = (const tcp_header_t*)pb->data;
+    
+    tcp_stats.segs_in++;
+    
+    if (pb->len < sizeof(tcp_header_t)) {
+        tcp_stats.rx_errors++;
+        return;
+    }
+    
+    uint16_t hdr_len = (tcp->data_off >> 4) * 4;
+    if (hdr_len < sizeof(tcp_header_t) || hdr_len > pb->len) {
+        tcp_stats.rx_errors++;
+        return;
+    }
+    
+    if (!(pb->flags & PKTBUF_F_CSUM_VALID) &&
+        csum_tcpudp_magic(ip->src_ip, ip->dest_ip, pb->len, IP_PROTO_TCP,
+                          csum_partial(tcp, pb->len, 0)) != 0) {
+        tcp_stats.rx_errors++;
+        return;
+    }
+    
+    tcp_seg_t seg;
+    seg.seq = __builtin_bswap32(tcp->seq);
+    seg.ack = __builtin_bswap32(tcp->ack);
+    seg.window = __builtin_bswap16(tcp->window);
+    seg.flags = tcp->flags;
+    seg.data = pb->data + hdr_len;
+    seg.len = pb->len - hdr_len;
+    seg.mss = 0;
+    if (seg.flags & TCP_SYN) {
+        seg.mss = tcp_parse_mss((const uint8_t*)(tcp + 1), hdr_len - sizeof(tcp_header_t));
+    }
+    
+    uint16_t local_port = __builtin_bswap16(tcp->dest_port);
+    uint16_t remote_port = __builtin_bswap16(tcp->src_port);
+    
+    tcp_socket_t* s = tcp_lookup(ip->dest_ip, local_port, ip->src_ip, remote_port);
+    if (s) {
+        tcp_input(s, ip, tcp, &seg);
+        return;
+    }
+    
+    tcp_socket_t* listener = tcp_find_listener(local_port);
+    if (listener) {
+        tcp_listen_input(listener, ip, tcp, &seg);
+        return;
+    }
+    
+    tcp_reset_reply(ip, tcp, &seg);
+}
+
+/**
+ * Listen for connections on a local port
+ */
+tcp_socket_t* tcp_listen(uint16_t port) {
+    if (port == 0 || tcp_find_listener(port)) {
+        return NULL;
+    }
+    
+    tcp_socket_t* s = tcp_alloc(0);
+    if (!s) {
+        return NULL;
+    }
+    
+    s->local_ip = net_get_ip();
+    s->local_port = port;
+    s->state = TCP_LISTEN;
+    s->hash_next = tcp_listeners;
+    tcp_listeners = s;
+    return s;
+}
+
+/**
+ * Take the next established connection from a listener
+ */
+tcp_socket_t* tcp_accept(tcp_socket_t* listener) {
+    if (listener->state != TCP_LISTEN || listener->accept_count == 0) {
+        return NULL;
+    }
+    
+    tcp_socket_t* s = listener->accept_queue[0];
+    listener->accept_count--;
+    memmove(&listener->accept_queue[0], &listener->accept_queue[1],
+            listener->accept_count * sizeof(tcp_socket_t*));
+    return s;
+}
+
+/**
+ * Start connecting to a remote address and port
+ */
+tcp_socket_t* tcp_connect(uint32_t dest_ip, uint16_t dest_port) {
+    uint32_t local_ip = net_get_ip();
+    uint16_t local_port = 0;
+    uint32_t range = TCP_EPHEMERAL_LAST - TCP_EPHEMERAL_FIRST + 1;
+    
+    for (uint32_t i = 0; i < range; i++) {
+        uint16_t port = tcp_next_ephemeral;
+        tcp_next_ephemeral = (port == TCP_EPHEMERAL_LAST) ? TCP_EPHEMERAL_FIRST : port + 1;
+        if (!tcp_find_listener(port) && !tcp_lookup(local_ip, port, dest_ip, dest_port)) {
+            local_port = port;
+            break;
+        }
+    }
+    if (local_port == 0) {
+        return NULL;
+    }
+    
+    tcp_socket_t* s = tcp_alloc(1);
+    if (!s) {
+        return NULL;
+    }
+    
+    s->local_ip = local_ip;
+    s->remote_ip = dest_ip;
+    s->local_port = local_port;
+    s->remote_port = dest_port;
+    tcp_set_mss(s, 0);
+    tcp_init_send(s);
+    
+    s->state = TCP_SYN_SENT;
+    tcp_hash_insert(s);
+    tcp_stats.active_opens++;
+    tcp_output(s, 0);
+    return s;
+}
+
+/**
+ * Queue data for sending
+ */
+int tcp_send(tcp_socket_t* sock, const void* data, uint32_t len) {
+    if (sock->flags & TCP_SF_FIN_QUEUED) {
+        return -1;
+    }
+    if (sock->state != TCP_SYN_SENT && sock->state != TCP_SYN_RECEIVED &&
+        sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT) {
+        return -1;
+    }
+    
+    uint32_t space = tcp_send_space(sock);
+    if (len > space) {
+        len = space;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    
+    uint32_t offset = (sock->snd_end - (sock->iss + 1)) & (TCP_SNDBUF_SIZE - 1);
+    uint32_t first = TCP_SNDBUF_SIZE - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(sock->sndbuf + offset, data, first);
+    memcpy(sock->sndbuf, (const uint8_t*)data + first, len - first);
+    sock->snd_end += len;
+    
+    tcp_output(sock, 0);
+    return (int)len;
+}
+
+/**
+ * Read received data
+ */
+int tcp_recv(tcp_socket_t* sock, void* buffer, uint32_t len) {
+    if (sock->rcv_len == 0) {
+        if ((sock->flags & TCP_SF_RCVD_FIN) || sock->state == TCP_CLOSED) {
+            return -1;
+        }
+        return 0;
+    }
+    
+    if (len > sock->rcv_len) {
+        len = sock->rcv_len;
+    }
+    
+    uint32_t first = TCP_RCVBUF_SIZE - sock->rcv_head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(buffer, sock->rcvbuf + sock->rcv_head, first);
+    memcpy((uint8_t*)buffer + first, sock->rcvbuf, len - first);
+    sock->rcv_head = (sock->rcv_head + len) & (TCP_RCVBUF_SIZE - 1);
+    sock->rcv_len -= len;
+    
+    /* Tell the peer once the window has opened by a useful amount */
+    uint32_t advertised = sock->rcv_adv - sock->rcv_nxt;
+    uint32_t window = tcp_rcv_window(sock);
+    if (sock->state != TCP_CLOSED &&
+        (window - advertised >= 2U * sock->mss || window - advertised >= TCP_RCVBUF_SIZE / 2)) {
+        sock->flags |= TCP_SF_ACK_NOW;
+        tcp_output(sock, 0);
+    }
+    return (int)len;
+}
+
+/**
+ * Bytes of send buffer space free
+ */
+uint32_t tcp_send_space(const tcp_socket_t* sock) {
+    return TCP_SNDBUF_SIZE - (sock->snd_end - tcp_snd_start(sock));
+}
+
+/**
+ * Check if everything sent has been acknowledged
+ */
+int tcp_send_done(const tcp_socket_t* sock) {
+    return SEQ_GEQ(sock->snd_una, sock->snd_end);
+}
+
+/**
+ * Get the connection state
+ */
+int tcp_get_state(const tcp_socket_t* sock) {
+    return sock->state;
+}
+
+/**
+ * Get the connection error
+ */
+int tcp_get_error(const tcp_socket_t* sock) {
+    return sock->error;
+}
+
+/**
+ * Get a printable name for a state
+ */
+const char* tcp_state_name(int state) {
+    if (state < 0 || state > TCP_TIME_WAIT) {
+        return "UNKNOWN";
+    }
+    return tcp_state_names[state];
+}
+
+/**
+ * Close a listener along with every connection it still owns
+ */
+static void tcp_close_listener(tcp_socket_t* listener) {
+    tcp_socket_t** link = &tcp_listeners;
+    while (*link) {
+        if (*link == listener) {
+            *link = listener->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    
+    while (listener->accept_count > 0) {
+        tcp_abort(listener->accept_queue[--listener->accept_count]);
+    }
+    
+    /* Half-open connections point back at the listener */
+    for (int i = 0; i < TCP_HASH_SIZE && listener->half_open > 0; i++) {
+        tcp_socket_t* s = tcp_hash[i];
+        while (s) {
+            tcp_socket_t* next = s->hash_next;
+            if (s->parent == listener) {
+                tcp_abort(s);
+            }
+            s = next;
+        }
+    }
+    
+    tcp_free(listener);
+}
+
+/**
+ * Close a socket
+ */
+void tcp_close(tcp_socket_t* sock) {
+    switch (sock->state) {
+        case TCP_LISTEN:
+            tcp_close_listener(sock);
+            return;
+        case TCP_CLOSED:
+            tcp_free(sock);
+            return;
+        case TCP_SYN_SENT:
+            sock->flags |= TCP_SF_DETACHED;
+            tcp_drop(sock, 0);
+            return;
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+            sock->state = TCP_FIN_WAIT_1;
+            sock->flags |= TCP_SF_FIN_QUEUED;
+            break;
+        case TCP_CLOSE_WAIT:
+            sock->state = TCP_LAST_ACK;
+            sock->flags |= TCP_SF_FIN_QUEUED;
+            break;
+        default:
+            break;  /* Already closing */
+    }
+    
+    sock->flags |= TCP_SF_DETACHED;
+    tcp_output(sock, 0);
+}
+
+/**
+ * Reset the connection and free the socket
+ */
+void tcp_abort(tcp_socket_t* sock) {
+    if (sock->state == TCP_LISTEN) {
+        tcp_close_listener(sock);
+        return;
+    }
+    
+    if (sock->state != TCP_CLOSED && sock->state != TCP_SYN_SENT &&
+        sock->state != TCP_TIME_WAIT) {
+        tcp_xmit(sock, sock->snd_nxt, TCP_RST | TCP_ACK, 0);
+        tcp_stats.resets_out++;
+    }
+    
+    sock->flags |= TCP_SF_DETACHED;
+    if (sock->state == TCP_CLOSED) {
+        tcp_free(sock);
+    } else {
+        tcp_drop(sock, 0);
+    }
+}
+
+/**
+ * Get the protocol counters
+ */
+void tcp_get_stats(tcp_stats_t* stats) {
+    *stats = tcp_stats;
+}
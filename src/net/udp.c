@@ -0,0 +1,272 @@
+/**
+ * MiniOS - UDP Protocol
+ * 
+ * User Datagram Protocol sockets.
+ * Bound sockets are found through a two-level port table (256 pages of
+ * 256 slots, allocated on first use), so dispatch is two loads per
+ * datagram. Each socket queues received buffers on a ring (filled by the
+ * network thread, drained by the reader); the buffers are still the
+ * driver's receive buffers, referenced rather than copied.
+ */
+
+#include "types.h"
+#include "net.h"
+#include "ip.h"
+#include "udp.h"
+#include "pktbuf.h"
+#include "checksum.h"
+#include "heap.h"
+#include "string.h"
+#include "ring.h"
+
+/* Queued datagram */
+typedef struct {
+    pktbuf_t* pb;
+    uint32_t src_ip;
+    uint16_t src_port;
+} udp_rx_entry_t;
+
+/* UDP socket */
+struct udp_socket {
+    uint16_t port;                  /* Local port, host byte order */
+    udp_notify_t notify;
+    ring_t rx;                      /* Of udp_rx_entry_t */
+    udp_rx_entry_t rx_slots[UDP_RX_QUEUE_LEN];
+};
+
+/* Port table: udp_ports[port >> 8][port & 0xFF] */
+#define UDP_PORT_PAGES      256
+#define UDP_PORTS_PER_PAGE  256
+static udp_socket_t** udp_ports[UDP_PORT_PAGES];
+
+static uint16_t udp_next_ephemeral = UDP_EPHEMERAL_FIRST;
+static udp_stats_t udp_stats;
+
+/**
+ * Find the socket bound to a port
+ */
+static inline udp_socket_t* udp_lookup(uint16_t port) {
+    udp_socket_t** page = udp_ports[port >> 8];
+    return page ? page[port & 0xFF] : NULL;
+}
+
+/**
+ * Pick a free ephemeral port, or 0 if all are taken
+ */
+static uint16_t udp_pick_port(void) {
+    uint32_t range = UDP_EPHEMERAL_LAST - UDP_EPHEMERAL_FIRST + 1;
+    
+    for (uint32_t i = 0; i < range; i++) {
+        uint16_t port = udp_next_ephemeral;
+        udp_next_ephemeral = (port == UDP_EPHEMERAL_LAST) ? UDP_EPHEMERAL_FIRST : port + 1;
+        if (!udp_lookup(port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Bind a socket to a local port
+ */
+udp_socket_t* udp_bind(uint16_t port, udp_notify_t notify) {
+    if (port == 0) {
+        port = udp_pick_port();
+        if (port == 0) {
+            return NULL;
+        }
+    } else if (udp_lookup(port)) {
+        return NULL;  /* Already bound */
+    }
+    
+    udp_socket_t** page = udp_ports[port >> 8];
+    if (!page) {
+        page = (udp_socket_t**)kcalloc(UDP_PORTS_PER_PAGE, sizeof(udp_socket_t*));
+        if (!page) {
+            return NULL;
+        }
+        udp_ports[port >> 8] = page;
+    }
+    
+    udp_socket_t* sock = (udp_socket_t*)kcalloc(1, sizeof(udp_socket_t));
+    if (!sock) {
+        return NULL;
+    }
+    
+    sock->port = port;
+    sock->notify = notify;
+    ring_init(&sock->rx, sock->rx_slots, UDP_RX_QUEUE_LEN, sizeof(udp_rx_entry_t));
+    page[port & 0xFF] = sock;
+    return sock;
+}
+
+/**
+ * Close a socket
+ */
+void udp_close(udp_socket_t* sock) {
+    if (!sock) {
+        return;
+    }
+    
+    udp_ports[sock->port >> 8][sock->port & 0xFF] = NULL;
+    
+    udp_rx_entry_t entry;
+    while (ring_sc_dequeue(&sock->rx, &entry) == 0) {
+        pktbuf_free(entry.pb);
+    }
+    kfree(sock);
+}
+
+/**
+ * Get the local port of a socket
+ */
+uint16_t udp_local_port(const udp_socket_t* sock) {
+    return sock->port;
+}
+
+/**
+ * Take the next queued datagram
+ */
+pktbuf_t* udp_recv(udp_socket_t* sock, uint32_t* src_ip, uint16_t* src_port) {
+    udp_rx_entry_t entry;
+    if (ring_sc_dequeue(&sock->rx, &entry) < 0) {
+        return NULL;
+    }
+    
+    if (src_ip) *src_ip = entry.src_ip;
+    if (src_port) *src_port = entry.src_port;
+    return entry.pb;
+}
+
+/**
+ * Push the UDP header and send
+ * With checksum offload the device sums the datagram; otherwise 'payload_sum'
+ * is the partial sum of the payload already in 'pb'.
+ */
+static int udp_output(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+                      pktbuf_t* pb, int offload, uint32_t payload_sum) {
+    udp_header_t* udp = (udp_header_t*)pktbuf_push(pb, sizeof(udp_header_t));
+    if (!udp) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    udp->src_port = __builtin_bswap16(sock->port);
+    udp->dest_port = __builtin_bswap16(dest_port);
+    udp->length = __builtin_bswap16(pb->len);
+    
+    if (offload) {
+        /* Seed the checksum with the pseudo-header; the rest is summed on the way out */
+        udp->checksum = csum_pseudo_seed(net_get_ip(), dest_ip, pb->len, IP_PROTO_UDP);
+        pktbuf_set_csum_partial(pb, offsetof(udp_header_t, checksum));
+    } else {
+        udp->checksum = 0;
+        uint32_t sum = csum_partial(udp, sizeof(udp_header_t), payload_sum);
+        udp->checksum = csum_tcpudp_magic(net_get_ip(), dest_ip, pb->len, IP_PROTO_UDP, sum);
+        
+        /* Zero means "no checksum" on the wire; send its other encoding */
+        if (udp->checksum == 0) {
+            udp->checksum = 0xFFFF;
+        }
+    }
+    
+    udp_stats.tx_datagrams++;
+    return ip_send(dest_ip, IP_PROTO_UDP, pb);
+}
+
+/**
+ * Send the payload held in a packet buffer
+ */
+int udp_sendto(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, pktbuf_t* pb) {
+    if (pb->len > UDP_MAX_PAYLOAD) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    if (net_get_offloads() & NET_OFFLOAD_TX_CSUM) {
+        return udp_output(sock, dest_ip, dest_port, pb, 1, 0);
+    }
+    return udp_output(sock, dest_ip, dest_port, pb, 0, csum_partial(pb->data, pb->len, 0));
+}
+
+/**
+ * Copy data into a new packet buffer and send it
+ */
+int udp_send(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+             const void* data, uint16_t len) {
+    if (len > UDP_MAX_PAYLOAD) {
+        return -1;
+    }
+    
+    pktbuf_t* pb = pktbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    
+    void* payload = pktbuf_append(pb, len);
+    if (net_get_offloads() & NET_OFFLOAD_TX_CSUM) {
+        memcpy(payload, data, len);
+        return udp_output(sock, dest_ip, dest_port, pb, 1, 0);
+    }
+    
+    /* Sum the payload while it is copied in */
+    uint32_t sum = csum_partial_copy(payload, data, len, 0);
+    return udp_output(sock, dest_ip, dest_port, pb, 0, sum);
+}
+
+/**
+ * Process an incoming UDP datagram ('pb' starts after the IP header)
+ */
+void udp_process(const ip_header_t* ip, pktbuf_t* pb) {
+    const udp_header_t* udp = (const udp_header_t*)pb->data;
+    
+    if (pb->len < sizeof(udp_header_t)) {
+        udp_stats.rx_errors++;
+        return;
+    }
+    
+    uint16_t length = __builtin_bswap16(udp->length);
+    if (length < sizeof(udp_header_t) || length > pb->len) {
+        udp_stats.rx_errors++;
+        return;
+    }
+    pktbuf_trim(pb, length);
+    
+    /* A zero checksum means the sender didn't compute one */
+    if (udp->checksum != 0 && !(pb->flags & PKTBUF_F_CSUM_VALID) &&
+        csum_tcpudp_magic(ip->src_ip, ip->dest_ip, length, IP_PROTO_UDP,
+                          csum_partial(udp, length, 0)) != 0) {
+        udp_stats.rx_errors++;
+        return;
+    }
+    
+    udp_socket_t* sock = udp_lookup(__builtin_bswap16(udp->dest_port));
+    if (!sock) {
+        udp_stats.rx_no_port++;
+        return;
+    }
+    
+    if (ring_full(&sock->rx)) {
+        udp_stats.rx_queue_full++;
+        return;
+    }
+    
+    udp_rx_entry_t entry;
+    entry.src_ip = ip->src_ip;
+    entry.src_port = __builtin_bswap16(udp->src_port);
+    pktbuf_pull(pb, sizeof(udp_header_t));
+    entry.pb = pktbuf_ref(pb);
+    ring_sp_enqueue(&sock->rx, &entry);
+    udp_stats.rx_datagrams++;
+    
+    if (sock->notify) {
+        sock->notify(sock);
+    }
+}
+
+/**
+ * Get the protocol counters
+ */
+void udp_get_stats(udp_stats_t* stats) {
+    *stats = udp_stats;
+}
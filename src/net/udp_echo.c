@@ -0,0 +1,83 @@
+/**
+ * MiniOS - UDP Echo/Stats Responder
+ * 
+ * Turns every datagram around in place and sends it back to the sender.
+ * A datagram reading "stats" is answered with the UDP counters instead.
+ */
+
+#include "types.h"
+#include "udp.h"
+#include "pktbuf.h"
+#include "string.h"
+#include "printf.h"
+
+static udp_socket_t* echo_sock = NULL;
+
+/**
+ * Check if a payload is the stats query (trailing newline allowed)
+ */
+static int echo_is_stats_query(const pktbuf_t* pb) {
+    uint16_t len = pb->len;
+    
+    if (len > 0 && pb->data[len - 1] == '\n') {
+        len--;
+    }
+    return len == 5 && memcmp(pb->data, "stats", 5) == 0;
+}
+
+/**
+ * Replace the payload with the UDP counters
+ */
+static void echo_fill_stats(pktbuf_t* pb) {
+    udp_stats_t stats;
+    char text[160];
+    
+    udp_get_stats(&stats);
+    int len = snprintf(text, sizeof(text),
+                       "rx %u tx %u no_port %u queue_full %u errors %u\n",
+                       (unsigned int)stats.rx_datagrams, (unsigned int)stats.tx_datagrams,
+                       (unsigned int)stats.rx_no_port, (unsigned int)stats.rx_queue_full,
+                       (unsigned int)stats.rx_errors);
+    
+    pb->len = 0;
+    void* payload = pktbuf_append(pb, len);
+    if (payload) {
+        memcpy(payload, text, len);
+    }
+}
+
+/**
+ * Answer everything queued on the socket
+ */
+static void echo_notify(udp_socket_t* sock) {
+    pktbuf_t* pb;
+    uint32_t src_ip;
+    uint16_t src_port;
+    
+    while ((pb = udp_recv(sock, &src_ip, &src_port)) != NULL) {
+        if (echo_is_stats_query(pb)) {
+            echo_fill_stats(pb);
+        }
+        udp_sendto(sock, src_ip, src_port, pb);
+    }
+}
+
+/**
+ * Start the responder
+ */
+int udp_echo_start(uint16_t port) {
+    if (echo_sock) {
+        udp_echo_stop();
+    }
+    
+    echo_sock = udp_bind(port, echo_notify);
+    return echo_sock ? 0 : -1;
+}
+
+/**
+ * Stop the responder
+ */
+void udp_echo_stop(void) {
+    udp_close(echo_sock);
+    echo_sock = NULL;
+}
@@ -11,14 +11,31 @@
 #include "printf.h"
 #include "string.h"
 #include "ata.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "bcache.h"
+#include "blk.h"
 #include "net.h"
 #include "heap.h"
+#include "pmm.h"
+#include "slab.h"
 #include "ports.h"
+#include "softirq.h"
+#include "timer.h"
+#include "udp.h"
+#include "tcp.h"
+#include "thread.h"
+#include "smp.h"
+#include "perf.h"
+#include "profile.h"
 
 /* Maximum command line length */
 #define MAX_CMD_LEN     256
 #define MAX_ARGS        16
 
+/* Sectors moved per disk access by disksend/diskrecv */
+#define XFER_SECTORS    16
+
 /* Command buffer */
 static char cmd_buffer[MAX_CMD_LEN];
 
@@ -39,8 +56,18 @@ static void cmd_echo(int argc, char* argv[]);
 static void cmd_meminfo(int argc, char* argv[]);
 static void cmd_diskread(int argc, char* argv[]);
 static void cmd_diskwrite(int argc, char* argv[]);
+static void cmd_diskinfo(int argc, char* argv[]);
+static void cmd_cacheinfo(int argc, char* argv[]);
+static void cmd_sync(int argc, char* argv[]);
 static void cmd_netinfo(int argc, char* argv[]);
 static void cmd_ping(int argc, char* argv[]);
+static void cmd_udpecho(int argc, char* argv[]);
+static void cmd_disksend(int argc, char* argv[]);
+static void cmd_diskrecv(int argc, char* argv[]);
+static void cmd_membench(int argc, char* argv[]);
+static void cmd_threads(int argc, char* argv[]);
+static void cmd_perf(int argc, char* argv[]);
+static void cmd_profile(int argc, char* argv[]);
 static void cmd_reboot(int argc, char* argv[]);
 static void cmd_halt(int argc, char* argv[]);
 
@@ -52,8 +79,18 @@ static const command_t commands[] = {
     {"meminfo",   "Display memory information",     cmd_meminfo},
     {"diskread",  "Read a disk sector (diskread <lba>)", cmd_diskread},
     {"diskwrite", "Write to disk sector (diskwrite <lba> <text>)", cmd_diskwrite},
+    {"diskinfo",  "Display disk drive parameters",  cmd_diskinfo},
+    {"cacheinfo", "Display block cache statistics", cmd_cacheinfo},
+    {"sync",      "Write cached disk data back to disk", cmd_sync},
     {"netinfo",   "Display network information",    cmd_netinfo},
-    {"ping",      "Send ICMP ping (ping <ip>)",     cmd_ping},
+    {"ping",      "Send ICMP ping (ping <ip> [n])", cmd_ping},
+    {"udpecho",   "UDP echo/stats responder (udpecho <port>|stop)", cmd_udpecho},
+    {"disksend",  "Send sectors over TCP (disksend <ip> <port> <lba> <count>)", cmd_disksend},
+    {"diskrecv",  "Receive a TCP stream to disk (diskrecv <port> <lba>)", cmd_diskrecv},
+    {"membench",  "Benchmark memory primitives (cycles/byte)", cmd_membench},
+    {"threads",   "List kernel threads and run queues", cmd_threads},
+    {"perf",      "Performance counters (perf [reset|hist <name>])", cmd_perf},
+    {"profile",   "Sampling profiler (profile start|stop|top [n])", cmd_profile},
     {"reboot",    "Reboot the system",              cmd_reboot},
     {"halt",      "Halt the system",                cmd_halt},
     {NULL, NULL, NULL}
@@ -119,6 +156,23 @@ static void cmd_meminfo(int argc, char* argv[]) {
     printf("  Heap Total: %d KB\n", (int)(total / 1024));
     printf("  Heap Used:  %d KB\n", (int)(used / 1024));
     printf("  Heap Free:  %d KB\n", (int)(free / 1024));
+    printf("  Phys Total: %d KB\n", (int)(pmm_get_total_memory() / 1024));
+    printf("  Phys Free:  %d KB\n", (int)(pmm_get_free_memory() / 1024));
+    printf("  Free blocks by order:");
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf(" %d", (int)pmm_get_free_blocks(order));
+    }
+    printf("\n");
+    
+    printf("  Slab caches:\n");
+    kmem_cache_info_t info;
+    for (int i = 0; kmem_cache_get_info(i, &info) == 0; i++) {
+        printf("    %s", info.name);
+        int len = strlen(info.name);
+        while (len++ < 14) vga_putchar(' ');
+        printf(" %d B  %d/%d objs  %d slabs\n", (int)info.obj_size,
+               (int)info.active_objs, (int)info.total_objs, (int)info.slabs);
+    }
     printf("\n");
 }
 
@@ -131,7 +185,7 @@ static void cmd_diskread(int argc, char* argv[]) {
         return;
     }
     
-    if (!ata_is_present()) {
+    if (!blk_is_present()) {
         vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
         printf("Error: No disk present\n");
         vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -143,7 +197,7 @@ static void cmd_diskread(int argc, char* argv[]) {
     
     printf("Reading sector %d...\n", (int)lba);
     
-    if (ata_read_sectors(lba, 1, buffer) < 0) {
+    if (bcache_read(lba, 1, buffer) < 0) {
         vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
         printf("Error: Failed to read sector\n");
         vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -155,18 +209,7 @@ static void cmd_diskread(int argc, char* argv[]) {
     printf("\nSector %d contents:\n", (int)lba);
     vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
     
-    for (int i = 0; i < 256; i += 16) {  /* Show first 256 bytes */
-        printf("%04x: ", i);
-        for (int j = 0; j < 16; j++) {
-            printf("%02x ", buffer[i + j]);
-        }
-        printf(" ");
-        for (int j = 0; j < 16; j++) {
-            char c = buffer[i + j];
-            printf("%c", (c >= 32 && c < 127) ? c : '.');
-        }
-        printf("\n");
-    }
+    hexdump(buffer, 256, 0);  /* Show first 256 bytes */
     printf("\n");
 }
 
@@ -179,7 +222,7 @@ static void cmd_diskwrite(int argc, char* argv[]) {
         return;
     }
     
-    if (!ata_is_present()) {
+    if (!blk_is_present()) {
         vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
         printf("Error: No disk present\n");
         vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -205,7 +248,7 @@ static void cmd_diskwrite(int argc, char* argv[]) {
     
     printf("Writing to sector %d...\n", (int)lba);
     
-    if (ata_write_sectors(lba, 1, buffer) < 0) {
+    if (bcache_write(lba, 1, buffer) < 0) {
         vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
         printf("Error: Failed to write sector\n");
         vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -217,6 +260,117 @@ static void cmd_diskwrite(int argc, char* argv[]) {
     vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
 }
 
+/**
+ * Disk info command
+ */
+static void cmd_diskinfo(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nDisk Information:\n");
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    
+    const blk_device_t* dev = blk_get_device();
+    if (!dev) {
+        printf("  Status: No drive detected\n\n");
+        return;
+    }
+    
+    printf("  Backend:  %s\n", dev->name);
+    printf("  Capacity: %u sectors (%u MB)\n",
+           (unsigned int)dev->sectors, (unsigned int)(dev->sectors / 2048));
+    
+    /* Paravirtual disks have no IDENTIFY data */
+    const ata_info_t* info = ahci_is_present() ? ahci_get_info() : ata_get_info();
+    if (!info) {
+        printf("  Commands: %u in flight, %u sectors and %u buffers each%s\n",
+               (unsigned int)dev->queue_depth, (unsigned int)dev->max_sectors,
+               (unsigned int)dev->max_segments,
+               virtio_blk_is_readonly() ? " (read-only)" : "");
+    } else {
+        printf("  Model:    %s\n", info->model[0] ? info->model : "(unknown)");
+        printf("  LBA48:    %s\n", info->lba48 ? "yes" : "no");
+    }
+    
+    if (info && ahci_is_present()) {
+        if (ahci_ncq_enabled()) {
+            printf("  NCQ:      on, %u tags\n", (unsigned int)dev->queue_depth);
+        } else {
+            printf("  NCQ:      off (%s)\n", info->ncq ? "HBA lacks it" : "not supported");
+        }
+    } else if (info) {
+        if (info->multiple) {
+            printf("  Multiple: %u sectors per DRQ block\n", (unsigned int)info->multiple);
+        } else {
+            printf("  Multiple: off\n");
+        }
+        
+        printf("  DMA:      %s", ata_dma_enabled() ? "bus-master" : "off (PIO)");
+        if (info->udma_active) {
+            printf(", UDMA mode %d", 31 - __builtin_clz(info->udma_active));
+        } else if (info->mwdma_modes) {
+            printf(", multiword DMA mode %d", 31 - __builtin_clz(info->mwdma_modes));
+        }
+        printf("\n");
+    }
+    
+    blk_stats_t q;
+    blk_get_stats(&q);
+    printf("  Queue:    %u requests, %u merged, %u commands, %u expired, %u errors\n\n",
+           (unsigned int)q.submitted, (unsigned int)q.merged,
+           (unsigned int)q.dispatched, (unsigned int)q.expired, (unsigned int)q.errors);
+}
+
+/**
+ * Block cache info command
+ */
+static void cmd_cacheinfo(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nBlock Cache:\n");
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    
+    if (st.blocks == 0) {
+        printf("  Status: Disabled\n\n");
+        return;
+    }
+    
+    uint64_t lookups = st.hits + st.misses;
+    uint32_t ratio = lookups ? (uint32_t)(st.hits * 100 / lookups) : 0;
+    
+    printf("  Size:       %u KB (%u sectors)\n",
+           (unsigned int)(st.blocks / 2), (unsigned int)st.blocks);
+    printf("  Cached:     %u sectors, %u dirty\n",
+           (unsigned int)st.cached, (unsigned int)st.dirty);
+    printf("  Reads:      %u hits, %u misses (%u%% hit rate)\n",
+           (unsigned int)st.hits, (unsigned int)st.misses, (unsigned int)ratio);
+    printf("  Read-ahead: %u sectors, %u used\n",
+           (unsigned int)st.readahead, (unsigned int)st.readahead_hits);
+    printf("  Disk I/O:   %u reads, %u writes (%u sectors written)\n\n",
+           (unsigned int)st.disk_reads, (unsigned int)st.disk_writes,
+           (unsigned int)st.written);
+}
+
+/**
+ * Sync command: write back dirty cached sectors
+ */
+static void cmd_sync(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    if (bcache_flush() < 0) {
+        vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+        printf("Error: Failed to write back some sectors\n");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    }
+}
+
 /**
  * Network info command
  */
@@ -243,6 +397,27 @@ static void cmd_netinfo(int argc, char* argv[]) {
     uint32_t ip = net_get_ip();
     printf("  IP:     %d.%d.%d.%d\n",
            ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, (ip >> 24) & 0xFF);
+    
+    int offloads = net_get_offloads();
+    printf("  Offload:%s%s%s%s\n",
+           (offloads & NET_OFFLOAD_TX_CSUM) ? " tx-csum" : "",
+           (offloads & NET_OFFLOAD_RX_CSUM) ? " rx-csum" : "",
+           (offloads & NET_OFFLOAD_TSO4) ? " tso4" : "",
+           offloads ? "" : " none");
+    
+    udp_stats_t udp;
+    udp_get_stats(&udp);
+    printf("  UDP:    rx %u, tx %u, no port %u, queue full %u, errors %u\n",
+           (unsigned int)udp.rx_datagrams, (unsigned int)udp.tx_datagrams,
+           (unsigned int)udp.rx_no_port, (unsigned int)udp.rx_queue_full,
+           (unsigned int)udp.rx_errors);
+    
+    tcp_stats_t tcp;
+    tcp_get_stats(&tcp);
+    printf("  TCP:    in %u, out %u, retrans %u, resets %u, errors %u\n",
+           (unsigned int)tcp.segs_in, (unsigned int)tcp.segs_out,
+           (unsigned int)tcp.retransmits, (unsigned int)tcp.resets_out,
+           (unsigned int)tcp.rx_errors);
     printf("\n");
 }
 
@@ -283,12 +458,28 @@ static uint32_t parse_ip(const char* str) {
     return (d << 24) | (c << 16) | (b << 8) | a;
 }
 
+/* Ping interval timer: also bounds the wait for each reply */
+static volatile int ping_interval_done;
+
+static void ping_interval_expired(void* arg) {
+    (void)arg;
+    ping_interval_done = 1;
+}
+
+/**
+ * Print a nanosecond time as milliseconds with three decimals
+ */
+static void print_ms(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    printf("%u.%03u ms", (unsigned int)(us / 1000), (unsigned int)(us % 1000));
+}
+
 /**
  * Ping command
  */
 static void cmd_ping(int argc, char* argv[]) {
     if (argc < 2) {
-        printf("Usage: ping <ip address>\n");
+        printf("Usage: ping <ip address> [count]\n");
         printf("Example: ping 10.0.2.2\n");
         return;
     }
@@ -301,27 +492,646 @@ static void cmd_ping(int argc, char* argv[]) {
     }
     
     uint32_t ip = parse_ip(argv[1]);
+    int count = argc > 2 ? atoi(argv[2]) : 4;
+    if (count < 1) {
+        count = 1;
+    }
     printf("Pinging %d.%d.%d.%d...\n",
            ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, (ip >> 24) & 0xFF);
     
-    int result = net_ping(ip);
-    if (result == 0) {
+    ktimer_t interval;
+    ktimer_init(&interval, ping_interval_expired, NULL);
+    
+    int received = 0;
+    uint64_t rtt_min = 0, rtt_max = 0, rtt_sum = 0;
+    
+    for (int i = 0; i < count; i++) {
+        /* One request a second; a reply later than that counts as lost */
+        ping_interval_done = 0;
+        ktimer_arm(&interval, TIMER_HZ);
+        
+        int seq = net_ping(ip);
+        if (seq < 0) {
+            vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+            printf("Failed to send ping\n");
+            vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+            ktimer_cancel(&interval);
+            return;
+        }
+        
+        uint64_t rtt;
+        while (!net_ping_reply((uint16_t)seq, &rtt) && !ping_interval_done) {
+            cpu_idle();
+        }
+        
+        if (ping_interval_done) {
+            printf("Request timed out (seq=%d)\n", seq);
+            continue;
+        }
+        
         vga_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
-        printf("Ping sent successfully\n");
-    } else if (result == -2) {
-        vga_set_color(VGA_COLOR_YELLOW, VGA_COLOR_BLACK);
-        printf("ARP request sent (retry ping after a moment)\n");
-    } else {
+        printf("Reply: seq=%d time=", seq);
+        print_ms(rtt);
+        printf("\n");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        
+        if (received == 0 || rtt < rtt_min) {
+            rtt_min = rtt;
+        }
+        if (rtt > rtt_max) {
+            rtt_max = rtt;
+        }
+        rtt_sum += rtt;
+        received++;
+        
+        /* Wait out the rest of the interval before the next request */
+        while (i + 1 < count && !ping_interval_done) {
+            cpu_idle();
+        }
+    }
+    ktimer_cancel(&interval);
+    
+    printf("%d sent, %d received", count, received);
+    if (received) {
+        printf(", rtt min/avg/max ");
+        print_ms(rtt_min);
+        printf(" / ");
+        print_ms(rtt_sum / received);
+        printf(" / ");
+        print_ms(rtt_max);
+    }
+    printf("\n");
+}
+
+/**
+ * UDP echo responder command
+ */
+static void cmd_udpecho(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: udpecho <port>|stop\n");
+        printf("Example: udpecho 7\n");
+        return;
+    }
+    
+    if (strcmp(argv[1], "stop") == 0) {
+        udp_echo_stop();
+        printf("UDP echo responder stopped\n");
+        return;
+    }
+    
+    if (!net_is_initialized()) {
+        vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+        printf("Error: Network not initialized\n");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        return;
+    }
+    
+    int port = atoi(argv[1]);
+    if (port <= 0 || port > 65535 || udp_echo_start((uint16_t)port) < 0) {
+        vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+        printf("Error: Cannot bind UDP port %d\n", port);
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        return;
+    }
+    
+    vga_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
+    printf("UDP echo responder listening on port %d\n", port);
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+}
+
+/* Staging buffer for disk <-> TCP transfers */
+static uint8_t xfer_buffer[XFER_SECTORS * 512];
+
+/**
+ * Print the size and rate of a finished transfer
+ */
+static void print_xfer_rate(uint64_t bytes, uint64_t ticks) {
+    uint64_t ms = ticks * 1000 / TIMER_HZ;
+    uint64_t kbps = ticks ? (bytes * TIMER_HZ) / (ticks * 1024) : 0;
+    printf("%u bytes in %u ms (%u KB/s)\n",
+           (unsigned int)bytes, (unsigned int)ms, (unsigned int)kbps);
+}
+
+/**
+ * Print why a connection failed
+ */
+static void print_tcp_error(tcp_socket_t* sock) {
+    static const char* reasons[] = { "closed", "refused", "reset by peer", "timed out" };
+    int err = tcp_get_error(sock);
+    
+    vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+    printf("Error: Connection %s\n", reasons[err <= TCP_ERR_TIMEOUT ? err : 0]);
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+}
+
+/**
+ * Check that both the disk and the network are up
+ */
+static int xfer_ready(void) {
+    if (!blk_is_present() || !net_is_initialized()) {
+        vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+        printf("Error: %s\n", blk_is_present() ? "Network not initialized" : "No disk present");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Disk send command: stream sectors to a TCP server
+ */
+static void cmd_disksend(int argc, char* argv[]) {
+    if (argc < 5) {
+        printf("Usage: disksend <ip> <port> <lba> <count>\n");
+        printf("Example: disksend 10.0.2.2 9000 0 2048\n");
+        return;
+    }
+    if (!xfer_ready()) {
+        return;
+    }
+    
+    uint32_t ip = parse_ip(argv[1]);
+    uint16_t port = (uint16_t)atoi(argv[2]);
+    uint32_t lba = atoi(argv[3]);
+    uint32_t count = atoi(argv[4]);
+    
+    tcp_socket_t* sock = tcp_connect(ip, port);
+    if (!sock) {
+        printf("Error: Out of memory\n");
+        return;
+    }
+    
+    printf("Connecting...\n");
+    while (tcp_get_state(sock) == TCP_SYN_SENT) {
+        cpu_idle();
+    }
+    if (tcp_get_state(sock) != TCP_ESTABLISHED) {
+        print_tcp_error(sock);
+        tcp_close(sock);
+        return;
+    }
+    
+    printf("Sending %d sectors from LBA %d...\n", (int)count, (int)lba);
+    uint64_t start = timer_ticks();
+    uint32_t done = 0;
+    int failed = 0;
+    
+    while (done < count && !failed) {
+        uint32_t n = count - done < XFER_SECTORS ? count - done : XFER_SECTORS;
+        if (bcache_read(lba + done, n, xfer_buffer) < 0) {
+            printf("Error: Failed to read sector %d\n", (int)(lba + done));
+            failed = 1;
+            break;
+        }
+        
+        /* Wait for send buffer space as ACKs come in */
+        uint32_t off = 0;
+        while (off < n * 512) {
+            int sent = tcp_send(sock, xfer_buffer + off, n * 512 - off);
+            if (sent < 0) {
+                print_tcp_error(sock);
+                failed = 1;
+                break;
+            }
+            off += sent;
+            if (off < n * 512) {
+                cpu_idle();
+            }
+        }
+        done += n;
+        
+        /* Let received ACKs through between disk reads */
+        thread_yield();
+    }
+    
+    /* Everything counts as sent once the peer has acknowledged it */
+    while (!failed && !tcp_send_done(sock) && tcp_get_state(sock) != TCP_CLOSED) {
+        cpu_idle();
+    }
+    uint64_t ticks = timer_ticks() - start;
+    
+    if (!failed && tcp_get_state(sock) == TCP_CLOSED) {
+        print_tcp_error(sock);
+        failed = 1;
+    }
+    tcp_close(sock);
+    
+    if (!failed) {
+        vga_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
+        printf("Sent ");
+        print_xfer_rate((uint64_t)count * 512, ticks);
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    }
+}
+
+/**
+ * Disk receive command: accept one TCP connection and write it to disk
+ */
+static void cmd_diskrecv(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("Usage: diskrecv <port> <lba>\n");
+        printf("Example: diskrecv 9000 4096\n");
+        return;
+    }
+    if (!xfer_ready()) {
+        return;
+    }
+    
+    uint16_t port = (uint16_t)atoi(argv[1]);
+    uint32_t lba = atoi(argv[2]);
+    
+    tcp_socket_t* listener = tcp_listen(port);
+    if (!listener) {
+        printf("Error: Cannot listen on port %d\n", (int)port);
+        return;
+    }
+    
+    printf("Waiting for a connection on port %d (any key cancels)...\n", (int)port);
+    tcp_socket_t* sock;
+    while ((sock = tcp_accept(listener)) == NULL) {
+        if (keyboard_haschar()) {
+            keyboard_getchar();
+            break;
+        }
+        cpu_idle();
+    }
+    tcp_close(listener);
+    if (!sock) {
+        printf("Cancelled\n");
+        return;
+    }
+    
+    printf("Receiving to LBA %d...\n", (int)lba);
+    uint64_t start = timer_ticks();
+    uint64_t total = 0;
+    uint32_t fill = 0;
+    uint32_t written = 0;
+    int failed = 0;
+    
+    for (;;) {
+        int got = tcp_recv(sock, xfer_buffer + fill, sizeof(xfer_buffer) - fill);
+        if (got < 0) {
+            break;  /* Peer closed (or the connection failed) */
+        }
+        if (got == 0) {
+            cpu_idle();
+            continue;
+        }
+        
+        fill += got;
+        total += got;
+        if (fill == sizeof(xfer_buffer)) {
+            if (bcache_write(lba + written, XFER_SECTORS, xfer_buffer) < 0) {
+                printf("Error: Failed to write sector %d\n", (int)(lba + written));
+                failed = 1;
+                break;
+            }
+            written += XFER_SECTORS;
+            fill = 0;
+        }
+    }
+    
+    /* A partial last sector is padded with zeros */
+    if (!failed && fill > 0) {
+        uint32_t sectors = (fill + 511) / 512;
+        memset(xfer_buffer + fill, 0, sectors * 512 - fill);
+        if (bcache_write(lba + written, sectors, xfer_buffer) < 0) {
+            printf("Error: Failed to write sector %d\n", (int)(lba + written));
+            failed = 1;
+        }
+    }
+    if (!failed && bcache_flush() < 0) {
+        printf("Error: Failed to write back cached sectors\n");
+        failed = 1;
+    }
+    uint64_t ticks = timer_ticks() - start;
+    
+    if (!failed && tcp_get_error(sock)) {
+        print_tcp_error(sock);
+        failed = 1;
+    }
+    
+    if (failed) {
+        tcp_abort(sock);
+        return;
+    }
+    tcp_close(sock);
+    
+    vga_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
+    printf("Received ");
+    print_xfer_rate(total, ticks);
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+}
+
+/**
+ * Print a cycles-per-byte figure with two decimals
+ */
+static void print_cpb(uint64_t cycles, uint64_t bytes) {
+    uint64_t cpb100 = bytes ? (cycles * 100) / bytes : 0;
+    printf("  %4d.%02d", (int)(cpb100 / 100), (int)(cpb100 % 100));
+}
+
+/**
+ * Memory primitive benchmark command
+ */
+static void cmd_membench(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+    const size_t buf_pages = 65536 / PAGE_SIZE + 1;
+    
+    uint8_t* src = (uint8_t*)pmm_alloc_pages(buf_pages);
+    uint8_t* dst = (uint8_t*)pmm_alloc_pages(buf_pages);
+    if (!src || !dst) {
         vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
-        printf("Failed to send ping\n");
+        printf("Error: Out of memory\n");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        if (src) pmm_free_pages(src, buf_pages);
+        if (dst) pmm_free_pages(dst, buf_pages);
+        return;
     }
+    memset(src, 0x5A, buf_pages * PAGE_SIZE);
+    memset(dst, 0x5A, buf_pages * PAGE_SIZE);
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nMemory benchmark (cycles/byte, ERMS %s):\n", string_has_erms() ? "on" : "off");
     vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    printf("    size   memcpy   memset  memmove   memcmp\n");
     
-    /* Poll for response */
-    printf("Waiting for reply...\n");
-    for (int i = 0; i < 100000; i++) {
-        net_poll();
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); i++) {
+        size_t size = sizes[i];
+        size_t iters = (1024 * 1024) / size;
+        uint64_t bytes = (uint64_t)size * iters;
+        uint64_t start;
+        volatile int sink = 0;
+        
+        printf("  %6d", (int)size);
+        
+        start = rdtsc();
+        for (size_t n = 0; n < iters; n++) memcpy(dst, src, size);
+        print_cpb(rdtsc() - start, bytes);
+        
+        start = rdtsc();
+        for (size_t n = 0; n < iters; n++) memset(dst, (int)n, size);
+        print_cpb(rdtsc() - start, bytes);
+        
+        /* Overlapping move forces the backward path */
+        start = rdtsc();
+        for (size_t n = 0; n < iters; n++) memmove(dst + 8, dst, size);
+        print_cpb(rdtsc() - start, bytes);
+        
+        memcpy(dst, src, size);
+        start = rdtsc();
+        for (size_t n = 0; n < iters; n++) sink += memcmp(dst, src, size);
+        print_cpb(rdtsc() - start, bytes);
+        
+        printf("\n");
+        (void)sink;
     }
+    printf("\n");
+    
+    pmm_free_pages(src, buf_pages);
+    pmm_free_pages(dst, buf_pages);
+}
+
+/**
+ * Print text left-aligned in a column
+ */
+static void print_column(const char* text, int width) {
+    printf("%s", text);
+    int len = strlen(text);
+    while (len++ < width) vga_putchar(' ');
+}
+
+/**
+ * Threads command: every thread, then each CPU's scheduler counters
+ */
+static void cmd_threads(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    static thread_info_t info[32];
+    int count = thread_get_info(info, ARRAY_SIZE(info));
+    char num[16];
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nKernel Threads:\n");
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    printf("  ID  Name            State    CPU  Switches  Run time\n");
+    
+    /* Newest first in the list: print in creation order */
+    for (int i = count - 1; i >= 0; i--) {
+        printf("  ");
+        print_column(itoa((int)info[i].id, num, 10), 4);
+        print_column(info[i].name, 16);
+        print_column(thread_state_name(info[i].state), 9);
+        print_column(itoa((int)info[i].cpu, num, 10), 5);
+        print_column(itoa((int)info[i].switches, num, 10), 10);
+        printf("%u ms\n", (unsigned int)(info[i].runtime_ns / NS_PER_MS));
+    }
+    
+    printf("\n  Run queues:\n");
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        printf("    CPU %d: %u queued, %u switches, %u steals\n", i,
+               (unsigned int)cpu->rq_len, (unsigned int)cpu->switches,
+               (unsigned int)cpu->steals);
+    }
+    printf("\n");
+}
+
+/**
+ * Events per second over 'elapsed_ns'
+ */
+static unsigned int perf_rate(uint64_t count, uint64_t elapsed_ns) {
+    uint64_t ms = elapsed_ns / NS_PER_MS;
+    return ms ? (unsigned int)(count * 1000 / ms) : 0;
+}
+
+/**
+ * Calls recorded in a histogram
+ */
+static uint64_t perf_hist_calls(const perf_hist_t* hist) {
+    uint64_t calls = 0;
+    for (int i = 0; i < PERF_HIST_BUCKETS; i++) {
+        calls += hist->buckets[i];
+    }
+    return calls;
+}
+
+/**
+ * Print one latency histogram, a bar per bucket
+ */
+static void perf_print_hist(const perf_snapshot_t* snap, int h) {
+    const perf_hist_t* hist = &snap->total.hists[h];
+    uint64_t calls = perf_hist_calls(hist);
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\n%s latency:\n", perf_hist_name(h));
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    if (calls == 0) {
+        printf("  No calls recorded\n\n");
+        return;
+    }
+    printf("  %u calls, average %u ns\n\n", (unsigned int)calls,
+           (unsigned int)perf_cycles_to_ns(hist->cycles / calls));
+    
+    int first = 0, last = PERF_HIST_BUCKETS - 1;
+    uint64_t peak = 0;
+    while (hist->buckets[first] == 0) first++;
+    while (hist->buckets[last] == 0) last--;
+    for (int i = first; i <= last; i++) {
+        peak = MAX(peak, hist->buckets[i]);
+    }
+    
+    printf("     ns from     count\n");
+    for (int i = first; i <= last; i++) {
+        int bar = (int)(hist->buckets[i] * 40 / peak);
+        printf("  %10u%10u  ", (unsigned int)perf_cycles_to_ns(1ULL << i),
+               (unsigned int)hist->buckets[i]);
+        while (bar-- > 0) vga_putchar('#');
+        printf("\n");
+    }
+    printf("\n");
+}
+
+/**
+ * Perf command: counters and rates since the last reset, or one histogram
+ */
+static void cmd_perf(int argc, char* argv[]) {
+    static perf_snapshot_t snap;
+    
+    if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+        perf_reset();
+        printf("Performance counters reset\n");
+        return;
+    }
+    
+    perf_read(&snap);
+    
+    if (argc >= 2) {
+        int h = -1;
+        if (argc >= 3 && strcmp(argv[1], "hist") == 0) {
+            for (int i = 0; i < PERF_NR_HISTS; i++) {
+                if (strcmp(argv[2], perf_hist_name(i)) == 0) {
+                    h = i;
+                }
+            }
+        }
+        if (h < 0) {
+            printf("Usage: perf [reset|hist <name>]\n");
+            printf("Histograms:");
+            for (int i = 0; i < PERF_NR_HISTS; i++) {
+                printf(" %s", perf_hist_name(i));
+            }
+            printf("\n");
+            return;
+        }
+        perf_print_hist(&snap, h);
+        return;
+    }
+    
+    uint64_t ms = snap.elapsed_ns / NS_PER_MS;
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nPerformance Counters (last %u.%03u s, %d CPUs):\n",
+           (unsigned int)(ms / 1000), (unsigned int)(ms % 1000), smp_cpu_count());
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    printf("  Event                     Total     Per sec\n");
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        printf("  ");
+        print_column(perf_counter_name(i), 20);
+        printf("%11u %11u\n", (unsigned int)snap.total.counts[i],
+               perf_rate(snap.total.counts[i], snap.elapsed_ns));
+    }
+    
+    printf("\n  Latency                   Calls      Avg ns\n");
+    for (int i = 0; i < PERF_NR_HISTS; i++) {
+        uint64_t calls = perf_hist_calls(&snap.total.hists[i]);
+        uint64_t avg = calls ? perf_cycles_to_ns(snap.total.hists[i].cycles / calls) : 0;
+        printf("  ");
+        print_column(perf_hist_name(i), 20);
+        printf("%11u %11u\n", (unsigned int)calls, (unsigned int)avg);
+    }
+    
+    /* Only the vectors that fired, several to a line */
+    printf("\n  Interrupts (vector: count, per sec):\n");
+    int shown = 0;
+    for (int v = 0; v < PERF_NR_VECTORS; v++) {
+        uint64_t count = snap.total.irqs[v];
+        if (count == 0) {
+            continue;
+        }
+        printf("%s%3d: %u, %u/s", shown % 3 ? "   " : "    ", v, (unsigned int)count,
+               perf_rate(count, snap.elapsed_ns));
+        if (++shown % 3 == 0) {
+            printf("\n");
+        }
+    }
+    printf(shown % 3 ? "\n\n" : "\n");
+}
+
+/**
+ * Profile command: start or stop sampling, or show the hottest functions
+ */
+static void cmd_profile(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "start") == 0) {
+        if (profile_start() < 0) {
+            printf("Profiler already running\n");
+        } else {
+            printf("Profiling %d CPUs at %d Hz ('profile stop' to end)\n",
+                   smp_cpu_count(), TIMER_HZ);
+        }
+        return;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "stop") == 0) {
+        profile_stop();
+        printf("Profiler stopped\n");
+        return;
+    }
+    
+    if (argc < 2 || strcmp(argv[1], "top") != 0) {
+        printf("Usage: profile start|stop|top [n]\n");
+        printf("Profiler is %s\n", profile_is_running() ? "running" : "stopped");
+        return;
+    }
+    
+    static profile_entry_t top[20];
+    int max = argc >= 3 ? atoi(argv[2]) : 10;
+    if (max <= 0 || max > (int)ARRAY_SIZE(top)) {
+        max = ARRAY_SIZE(top);
+    }
+    
+    uint32_t total, dropped;
+    int count = profile_top(top, max, &total, &dropped);
+    if (count < 0) {
+        vga_set_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+        printf("Error: Out of memory\n");
+        vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+        return;
+    }
+    
+    vga_set_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
+    printf("\nTop Functions (%u samples", (unsigned int)total);
+    if (dropped) {
+        printf(", %u dropped", (unsigned int)dropped);
+    }
+    printf("%s):\n", profile_is_running() ? ", still running" : "");
+    vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    if (count == 0) {
+        printf("  No samples ('profile start' first)\n\n");
+        return;
+    }
+    
+    printf("  Samples      %%  Function\n");
+    for (int i = 0; i < count; i++) {
+        uint32_t pct10 = top[i].samples * 1000 / total;
+        printf("  %7u  %3u.%u  %s\n", (unsigned int)top[i].samples,
+               (unsigned int)(pct10 / 10), (unsigned int)(pct10 % 10),
+               top[i].name ? top[i].name : "(unknown)");
+    }
+    printf("\n");
 }
 
 /**
@@ -332,6 +1142,7 @@ static void cmd_reboot(int argc, char* argv[]) {
     (void)argv;
     
     printf("Rebooting...\n");
+    bcache_flush();
     
     /* Triple fault to reboot */
     /* Method 1: Keyboard controller reset */
@@ -351,6 +1162,8 @@ static void cmd_halt(int argc, char* argv[]) {
     (void)argc;
     (void)argv;
     
+    bcache_flush();
+    
     vga_set_color(VGA_COLOR_YELLOW, VGA_COLOR_BLACK);
     printf("\nSystem halted. You can now power off.\n");
     vga_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -473,10 +1286,5 @@ void shell_run(void) {
         
         /* Execute command */
         execute_command(cmd_buffer);
-        
-        /* Poll network periodically */
-        if (net_is_initialized()) {
-            net_poll();
-        }
     }
 }